@@ -1,5 +1,8 @@
 #include "ui/ui.h"
 #include "logic/client_logic.h"
+#include "headless/headless.h"
+#include "logic/metrics.h"
+#include "logic/trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <libgen.h>
@@ -7,36 +10,93 @@
 #include <pthread.h>
 #include <limits.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
 
 int main(int argc, char *argv[]) {
+    // --headless <控制套接字路径>: 不启动界面，以守护进程方式运行，通过控制套接字驱动
+    // --data <目录>: 身份、通讯录和聊天记录存放的目录（默认为程序所在目录），同一台机器上运行多个客户端时各用一个
+    // --metrics <文件>: 每隔 --metrics-interval 秒（默认 10）向文件追加一行运行统计 JSON
+    // --trace <文件>: 把每条私聊消息经过各阶段的时间点写入环形文件，用 tools/trace_dump 查看
+    const char *control_path = NULL, *data_dir = NULL, *metrics_path = NULL, *trace_path = NULL;
+    int metrics_interval = 10;
+    while (argc >= 3 && (strcmp(argv[1], "--headless") == 0 || strcmp(argv[1], "--data") == 0 ||
+                         strcmp(argv[1], "--metrics") == 0 || strcmp(argv[1], "--metrics-interval") == 0 ||
+                         strcmp(argv[1], "--trace") == 0)) {
+        if (strcmp(argv[1], "--headless") == 0) control_path = argv[2];
+        else if (strcmp(argv[1], "--data") == 0) data_dir = argv[2];
+        else if (strcmp(argv[1], "--metrics") == 0) metrics_path = argv[2];
+        else if (strcmp(argv[1], "--trace") == 0) trace_path = argv[2];
+        else metrics_interval = atoi(argv[2]);
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
     if (argc < 3 || argc > 4) {
-        fprintf(stderr, "用法: %s <服务器IP> <服务器端口> [P2P端口]\n", argv[0]);
+        fprintf(stderr, "用法: %s [--headless <控制套接字路径>] [--data <数据目录>] [--metrics <文件> [--metrics-interval <秒>]] [--trace <文件>] <服务器IP> <服务器端口> [P2P端口]\n", argv[0]);
         return 1;
     }
 
     // 1. 初始化核心服务
     char exe_path_buf[PATH_MAX];
     char final_path[PATH_MAX];
-    ssize_t len = readlink("/proc/self/exe", exe_path_buf, sizeof(exe_path_buf) - 1);
-    if (len != -1) {
-        exe_path_buf[len] = '\0';
-        strcpy(final_path, dirname(exe_path_buf));
+    if (data_dir) {
+        if (mkdir(data_dir, 0700) != 0 && errno != EEXIST) {
+            fprintf(stderr, "无法创建数据目录 %s: %s\n", data_dir, strerror(errno));
+            return 1;
+        }
+        if (!realpath(data_dir, final_path)) {
+            fprintf(stderr, "无效的数据目录 %s: %s\n", data_dir, strerror(errno));
+            return 1;
+        }
     } else {
-        getcwd(final_path, sizeof(final_path));
+        ssize_t len = readlink("/proc/self/exe", exe_path_buf, sizeof(exe_path_buf) - 1);
+        if (len != -1) {
+            exe_path_buf[len] = '\0';
+            strcpy(final_path, dirname(exe_path_buf));
+        } else {
+            getcwd(final_path, sizeof(final_path));
+        }
     }
 
     if (init_client_services(final_path) != 0) {
         fprintf(stderr, "客户端服务初始化失败。\n");
         return 1;
     }
+    if (metrics_path && metrics_dump_start(metrics_path, metrics_interval) != 0) {
+        fprintf(stderr, "无法写入运行统计文件 %s\n", metrics_path);
+        shutdown_client_services();
+        return 1;
+    }
+    if (trace_path) {
+        char node[TRACE_NODE_SIZE];
+        snprintf(node, sizeof(node), "%.16s", get_my_public_key_hex());
+        if (trace_start(trace_path, 0, node) != 0) {
+            fprintf(stderr, "无法创建追踪文件 %s: %s\n", trace_path, strerror(errno));
+            shutdown_client_services();
+            return 1;
+        }
+    }
+
+    const char *server_ip = argv[1];
+    int server_port = atoi(argv[2]);
+    int p2p_port = (argc == 4) ? atoi(argv[3]) : 0;
+    if (control_path) {
+        int rc = headless_init();
+        if (rc == 0 && connect_and_listen(server_ip, server_port, p2p_port) != 0) {
+            log_msg("[致命错误] 网络连接失败。");
+            rc = -1;
+        }
+        if (rc == 0) rc = run_headless(control_path);
+        shutdown_client_services();
+        return rc == 0 ? 0 : 1;
+    }
 
     // 2. 初始化UI
     init_ui();
 
     // 3. 连接网络
-    const char *server_ip = argv[1];
-    int server_port = atoi(argv[2]);
-    int p2p_port = (argc == 4) ? atoi(argv[3]) : 0;
     if (connect_and_listen(server_ip, server_port, p2p_port) != 0) {
         log_msg("[致命错误] 网络连接失败。");
         sleep(3);
@@ -45,12 +105,19 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // 4. 进入主事件循环
+    // 4. 进入主事件循环：只在有按键或后台线程发来通知时醒来，空闲时不占用 CPU
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = ui_event_fd(), .events = POLLIN },
+    };
     while (current_ui_state != UI_STATE_EXITING) {
         // 所有UI更新都在这个主线程中串行执行
         update_logs_from_queue();
         handle_input_and_events();
-        usleep(50000); // 50ms延迟，防止CPU占用过高
+        if (current_ui_state == UI_STATE_EXITING) break;
+        if (poll(fds, 2, ui_poll_timeout_ms()) < 0 && errno != EINTR) break;
+        // 先清除通知再处理，处理期间到达的通知会让下一次 poll 立即返回
+        if (fds[1].revents & POLLIN) ui_clear_events();
     }
 
     // 5. 清理和退出
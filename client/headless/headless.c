@@ -0,0 +1,457 @@
+#define _GNU_SOURCE // accept4
+#include "headless.h"
+#include "../logic/client_logic.h"
+#include "../logic/contact_store.h"
+#include "../logic/sync_scheduler.h"
+#include "../logic/metrics.h"
+#include "../ui/event_ring.h"
+#include <cjson/cJSON.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#define CONTROL_MAX_CLIENTS 16
+#define CONTROL_LINE_MAX (64 * 1024)     // 单个请求的最大长度
+#define CONTROL_OUT_MAX (4 * 1024 * 1024) // 订阅者未读出的数据超过此值时断开
+#define CONTROL_EVENT_CAPACITY 4096
+#define CONTROL_EVENT_BATCH 256
+#define HISTORY_LIMIT_MAX 1000
+#define PEERS_LIMIT_MAX 500
+#define METRICS_PEERS_MAX 64
+
+typedef struct {
+    int fd;
+    int subscribed;
+    char *in;
+    size_t in_len;
+    char *out;
+    size_t out_len, out_cap;
+} control_client_t;
+
+static EventRing *events = NULL;
+static int event_fd = -1;
+static atomic_int wake_pending = 0;
+static volatile sig_atomic_t stopping = 0;
+static control_client_t clients[CONTROL_MAX_CLIENTS];
+
+static void wake() {
+    // 与界面的 ui_notify 相同：主循环处理之前的重复通知不再写 eventfd，可在信号处理函数中调用
+    if (event_fd < 0 || atomic_exchange(&wake_pending, 1)) return;
+    uint64_t one = 1;
+    ssize_t n = write(event_fd, &one, sizeof(one));
+    (void)n;
+}
+
+static void post_log(const char* line) {
+    if (event_ring_push(events, UI_EVENT_LOG, PK_ID_NONE, line) == 0) wake();
+}
+
+static void post_chat(pk_id_t chat_id) {
+    if (event_ring_push(events, UI_EVENT_CHAT, chat_id, NULL) == 0) wake();
+}
+
+static void handle_stop(int sig) {
+    (void)sig;
+    stopping = 1;
+    wake();
+}
+
+int headless_init() {
+    static const client_events_t headless_events = { post_log, post_chat };
+    events = event_ring_create(CONTROL_EVENT_CAPACITY);
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!events || event_fd < 0) {
+        fprintf(stderr, "[控制] 错误: 无法创建事件队列。\n");
+        return -1;
+    }
+    set_client_events(&headless_events);
+    return 0;
+}
+
+// --- 连接管理 ---
+static void client_close(control_client_t* c) {
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+/**
+ * 把一行 JSON 放进发送缓冲区，由主循环在可写时发出。
+ * @return 缓冲区超限（对方长时间不读）时返回 -1，调用者应断开。
+ */
+static int client_queue(control_client_t* c, cJSON* json) {
+    char *text = cJSON_PrintUnformatted(json);
+    if (!text) return -1;
+    size_t len = strlen(text);
+    if (c->out_len + len + 1 > CONTROL_OUT_MAX) {
+        free(text);
+        return -1;
+    }
+    if (c->out_len + len + 1 > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 4096;
+        while (cap < c->out_len + len + 1) cap *= 2;
+        char *out = realloc(c->out, cap);
+        if (!out) {
+            free(text);
+            return -1;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, text, len);
+    c->out[c->out_len + len] = '\n';
+    c->out_len += len + 1;
+    free(text);
+    return 0;
+}
+
+static int client_flush(control_client_t* c) {
+    while (c->out_len > 0) {
+        ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        memmove(c->out, c->out + n, c->out_len - (size_t)n);
+        c->out_len -= (size_t)n;
+    }
+    return 0;
+}
+
+// --- 请求处理 ---
+static cJSON* reply_error(const char* error) {
+    cJSON *reply = cJSON_CreateObject();
+    cJSON_AddFalseToObject(reply, "ok");
+    cJSON_AddStringToObject(reply, "error", error);
+    return reply;
+}
+
+static cJSON* reply_ok() {
+    cJSON *reply = cJSON_CreateObject();
+    cJSON_AddTrueToObject(reply, "ok");
+    return reply;
+}
+
+static const char* json_string(cJSON* json, const char* key) {
+    cJSON *item = cJSON_GetObjectItem(json, key);
+    return cJSON_IsString(item) ? item->valuestring : NULL;
+}
+
+static int json_int(cJSON* json, const char* key, int fallback, int max) {
+    cJSON *item = cJSON_GetObjectItem(json, key);
+    if (!cJSON_IsNumber(item) || item->valuedouble < 1) return fallback;
+    return item->valuedouble > max ? max : (int)item->valuedouble;
+}
+
+static cJSON* cmd_status() {
+    cJSON *reply = reply_ok();
+    cJSON_AddStringToObject(reply, "pk", get_my_public_key_hex());
+    cJSON_AddNumberToObject(reply, "p2p_port", get_my_p2p_port());
+    cJSON_AddNumberToObject(reply, "online", get_online_peer_count());
+    cJSON_AddNumberToObject(reply, "contacts", contact_store_count());
+    int active = 0, queued = 0;
+    sync_scheduler_get_summary(&active, &queued);
+    cJSON_AddNumberToObject(reply, "sync_active", active);
+    cJSON_AddNumberToObject(reply, "sync_queued", queued);
+    cJSON_AddNumberToObject(reply, "tx_bytes", (double)metrics_counter(METRIC_BYTES_OUT));
+    cJSON_AddNumberToObject(reply, "rx_bytes", (double)metrics_counter(METRIC_BYTES_IN));
+    return reply;
+}
+
+static cJSON* cmd_peers(cJSON* req) {
+    int limit = json_int(req, "limit", 100, PEERS_LIMIT_MAX);
+    const char *prefix = json_string(req, "prefix"), *after = json_string(req, "after");
+    contact_t *page = malloc(sizeof(contact_t) * (size_t)limit);
+    if (!page) return reply_error("内存不足");
+    int n = contact_store_list(prefix ? prefix : "", after && after[0] ? after : NULL, page, limit);
+    if (n < 0) {
+        free(page);
+        return reply_error("读取通讯录失败");
+    }
+    cJSON *reply = reply_ok(), *list = cJSON_AddArrayToObject(reply, "peers");
+    char hex[PK_BYTES * 2 + 1];
+    for (int i = 0; i < n; i++) {
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "name", page[i].name);
+        cJSON_AddStringToObject(item, "pk", sodium_bin2hex(hex, sizeof(hex), page[i].pk, PK_BYTES));
+        cJSON_AddBoolToObject(item, "group", page[i].kind == CONTACT_KIND_GROUP);
+        // 没有驻留的好友从未连接过，不可能在线
+        int received = 0;
+        SyncJobState sync = page[i].id != PK_ID_NONE ? sync_scheduler_get_state(page[i].id, &received) : SYNC_JOB_NONE;
+        cJSON_AddBoolToObject(item, "online", page[i].id != PK_ID_NONE && is_peer_online(page[i].id));
+        cJSON_AddStringToObject(item, "sync", sync == SYNC_JOB_ACTIVE ? "active" : sync == SYNC_JOB_QUEUED ? "queued" : "none");
+        cJSON_AddItemToArray(list, item);
+    }
+    free(page);
+    return reply;
+}
+
+static cJSON* cmd_send(cJSON* req) {
+    const char *to = json_string(req, "to"), *text = json_string(req, "text");
+    if (!to || !text || !text[0]) return reply_error("需要 to 和 text");
+    if (contact_store_find_by_name(to) == PK_ID_NONE) return reply_error("没有这个联系人");
+    send_chat_message(to, text);
+    return reply_ok();
+}
+
+static void add_history_line(void* ctx, sqlite3_int64 id, const char* line) {
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddNumberToObject(item, "id", (double)id);
+    cJSON_AddStringToObject(item, "line", line);
+    cJSON_AddItemToArray((cJSON*)ctx, item);
+}
+
+static cJSON* cmd_history(cJSON* req) {
+    const char *chat = json_string(req, "chat");
+    pk_id_t chat_id = chat ? contact_store_find_by_name(chat) : PK_ID_NONE;
+    if (chat_id == PK_ID_NONE) return reply_error("没有这个联系人");
+    int limit = json_int(req, "limit", 50, HISTORY_LIMIT_MAX);
+    cJSON *after = cJSON_GetObjectItem(req, "after"), *before = cJSON_GetObjectItem(req, "before");
+    int older = !cJSON_IsNumber(after);
+    sqlite3_int64 cursor = older ? (cJSON_IsNumber(before) ? (sqlite3_int64)before->valuedouble : 0) : (sqlite3_int64)after->valuedouble;
+    cJSON *reply = reply_ok(), *list = cJSON_AddArrayToObject(reply, "messages");
+    int n = read_chat_history(chat_id, cursor, older, limit, add_history_line, list);
+    if (n < 0) {
+        cJSON_Delete(reply);
+        return reply_error("读取聊天记录失败");
+    }
+    if (older) {
+        // 向前读取时按行号降序得到，统一按升序返回
+        cJSON *sorted = cJSON_CreateArray(), *item;
+        while ((item = cJSON_DetachItemFromArray(list, cJSON_GetArraySize(list) - 1)) != NULL) cJSON_AddItemToArray(sorted, item);
+        cJSON_ReplaceItemInObject(reply, "messages", sorted);
+    }
+    return reply;
+}
+
+static cJSON* cmd_add_friend(cJSON* req) {
+    const char *pk = json_string(req, "pk"), *name = json_string(req, "name");
+    if (!pk || !name || strlen(pk) != PK_BYTES * 2 || !name[0]) return reply_error("需要 64 位十六进制的 pk 和 name");
+    add_new_friend(pk, name);
+    return reply_ok();
+}
+
+static cJSON* cmd_metrics() {
+    metrics_snapshot_t snap;
+    metrics_snapshot(&snap);
+    cJSON *reply = reply_ok();
+    cJSON_AddItemToObject(reply, "metrics", metrics_snapshot_json(&snap));
+    cJSON *list = cJSON_AddArrayToObject(reply, "peers");
+    peer_traffic_t traffic[METRICS_PEERS_MAX];
+    int n = get_peer_traffic(traffic, METRICS_PEERS_MAX);
+    for (int i = 0; i < n; i++) {
+        const char *name = contact_store_name(traffic[i].id);
+        cJSON *item = cJSON_CreateObject();
+        if (name) cJSON_AddStringToObject(item, "name", name);
+        cJSON_AddStringToObject(item, "pk", pk_hex(traffic[i].id));
+        cJSON_AddBoolToObject(item, "relayed", traffic[i].relayed);
+        cJSON_AddNumberToObject(item, "bytes_out", (double)traffic[i].bytes_out);
+        cJSON_AddNumberToObject(item, "bytes_in", (double)traffic[i].bytes_in);
+        cJSON_AddNumberToObject(item, "frames_out", (double)traffic[i].frames_out);
+        cJSON_AddNumberToObject(item, "frames_in", (double)traffic[i].frames_in);
+        cJSON_AddItemToArray(list, item);
+    }
+    return reply;
+}
+
+static cJSON* handle_request(control_client_t* c, const char* line) {
+    cJSON *req = cJSON_Parse(line);
+    if (!req) return reply_error("请求不是有效的 JSON");
+    const char *cmd = json_string(req, "cmd");
+    cJSON *reply;
+    if (!cmd) reply = reply_error("缺少 cmd");
+    else if (strcmp(cmd, "status") == 0) reply = cmd_status();
+    else if (strcmp(cmd, "peers") == 0) reply = cmd_peers(req);
+    else if (strcmp(cmd, "send") == 0) reply = cmd_send(req);
+    else if (strcmp(cmd, "history") == 0) reply = cmd_history(req);
+    else if (strcmp(cmd, "add_friend") == 0) reply = cmd_add_friend(req);
+    else if (strcmp(cmd, "metrics") == 0) reply = cmd_metrics();
+    else if (strcmp(cmd, "subscribe") == 0) {
+        c->subscribed = 1;
+        reply = reply_ok();
+    } else if (strcmp(cmd, "shutdown") == 0) {
+        stopping = 1;
+        reply = reply_ok();
+    } else {
+        reply = reply_error("未知的 cmd");
+    }
+    cJSON *id = cJSON_GetObjectItem(req, "id");
+    if (id) cJSON_AddItemToObject(reply, "id", cJSON_Duplicate(id, 1));
+    cJSON_Delete(req);
+    return reply;
+}
+
+/**
+ * 读取并处理连接上已到达的完整请求行。
+ * @return 对方关闭或出错时返回 -1。
+ */
+static int client_read(control_client_t* c) {
+    char buf[4096];
+    ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+    if (n == 0) return -1;
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    if (c->in_len + (size_t)n > CONTROL_LINE_MAX) return -1;
+    if (!c->in && !(c->in = malloc(CONTROL_LINE_MAX + 1))) return -1;
+    memcpy(c->in + c->in_len, buf, (size_t)n);
+    c->in_len += (size_t)n;
+    size_t start = 0;
+    for (size_t i = 0; i < c->in_len; i++) {
+        if (c->in[i] != '\n') continue;
+        c->in[i] = '\0';
+        if (i > start) {
+            cJSON *reply = handle_request(c, c->in + start);
+            int rc = client_queue(c, reply);
+            cJSON_Delete(reply);
+            if (rc != 0) return -1;
+        }
+        start = i + 1;
+    }
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+    return 0;
+}
+
+// --- 事件推送 ---
+static void broadcast(cJSON* event) {
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        control_client_t *c = &clients[i];
+        if (c->fd < 0 || !c->subscribed) continue;
+        if (client_queue(c, event) != 0) {
+            fprintf(stderr, "[控制] 订阅者读取太慢，已断开。\n");
+            client_close(c);
+        }
+    }
+}
+
+static void drain_events() {
+    const ui_event_t *ev;
+    int n = 0;
+    metrics_gauge_set(METRIC_GAUGE_EVENT_QUEUE, (int64_t)event_ring_size(events));
+    while (n < CONTROL_EVENT_BATCH && (ev = event_ring_peek(events)) != NULL) {
+        cJSON *event = cJSON_CreateObject();
+        if (ev->type == UI_EVENT_LOG) {
+            fprintf(stderr, "%s\n", ev->text);
+            cJSON_AddStringToObject(event, "event", "log");
+            cJSON_AddStringToObject(event, "text", ev->text);
+        } else {
+            const char *name = contact_store_name(ev->chat_id);
+            cJSON_AddStringToObject(event, "event", "chat");
+            if (name) cJSON_AddStringToObject(event, "chat", name);
+            cJSON_AddStringToObject(event, "pk", pk_hex(ev->chat_id));
+        }
+        broadcast(event);
+        cJSON_Delete(event);
+        event_ring_pop(events);
+        n++;
+    }
+    if (n == CONTROL_EVENT_BATCH) wake();
+    uint64_t dropped_logs = event_ring_take_drops(events, UI_EVENT_LOG), dropped_chats = event_ring_take_drops(events, UI_EVENT_CHAT);
+    metrics_add(METRIC_LOG_DROPPED, dropped_logs);
+    metrics_add(METRIC_CHAT_EVENT_DROPPED, dropped_chats);
+    uint64_t dropped = dropped_logs + dropped_chats;
+    if (dropped) {
+        // 丢掉的新消息通知无从补发，订阅者收到后应对所有关心的会话用 history 补读
+        cJSON *event = cJSON_CreateObject();
+        cJSON_AddStringToObject(event, "event", "dropped");
+        cJSON_AddNumberToObject(event, "count", (double)dropped);
+        broadcast(event);
+        cJSON_Delete(event);
+    }
+}
+
+static int listen_control(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[控制] 错误: 套接字路径过长: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path); // 上次异常退出留下的套接字文件
+    // 控制接口可以代替本机用户收发消息，只允许属主连接
+    mode_t old_mask = umask(0177);
+    int rc = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (rc != 0 || listen(fd, CONTROL_MAX_CLIENTS) != 0) {
+        fprintf(stderr, "[控制] 错误: 无法监听 %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int run_headless(const char* control_path) {
+    if (!events && headless_init() != 0) return -1;
+    int listen_fd = listen_control(control_path);
+    if (listen_fd < 0) return -1;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) clients[i].fd = -1;
+    signal(SIGINT, handle_stop);
+    signal(SIGTERM, handle_stop);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "[控制] 无界面模式已启动，控制套接字: %s\n", control_path);
+
+    struct pollfd fds[2 + CONTROL_MAX_CLIENTS];
+    while (!stopping) {
+        drain_events();
+        int nfds = 0;
+        fds[nfds++] = (struct pollfd){ .fd = event_fd, .events = POLLIN };
+        fds[nfds++] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+        int slot_of[CONTROL_MAX_CLIENTS];
+        for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+            if (clients[i].fd < 0) continue;
+            slot_of[nfds - 2] = i;
+            fds[nfds++] = (struct pollfd){ .fd = clients[i].fd, .events = POLLIN | (clients[i].out_len ? POLLOUT : 0) };
+        }
+        if (poll(fds, nfds, -1) < 0 && errno != EINTR) break;
+        if (fds[0].revents & POLLIN) {
+            // 先清标志再读，之后投递的事件会再次写 eventfd
+            uint64_t count;
+            atomic_store(&wake_pending, 0);
+            while (read(event_fd, &count, sizeof(count)) == sizeof(count)) {}
+        }
+        if (fds[1].revents & POLLIN) {
+            int fd;
+            while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                int slot = -1;
+                for (int i = 0; i < CONTROL_MAX_CLIENTS && slot < 0; i++) if (clients[i].fd < 0) slot = i;
+                if (slot < 0) {
+                    close(fd);
+                    fprintf(stderr, "[控制] 控制连接已满，拒绝新连接。\n");
+                    continue;
+                }
+                clients[slot].fd = fd;
+            }
+        }
+        for (int k = 2; k < nfds; k++) {
+            control_client_t *c = &clients[slot_of[k - 2]];
+            if (c->fd != fds[k].fd) continue; // 本轮广播时已被断开
+            int failed = (fds[k].revents & (POLLERR | POLLNVAL)) != 0;
+            if (!failed && (fds[k].revents & (POLLIN | POLLHUP))) failed = client_read(c) != 0;
+            if (!failed) failed = client_flush(c) != 0;
+            if (failed) client_close(c);
+        }
+    }
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (clients[i].fd < 0) continue;
+        client_flush(&clients[i]); // 尽量把 shutdown 的应答发出去
+        client_close(&clients[i]);
+    }
+    close(listen_fd);
+    unlink(control_path);
+    // 网络线程可能刚取得事件接收者，队列和 eventfd 留到进程退出；之后的日志直接写标准错误
+    set_client_events(NULL);
+    fprintf(stderr, "[控制] 无界面模式已退出。\n");
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef ZEROLINK_HEADLESS_H
+#define ZEROLINK_HEADLESS_H
+
+/**
+ * @file headless.h
+ * @brief 无界面模式：业务逻辑作为守护进程运行，通过 UNIX 域套接字上的控制接口驱动，用于服务器上的机器人、中继和压力测试。
+ *
+ * 协议为按行分隔的 JSON：客户端每行发送一个请求，服务端每行返回一个应答，请求中的 "id" 原样带回。
+ *   {"cmd":"status"}                                   本机公钥、P2P 端口、在线好友数、同步任务数、链路收发字节数
+ *   {"cmd":"peers","prefix":"","after":"名字","limit":100}  按名字分页列出联系人及在线、同步状态
+ *   {"cmd":"send","to":"名字","text":"..."}            发送消息（对群名同样适用）
+ *   {"cmd":"history","chat":"名字","before":0,"after":0,"limit":50}
+ *                                                      以行号为游标读取聊天记录，结果按行号升序；
+ *                                                      给出 after 时读其后的消息，否则读 before 之前（0 为最新）的消息
+ *   {"cmd":"add_friend","pk":"公钥","name":"名字"}
+ *   {"cmd":"metrics"}                                  指标快照（见 metrics.h）和各连接的收发统计
+ *   {"cmd":"subscribe"}                                此后推送事件: {"event":"log","text":...}、
+ *                                                      {"event":"chat","chat":"名字","pk":...}（收到后用 history 的 after 读取）
+ *   {"cmd":"shutdown"}                                 退出守护进程
+ * 成功的应答带 "ok":true，失败的带 "ok":false 和 "error"。
+ * 读取跟不上事件的订阅者会被断开，不会拖慢网络线程。
+ */
+
+/**
+ * @brief 接管日志与事件输出，之后的日志先进入队列，由 run_headless 写到标准错误并推送给订阅者。
+ * @return 成功返回 0，失败返回 -1。
+ */
+int headless_init();
+
+/**
+ * @brief 在 control_path 上监听控制连接，运行到收到 shutdown 请求或 SIGINT/SIGTERM 为止。
+ *        调用顺序: init_client_services、headless_init、connect_and_listen、run_headless、shutdown_client_services。
+ * @return 正常退出返回 0，出错返回 -1。
+ */
+int run_headless(const char* control_path);
+
+#endif //ZEROLINK_HEADLESS_H
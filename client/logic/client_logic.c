@@ -1,5 +1,8 @@
 #include "client_logic.h"
-#include "../ui/ui.h"
+#include "sync_scheduler.h"
+#include "contact_store.h"
+#include "metrics.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,71 +19,280 @@
 #include <sqlite3.h>
 #include <cjson/cJSON.h>
 #include <limits.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <netinet/tcp.h>
+#include "../../core/storage/uid_filter.h"
+#include "../../core/storage/archive_block.h"
+#include "../../core/crypto/peer_crypto.h"
+#include "../../core/crypto/group_crypto.h"
+#include "../../core/net/gossip.h"
+#include "../../core/net/rudp.h"
+#include "../../core/net/link_mux.h"
+#include "../../core/relay/peer_relay.h"
 
 #define MAX_PEERS 30
-#define MAX_FRIENDS 50
 #define BUFFER_SIZE 4096
 #define IDENTITY_FILE "identity.dat"
-#define FRIENDS_FILE "friends.dat"
+#define FRIENDS_FILE "friends.dat"       // 旧版本的好友列表，导入通讯录后改名保留
+#define CONTACTS_FILE "contacts.db"      // 位于 data/<本机公钥>/ 下
 #define DB_FILE "chat.db"
+#define UID_FILTER_FILE "uid_filter.bin" // 旧版本的全局过滤器，迁移后删除
 
-typedef struct {
-    int sockfd;
+// --- 消息 UID ---
+// 16 字节：前 6 字节为毫秒时间戳（大端），后 10 字节随机。数据库中以 BLOB 存储，线路上用十六进制表示。
+#define MSG_UID_BYTES 16
+#define MSG_UID_HEX_LEN (MSG_UID_BYTES * 2)
+
+// --- UID 过滤器 ---
+// 每个会话分片一个布隆过滤器，记录该会话已有的全部消息 UID，与分片一起持久化（水位为已收录的最大行号）。
+// 不命中说明消息一定不存在；命中可能是假阳性，因此只有续传流这类重放数据才据此直接丢弃。
+#define UID_FILTER_MIN_CAPACITY 2048
+#define UID_FILTER_SAVE_INTERVAL 4096 // 每新增多少条消息落盘一次
+
+// --- 区间集合协调 (Range-based set reconciliation) ---
+// 每条消息以 BLAKE2b(uid) 的前 64 位为指纹：高 32 位 hkey 决定其在哈希空间中的位置，低 32 位 hlow 参与校验和。
+// 区间指纹 = (消息数, Σhkey, Σhlow)，双方只对指纹不同的区间递归细分，
+// 交换的数据量与差异大小成正比，与历史长度仅成对数关系。
+#define SYNC_HASH_SPACE (1ULL << 32)
+#define SYNC_BUCKET_SHIFT 20        // 持久化叶子桶宽度 2^20，共 4096 个桶
+#define SYNC_FANOUT 16              // 每次递归把区间分成 16 份
+#define SYNC_ITEM_THRESHOLD 16      // 区间内消息数不超过该值时直接交换 uid 列表
+#define SYNC_MAX_RANGES_PER_MSG 24  // 单个 sync_ranges 报文携带的最大区间数
+
+// --- 流式同步 ---
+// 缺失消息以 sync_chunk 分块发送，每块不超过 SYNC_CHUNK_BYTES；接收方每处理完一块归还一个信用，
+// 发送方只在信用大于零时继续从数据库游标读取下一块，因此双方内存占用与积压量无关。
+#define MAX_FRAME_SIZE (128 * 1024)  // 线路上单个加密帧的上限
+#define RECV_BATCH_FRAMES 32         // 一次读取后最多成批解密的帧数
+#define PEER_KEY_CACHE_SIZE (MAX_PEERS * 2) // 断开的好友的共享密钥也保留一段时间，重连时不必重新计算
+#define FRAME_GROUP_FLAG 0x80000000u         // 长度头的最高位：帧体是已加密签名的群帧，不经过链路加密
+#define FRAME_RELAY_FLAG 0x40000000u         // 长度头的次高位：帧体解密后是中继包 (RELAY_WRAPPED_PACKET)
+#define FRAME_MUX_FLAG 0x20000000u           // 长度头的第三位：帧体是一个较大的帧的分片 (link_mux.h)，只在声明过 link_mux 的直连上出现
+#define FRAME_FLAGS (FRAME_GROUP_FLAG | FRAME_RELAY_FLAG | FRAME_MUX_FLAG)
+#define LINK_NOTSENT_LOWAT (16 * 1024) // 直连的内核发送队列中尚未发出的数据上限，超过时写线程阻塞，排队留在发送队列里
+#define LINK_QUEUE_SOFT_BYTES (1024 * 1024)     // 发送队列超过该值时，接收线程以外的发送方等待写线程追上，中继转发回复 busy
+#define LINK_QUEUE_MAX_BYTES (32 * 1024 * 1024) // 直连发送队列的上限，超过说明对端长时间不读取，连接被断开
+#define RELAY_FRAME_OVERHEAD (PEER_BOX_OVERHEAD + RELAY_HEADER_BYTES + 4) // 中继包比它携带的内层帧多出的字节
+#define MAX_LINK_FRAME_SIZE (MAX_FRAME_SIZE + RELAY_FRAME_OVERHEAD)
+#define SYNC_CHUNK_BYTES (32 * 1024) // 单个同步块的目标大小
+#define SYNC_CHUNK_ROWS 64           // 单次游标读取的最大行数
+#define SYNC_INITIAL_CREDITS 4       // 新建流的初始信用（双方约定）
+#define SYNC_MAX_STREAMS 32          // 每个对端同时进行的发送流上限
+#define SYNC_MAX_WAITING_STREAMS 256 // 超出上限的区间排队等待空出的流，排队数上限
+#define SYNC_MAX_SKIP 64             // 每个流最多记录的“对方已有”uid 数
+#define SYNC_MAX_ACTIVE_JOBS 3       // 同时进行的同步任务上限（当前会话另有一个专用槽）
+
+// --- 全文搜索 ---
+// 每个分片带一个 FTS5 外部内容索引（trigram 分词，中英文都按子串匹配），随消息写入在同一事务内增量维护。
+// 排序不用内置 bm25：它的 IDF 需要扫描每个词的完整倒排表，常见词在百万级消息上要上百毫秒。
+// 这里只按词频与消息长度打分，并且只对最新的一段候选消息排序，窗口不够时按倍数向更早的消息扩展。
+#define SEARCH_MIN_TERM_CHARS 3      // trigram 无法索引更短的词，这类词改为在候选消息中逐条过滤
+#define SEARCH_MAX_TERMS 8
+#define SEARCH_CANDIDATES 1000       // 参与排序的候选消息数下限
+#define SEARCH_INITIAL_WINDOW 4096   // 首个候选窗口覆盖的最新消息数
+#define SEARCH_WINDOW_GROWTH 4
+#define SEARCH_SCAN_LIMIT 100000     // 查询只含短词时，顺序扫描的最新消息数
+
+// --- 历史归档 ---
+// 超过保留期的消息按行号顺序打包成归档段：段由若干压缩块组成（archive_block.h），每块一行存入 archive_blocks，
+// 然后从热表（连同全文索引）删除。每条归档消息在 archive_keys 中保留同步键 (hkey, uid, hlow) 和所在的块，
+// 因此区间协调、去重和按 uid 取消息照常工作，叶子桶也不需要改动。
+// 同步与历史分页透明地读取归档；全文搜索只覆盖热表。
+#define ARCHIVE_DEFAULT_AGE_DAYS 90
+#define ARCHIVE_AGE_FILE "archive_age"   // 位于 data/<本机公钥>/ 下，内容为天数
+#define ARCHIVE_SEGMENT_ROWS 4096        // 每段的消息数上限（一个事务）
+#define ARCHIVE_MIN_SEGMENT_ROWS 512     // 过期消息不足该数时暂不归档，避免产生碎段
+#define ARCHIVE_QUEUE_SLOTS 64           // 归档线程的任务数上限，满了之后新打开的会话留到下次打开，指令提示稍后再试
+#define ARCHIVE_IDLE_MS 2000             // 会话打开后等待这么久再归档，避开打开时的读写高峰
+#define ARCHIVE_BLOCK_CACHE 8            // 每个分片缓存的已解压块数
+// 归档块的格式 (archive_block.h) 独立于本文件定义，两边的字段长度必须一致
+_Static_assert(ARCHIVE_UID_BYTES == MSG_UID_BYTES, "归档块的 UID 长度与消息 UID 不一致");
+_Static_assert(ARCHIVE_PK_BYTES == PK_BYTES, "归档块的公钥长度与 PK_BYTES 不一致");
+
+// --- 群聊 ---
+// 群是特殊的联系人（contact_store.h），群 id 随机生成。成员变动时由发起方把新的纪元和成员列表 (group_update)
+// 发给新旧全部成员，收到的成员再转发给其他在线成员；每个成员应用后为新纪元生成自己的发送者密钥，
+// 封装成任何成员都可以原样转发、只有对应成员能打开的密钥包 (group_key)，同样逐跳转发。
+// 群消息用发送者密钥加密并签名一次（group_crypto.h），按流言方式传播（gossip.h）：发送者和每个第一次收到该帧的成员
+// 只把它转发给 GROUP_GOSSIP_FANOUT 个随机选出的在线成员，发送者的上传量与群的人数无关。
+// 扇出没覆盖到、当时不在线或缺少密钥的成员由周期性的反熵补齐：帧按消息时间的小时桶保存，双方交换各桶的摘要，
+// 不一致的桶再交换 uid 列表并互相补发。成员上线时会收到双方共同所在各群的最新状态、密钥包和一次反熵。
+#define GROUP_KEYRING_SIZE 256        // 常驻锁定内存的发送者密钥数，其余按需从通讯录读取
+#define GROUP_SHARED_MAX 64           // 好友上线时同步的共同群数上限
+#define GROUP_GOSSIP_FANOUT GOSSIP_DEFAULT_FANOUT
+#define GROUP_SEEN_CAPACITY 8192      // 去重集合每一代记住的帧数
+#define GROUP_KEY_WANT_INTERVAL 2     // 同一把缺失的密钥两次索取的最小间隔（秒）
+#define GROUP_ENTROPY_INTERVAL 5      // 反熵的周期（秒），每轮只和一个群的一位成员交换
+#define GROUP_FRAME_BUCKET_MS 3600000 // 反熵按消息时间分桶，每桶一小时
+#define GROUP_FRAME_RETENTION 72      // 保留并参与反熵的桶数（小时），更早的帧被删除，消息本身不受影响
+#define GROUP_ENTROPY_MAX_UIDS 256    // 单个 group_uids / group_want 报文携带的 uid 数上限
+#define GROUP_INVITE_BURST 4          // 每位好友可以连续拉本机进入的新群数，之后按下面的间隔恢复
+#define GROUP_INVITE_INTERVAL_MS 60000
+#define GROUP_INVITE_SLOTS 64         // 记录邀请配额的好友数，超出时复用最久未邀请的一项
+
+// --- 二级中继 ---
+#define DIAL_TIMEOUT_MS 3000          // 直连的 TCP 握手超时，超时后改走中继
+#define DIAL_UDP_TIMEOUT_MS 1000      // 直连先试 UDP，这么久没有应答（对方是旧版本或 UDP 不通）再试 TCP
+#define RELAY_PROBE_WINDOW_MS 300     // 发出探测后等待应答的时间，之后从已应答的候选中选出得分最低的
+#define RELAY_PROBE_MAX 8             // 单次选路最多探测的候选中继数
+#define RELAY_DIRECT_RETRY_MS 30000   // 经中继通信期间重试直连的间隔
+#define RELAY_MAX_MISSES 3            // 连续找不到中继的次数上限，之后放弃，等待引导服务器再次通告
+#define RELAY_DIAL_SLOTS 64           // 记录好友地址与拨号状态的表项数
+#define RELAY_RATE_BYTES (256 * 1024) // 本机作为中继时的转发带宽上限（字节/秒）
+#define RELAY_BURST_BYTES (1024 * 1024)
+
+typedef struct sync_stream {
+    uint32_t id;
+    uint64_t lo, hi;               // 哈希区间 [lo, hi)
+    uint32_t pos_hkey;             // 游标位置：已发送的最后一条 (hkey, uid)
+    unsigned char pos_uid[MSG_UID_BYTES];
+    int has_pos;
+    int resume;                    // 由 sync_resume 发起的续传流
+    int waiting;                   // 排队中：同时进行的流已达 SYNC_MAX_STREAMS，等前面的流结束后再发送
+    int credits;
+    int sent;                      // 已发送的消息数
+    int skip_count;
+    uint64_t skip[SYNC_MAX_SKIP];  // 对方已有消息的 uid 指纹
+    struct sync_stream *next;
+} sync_stream_t;
+
+typedef struct peer {
+    _Atomic int refs;              // 连接表（或退役链表）持有一个引用，见 peer_hold
+    int sockfd;                    // 经中继的虚拟连接为 -1
     char ip[INET_ADDRSTRLEN];
     int port;
     unsigned char pk[crypto_box_PUBLICKEYBYTES];
-    unsigned char shared_key[crypto_box_BEFORENMBYTES];
+    pk_id_t id;                    // 对端公钥的驻留 id
+    const PeerKey *key;            // 共享密钥，由 key_cache 持有
     int key_exchanged;
     pthread_t recv_tid;
+    pthread_t send_tid;            // 写线程，按优先级取出发送队列中的帧写入连接
+    int writer_started;
+    link_mux_t mux;                // 直连的发送队列；虚拟连接的帧排在它的中继的队列里
+    _Atomic int mux_enabled;       // 对方声明过能重组分片（link_mux 报文），较大的帧可以切开发送
+    sync_stream_t *streams;        // 发送流，仅由该对端的接收线程访问
+    uint32_t next_stream_id;
+    int sync_received;             // 当前入站流已接收的新消息数
+    int outbound;                  // 由本机发起的直连
+    int supersedes;                // 与已有直连重复且按发起方规则胜出，解密出第一个帧后才关闭旧连接，仅由接收线程访问
+    int udp;                       // 直连走 UDP 传输（rudp.h），sockfd 为它的本地流套接字
+    struct peer *via;              // 虚拟连接的中继（一条直连，持有它的一个引用）；直连为 NULL。虚拟连接的报文都由中继的接收线程处理
+    struct peer *next_retired;     // 已退役、等待中继的接收线程释放的虚拟连接，由 relay_mutex 保护
+    // 收发统计：虚拟连接计自己的帧，承载它的直连另外计入转发后的帧
+    _Atomic uint64_t bytes_out, bytes_in, frames_out, frames_in;
 } peer_t;
 
+/**
+ * 好友的地址与拨号状态，表项只复用不释放。
+ */
+typedef struct {
+    pk_id_t target;                // PK_ID_NONE 表示空闲
+    char ip[INET_ADDRSTRLEN];
+    int port;                      // 0 表示引导服务器尚未通告地址，只能经中继连接
+    int dialing;                   // 拨号线程正在运行
+    int collecting;                // 正在收集中继探测的应答
+    pk_id_t best;                  // 目前得分最低的候选中继
+    double best_score;
+    uint32_t probe_id;             // 本轮探测的随机编号，应答须原样带回
+    int probe_count;
+    pk_id_t probed[RELAY_PROBE_MAX];          // 本轮探测的候选中继
+    uint64_t probe_sent_ms[RELAY_PROBE_MAX];  // 向它发出探测的本机时间，往返时间只按它计算；0 表示尚未发出或已应答
+} relay_dial_t;
+
 // --- 全局变量与锁 ---
-static sqlite3 *db;
-static pthread_mutex_t db_mutex = PTHREAD_MUTEX_INITIALIZER;
-static friend_t* friends[MAX_FRIENDS];
-static int friend_count = 0;
 static unsigned char my_pk[crypto_box_PUBLICKEYBYTES];
-static unsigned char my_sk[crypto_box_SECRETKEYBYTES];
-static char my_pk_hex[PK_HEX_LEN + 1]; // 缓存十六进制公钥
+static PeerKeyCache *key_cache = NULL; // 本机私钥只保存在这里（锁定内存）
+static pk_id_t my_id = PK_ID_NONE;
+static RudpEngine *udp_engine = NULL;   // 与 P2P 监听同一端口号；创建失败时只用 TCP
 static char exe_dir[PATH_MAX];
 static peer_t *peers[MAX_PEERS];
 static pthread_mutex_t peers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t peers_cond = PTHREAD_COND_INITIALIZER;    // 接收线程退出
+static int peers_stopping = 0;          // 正在关闭，不再登记新连接
+static int recv_threads = 0;            // 运行中的接收线程，关闭时等它们全部退出后才关闭分片
 static char my_ip[INET_ADDRSTRLEN] = {0};
 static int my_p2p_port = 0;
 static pthread_mutex_t port_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t port_cond = PTHREAD_COND_INITIALIZER;
 static int port_ready = 0;
+static GroupKeyring *group_keys = NULL;
+static pthread_mutex_t group_mutex = PTHREAD_MUTEX_INITIALIZER; // 成员变动（读取、比较、写回纪元与成员列表）串行执行
+static GossipSeen *group_seen = NULL;   // 已验证过的群帧，流言传播下重复到达的副本不再验证
+static int entropy_running = 0;
+static pthread_t entropy_tid;
+static pthread_mutex_t entropy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t entropy_cond = PTHREAD_COND_INITIALIZER;
+// 锁顺序: peers_mutex -> relay_mutex
+static pthread_mutex_t relay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t relay_cond = PTHREAD_COND_INITIALIZER;  // 连接表变化或中继失效时唤醒拨号线程
+static int relay_stopping = 0;
+static relay_budget_t relay_budget;     // 本机为他人转发的带宽
+static relay_dial_t relay_dials[RELAY_DIAL_SLOTS];
+static peer_t *relay_retired = NULL;
 
 // --- 内部函数原型 ---
 static void init_identity();
 static void load_friends();
-static void save_friends();
 static void db_init();
 static const char* get_config_path(const char* filename, char* out_path, size_t out_len);
-static const char* get_friend_pk_by_name(const char* name);
-static const char* get_friend_name_by_hex(const char *pk_hex);
-static const char* get_friend_name(const unsigned char *pk);
-static void generate_message_uid(char* uid_buf, size_t buf_len);
-static void db_save_message(const char* message_uid, const char* chat_id, const char* sender_pk_hex, const char* content, const char* vector_clock);
-static void send_encrypted(int sockfd, const unsigned char* shared_key, const char* json_string);
+static pk_id_t get_friend_id_by_name(const char* name);
+static const char* get_friend_name(pk_id_t id);
+static void generate_message_uid(unsigned char uid[MSG_UID_BYTES]);
+static void db_migrate_legacy_store();
+static void chat_db_close_all();
+static void send_encrypted(peer_t* peer, link_prio_t prio, const char* json_string);
 static void *p2p_listener(void *arg);
 static void *server_handler(void *arg);
-static cJSON* db_get_vector_clock(const char* chat_id);
-static void db_save_vector_clock(const char* chat_id, cJSON* clock);
 static void vc_merge(cJSON* local_clock, cJSON* remote_clock);
 static void vc_increment(cJSON* clock, const char* node_id);
-static void add_peer(peer_t *peer);
+static int add_peer(peer_t *peer);
+static void peer_supersede(peer_t *peer);
 static void remove_peer(int sockfd);
-static void connect_to_peer(const char *pk_hex, const char *ip, int port);
+static void free_sync_streams(peer_t *peer);
+static int connect_to_peer(pk_id_t id, const char *ip, int port);
+static void relay_receive(peer_t *link, const unsigned char* data, size_t len);
+static void relay_reap(peer_t *link);
+static void relay_dial_start(pk_id_t id);
+static void relay_note_addr(pk_id_t id, const char* ip, int port);
+static uint64_t monotonic_ms();
+static int pk_from_hex(const char* hex, unsigned char out[PK_BYTES]);
+static int start_chat_sync(pk_id_t friend_id);
+static void send_group_message(pk_id_t group_id, const char* message);
+static void handle_group_frame(peer_t *peer, const unsigned char* frame, size_t len);
+static void group_sync_with_peer(pk_id_t peer_id);
+static int group_entropy_start();
+static void group_entropy_stop();
+static int archive_start();
+static void archive_stop();
+static void sample_metrics();
+
+// --- 日志与事件输出：业务逻辑不依赖界面，事件交给 set_client_events 设置的接收者 ---
+static _Atomic(const client_events_t*) client_events = NULL;
+
+void set_client_events(const client_events_t* events) {
+    atomic_store(&client_events, events);
+}
 
-// --- 日志 ---
 void log_msg(const char *format, ...) {
     char buffer[BUFFER_SIZE];
     va_list args;
     va_start(args, format);
     vsnprintf(buffer, sizeof(buffer), format, args);
     va_end(args);
-    queue_log_message(buffer);
+    const client_events_t *events = atomic_load(&client_events);
+    if (events && events->log) events->log(buffer);
+    else fprintf(stderr, "%s\n", buffer);
+}
+
+/**
+ * 通知事件接收者某个会话写入了新消息，接收者按行号游标从数据库读取。
+ */
+static void chat_updated(pk_id_t chat_id) {
+    const client_events_t *events = atomic_load(&client_events);
+    if (events && events->chat_updated) events->chat_updated(chat_id);
 }
 
 // --- 服务初始化/关闭 ---
@@ -95,730 +307,4784 @@ int init_client_services(const char* path) {
         fprintf(stderr, "致命错误: libsodium 初始化失败！\n");
         return -1;
     }
-    db_init();
+    metrics_now_ns(); // 运行时长从这里算起
+    metrics_set_sampler(sample_metrics);
     init_identity();
+    db_init();
     load_friends();
+    relay_budget_init(&relay_budget, RELAY_RATE_BYTES, RELAY_BURST_BYTES, monotonic_ms());
+    if (sync_scheduler_start(SYNC_MAX_ACTIVE_JOBS, start_chat_sync) != 0) {
+        fprintf(stderr, "致命错误: 无法启动同步调度线程！\n");
+        return -1;
+    }
+    if (group_entropy_start() != 0) {
+        fprintf(stderr, "致命错误: 无法启动群消息反熵线程！\n");
+        return -1;
+    }
+    if (archive_start() != 0) {
+        fprintf(stderr, "致命错误: 无法启动历史归档线程！\n");
+        return -1;
+    }
     return 0;
 }
 
+static void peer_put(peer_t *peer);
+
 void shutdown_client_services() {
-    if (db) sqlite3_close(db);
-    for (int i = 0; i < friend_count; i++) free(friends[i]);
+    metrics_dump_stop(); // 最后一行快照仍包含连接与同步状态
+    metrics_set_sampler(NULL);
+    trace_stop();
+    pthread_mutex_lock(&relay_mutex);
+    relay_stopping = 1;
+    pthread_cond_broadcast(&relay_cond);
+    pthread_mutex_unlock(&relay_mutex);
+    group_entropy_stop();
+    sync_scheduler_stop();
+    archive_stop();
+    // 接收线程与拨号线程会写分片、查联系人：先让它们全部退出，最后才关闭分片池与联系人库
+    pthread_mutex_lock(&relay_mutex);
+    for (int i = 0; i < RELAY_DIAL_SLOTS; i++) {
+        while (relay_dials[i].dialing) pthread_cond_wait(&relay_cond, &relay_mutex);
+    }
+    pthread_mutex_unlock(&relay_mutex);
+    rudp_destroy(udp_engine); // UDP 直连的流套接字随后读到 EOF，接收线程退出
+    udp_engine = NULL;
+    pthread_mutex_lock(&peers_mutex);
+    peers_stopping = 1;
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peers[i] && !peers[i]->via) shutdown(peers[i]->sockfd, SHUT_RDWR);
+    }
+    while (recv_threads > 0) pthread_cond_wait(&peers_cond, &peers_mutex);
+    pthread_mutex_unlock(&peers_mutex);
+    // 接收线程退出时已移出并释放自己的直连及经它中继的虚拟连接；剩下的是没有接收线程的表项。
+    // 按引用计数释放：虚拟连接释放时才放开它的中继
     for (int i = 0; i < MAX_PEERS; i++) {
         if(peers[i]) {
-            close(peers[i]->sockfd);
-            free(peers[i]);
+            peer_put(peers[i]);
+            peers[i] = NULL;
         }
     }
+    while (relay_retired) {
+        peer_t *next = relay_retired->next_retired;
+        peer_put(relay_retired);
+        relay_retired = next;
+    }
+    chat_db_close_all();
+    contact_store_close();
+    peer_key_cache_destroy(key_cache);
+    key_cache = NULL;
+    group_keyring_destroy(group_keys);
+    group_keys = NULL;
+    gossip_seen_destroy(group_seen);
+    group_seen = NULL;
 }
 
 // --- 数据库操作 (全部加锁) ---
-static void db_init() {
-    char path[PATH_MAX];
-    get_config_path(DB_FILE, path, sizeof(path));
-    if (sqlite3_open(path, &db)) {
-        log_msg("[致命错误] 无法打开数据库: %s", sqlite3_errmsg(db));
-        exit(1);
-    }
+// 每个会话一个 SQLite 分片: <exe_dir>/data/<本机公钥>/chatlogs/<会话公钥>.db，UID 过滤器保存在同名的 .uidf 文件中。
+// 打开的分片放在按 LRU 淘汰的句柄池里；每个句柄有自己的锁，不同会话的读写互不阻塞。
+// 压缩、导出、清空单个会话都只涉及该会话自己的文件。
+#define CHAT_DB_POOL_SIZE 16   // 保持打开的分片数（软上限，正在使用的句柄不会被淘汰）
+#define CHAT_DB_SLOTS 64       // 句柄池的硬上限
+#define CHAT_DB_SUFFIX ".db"
+#define UID_FILTER_SUFFIX ".uidf"
+#define LEGACY_DB_SCHEMA_VERSION 2
+#define CHAT_DB_SCHEMA_VERSION 1      // 1: 全文索引
+
+static const char *CHAT_DB_SCHEMA =
+    "CREATE TABLE IF NOT EXISTS messages(id INTEGER PRIMARY KEY, message_uid BLOB UNIQUE, sender_pk BLOB, content TEXT, timestamp INTEGER, vector_clock TEXT, hkey INTEGER, hlow INTEGER);"
+    "CREATE INDEX IF NOT EXISTS idx_messages_sync ON messages(hkey, message_uid);"
+    "CREATE TABLE IF NOT EXISTS vector_clock(id INTEGER PRIMARY KEY CHECK (id = 0), clock TEXT);"
+    "CREATE TABLE IF NOT EXISTS sync_buckets(bucket INTEGER PRIMARY KEY, cnt INTEGER, sum_hi INTEGER, sum_lo INTEGER);"
+    "CREATE TABLE IF NOT EXISTS sync_progress(lo INTEGER, hi INTEGER, pos_hkey INTEGER, pos_uid BLOB, PRIMARY KEY(lo, hi));"
+    "CREATE VIRTUAL TABLE IF NOT EXISTS messages_fts USING fts5(content, content='messages', content_rowid='id', tokenize='trigram');"
+    "CREATE TABLE IF NOT EXISTS archive_segments(id INTEGER PRIMARY KEY, first_id INTEGER, last_id INTEGER, first_ts INTEGER, last_ts INTEGER, cnt INTEGER, first_block INTEGER, last_block INTEGER, bytes INTEGER);"
+    "CREATE TABLE IF NOT EXISTS archive_blocks(id INTEGER PRIMARY KEY, first_id INTEGER, last_id INTEGER, cnt INTEGER, data BLOB);"
+    "CREATE INDEX IF NOT EXISTS idx_archive_blocks_last ON archive_blocks(last_id);"
+    "CREATE TABLE IF NOT EXISTS archive_keys(hkey INTEGER, message_uid BLOB, hlow INTEGER, block INTEGER, PRIMARY KEY(hkey, message_uid)) WITHOUT ROWID;"
+    // 群消息的原始帧（仅群会话），供反熵补发；bucket 为消息时间所在的小时
+    "CREATE TABLE IF NOT EXISTS group_frames(message_uid BLOB PRIMARY KEY, bucket INTEGER NOT NULL, hkey INTEGER, hlow INTEGER, frame BLOB NOT NULL) WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS idx_group_frames_bucket ON group_frames(bucket);";
+
+typedef struct {
+    sqlite3_int64 id;
+    ArchiveBlock *block;
+    uint64_t last_used;
+} archive_cache_entry_t;
+
+typedef struct {
+    pk_id_t chat_id;
+    sqlite3 *db;
+    pthread_mutex_t lock;          // 串行化对该分片（含 UID 过滤器与归档块缓存）的所有访问
+    UidFilter *filter;
+    int filter_unsaved;
+    // db_save_message 的预编译语句，随分片打开、关闭，每次使用后 reset
+    sqlite3_stmt *save_stmt, *bucket_stmt, *fts_stmt;
+    archive_cache_entry_t archive_cache[ARCHIVE_BLOCK_CACHE];
+    uint64_t archive_clock;
+    int refs;                      // 已获取该句柄的线程数，非零时不会被淘汰；由 pool_mutex 保护
+    uint64_t last_used;            // 由 pool_mutex 保护
+} chat_db_t;
+
+static chat_db_t *chat_dbs[CHAT_DB_SLOTS];
+static uint64_t chat_db_clock = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char chatlog_dir[PATH_MAX];
+static int archive_age_days = ARCHIVE_DEFAULT_AGE_DAYS; // 0 表示不归档
+// 后台归档：打开分片时只登记会话，由归档线程逐段处理，每段之间释放分片。
+// 归档、压缩、导出指令也交给归档线程，排在空闲归档之前，完成后写日志报告
+typedef enum {
+    ARCHIVE_JOB_IDLE,              // 打开分片时登记，等待 ARCHIVE_IDLE_MS 后归档
+    ARCHIVE_JOB_ARCHIVE,           // /archive：立即归档并报告条数
+    ARCHIVE_JOB_COMPACT,           // /compact：VACUUM
+    ARCHIVE_JOB_EXPORT             // /export：VACUUM INTO dest
+} archive_job_kind_t;
+
+typedef struct {
+    pk_id_t chat_id;
+    archive_job_kind_t kind;
+    char *dest;                    // 导出的目标路径，由队列持有
+} archive_job_t;
+
+static archive_job_t archive_queue[ARCHIVE_QUEUE_SLOTS];
+static int archive_queued = 0;
+static int archive_running = 0;
+static pthread_t archive_tid;
+static pthread_mutex_t archive_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t archive_cond = PTHREAD_COND_INITIALIZER;
+
+static void db_exec_or_die(sqlite3* db, const char* sql, const char* what) {
     char *err_msg = 0;
-    const char *sql_messages = "CREATE TABLE IF NOT EXISTS messages(id INTEGER PRIMARY KEY, message_uid TEXT UNIQUE, chat_id TEXT, sender_pk TEXT, content TEXT, timestamp INTEGER, vector_clock TEXT);";
-    if (sqlite3_exec(db, sql_messages, 0, 0, &err_msg) != SQLITE_OK) {
-        log_msg("[致命错误] 无法创建消息表: %s", err_msg);
+    if (sqlite3_exec(db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+        log_msg("[致命错误] 无法%s: %s", what, err_msg);
         sqlite3_free(err_msg);
         exit(1);
     }
-    const char *sql_vc = "CREATE TABLE IF NOT EXISTS vector_clocks(chat_id TEXT PRIMARY KEY, clock TEXT);";
-    if (sqlite3_exec(db, sql_vc, 0, 0, &err_msg) != SQLITE_OK) {
-        log_msg("[致命错误] 无法创建向量时钟表: %s", err_msg);
-        sqlite3_free(err_msg);
-        exit(1);
+}
+
+static int mkdir_p(const char* path) {
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *p = buf + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(buf, 0700) != 0 && errno != EEXIST) return -1;
+        *p = '/';
     }
+    return (mkdir(buf, 0700) != 0 && errno != EEXIST) ? -1 : 0;
 }
 
-static void db_save_message(const char* message_uid, const char* chat_id, const char* sender_pk_hex, const char* content, const char* vector_clock) {
-    pthread_mutex_lock(&db_mutex);
-    char *sql = sqlite3_mprintf("INSERT OR IGNORE INTO messages (message_uid, chat_id, sender_pk, content, timestamp, vector_clock) VALUES ('%q', '%q', '%q', '%q', %lld, '%q');",
-                          message_uid, chat_id, sender_pk_hex, content, (sqlite3_int64)time(NULL), vector_clock ? vector_clock : "");
-    char *err_msg = 0;
-    if (sqlite3_exec(db, sql, 0, 0, &err_msg) != SQLITE_OK) {
-        log_msg("[数据库错误] 保存消息失败: %s", err_msg);
-        sqlite3_free(err_msg);
+static const char* archive_age_path(char* out, size_t out_len) {
+    char rel[PATH_MAX];
+    snprintf(rel, sizeof(rel), "data/%s/" ARCHIVE_AGE_FILE, pk_hex(my_id));
+    return get_config_path(rel, out, out_len);
+}
+
+static void db_init() {
+    char rel[PATH_MAX];
+    snprintf(rel, sizeof(rel), "data/%s/chatlogs", pk_hex(my_id));
+    get_config_path(rel, chatlog_dir, sizeof(chatlog_dir));
+    if (mkdir_p(chatlog_dir) != 0) {
+        log_msg("[致命错误] 无法创建聊天记录目录 %s: %s", chatlog_dir, strerror(errno));
+        exit(1);
     }
-    sqlite3_free(sql);
-    pthread_mutex_unlock(&db_mutex);
+    FILE *fp = fopen(archive_age_path(rel, sizeof(rel)), "r");
+    if (fp) {
+        int days;
+        if (fscanf(fp, "%d", &days) == 1 && days >= 0) archive_age_days = days;
+        fclose(fp);
+    }
+    db_migrate_legacy_store();
 }
 
-void db_load_history(const char* chat_id) {
-    pthread_mutex_lock(&db_mutex);
-    char* sql = sqlite3_mprintf("SELECT sender_pk, content FROM messages WHERE chat_id = '%q' ORDER BY timestamp ASC LIMIT 50;", chat_id);
+static int db_column_exists(sqlite3* db, const char* table, const char* column) {
+    int found = 0;
+    char* sql = sqlite3_mprintf("PRAGMA table_info(%q);", table);
     sqlite3_stmt *stmt;
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
         while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const char *sender_pk_hex = (const char*)sqlite3_column_text(stmt, 0);
-            const char *content = (const char*)sqlite3_column_text(stmt, 1);
-            char my_pk_hex_local[PK_HEX_LEN + 1];
-            sodium_bin2hex(my_pk_hex_local, sizeof(my_pk_hex_local), my_pk, sizeof(my_pk));
-            char buffer[BUFFER_SIZE];
-            if (strcmp(sender_pk_hex, my_pk_hex_local) == 0) {
-                snprintf(buffer, sizeof(buffer), "[我]: %s", content);
-            } else {
-                snprintf(buffer, sizeof(buffer), "[%s]: %s", get_friend_name_by_hex(sender_pk_hex), content);
+            if (strcmp((const char*)sqlite3_column_text(stmt, 1), column) == 0) {
+                found = 1;
+                break;
             }
-            log_msg(buffer);
         }
     }
     sqlite3_finalize(stmt);
     sqlite3_free(sql);
-    pthread_mutex_unlock(&db_mutex);
+    return found;
 }
 
-static cJSON* db_get_vector_clock(const char* chat_id) {
-    pthread_mutex_lock(&db_mutex);
+static sqlite3_int64 db_query_int64(sqlite3* db, const char* sql) {
+    sqlite3_int64 value = 0;
     sqlite3_stmt *stmt;
-    char* sql = sqlite3_mprintf("SELECT clock FROM vector_clocks WHERE chat_id = '%q';", chat_id);
-    cJSON* clock_json = NULL;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            const char *clock_str = (const char*)sqlite3_column_text(stmt, 0);
-            if(clock_str) clock_json = cJSON_Parse(clock_str);
-        }
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 0);
     }
     sqlite3_finalize(stmt);
-    sqlite3_free(sql);
-    pthread_mutex_unlock(&db_mutex);
-    return clock_json ? clock_json : cJSON_CreateObject();
+    return value;
 }
 
-static void db_save_vector_clock(const char* chat_id, cJSON* clock) {
-    char* clock_str = cJSON_PrintUnformatted(clock);
-    if (!clock_str) return;
-    pthread_mutex_lock(&db_mutex);
-    char* sql = sqlite3_mprintf("INSERT OR REPLACE INTO vector_clocks (chat_id, clock) VALUES ('%q', '%q');", chat_id, clock_str);
-    char *err_msg = 0;
-    if (sqlite3_exec(db, sql, 0, 0, &err_msg) != SQLITE_OK) {
-        log_msg("[数据库错误] 保存向量时钟失败: %s", err_msg);
-        sqlite3_free(err_msg);
+/**
+ * 在分片上预编译一条语句。调用者需持有该分片并负责 finalize。
+ */
+static sqlite3_stmt* chat_db_prepare(chat_db_t* cdb, const char* sql) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(cdb->db, sql, -1, &stmt, 0) != SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return NULL;
     }
-    sqlite3_free(sql);
-    pthread_mutex_unlock(&db_mutex);
-    free(clock_str);
+    return stmt;
 }
 
-// --- 向量时钟 (无锁，由调用者保证) ---
-static void vc_increment(cJSON* clock, const char* node_id) {
-    cJSON* node_clock = cJSON_GetObjectItem(clock, node_id);
-    if (cJSON_IsNumber(node_clock)) {
-        cJSON_SetNumberValue(node_clock, node_clock->valuedouble + 1);
-    } else {
-        cJSON_AddNumberToObject(clock, node_id, 1);
-    }
+static int chat_db_exec(chat_db_t* cdb, const char* sql) {
+    return sqlite3_exec(cdb->db, sql, 0, 0, 0) == SQLITE_OK ? 0 : -1;
 }
 
-static void vc_merge(cJSON* local_clock, cJSON* remote_clock) {
-    cJSON *remote_node;
-    cJSON_ArrayForEach(remote_node, remote_clock) {
-        const char* node_id = remote_node->string;
-        cJSON* local_node = cJSON_GetObjectItem(local_clock, node_id);
-        if (cJSON_IsNumber(local_node)) {
-            if (remote_node->valuedouble > local_node->valuedouble) {
-                cJSON_SetNumberValue(local_node, remote_node->valuedouble);
-            }
-        } else {
-            cJSON_AddNumberToObject(local_clock, node_id, remote_node->valuedouble);
-        }
-    }
+static void sync_uid_hash(const unsigned char* uid, size_t uid_len, uint32_t* hkey, uint32_t* hlow) {
+    unsigned char h[8];
+    crypto_generichash(h, sizeof(h), uid, uid_len, NULL, 0);
+    *hkey = ((uint32_t)h[0] << 24) | ((uint32_t)h[1] << 16) | ((uint32_t)h[2] << 8) | h[3];
+    *hlow = ((uint32_t)h[4] << 24) | ((uint32_t)h[5] << 16) | ((uint32_t)h[6] << 8) | h[7];
 }
 
-// --- 身份与好友管理 ---
-static void init_identity() {
-    char path[PATH_MAX];
-    get_config_path(IDENTITY_FILE, path, sizeof(path));
-    FILE *fp = fopen(path, "rb");
-    if (fp) {
-        fread(my_pk, 1, sizeof(my_pk), fp);
-        fread(my_sk, 1, sizeof(my_sk), fp);
-        fclose(fp);
-    } else {
-        log_msg("[身份] 未找到身份文件。正在生成新身份...");
-        crypto_box_keypair(my_pk, my_sk);
-        fp = fopen(path, "wb");
-        if (fp) {
-            fwrite(my_pk, 1, sizeof(my_pk), fp);
-            fwrite(my_sk, 1, sizeof(my_sk), fp);
-            fclose(fp);
-        } else {
-            log_msg("[错误] 保存身份文件失败: %s", strerror(errno));
-            exit(1);
-        }
-    }
-    sodium_bin2hex(my_pk_hex, sizeof(my_pk_hex), my_pk, sizeof(my_pk));
-    log_msg("==================================================================");
-    log_msg("您的公钥 (ID): %s", my_pk_hex);
-    log_msg("==================================================================");
+static uint64_t sync_uid_fingerprint(const unsigned char uid[MSG_UID_BYTES]) {
+    uint32_t hkey, hlow;
+    sync_uid_hash(uid, MSG_UID_BYTES, &hkey, &hlow);
+    return ((uint64_t)hkey << 32) | hlow;
 }
 
-static void load_friends() {
-    char path[PATH_MAX];
-    get_config_path(FRIENDS_FILE, path, sizeof(path));
-    FILE *fp = fopen(path, "r");
-    if (!fp) return;
-    char line[BUFFER_SIZE];
-    while (friend_count < MAX_FRIENDS && fgets(line, sizeof(line), fp)) {
-        char *comma = strchr(line, ',');
-        if (comma) {
-            *comma = '\0';
-            char *name = comma + 1;
-            name[strcspn(name, "\n")] = 0;
-            friends[friend_count] = malloc(sizeof(friend_t));
-            strncpy(friends[friend_count]->pk_hex, line, PK_HEX_LEN);
-            friends[friend_count]->pk_hex[PK_HEX_LEN] = '\0';
-            strncpy(friends[friend_count]->name, name, 31);
-            friends[friend_count]->name[31] = '\0';
-            friend_count++;
+static void uid_to_hex(const unsigned char uid[MSG_UID_BYTES], char out[MSG_UID_HEX_LEN + 1]) {
+    sodium_bin2hex(out, MSG_UID_HEX_LEN + 1, uid, MSG_UID_BYTES);
+}
+
+/**
+ * @return 成功返回 0，格式不符返回 -1。
+ */
+static int uid_from_hex(const char* hex, unsigned char uid[MSG_UID_BYTES]) {
+    size_t bin_len = 0;
+    if (!hex || strlen(hex) != MSG_UID_HEX_LEN) return -1;
+    if (sodium_hex2bin(uid, MSG_UID_BYTES, hex, MSG_UID_HEX_LEN, NULL, &bin_len, NULL) != 0 || bin_len != MSG_UID_BYTES) return -1;
+    return 0;
+}
+
+// --- UID 过滤器 (以下函数要求调用者持有分片) ---
+static void chat_db_path(pk_id_t chat_id, const char* suffix, char* out, size_t out_len) {
+    snprintf(out, out_len, "%s/%s%s", chatlog_dir, pk_hex(chat_id), suffix);
+}
+
+/**
+ * 把查询结果 (id, hkey, hlow) 加入过滤器。
+ * @return 结果中最大的 id。
+ */
+static int64_t uid_filter_add_rows(chat_db_t* cdb, const char* sql, int64_t mark) {
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, sql);
+    if (stmt) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (sqlite3_column_int64(stmt, 0) > mark) mark = sqlite3_column_int64(stmt, 0);
+            uint64_t fingerprint = ((uint64_t)(uint32_t)sqlite3_column_int64(stmt, 1) << 32) | (uint32_t)sqlite3_column_int64(stmt, 2);
+            uid_filter_add(cdb->filter, fingerprint);
+            cdb->filter_unsaved++;
         }
     }
-    fclose(fp);
-    log_msg("[好友] 已加载 %d 位好友。", friend_count);
+    sqlite3_finalize(stmt);
+    return mark;
 }
 
-static void save_friends() {
-    char path[PATH_MAX];
-    get_config_path(FRIENDS_FILE, path, sizeof(path));
-    FILE *fp = fopen(path, "w");
-    if (!fp) return;
-    for (int i = 0; i < friend_count; i++) {
-        fprintf(fp, "%s,%s\n", friends[i]->pk_hex, friends[i]->name);
+/**
+ * 把行号大于水位的消息补进过滤器，并推进水位。
+ * 归档消息的行号都小于热表中的行号；水位落后于已归档的部分时（例如重建），先补上这些块的归档键。
+ */
+static void uid_filter_catch_up(chat_db_t* cdb) {
+    int64_t mark = uid_filter_get_mark(cdb->filter);
+    char *sql = sqlite3_mprintf("SELECT ifnull(min(id), 0) FROM archive_blocks WHERE last_id > %lld;", (sqlite3_int64)mark);
+    sqlite3_int64 first_block = db_query_int64(cdb->db, sql);
+    sqlite3_free(sql);
+    int64_t archived_mark = mark;
+    if (first_block > 0) {
+        sql = sqlite3_mprintf("SELECT 0, hkey, hlow FROM archive_keys WHERE block >= %lld;", first_block);
+        uid_filter_add_rows(cdb, sql, mark);
+        sqlite3_free(sql);
+        archived_mark = db_query_int64(cdb->db, "SELECT ifnull(max(last_id), 0) FROM archive_blocks;");
     }
-    fclose(fp);
+    sql = sqlite3_mprintf("SELECT id, hkey, hlow FROM messages WHERE id > %lld ORDER BY id;", (sqlite3_int64)mark);
+    mark = uid_filter_add_rows(cdb, sql, archived_mark > mark ? archived_mark : mark);
+    sqlite3_free(sql);
+    uid_filter_set_mark(cdb->filter, mark);
 }
 
-void add_new_friend(const char* pk_hex, const char* name) {
-    if (friend_count >= MAX_FRIENDS) {
-        log_msg("[系统] 错误: 好友列表已满。");
+/**
+ * 按当前消息数（含归档）的两倍重新建立过滤器。内存不足时保留旧过滤器。
+ */
+static void uid_filter_rebuild(chat_db_t* cdb) {
+    uint64_t capacity = (uint64_t)db_query_int64(cdb->db, "SELECT (SELECT count(*) FROM messages) + (SELECT count(*) FROM archive_keys);") * 2;
+    UidFilter *fresh = uid_filter_create(capacity > UID_FILTER_MIN_CAPACITY ? capacity : UID_FILTER_MIN_CAPACITY);
+    if (!fresh) {
+        log_msg("[系统] 警告: 内存不足，无法重建 UID 过滤器。");
         return;
     }
-    friends[friend_count] = malloc(sizeof(friend_t));
-    strcpy(friends[friend_count]->pk_hex, pk_hex);
-    strcpy(friends[friend_count]->name, name);
-    friend_count++;
-    save_friends();
-    log_msg("[系统] 好友 %s 已添加。", name);
+    uid_filter_destroy(cdb->filter);
+    cdb->filter = fresh;
+    uid_filter_catch_up(cdb);
 }
 
-void delete_friend_by_name(const char* name) {
-    int found_idx = -1;
-    for (int i = 0; i < friend_count; i++) {
-        if (strcmp(friends[i]->name, name) == 0) {
-            found_idx = i;
-            break;
-        }
+static void uid_filter_flush(chat_db_t* cdb) {
+    char path[PATH_MAX];
+    chat_db_path(cdb->chat_id, UID_FILTER_SUFFIX, path, sizeof(path));
+    if (uid_filter_save(cdb->filter, path) != 0) {
+        log_msg("[系统] 警告: 无法保存 UID 过滤器: %s", strerror(errno));
     }
-    if (found_idx != -1) {
-        free(friends[found_idx]);
-        for (int i = found_idx; i < friend_count - 1; i++) {
-            friends[i] = friends[i + 1];
-        }
-        friend_count--;
-        save_friends();
-        log_msg("[系统] 好友 %s 已删除。", name);
+    cdb->filter_unsaved = 0;
+}
+
+/**
+ * 加载持久化的过滤器并用分片补齐；文件缺失、损坏或水位超出分片（分片被替换）时重建。
+ */
+static void uid_filter_open(chat_db_t* cdb) {
+    char path[PATH_MAX];
+    chat_db_path(cdb->chat_id, UID_FILTER_SUFFIX, path, sizeof(path));
+    cdb->filter = uid_filter_load(path);
+    if (cdb->filter && uid_filter_get_mark(cdb->filter) > db_query_int64(cdb->db, "SELECT max(id) FROM messages;")) {
+        uid_filter_destroy(cdb->filter);
+        cdb->filter = NULL;
     }
+    if (cdb->filter) uid_filter_catch_up(cdb);
+    if (!cdb->filter || uid_filter_count(cdb->filter) > uid_filter_capacity(cdb->filter)) uid_filter_rebuild(cdb);
+}
+
+/**
+ * 记录一条刚写入的消息。
+ */
+static void uid_filter_note(chat_db_t* cdb, uint64_t fingerprint, sqlite3_int64 rowid) {
+    if (!cdb->filter) return;
+    uid_filter_add(cdb->filter, fingerprint);
+    uid_filter_set_mark(cdb->filter, rowid);
+    if (uid_filter_count(cdb->filter) > uid_filter_capacity(cdb->filter)) uid_filter_rebuild(cdb);
+    if (++cdb->filter_unsaved >= UID_FILTER_SAVE_INTERVAL) uid_filter_flush(cdb);
 }
 
-friend_t** get_friends() { return friends; }
-int get_friend_count() { return friend_count; }
+/**
+ * @return 返回 0 表示消息肯定不在本地；返回 1 表示可能存在（过滤器不可用时也返回 1）。
+ */
+static int uid_filter_seen(chat_db_t* cdb, uint64_t fingerprint) {
+    return !cdb->filter || uid_filter_maybe_contains(cdb->filter, fingerprint);
+}
 
-static const char* get_friend_pk_by_name(const char* name) {
-    for (int i = 0; i < friend_count; i++) {
-        if (strcmp(friends[i]->name, name) == 0) return friends[i]->pk_hex;
+// --- 全文索引 ---
+/**
+ * FTS5 辅助函数 zl_rank(messages_fts)：BM25 去掉 IDF 后的词频/长度得分，越大越相关。
+ * 只用到当前行的命中位置和索引里缓存的平均长度，不需要读取其他文档。
+ */
+static void fts_rank(const Fts5ExtensionApi *api, Fts5Context *fts, sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    (void)argc;
+    (void)argv;
+    const double k1 = 1.2, b = 0.75;
+    int phrases = api->xPhraseCount(fts), insts = 0, tokens = 0;
+    sqlite3_int64 rows = 0, total = 0;
+    int tf[SEARCH_MAX_TERMS] = {0};
+    if (api->xInstCount(fts, &insts) != SQLITE_OK || api->xColumnSize(fts, 0, &tokens) != SQLITE_OK) {
+        sqlite3_result_error(ctx, "zl_rank: 无法读取命中信息", -1);
+        return;
     }
-    return NULL;
+    for (int i = 0; i < insts; i++) {
+        int phrase, col, off;
+        if (api->xInst(fts, i, &phrase, &col, &off) == SQLITE_OK && phrase >= 0 && phrase < SEARCH_MAX_TERMS) tf[phrase]++;
+    }
+    double avg = (api->xRowCount(fts, &rows) == SQLITE_OK && api->xColumnTotalSize(fts, 0, &total) == SQLITE_OK && rows > 0 && total > 0)
+                 ? (double)total / rows : tokens > 0 ? tokens : 1;
+    double norm = k1 * (1 - b + b * tokens / avg), score = 0;
+    for (int i = 0; i < phrases && i < SEARCH_MAX_TERMS; i++) {
+        score += tf[i] * (k1 + 1) / (tf[i] + norm);
+    }
+    sqlite3_result_double(ctx, score);
+}
+
+static int fts_register_rank(sqlite3* db) {
+    fts5_api *api = NULL;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT fts5(?1);", -1, &stmt, 0) != SQLITE_OK) return -1;
+    sqlite3_bind_pointer(stmt, 1, (void*)&api, "fts5_api_ptr", NULL);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (!api || api->iVersion < 2) return -1;
+    return api->xCreateFunction(api, "zl_rank", NULL, fts_rank, NULL) == SQLITE_OK ? 0 : -1;
 }
 
-static const char* get_friend_name_by_hex(const char *pk_hex) {
-    for (int i = 0; i < friend_count; i++) {
-        if (strcmp(friends[i]->pk_hex, pk_hex) == 0) return friends[i]->name;
+/**
+ * 按 user_version 升级分片。版本 0 的分片（包括刚创建的）在这里为已有消息建立全文索引。
+ */
+static int chat_db_upgrade(chat_db_t* cdb) {
+    int version = (int)db_query_int64(cdb->db, "PRAGMA user_version;");
+    if (version >= CHAT_DB_SCHEMA_VERSION) return 0;
+    char *sql = sqlite3_mprintf("BEGIN;"
+                                "INSERT INTO messages_fts (messages_fts) VALUES ('rebuild');"
+                                "PRAGMA user_version = %d;"
+                                "COMMIT;", CHAT_DB_SCHEMA_VERSION);
+    int rc = chat_db_exec(cdb, sql);
+    if (rc != 0) {
+        log_msg("[数据库错误] 建立全文索引失败: %s", sqlite3_errmsg(cdb->db));
+        chat_db_exec(cdb, "ROLLBACK;");
     }
-    return "未知用户";
+    sqlite3_free(sql);
+    return rc;
 }
 
-static const char* get_friend_name(const unsigned char *pk) {
-    char pk_hex[PK_HEX_LEN + 1];
-    sodium_bin2hex(pk_hex, sizeof(pk_hex), pk, crypto_box_PUBLICKEYBYTES);
-    return get_friend_name_by_hex(pk_hex);
+// --- 归档读取 ---
+/**
+ * 取得已解压的归档块，使用分片内的小型 LRU 缓存（块写入后不再修改，缓存无需失效）。调用者需持有分片。
+ */
+static ArchiveBlock* archive_cache_get(chat_db_t* cdb, sqlite3_int64 block_id) {
+    archive_cache_entry_t *slot = &cdb->archive_cache[0];
+    for (int i = 0; i < ARCHIVE_BLOCK_CACHE; i++) {
+        archive_cache_entry_t *e = &cdb->archive_cache[i];
+        if (e->block && e->id == block_id) {
+            e->last_used = ++cdb->archive_clock;
+            return e->block;
+        }
+        if (!e->block || (slot->block && e->last_used < slot->last_used)) slot = e;
+    }
+    ArchiveBlock *block = NULL;
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, "SELECT data FROM archive_blocks WHERE id = ?1;");
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, block_id);
+        if (sqlite3_step(stmt) == SQLITE_ROW) block = archive_block_open(sqlite3_column_blob(stmt, 0), (size_t)sqlite3_column_bytes(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    if (!block) {
+        log_msg("[数据库错误] 归档块 %lld 缺失或已损坏。", block_id);
+        return NULL;
+    }
+    archive_block_close(slot->block);
+    slot->id = block_id;
+    slot->block = block;
+    slot->last_used = ++cdb->archive_clock;
+    return block;
 }
 
-static int is_friend(const char *pk_hex) {
-    for (int i = 0; i < friend_count; i++) {
-        if (strcmp(friends[i]->pk_hex, pk_hex) == 0) return 1;
+static void archive_cache_clear(chat_db_t* cdb) {
+    for (int i = 0; i < ARCHIVE_BLOCK_CACHE; i++) {
+        archive_block_close(cdb->archive_cache[i].block);
+        cdb->archive_cache[i].block = NULL;
     }
-    return 0;
 }
 
-// --- 消息与网络核心逻辑 ---
-static void generate_message_uid(char* uid_buf, size_t buf_len) {
-    char my_pk_hex_local[PK_HEX_LEN + 1];
-    unsigned char random_bytes[16];
-    char random_hex[33];
-    sodium_bin2hex(my_pk_hex_local, sizeof(my_pk_hex_local), my_pk, sizeof(my_pk));
-    randombytes_buf(random_bytes, sizeof(random_bytes));
-    sodium_bin2hex(random_hex, sizeof(random_hex), random_bytes, sizeof(random_bytes));
-    snprintf(uid_buf, buf_len, "%s-%lld-%s", my_pk_hex_local, (long long)time(NULL), random_hex);
-}
-
-static void send_encrypted(int sockfd, const unsigned char* shared_key, const char* json_string) {
-    size_t message_len = strlen(json_string);
-    size_t ciphertext_len = crypto_box_MACBYTES + message_len;
-    unsigned char nonce[crypto_box_NONCEBYTES];
-    unsigned char *buffer = malloc(crypto_box_NONCEBYTES + ciphertext_len);
-    if (!buffer) return;
-    randombytes_buf(nonce, sizeof(nonce));
-    if (crypto_box_easy_afternm(buffer + crypto_box_NONCEBYTES, (const unsigned char*)json_string, message_len, nonce, shared_key) != 0) {
-        free(buffer);
+/**
+ * SQL 函数 zl_archive_field(block, uid, field)：从归档块中读出一条消息的字段，
+ * field 依次为 0 发送者公钥、1 正文、2 时间戳、3 向量时钟（与 SYNC_ROW_COLUMNS 的顺序一致）。
+ */
+static void sql_archive_field(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    (void)argc;
+    chat_db_t *cdb = sqlite3_user_data(ctx);
+    const unsigned char *uid = sqlite3_value_blob(argv[1]);
+    if (!uid || sqlite3_value_bytes(argv[1]) != MSG_UID_BYTES) {
+        sqlite3_result_null(ctx);
         return;
     }
-    memcpy(buffer, nonce, sizeof(nonce));
-    send(sockfd, buffer, crypto_box_NONCEBYTES + ciphertext_len, 0);
-    free(buffer);
+    ArchiveBlock *block = archive_cache_get(cdb, sqlite3_value_int64(argv[0]));
+    long index = block ? archive_block_find(block, uid) : -1;
+    archive_row_t row;
+    if (index < 0 || archive_block_get(block, (size_t)index, &row) != 0) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    switch (sqlite3_value_int(argv[2])) {
+        case 0: sqlite3_result_blob(ctx, row.sender_pk, ARCHIVE_PK_BYTES, SQLITE_TRANSIENT); break;
+        case 1: sqlite3_result_text(ctx, row.content, -1, SQLITE_TRANSIENT); break;
+        case 2: sqlite3_result_int64(ctx, row.timestamp); break;
+        case 3: sqlite3_result_text(ctx, row.vector_clock, -1, SQLITE_TRANSIENT); break;
+        default: sqlite3_result_null(ctx); break;
+    }
 }
 
-void send_chat_message(const char* recipient_name, const char* message) {
-    const char* target_pk_hex = get_friend_pk_by_name(recipient_name);
-    if (!target_pk_hex) {
-        log_msg("[系统] 错误：未在好友列表中找到名为 '%s' 的好友。", recipient_name);
-        return;
+static void archive_enqueue(pk_id_t chat_id);
+
+// --- 分片句柄池 ---
+static void chat_db_finalize_statements(chat_db_t* cdb) {
+    sqlite3_finalize(cdb->save_stmt);
+    sqlite3_finalize(cdb->bucket_stmt);
+    sqlite3_finalize(cdb->fts_stmt);
+    cdb->save_stmt = cdb->bucket_stmt = cdb->fts_stmt = NULL;
+}
+
+static int chat_db_open_file(chat_db_t* cdb) {
+    char path[PATH_MAX];
+    chat_db_path(cdb->chat_id, CHAT_DB_SUFFIX, path, sizeof(path));
+    char *err_msg = 0;
+    if (sqlite3_open(path, &cdb->db) != SQLITE_OK || sqlite3_exec(cdb->db, CHAT_DB_SCHEMA, 0, 0, &err_msg) != SQLITE_OK) {
+        log_msg("[数据库错误] 无法打开会话数据库 %s: %s", path, err_msg ? err_msg : sqlite3_errmsg(cdb->db));
+        sqlite3_free(err_msg);
+        sqlite3_close(cdb->db);
+        cdb->db = NULL;
+        return -1;
     }
-    char my_pk_hex_local[PK_HEX_LEN+1];
-    sodium_bin2hex(my_pk_hex_local, sizeof(my_pk_hex_local), my_pk, sizeof(my_pk));
-    char uid[PK_HEX_LEN + 50];
-    generate_message_uid(uid, sizeof(uid));
-    cJSON* clock = db_get_vector_clock(target_pk_hex);
-    vc_increment(clock, my_pk_hex_local);
-    char* clock_str = cJSON_PrintUnformatted(clock);
-    
-    db_save_message(uid, target_pk_hex, my_pk_hex_local, message, clock_str);
-    db_save_vector_clock(target_pk_hex, clock);
-    
-    log_msg("[我 -> %s]: %s", recipient_name, message);
-    
-    cJSON *json = cJSON_CreateObject();
-    cJSON_AddStringToObject(json, "type", "chat");
-    cJSON_AddStringToObject(json, "uid", uid);
-    cJSON_AddStringToObject(json, "content", message);
-    cJSON_AddStringToObject(json, "vector_clock", clock_str);
-    char *json_string = cJSON_PrintUnformatted(json);
-    
-    free(clock_str);
-    cJSON_Delete(clock);
-    
-    unsigned char target_pk[crypto_box_PUBLICKEYBYTES];
-    sodium_hex2bin(target_pk, sizeof(target_pk), target_pk_hex, strlen(target_pk_hex), NULL, NULL, NULL);
-    
-    int found = 0;
-    pthread_mutex_lock(&peers_mutex);
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (peers[i] && peers[i]->key_exchanged && sodium_compare(peers[i]->pk, target_pk, sizeof(target_pk)) == 0) {
-            send_encrypted(peers[i]->sockfd, peers[i]->shared_key, json_string);
-            found = 1;
-            break;
-        }
+    sqlite3_busy_timeout(cdb->db, 5000);
+    if (chat_db_upgrade(cdb) != 0) {
+        sqlite3_close(cdb->db);
+        cdb->db = NULL;
+        return -1;
     }
-    pthread_mutex_unlock(&peers_mutex);
-    
-    free(json_string);
-    if (!found) {
-        log_msg("[系统] 提示：好友 %s 当前不在线，消息已缓存。", recipient_name);
+    cdb->save_stmt = chat_db_prepare(cdb, "INSERT OR IGNORE INTO messages (message_uid, sender_pk, content, timestamp, vector_clock, hkey, hlow) "
+                                          "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7);");
+    cdb->bucket_stmt = chat_db_prepare(cdb, "INSERT INTO sync_buckets (bucket, cnt, sum_hi, sum_lo) VALUES (?1, 1, ?2, ?3) "
+                                            "ON CONFLICT(bucket) DO UPDATE SET cnt = cnt + 1, sum_hi = sum_hi + excluded.sum_hi, sum_lo = sum_lo + excluded.sum_lo;");
+    cdb->fts_stmt = chat_db_prepare(cdb, "INSERT INTO messages_fts (rowid, content) VALUES (?1, ?2);");
+    if (!cdb->save_stmt || !cdb->bucket_stmt) {
+        log_msg("[数据库错误] 无法预编译会话数据库 %s 的写入语句: %s", path, sqlite3_errmsg(cdb->db));
+        chat_db_finalize_statements(cdb);
+        sqlite3_close(cdb->db);
+        cdb->db = NULL;
+        return -1;
     }
+    if (fts_register_rank(cdb->db) != 0) log_msg("[数据库错误] 无法注册搜索排序函数，搜索将不可用。");
+    sqlite3_create_function(cdb->db, "zl_archive_field", 3, SQLITE_UTF8, cdb, sql_archive_field, NULL, NULL);
+    uid_filter_open(cdb);
+    if (archive_age_days > 0) archive_enqueue(cdb->chat_id);
+    return 0;
+}
+
+static void chat_db_close_file(chat_db_t* cdb) {
+    if (cdb->filter && cdb->filter_unsaved > 0) uid_filter_flush(cdb);
+    uid_filter_destroy(cdb->filter);
+    cdb->filter = NULL;
+    cdb->filter_unsaved = 0;
+    archive_cache_clear(cdb);
+    chat_db_finalize_statements(cdb);
+    sqlite3_close(cdb->db);
+    cdb->db = NULL;
 }
 
-static void handle_sync_request(peer_t *peer, cJSON *json);
-static void handle_sync_response(cJSON *json);
+// 调用者需保证句柄已从池中移除且没有其他线程持有
+static void chat_db_free(chat_db_t* cdb) {
+    if (cdb->db) chat_db_close_file(cdb);
+    pthread_mutex_destroy(&cdb->lock);
+    free(cdb);
+}
 
-static void *receive_from_peer(void *arg) {
-    peer_t *peer = (peer_t *)arg;
-    unsigned char encrypted_buffer[BUFFER_SIZE];
-    unsigned char decrypted_buffer[BUFFER_SIZE];
-    int n;
-    char sender_pk_hex[PK_HEX_LEN + 1];
-    sodium_bin2hex(sender_pk_hex, sizeof(sender_pk_hex), peer->pk, sizeof(peer->pk));
-    while ((n = recv(peer->sockfd, encrypted_buffer, sizeof(encrypted_buffer), 0)) > 0) {
-        if (n < crypto_box_NONCEBYTES + crypto_box_MACBYTES) continue;
-        if (crypto_box_open_easy_afternm(decrypted_buffer, encrypted_buffer + crypto_box_NONCEBYTES, n - crypto_box_NONCEBYTES, encrypted_buffer, peer->shared_key) != 0) continue;
-        size_t decrypted_len = n - crypto_box_NONCEBYTES - crypto_box_MACBYTES;
-        decrypted_buffer[decrypted_len] = '\0';
-        cJSON *received_json = cJSON_Parse((const char*)decrypted_buffer);
-        if (!received_json) continue;
-        cJSON *type = cJSON_GetObjectItem(received_json, "type");
-        if (!cJSON_IsString(type)) {
-            cJSON_Delete(received_json);
+static void chat_db_release(chat_db_t* cdb) {
+    pthread_mutex_unlock(&cdb->lock);
+    pthread_mutex_lock(&pool_mutex);
+    cdb->refs--;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/**
+ * 获取会话分片并加锁，必要时打开文件并淘汰最久未用的空闲句柄。
+ * 打开文件与关闭被淘汰的句柄都在 pool_mutex 之外进行。
+ * @return 成功返回已加锁的句柄，用完后调用 chat_db_release；失败返回 NULL。
+ */
+static chat_db_t* chat_db_acquire(pk_id_t chat_id) {
+    if (chat_id == PK_ID_NONE || !chatlog_dir[0]) return NULL;
+    chat_db_t *cdb = NULL, *victim = NULL;
+    int open_count = 0, free_slot = -1, opening = 0;
+    pthread_mutex_lock(&pool_mutex);
+    for (int i = 0; i < CHAT_DB_SLOTS; i++) {
+        if (!chat_dbs[i]) {
+            if (free_slot < 0) free_slot = i;
             continue;
         }
-        if (strcmp(type->valuestring, "chat") == 0) {
-            cJSON *uid = cJSON_GetObjectItem(received_json, "uid");
-            cJSON *content = cJSON_GetObjectItem(received_json, "content");
-            cJSON *vc_str_item = cJSON_GetObjectItem(received_json, "vector_clock");
-            if (cJSON_IsString(uid) && cJSON_IsString(content) && cJSON_IsString(vc_str_item)) {
-                db_save_message(uid->valuestring, sender_pk_hex, sender_pk_hex, content->valuestring, vc_str_item->valuestring);
-                cJSON* remote_clock = cJSON_Parse(vc_str_item->valuestring);
-                if(remote_clock) {
-                    cJSON* local_clock = db_get_vector_clock(sender_pk_hex);
-                    vc_merge(local_clock, remote_clock);
-                    db_save_vector_clock(sender_pk_hex, local_clock);
-                    cJSON_Delete(local_clock);
-                    cJSON_Delete(remote_clock);
-                }
-                if (current_ui_state == UI_STATE_CHATTING && strcmp(sender_pk_hex, chat_target_pk_hex) == 0) {
-                    log_msg("[%s]: %s", get_friend_name_by_hex(sender_pk_hex), content->valuestring);
-                }
+        open_count++;
+        if (chat_dbs[i]->chat_id == chat_id) cdb = chat_dbs[i];
+    }
+    if (!cdb) {
+        if (open_count >= CHAT_DB_POOL_SIZE || free_slot < 0) {
+            int victim_slot = -1;
+            for (int i = 0; i < CHAT_DB_SLOTS; i++) {
+                if (chat_dbs[i] && chat_dbs[i]->refs == 0 && (victim_slot < 0 || chat_dbs[i]->last_used < chat_dbs[victim_slot]->last_used)) victim_slot = i;
+            }
+            if (victim_slot >= 0) {
+                victim = chat_dbs[victim_slot];
+                chat_dbs[victim_slot] = NULL;
+                if (free_slot < 0) free_slot = victim_slot;
             }
-        } else if (strcmp(type->valuestring, "sync_request") == 0) {
-            handle_sync_request(peer, received_json);
-        } else if (strcmp(type->valuestring, "sync_response") == 0) {
-            handle_sync_response(received_json);
         }
-        cJSON_Delete(received_json);
+        if (free_slot >= 0 && (cdb = calloc(1, sizeof(chat_db_t)))) {
+            cdb->chat_id = chat_id;
+            pthread_mutex_init(&cdb->lock, NULL);
+            pthread_mutex_lock(&cdb->lock); // 打开完成之前，其他获取者会阻塞在这把锁上
+            chat_dbs[free_slot] = cdb;
+            opening = 1;
+        }
     }
-    remove_peer(peer->sockfd);
-    return NULL;
+    if (cdb) {
+        cdb->refs++;
+        cdb->last_used = ++chat_db_clock;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (victim) chat_db_free(victim);
+    if (!cdb) {
+        log_msg("[数据库错误] 同时打开的会话数据库过多。");
+        return NULL;
+    }
+    if (!opening) pthread_mutex_lock(&cdb->lock);
+    if (!cdb->db && chat_db_open_file(cdb) != 0) {
+        chat_db_release(cdb);
+        return NULL;
+    }
+    return cdb;
 }
 
-static void add_peer(peer_t *peer) {
-    pthread_mutex_lock(&peers_mutex);
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (!peers[i]) {
-            peers[i] = peer;
-            break;
-        }
+static void chat_db_close_all() {
+    chat_db_t *closing[CHAT_DB_SLOTS];
+    pthread_mutex_lock(&pool_mutex);
+    for (int i = 0; i < CHAT_DB_SLOTS; i++) {
+        closing[i] = chat_dbs[i];
+        chat_dbs[i] = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    for (int i = 0; i < CHAT_DB_SLOTS; i++) {
+        if (closing[i]) chat_db_free(closing[i]);
     }
-    pthread_mutex_unlock(&peers_mutex);
-    
-    char pk_hex[PK_HEX_LEN + 1];
-    sodium_bin2hex(pk_hex, sizeof(pk_hex), peer->pk, sizeof(peer->pk));
-    
-    log_msg("[系统] 好友 %s 已连接。", get_friend_name_by_hex(pk_hex));
-    request_chat_sync(pk_hex);
 }
 
-static void remove_peer(int sockfd) {
-    char friend_name_copy[32] = "未知用户";
-    pthread_mutex_lock(&peers_mutex);
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (peers[i] && peers[i]->sockfd == sockfd) {
-            strcpy(friend_name_copy, get_friend_name(peers[i]->pk));
-            close(peers[i]->sockfd);
-            free(peers[i]);
-            peers[i] = NULL;
-            break;
+// --- 旧版单文件数据库的迁移 ---
+// 旧版本把所有会话放在 exe_dir/chat.db 中（chat_id 列区分会话）。
+// 启动时先把它升级到最后一个单文件版本，再按会话拆分到各个分片，完成后改名为 chat.db.migrated。
+
+/**
+ * 为旧版本数据库中的消息补齐同步指纹，并重建叶子桶。
+ */
+static void db_migrate_sync_index(sqlite3* db) {
+    char *err_msg = 0;
+    if (!db_column_exists(db, "messages", "hkey")) {
+        if (sqlite3_exec(db, "ALTER TABLE messages ADD COLUMN hkey INTEGER; ALTER TABLE messages ADD COLUMN hlow INTEGER;", 0, 0, &err_msg) != SQLITE_OK) {
+            log_msg("[致命错误] 无法升级消息表: %s", err_msg);
+            sqlite3_free(err_msg);
+            exit(1);
         }
     }
-    pthread_mutex_unlock(&peers_mutex);
-    log_msg("[系统] 好友 %s 已断开连接。", friend_name_copy);
+    sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS idx_messages_sync ON messages(chat_id, hkey);", 0, 0, 0);
+
+    sqlite3_stmt *select_stmt, *update_stmt;
+    if (sqlite3_prepare_v2(db, "SELECT id, message_uid FROM messages WHERE hkey IS NULL;", -1, &select_stmt, 0) != SQLITE_OK) return;
+    if (sqlite3_prepare_v2(db, "UPDATE messages SET hkey = ?, hlow = ? WHERE id = ?;", -1, &update_stmt, 0) != SQLITE_OK) {
+        sqlite3_finalize(select_stmt);
+        return;
+    }
+    int migrated = 0;
+    sqlite3_exec(db, "BEGIN;", 0, 0, 0);
+    while (sqlite3_step(select_stmt) == SQLITE_ROW) {
+        const unsigned char *uid = sqlite3_column_blob(select_stmt, 1);
+        uint32_t hkey, hlow;
+        sync_uid_hash(uid ? uid : (const unsigned char*)"", (size_t)sqlite3_column_bytes(select_stmt, 1), &hkey, &hlow);
+        sqlite3_bind_int64(update_stmt, 1, hkey);
+        sqlite3_bind_int64(update_stmt, 2, hlow);
+        sqlite3_bind_int64(update_stmt, 3, sqlite3_column_int64(select_stmt, 0));
+        sqlite3_step(update_stmt);
+        sqlite3_reset(update_stmt);
+        migrated++;
+    }
+    sqlite3_finalize(select_stmt);
+    sqlite3_finalize(update_stmt);
+    sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+    if (migrated > 0) log_msg("[数据库] 已为 %d 条历史消息建立同步索引。", migrated);
 }
 
-static void *p2p_listener(void *arg) {
-    int requested_port = *(int*)arg;
-    free(arg); 
-    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    int opt = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    struct sockaddr_in serv_addr = {0};
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serv_addr.sin_port = htons(requested_port);
-    if (bind(listen_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        log_msg("[致命错误] P2P监听端口绑定失败: %s", strerror(errno));
+// SQL 函数 zl_unhex(x)：把 64 位十六进制公钥转换为 32 字节 BLOB，其他值原样返回。仅用于迁移。
+static void sql_unhex_pk(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    (void)argc;
+    unsigned char pk[PK_BYTES];
+    size_t bin_len = 0;
+    const char *hex = (const char*)sqlite3_value_text(argv[0]);
+    if (sqlite3_value_type(argv[0]) == SQLITE_TEXT && hex && strlen(hex) == PK_HEX_LEN &&
+        sodium_hex2bin(pk, sizeof(pk), hex, PK_HEX_LEN, NULL, &bin_len, NULL) == 0 && bin_len == PK_BYTES) {
+        sqlite3_result_blob(ctx, pk, PK_BYTES, SQLITE_TRANSIENT);
+    } else {
+        sqlite3_result_value(ctx, argv[0]);
+    }
+}
+
+/**
+ * 把旧版本中以十六进制 TEXT 存储的公钥列整体迁移为 BLOB，然后重建索引与叶子桶并压缩数据库文件。
+ * 同步进度只是续传提示，迁移时直接丢弃。
+ */
+static void db_migrate_binary_keys(sqlite3* db) {
+    sqlite3_create_function(db, "zl_unhex", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_unhex_pk, NULL, NULL);
+    char *err_msg = 0;
+    const char *sql =
+        "BEGIN;"
+        "DROP INDEX IF EXISTS idx_messages_sync;"
+        "ALTER TABLE messages RENAME TO messages_hex;"
+        "CREATE TABLE messages(id INTEGER PRIMARY KEY, message_uid BLOB UNIQUE, chat_id BLOB, sender_pk BLOB, content TEXT, timestamp INTEGER, vector_clock TEXT, hkey INTEGER, hlow INTEGER);"
+        "INSERT INTO messages (id, message_uid, chat_id, sender_pk, content, timestamp, vector_clock, hkey, hlow) "
+        "SELECT id, message_uid, zl_unhex(chat_id), zl_unhex(sender_pk), content, timestamp, vector_clock, hkey, hlow FROM messages_hex;"
+        "DROP TABLE messages_hex;"
+        "CREATE INDEX idx_messages_sync ON messages(chat_id, hkey);"
+        "ALTER TABLE vector_clocks RENAME TO vector_clocks_hex;"
+        "CREATE TABLE vector_clocks(chat_id BLOB PRIMARY KEY, clock TEXT);"
+        "INSERT OR REPLACE INTO vector_clocks SELECT zl_unhex(chat_id), clock FROM vector_clocks_hex;"
+        "DROP TABLE vector_clocks_hex;"
+        "DROP TABLE sync_buckets;"
+        "CREATE TABLE sync_buckets(chat_id BLOB, bucket INTEGER, cnt INTEGER, sum_hi INTEGER, sum_lo INTEGER, PRIMARY KEY(chat_id, bucket));"
+        "INSERT INTO sync_buckets SELECT chat_id, hkey >> 20, count(*), sum(hkey), sum(hlow) FROM messages GROUP BY chat_id, hkey >> 20;"
+        "DROP TABLE sync_progress;"
+        "CREATE TABLE sync_progress(chat_id BLOB, lo INTEGER, hi INTEGER, pos_hkey INTEGER, pos_uid BLOB, PRIMARY KEY(chat_id, lo, hi));"
+        "PRAGMA user_version = 1;"
+        "COMMIT;";
+    if (sqlite3_exec(db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+        log_msg("[致命错误] 无法迁移公钥列: %s", err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
         exit(1);
     }
-    if (requested_port == 0) {
-        socklen_t len = sizeof(serv_addr);
-        getsockname(listen_fd, (struct sockaddr *)&serv_addr, &len);
+    log_msg("[数据库] 已将公钥列迁移为二进制格式。");
+}
+
+// SQL 函数 zl_uid(x)：把旧版本的文本 UID 映射为 BLAKE2b-128(x)，其他值原样返回。仅用于迁移。
+// 映射是确定性的，双方各自迁移后同一条历史消息仍对应同一个 UID。
+static void sql_uid_from_text(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    (void)argc;
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+    unsigned char uid[MSG_UID_BYTES];
+    const unsigned char *text = sqlite3_value_text(argv[0]);
+    crypto_generichash(uid, sizeof(uid), text, (size_t)sqlite3_value_bytes(argv[0]), NULL, 0);
+    sqlite3_result_blob(ctx, uid, sizeof(uid), SQLITE_TRANSIENT);
+}
+
+/**
+ * 把旧版本的文本 UID 迁移为 16 字节 BLOB，随后重新计算同步指纹。
+ * 同步进度中的游标基于旧 UID，直接丢弃。
+ */
+static void db_migrate_binary_uids(sqlite3* db) {
+    sqlite3_create_function(db, "zl_uid", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_uid_from_text, NULL, NULL);
+    char *err_msg = 0;
+    const char *sql =
+        "BEGIN;"
+        "UPDATE messages SET message_uid = zl_uid(message_uid), hkey = NULL, hlow = NULL WHERE typeof(message_uid) = 'text';"
+        "DELETE FROM sync_progress;"
+        "PRAGMA user_version = 2;"
+        "COMMIT;";
+    if (sqlite3_exec(db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+        log_msg("[致命错误] 无法迁移消息 UID: %s", err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+        exit(1);
+    }
+    db_migrate_sync_index(db);
+    log_msg("[数据库] 已将消息 UID 迁移为二进制格式。");
+}
+
+/**
+ * 把旧库中一个会话的数据复制到它的分片，叶子桶与全文索引在分片内重新生成。
+ */
+static int db_split_legacy_chat(const char* legacy_path, pk_id_t chat_id) {
+    chat_db_t *cdb = chat_db_acquire(chat_id);
+    if (!cdb) return -1;
+    // 公钥已校验为十六进制，可以直接作为 BLOB 字面量
+    const char *hex = pk_hex(chat_id);
+    char *sql = sqlite3_mprintf(
+        "ATTACH DATABASE '%q' AS legacy;"
+        "BEGIN;"
+        "INSERT OR IGNORE INTO messages (message_uid, sender_pk, content, timestamp, vector_clock, hkey, hlow) "
+        "SELECT message_uid, sender_pk, content, timestamp, vector_clock, hkey, hlow FROM legacy.messages WHERE chat_id = X'%s' ORDER BY id;"
+        "DELETE FROM sync_buckets;"
+        "INSERT INTO sync_buckets SELECT hkey >> %d, count(*), sum(hkey), sum(hlow) FROM messages GROUP BY hkey >> %d;"
+        "INSERT OR REPLACE INTO vector_clock (id, clock) SELECT 0, clock FROM legacy.vector_clocks WHERE chat_id = X'%s';"
+        "INSERT INTO messages_fts (messages_fts) VALUES ('rebuild');"
+        "COMMIT;",
+        legacy_path, hex, SYNC_BUCKET_SHIFT, SYNC_BUCKET_SHIFT, hex);
+    char *err_msg = 0;
+    int rc = sqlite3_exec(cdb->db, sql, 0, 0, &err_msg) == SQLITE_OK ? 0 : -1;
+    if (rc != 0) {
+        log_msg("[数据库错误] 拆分会话 %s 失败: %s", hex, err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec(cdb->db, "ROLLBACK;", 0, 0, 0);
+    }
+    sqlite3_exec(cdb->db, "DETACH DATABASE legacy;", 0, 0, 0);
+    sqlite3_free(sql);
+    if (rc == 0) uid_filter_catch_up(cdb);
+    chat_db_release(cdb);
+    return rc;
+}
+
+static void db_migrate_legacy_store() {
+    char path[PATH_MAX], done_path[PATH_MAX];
+    get_config_path(DB_FILE, path, sizeof(path));
+    if (access(path, F_OK) != 0) return;
+    sqlite3 *db;
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        log_msg("[致命错误] 无法打开旧数据库: %s", sqlite3_errmsg(db));
+        exit(1);
+    }
+    int version = (int)db_query_int64(db, "PRAGMA user_version;");
+    if (!db_column_exists(db, "messages", "chat_id")) {
+        // 空库，没有需要迁移的数据
+        sqlite3_close(db);
+        unlink(path);
+        return;
+    }
+    db_exec_or_die(db, "CREATE TABLE IF NOT EXISTS vector_clocks(chat_id BLOB PRIMARY KEY, clock TEXT);", "创建向量时钟表");
+    db_exec_or_die(db, "CREATE TABLE IF NOT EXISTS sync_buckets(chat_id BLOB, bucket INTEGER, cnt INTEGER, sum_hi INTEGER, sum_lo INTEGER, PRIMARY KEY(chat_id, bucket));", "创建同步索引表");
+    db_exec_or_die(db, "CREATE TABLE IF NOT EXISTS sync_progress(chat_id BLOB, lo INTEGER, hi INTEGER, pos_hkey INTEGER, pos_uid BLOB, PRIMARY KEY(chat_id, lo, hi));", "创建同步进度表");
+    db_migrate_sync_index(db);
+    if (version < 1) db_migrate_binary_keys(db);
+    if (version < LEGACY_DB_SCHEMA_VERSION) db_migrate_binary_uids(db);
+
+    int chats = 0, failed = 0;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT chat_id FROM messages UNION SELECT chat_id FROM vector_clocks;", -1, &stmt, 0) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (sqlite3_column_bytes(stmt, 0) != PK_BYTES) continue;
+            pk_id_t chat_id = pk_intern(sqlite3_column_blob(stmt, 0));
+            if (chat_id == PK_ID_NONE || db_split_legacy_chat(path, chat_id) != 0) failed++;
+            else chats++;
+        }
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    if (failed > 0) {
+        log_msg("[数据库] 警告: %d 个会话拆分失败，旧数据库已保留，下次启动时会重试。", failed);
+        return;
+    }
+    snprintf(done_path, sizeof(done_path), "%s.migrated", path);
+    rename(path, done_path);
+    unlink(get_config_path(UID_FILTER_FILE, path, sizeof(path)));
+    log_msg("[数据库] 已将 %d 个会话拆分到 %s。", chats, chatlog_dir);
+}
+
+static int db_is_archived(chat_db_t* cdb, const unsigned char message_uid[MSG_UID_BYTES], uint32_t hkey) {
+    int found = 0;
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, "SELECT 1 FROM archive_keys WHERE hkey = ?1 AND message_uid = ?2;");
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)hkey);
+        sqlite3_bind_blob(stmt, 2, message_uid, MSG_UID_BYTES, SQLITE_STATIC);
+        found = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+/**
+ * 写入一条消息并更新叶子桶、全文索引与 UID 过滤器。调用者需持有分片。
+ * 使用保存点，因此可以嵌套在调用者的批量事务中（例如同步块），此时全部写入随外层事务一起提交。
+ * @return 新插入返回 1，消息已存在返回 0，出错返回 -1。
+ */
+static int db_save_message(chat_db_t* cdb, const unsigned char message_uid[MSG_UID_BYTES], pk_id_t sender_id, const char* content, const char* vector_clock) {
+    uint32_t hkey, hlow;
+    sync_uid_hash(message_uid, MSG_UID_BYTES, &hkey, &hlow);
+    // 热表的 UNIQUE 约束管不到已归档的消息，过滤器命中时再查一次归档键
+    if (uid_filter_seen(cdb, ((uint64_t)hkey << 32) | hlow) && db_is_archived(cdb, message_uid, hkey)) return 0;
+    int inserted = -1;
+    sqlite3_int64 rowid = 0;
+    uint64_t start = metrics_now_ns();
+    chat_db_exec(cdb, "SAVEPOINT save_message;");
+    sqlite3_stmt *stmt = cdb->save_stmt;
+    sqlite3_bind_blob(stmt, 1, message_uid, MSG_UID_BYTES, SQLITE_STATIC);
+    sqlite3_bind_blob(stmt, 2, pk_bytes(sender_id), PK_BYTES, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, content, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, (sqlite3_int64)time(NULL));
+    sqlite3_bind_text(stmt, 5, vector_clock ? vector_clock : "", -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 6, (sqlite3_int64)hkey);
+    sqlite3_bind_int64(stmt, 7, (sqlite3_int64)hlow);
+    if (sqlite3_step(stmt) == SQLITE_DONE) inserted = sqlite3_changes(cdb->db) > 0;
+    rowid = sqlite3_last_insert_rowid(cdb->db);
+    if (inserted < 0) log_msg("[数据库错误] 保存消息失败: %s", sqlite3_errmsg(cdb->db));
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (inserted == 1) {
+        // 同一事务内更新叶子桶，保证区间指纹与消息表一致
+        stmt = cdb->bucket_stmt;
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)(hkey >> SYNC_BUCKET_SHIFT));
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)hkey);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)hlow);
+        if (sqlite3_step(stmt) != SQLITE_DONE) log_msg("[数据库错误] 更新同步索引失败: %s", sqlite3_errmsg(cdb->db));
+        sqlite3_reset(stmt);
+        stmt = cdb->fts_stmt;
+        if (stmt) {
+            sqlite3_bind_int64(stmt, 1, rowid);
+            sqlite3_bind_text(stmt, 2, content, -1, SQLITE_STATIC);
+            if (sqlite3_step(stmt) != SQLITE_DONE) log_msg("[数据库错误] 更新全文索引失败: %s", sqlite3_errmsg(cdb->db));
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+        }
+    }
+    chat_db_exec(cdb, "RELEASE save_message;");
+    metrics_observe_since(METRIC_HIST_DB_SAVE, start);
+    if (inserted == 1) uid_filter_note(cdb, ((uint64_t)hkey << 32) | hlow, rowid);
+    return inserted;
+}
+
+// --- 历史归档 (以下函数要求调用者持有分片) ---
+/**
+ * 把一个压缩块写入 archive_blocks，并为块内消息登记归档键。
+ * @return 新块的 id，出错返回 -1。
+ */
+static sqlite3_int64 archive_write_block(chat_db_t* cdb, ArchiveBuilder* builder, sqlite3_int64 first_id, sqlite3_int64 last_id, size_t* bytes) {
+    unsigned char *data;
+    size_t len;
+    size_t count = archive_builder_count(builder);
+    if (archive_builder_finish(builder, &data, &len) != 0) return -1;
+    sqlite3_int64 block_id = -1;
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, "INSERT INTO archive_blocks (first_id, last_id, cnt, data) VALUES (?1, ?2, ?3, ?4);");
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, first_id);
+        sqlite3_bind_int64(stmt, 2, last_id);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)count);
+        sqlite3_bind_blob(stmt, 4, data, (int)len, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_DONE) block_id = sqlite3_last_insert_rowid(cdb->db);
+    }
+    sqlite3_finalize(stmt);
+    free(data);
+    if (block_id < 0) return -1;
+    char *sql = sqlite3_mprintf("INSERT INTO archive_keys (hkey, message_uid, hlow, block) "
+                                "SELECT hkey, message_uid, hlow, %lld FROM messages WHERE id BETWEEN %lld AND %lld;",
+                                block_id, first_id, last_id);
+    int rc = chat_db_exec(cdb, sql);
+    sqlite3_free(sql);
+    *bytes += len;
+    return rc == 0 ? block_id : -1;
+}
+
+/**
+ * 把早于 cutoff 的最旧一批消息归档为一个段（一个事务）。
+ * 只归档按行号连续的前缀，并且始终保留最新的一条消息在热表中，使新消息的行号继续大于所有归档消息。
+ * @return 归档的消息数，过期消息不足一段时返回 0，出错返回 -1。
+ */
+static int chat_db_archive_segment(chat_db_t* cdb, sqlite3_int64 cutoff) {
+    sqlite3_int64 max_id = db_query_int64(cdb->db, "SELECT ifnull(max(id), 0) FROM messages;");
+    char *sql = sqlite3_mprintf("SELECT ifnull((SELECT min(id) FROM (SELECT id, timestamp FROM messages WHERE id < %lld ORDER BY id LIMIT %d) "
+                                "WHERE timestamp >= %lld), %lld);",
+                                max_id, ARCHIVE_SEGMENT_ROWS, cutoff, max_id);
+    sqlite3_int64 bound = db_query_int64(cdb->db, sql);
+    sqlite3_free(sql);
+    sql = sqlite3_mprintf("SELECT count(*) FROM (SELECT id FROM messages WHERE id < %lld ORDER BY id LIMIT %d);", bound, ARCHIVE_SEGMENT_ROWS);
+    sqlite3_int64 eligible = db_query_int64(cdb->db, sql);
+    sqlite3_free(sql);
+    if (eligible < ARCHIVE_MIN_SEGMENT_ROWS) return 0;
+
+    ArchiveBuilder *builder = archive_builder_create();
+    if (!builder) return -1;
+    int rows = 0, rc = -1;
+    sqlite3_int64 first_id = 0, last_id = 0, block_first = 0, first_ts = 0, last_ts = 0;
+    sqlite3_int64 first_block = 0, last_block = 0;
+    size_t bytes = 0;
+    chat_db_exec(cdb, "BEGIN;");
+    sql = sqlite3_mprintf("SELECT id, message_uid, sender_pk, content, timestamp, vector_clock FROM messages WHERE id < %lld ORDER BY id LIMIT %d;",
+                          bound, ARCHIVE_SEGMENT_ROWS);
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, sql);
+    sqlite3_free(sql);
+    int step = stmt ? sqlite3_step(stmt) : SQLITE_ERROR;
+    for (; step == SQLITE_ROW; step = sqlite3_step(stmt)) {
+        archive_row_t row = {
+            .id = sqlite3_column_int64(stmt, 0),
+            .uid = sqlite3_column_blob(stmt, 1),
+            .sender_pk = sqlite3_column_blob(stmt, 2),
+            .content = (const char*)sqlite3_column_text(stmt, 3),
+            .timestamp = sqlite3_column_int64(stmt, 4),
+            .vector_clock = (const char*)sqlite3_column_text(stmt, 5),
+        };
+        // 格式不符的行（理论上不存在）留在热表中，段在它之前结束
+        if (!row.uid || sqlite3_column_bytes(stmt, 1) != MSG_UID_BYTES ||
+            !row.sender_pk || sqlite3_column_bytes(stmt, 2) != PK_BYTES) break;
+        if (archive_builder_count(builder) == 0) block_first = row.id;
+        if (archive_builder_add(builder, &row) != 0) break;
+        if (rows++ == 0) {
+            first_id = row.id;
+            first_ts = row.timestamp;
+        }
+        last_id = row.id;
+        last_ts = row.timestamp;
+        if (archive_builder_count(builder) == ARCHIVE_BLOCK_ROWS) {
+            if ((last_block = archive_write_block(cdb, builder, block_first, last_id, &bytes)) < 0) break;
+            if (!first_block) first_block = last_block;
+        }
+    }
+    int complete = step == SQLITE_DONE || step == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    if (complete && last_block >= 0 && archive_builder_count(builder) > 0) {
+        if ((last_block = archive_write_block(cdb, builder, block_first, last_id, &bytes)) > 0 && !first_block) first_block = last_block;
+    }
+    archive_builder_destroy(builder);
+
+    if (complete && last_block > 0 && rows > 0) {
+        sql = sqlite3_mprintf(
+            "INSERT INTO messages_fts (messages_fts, rowid, content) SELECT 'delete', id, content FROM messages WHERE id BETWEEN %lld AND %lld;"
+            "DELETE FROM messages WHERE id BETWEEN %lld AND %lld;"
+            "INSERT INTO archive_segments (first_id, last_id, first_ts, last_ts, cnt, first_block, last_block, bytes) "
+            "VALUES (%lld, %lld, %lld, %lld, %d, %lld, %lld, %lld);",
+            first_id, last_id, first_id, last_id,
+            first_id, last_id, first_ts, last_ts, rows, first_block, last_block, (sqlite3_int64)bytes);
+        rc = chat_db_exec(cdb, sql);
+        sqlite3_free(sql);
+    }
+    if (rc == 0 && chat_db_exec(cdb, "COMMIT;") == 0) return rows;
+    log_msg("[数据库错误] 归档失败: %s", sqlite3_errmsg(cdb->db));
+    chat_db_exec(cdb, "ROLLBACK;");
+    return -1;
+}
+
+/**
+ * 登记一个归档线程的任务。空闲归档对同一会话只登记一次；指令任务排在所有空闲归档之前，
+ * 立即归档会取代同一会话尚未开始的空闲归档。可以在持有分片时调用。
+ * @return 已登记返回 0，队列已满（或指令任务提交时归档线程未运行）返回 -1。
+ */
+static int archive_job_add(pk_id_t chat_id, archive_job_kind_t kind, const char* dest) {
+    char *dest_copy = dest ? strdup(dest) : NULL;
+    if (dest && !dest_copy) return -1;
+    pthread_mutex_lock(&archive_mutex);
+    int rc = 0, pos = 0, found = 0;
+    for (int i = 0; i < archive_queued;) {
+        archive_job_t *job = &archive_queue[i];
+        int same = job->chat_id == chat_id && (job->kind == ARCHIVE_JOB_IDLE || job->kind == ARCHIVE_JOB_ARCHIVE);
+        if (same && kind == ARCHIVE_JOB_ARCHIVE && job->kind == ARCHIVE_JOB_IDLE) {
+            memmove(job, job + 1, (size_t)(archive_queued - i - 1) * sizeof(*job)); // 由立即归档取代
+            archive_queued--;
+            continue;
+        }
+        if (same && (kind == job->kind || kind == ARCHIVE_JOB_IDLE)) found = 1;
+        if (job->kind != ARCHIVE_JOB_IDLE) pos = i + 1;
+        i++;
+    }
+    if (!found && (archive_queued >= ARCHIVE_QUEUE_SLOTS || (kind != ARCHIVE_JOB_IDLE && !archive_running))) {
+        rc = -1;
+    } else if (!found) {
+        if (kind == ARCHIVE_JOB_IDLE) pos = archive_queued;
+        memmove(&archive_queue[pos + 1], &archive_queue[pos], (size_t)(archive_queued - pos) * sizeof(archive_queue[0]));
+        archive_queue[pos] = (archive_job_t){ .chat_id = chat_id, .kind = kind, .dest = dest_copy };
+        archive_queued++;
+        dest_copy = NULL;
+        pthread_cond_signal(&archive_cond);
+    }
+    pthread_mutex_unlock(&archive_mutex);
+    free(dest_copy);
+    return rc;
+}
+
+static void archive_enqueue(pk_id_t chat_id) {
+    archive_job_add(chat_id, ARCHIVE_JOB_IDLE, NULL);
+}
+
+/**
+ * 归档一个会话，每段单独获取和释放分片，界面读写和同步可以插在两段之间。
+ * @return 归档的消息数，出错返回 -1。
+ */
+static int archive_chat_idle(pk_id_t chat_id) {
+    int total = 0, n;
+    do {
+        chat_db_t *cdb = chat_db_acquire(chat_id);
+        if (!cdb) return total > 0 ? total : -1;
+        sqlite3_int64 cutoff = (sqlite3_int64)time(NULL) - (sqlite3_int64)archive_age_days * 86400;
+        n = archive_age_days > 0 ? chat_db_archive_segment(cdb, cutoff) : 0;
+        chat_db_release(cdb);
+        if (n > 0) total += n;
+        pthread_mutex_lock(&archive_mutex);
+        int running = archive_running;
+        pthread_mutex_unlock(&archive_mutex);
+        if (!running) break;
+    } while (n > 0);
+    if (total > 0) log_msg("[归档] 已将会话 %s 中 %d 条早于 %d 天的消息压缩归档。", pk_hex(chat_id), total, archive_age_days);
+    return n < 0 && total == 0 ? -1 : total;
+}
+
+/**
+ * 执行一个归档线程的任务，结果写入日志。VACUUM 是单条语句，压缩与导出期间一直持有分片。
+ */
+static void archive_run_job(const archive_job_t* job) {
+    if (job->kind == ARCHIVE_JOB_IDLE) {
+        archive_chat_idle(job->chat_id);
+        return;
+    }
+    if (job->kind == ARCHIVE_JOB_ARCHIVE) {
+        int archived = archive_chat_idle(job->chat_id);
+        if (archived >= 0) log_msg("[系统] 保留期 %d 天，本次归档与 %s 的 %d 条消息。", archive_age_days, get_friend_name(job->chat_id), archived);
+        else log_msg("[数据库错误] 归档与 %s 的聊天记录失败。", get_friend_name(job->chat_id));
+        return;
+    }
+    chat_db_t *cdb = chat_db_acquire(job->chat_id);
+    if (!cdb) return;
+    if (job->kind == ARCHIVE_JOB_COMPACT) {
+        if (chat_db_exec(cdb, "VACUUM;") == 0) log_msg("[系统] 已压缩与 %s 的聊天记录。", get_friend_name(job->chat_id));
+        else log_msg("[数据库错误] 压缩失败: %s", sqlite3_errmsg(cdb->db));
+    } else {
+        char *sql = sqlite3_mprintf("VACUUM INTO '%q';", job->dest);
+        if (chat_db_exec(cdb, sql) == 0) log_msg("[系统] 聊天记录已导出到 %s。", job->dest);
+        else log_msg("[数据库错误] 导出失败: %s", sqlite3_errmsg(cdb->db));
+        sqlite3_free(sql);
+    }
+    chat_db_release(cdb);
+}
+
+static void *archive_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&archive_mutex);
+    while (archive_running) {
+        if (archive_queued == 0) {
+            pthread_cond_wait(&archive_cond, &archive_mutex);
+            continue;
+        }
+        if (archive_queue[0].kind == ARCHIVE_JOB_IDLE) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += ARCHIVE_IDLE_MS / 1000;
+            deadline.tv_nsec += (ARCHIVE_IDLE_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&archive_cond, &archive_mutex, &deadline);
+            if (!archive_running || archive_queued == 0) continue;
+        }
+        archive_job_t job = archive_queue[0];
+        memmove(archive_queue, archive_queue + 1, (size_t)(--archive_queued) * sizeof(archive_queue[0]));
+        pthread_mutex_unlock(&archive_mutex);
+        archive_run_job(&job);
+        free(job.dest);
+        pthread_mutex_lock(&archive_mutex);
+    }
+    pthread_mutex_unlock(&archive_mutex);
+    return NULL;
+}
+
+static int archive_start() {
+    pthread_mutex_lock(&archive_mutex);
+    int rc = 0;
+    if (!archive_running) {
+        archive_running = 1;
+        if (pthread_create(&archive_tid, NULL, archive_thread, NULL) != 0) {
+            archive_running = 0;
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&archive_mutex);
+    return rc;
+}
+
+static void archive_stop() {
+    pthread_mutex_lock(&archive_mutex);
+    int was_running = archive_running;
+    archive_running = 0;
+    for (int i = 0; i < archive_queued; i++) free(archive_queue[i].dest);
+    archive_queued = 0;
+    pthread_cond_signal(&archive_cond);
+    pthread_mutex_unlock(&archive_mutex);
+    if (was_running) pthread_join(archive_tid, NULL);
+}
+
+typedef void (*history_row_fn)(void* ctx, sqlite3_int64 id, const void* sender_pk, const char* content);
+
+/**
+ * 按行号升序读取行号大于 after_id 的消息，先读归档块，再读热表，最多 limit 条。
+ * @return 读到的消息数。
+ */
+static int db_read_history(chat_db_t* cdb, sqlite3_int64 after_id, int limit, history_row_fn fn, void* ctx) {
+    int rows = 0;
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, "SELECT id FROM archive_blocks WHERE last_id > ?1 ORDER BY last_id;");
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, after_id);
+        while (rows < limit && sqlite3_step(stmt) == SQLITE_ROW) {
+            ArchiveBlock *block = archive_cache_get(cdb, sqlite3_column_int64(stmt, 0));
+            if (!block) continue;
+            archive_row_t row;
+            for (size_t i = 0; rows < limit && archive_block_get(block, i, &row) == 0; i++) {
+                if (row.id <= after_id) continue;
+                fn(ctx, row.id, row.sender_pk, row.content);
+                after_id = row.id;
+                rows++;
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (rows >= limit) return rows;
+    stmt = chat_db_prepare(cdb, "SELECT id, sender_pk, content FROM messages WHERE id > ?1 ORDER BY id LIMIT ?2;");
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, after_id);
+        sqlite3_bind_int(stmt, 2, limit - rows);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const void *sender_pk = sqlite3_column_bytes(stmt, 1) == PK_BYTES ? sqlite3_column_blob(stmt, 1) : NULL;
+            fn(ctx, sqlite3_column_int64(stmt, 0), sender_pk, (const char*)sqlite3_column_text(stmt, 2));
+            rows++;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return rows;
+}
+
+static const char* member_name(const unsigned char pk[PK_BYTES], char* buf, size_t len);
+
+/**
+ * 按行号降序读取行号小于 before_id 的消息，先读热表，再按块倒序读归档，最多 limit 条。
+ * @return 读到的消息数。
+ */
+static int db_read_history_before(chat_db_t* cdb, sqlite3_int64 before_id, int limit, history_row_fn fn, void* ctx) {
+    int rows = 0;
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, "SELECT id, sender_pk, content FROM messages WHERE id < ?1 ORDER BY id DESC LIMIT ?2;");
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, before_id);
+        sqlite3_bind_int(stmt, 2, limit);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const void *sender_pk = sqlite3_column_bytes(stmt, 1) == PK_BYTES ? sqlite3_column_blob(stmt, 1) : NULL;
+            before_id = sqlite3_column_int64(stmt, 0);
+            fn(ctx, before_id, sender_pk, (const char*)sqlite3_column_text(stmt, 2));
+            rows++;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (rows >= limit) return rows;
+    stmt = chat_db_prepare(cdb, "SELECT id FROM archive_blocks WHERE first_id < ?1 ORDER BY last_id DESC;");
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, before_id);
+        while (rows < limit && sqlite3_step(stmt) == SQLITE_ROW) {
+            ArchiveBlock *block = archive_cache_get(cdb, sqlite3_column_int64(stmt, 0));
+            if (!block) continue;
+            archive_row_t row;
+            for (size_t i = archive_block_count(block); rows < limit && i-- > 0;) {
+                if (archive_block_get(block, i, &row) != 0 || row.id >= before_id) continue;
+                fn(ctx, row.id, row.sender_pk, row.content);
+                before_id = row.id;
+                rows++;
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+    return rows;
+}
+
+typedef struct {
+    chat_line_fn fn;
+    void *ctx;
+} history_line_ctx_t;
+
+static void format_history_row(void* ctx, sqlite3_int64 id, const void* sender_pk, const char* content) {
+    history_line_ctx_t *c = ctx;
+    char buffer[BUFFER_SIZE], name[16];
+    // 群聊中的发送者不一定是好友，不是好友时显示公钥开头
+    snprintf(buffer, sizeof(buffer), "[%s]: %s", sender_pk ? member_name(sender_pk, name, sizeof(name)) : "未知用户", content ? content : "");
+    c->fn(c->ctx, id, buffer);
+}
+
+/**
+ * 追踪：按行号读出的新消息即将显示，为它们记录显示的时间点。新消息不会已在归档中，只查热表。
+ */
+static void trace_displayed(chat_db_t* cdb, sqlite3_int64 after_id, int rows) {
+    uint64_t now = trace_now_ns();
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, "SELECT message_uid FROM messages WHERE id > ?1 ORDER BY id LIMIT ?2;");
+    if (!stmt) return;
+    sqlite3_bind_int64(stmt, 1, after_id);
+    sqlite3_bind_int(stmt, 2, rows);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (sqlite3_column_bytes(stmt, 0) != MSG_UID_BYTES) continue;
+        trace_span_at(trace_id_from_uid(sqlite3_column_blob(stmt, 0)), TRACE_STAGE_DISPLAYED, now, 0);
+    }
+    sqlite3_finalize(stmt);
+}
+
+int read_chat_history(pk_id_t chat_id, sqlite3_int64 cursor, int older, int limit, chat_line_fn fn, void* ctx) {
+    chat_db_t *cdb = chat_db_acquire(chat_id);
+    if (!cdb) return -1;
+    history_line_ctx_t c = { fn, ctx };
+    uint64_t start = metrics_now_ns();
+    int rows = older ? db_read_history_before(cdb, cursor > 0 ? cursor : INT64_MAX, limit, format_history_row, &c)
+                     : db_read_history(cdb, cursor, limit, format_history_row, &c);
+    if (!older && rows > 0 && trace_active()) trace_displayed(cdb, cursor, rows);
+    chat_db_release(cdb);
+    metrics_observe_since(METRIC_HIST_DB_HISTORY, start);
+    return rows;
+}
+
+// --- 全文搜索 ---
+// 查询参数编号：?1 为 MATCH 表达式，?2 为候选窗口的起始行号，?3 起依次为短词，?21/?22 为 LIMIT/OFFSET。
+#define SEARCH_PARAM_LIMIT 21
+#define SEARCH_PARAM_OFFSET 22
+
+/**
+ * 按 UTF-8 字符边界截断复制。
+ */
+static void copy_utf8(char* dst, size_t size, const char* src) {
+    size_t len = strlen(src);
+    if (len >= size) {
+        len = size - 1;
+        while (len > 0 && ((unsigned char)src[len] & 0xC0) == 0x80) len--;
+    }
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+static void search_bind(sqlite3_stmt* stmt, const char* match, sqlite3_int64 lo, char** short_terms, int shorts) {
+    if (match) sqlite3_bind_text(stmt, 1, match, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, lo);
+    for (int i = 0; i < shorts; i++) sqlite3_bind_text(stmt, i + 3, short_terms[i], -1, SQLITE_STATIC);
+}
+
+/**
+ * 从最新的消息开始逐步扩大候选窗口，直到窗口内至少有 target 条匹配或已覆盖全部消息。
+ * 计数按行号升序流式读取倒排表并在 target 处截止，不会读完常见词的整个倒排表。
+ * @return 候选窗口的起始行号，出错返回 -1。
+ */
+static sqlite3_int64 search_find_window(chat_db_t* cdb, const char* from, const char* match, char** short_terms, int shorts, sqlite3_int64 target) {
+    sqlite3_int64 max_id = db_query_int64(cdb->db, "SELECT ifnull(max(id), 0) FROM messages;");
+    if (!match) return max_id > SEARCH_SCAN_LIMIT ? max_id - SEARCH_SCAN_LIMIT + 1 : 1;
+    char *sql = sqlite3_mprintf("SELECT count(*) FROM (SELECT 1 %s LIMIT ?%d);", from, SEARCH_PARAM_LIMIT);
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, sql);
+    sqlite3_free(sql);
+    if (!stmt) return -1;
+    sqlite3_int64 lo = 1;
+    for (sqlite3_int64 window = SEARCH_INITIAL_WINDOW; max_id - window + 1 > 1; window *= SEARCH_WINDOW_GROWTH) {
+        sqlite3_reset(stmt);
+        search_bind(stmt, match, max_id - window + 1, short_terms, shorts);
+        sqlite3_bind_int64(stmt, SEARCH_PARAM_LIMIT, target);
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            lo = -1;
+            break;
+        }
+        if (sqlite3_column_int64(stmt, 0) >= target) {
+            lo = max_id - window + 1;
+            break;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return lo;
+}
+
+int search_chat_history(pk_id_t chat_id, const char* query, int offset, search_hit_t* hits, int max_hits, int* truncated) {
+    if (truncated) *truncated = 0;
+    if (!query || offset < 0 || max_hits <= 0) return 0;
+    // 拆词：够长的词转成 FTS5 短语（引号内不会被当作查询语法），短词留给逐条过滤
+    char buf[BUFFER_SIZE], *save = NULL, *match = NULL;
+    char *short_terms[SEARCH_MAX_TERMS];
+    int terms = 0, shorts = 0;
+    snprintf(buf, sizeof(buf), "%s", query);
+    for (char *t = strtok_r(buf, " \t", &save); t && terms < SEARCH_MAX_TERMS; t = strtok_r(NULL, " \t", &save), terms++) {
+        int chars = 0;
+        for (const char *p = t; *p; p++) chars += ((unsigned char)*p & 0xC0) != 0x80;
+        if (chars < SEARCH_MIN_TERM_CHARS) {
+            short_terms[shorts++] = t;
+            continue;
+        }
+        char *next = sqlite3_mprintf("%s%s\"%w\"", match ? match : "", match ? " " : "", t);
+        sqlite3_free(match);
+        match = next;
+    }
+    if (terms == 0) return 0;
+
+    char *from = match ? sqlite3_mprintf("FROM messages_fts JOIN messages m ON m.id = messages_fts.rowid WHERE messages_fts MATCH ?1 AND messages_fts.rowid >= ?2")
+                       : sqlite3_mprintf("FROM messages m WHERE m.id >= ?2");
+    for (int i = 0; i < shorts; i++) {
+        char *next = sqlite3_mprintf("%s AND instr(m.content, ?%d) > 0", from, i + 3);
+        sqlite3_free(from);
+        from = next;
+    }
+
+    chat_db_t *cdb = chat_db_acquire(chat_id);
+    if (!cdb) {
+        sqlite3_free(from);
+        sqlite3_free(match);
+        return -1;
+    }
+    int count = -1;
+    sqlite3_int64 target = (sqlite3_int64)offset + max_hits > SEARCH_CANDIDATES ? (sqlite3_int64)offset + max_hits : SEARCH_CANDIDATES;
+    sqlite3_int64 lo = search_find_window(cdb, from, match, short_terms, shorts, target);
+    char *sql = sqlite3_mprintf("SELECT m.id, m.sender_pk, m.timestamp, m.content %s ORDER BY %s m.id DESC LIMIT ?%d OFFSET ?%d;",
+                                from, match ? "zl_rank(messages_fts) DESC," : "", SEARCH_PARAM_LIMIT, SEARCH_PARAM_OFFSET);
+    sqlite3_stmt *stmt = lo >= 0 ? chat_db_prepare(cdb, sql) : NULL;
+    sqlite3_stmt *snip = match ? chat_db_prepare(cdb, "SELECT snippet(messages_fts, 0, '【', '】', '…', 48) FROM messages_fts WHERE messages_fts MATCH ?1 AND rowid = ?2;") : NULL;
+    if (stmt && (!match || snip)) {
+        search_bind(stmt, match, lo, short_terms, shorts);
+        sqlite3_bind_int(stmt, SEARCH_PARAM_LIMIT, max_hits);
+        sqlite3_bind_int(stmt, SEARCH_PARAM_OFFSET, offset);
+        int rc = SQLITE_DONE;
+        count = 0;
+        while (count < max_hits && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            search_hit_t *hit = &hits[count++];
+            const void *sender_pk = sqlite3_column_blob(stmt, 1);
+            const char *content = (const char*)sqlite3_column_text(stmt, 3);
+            hit->message_id = sqlite3_column_int64(stmt, 0);
+            hit->sender_id = (sender_pk && sqlite3_column_bytes(stmt, 1) == PK_BYTES) ? pk_lookup(sender_pk) : PK_ID_NONE;
+            hit->timestamp = sqlite3_column_int64(stmt, 2);
+            copy_utf8(hit->snippet, sizeof(hit->snippet), content ? content : "");
+            // 只为最终返回的结果生成高亮摘要
+            if (snip) {
+                sqlite3_reset(snip);
+                sqlite3_bind_text(snip, 1, match, -1, SQLITE_STATIC);
+                sqlite3_bind_int64(snip, 2, hit->message_id);
+                if (sqlite3_step(snip) == SQLITE_ROW && sqlite3_column_text(snip, 0)) {
+                    copy_utf8(hit->snippet, sizeof(hit->snippet), (const char*)sqlite3_column_text(snip, 0));
+                }
+            }
+        }
+        if (count < max_hits && rc != SQLITE_DONE) count = -1;
+    }
+    if (count >= 0 && truncated) {
+        // 只含短词时窗口由 SEARCH_SCAN_LIMIT 截断；含长词时窗口已包含足够的候选，不算遗漏
+        if (!match && lo > db_query_int64(cdb->db, "SELECT ifnull(min(id), 1) FROM messages;")) *truncated |= SEARCH_TRUNCATED_SCAN;
+        if (db_query_int64(cdb->db, "SELECT EXISTS (SELECT 1 FROM archive_blocks);")) *truncated |= SEARCH_TRUNCATED_ARCHIVE;
+    }
+    if (count < 0) log_msg("[数据库错误] 搜索失败: %s", sqlite3_errmsg(cdb->db));
+    sqlite3_finalize(snip);
+    sqlite3_finalize(stmt);
+    chat_db_release(cdb);
+    sqlite3_free(sql);
+    sqlite3_free(from);
+    sqlite3_free(match);
+    return count;
+}
+
+/**
+ * 调用者需持有分片。
+ */
+static cJSON* db_get_vector_clock(chat_db_t* cdb) {
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, "SELECT clock FROM vector_clock WHERE id = 0;");
+    cJSON* clock_json = NULL;
+    if (stmt) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *clock_str = (const char*)sqlite3_column_text(stmt, 0);
+            if(clock_str) clock_json = cJSON_Parse(clock_str);
+        }
+    }
+    sqlite3_finalize(stmt);
+    return clock_json ? clock_json : cJSON_CreateObject();
+}
+
+/**
+ * 调用者需持有分片。
+ */
+static void db_save_vector_clock(chat_db_t* cdb, cJSON* clock) {
+    char* clock_str = cJSON_PrintUnformatted(clock);
+    if (!clock_str) return;
+    char* sql = sqlite3_mprintf("INSERT OR REPLACE INTO vector_clock (id, clock) VALUES (0, '%q');", clock_str);
+    if (chat_db_exec(cdb, sql) != 0) {
+        log_msg("[数据库错误] 保存向量时钟失败: %s", sqlite3_errmsg(cdb->db));
+    }
+    sqlite3_free(sql);
+    free(clock_str);
+}
+
+/**
+ * 把远端的向量时钟并入会话的本地时钟。调用者需持有分片。
+ */
+static void db_merge_vector_clock(chat_db_t* cdb, const char* remote_clock_str) {
+    cJSON* remote_clock = cJSON_Parse(remote_clock_str);
+    if (!remote_clock) return;
+    cJSON* local_clock = db_get_vector_clock(cdb);
+    vc_merge(local_clock, remote_clock);
+    db_save_vector_clock(cdb, local_clock);
+    cJSON_Delete(local_clock);
+    cJSON_Delete(remote_clock);
+}
+
+// --- 单个会话的维护操作 ---
+int archive_chat_history(pk_id_t chat_id) {
+    return archive_job_add(chat_id, ARCHIVE_JOB_ARCHIVE, NULL);
+}
+
+int compact_chat_history(pk_id_t chat_id) {
+    return archive_job_add(chat_id, ARCHIVE_JOB_COMPACT, NULL);
+}
+
+int export_chat_history(pk_id_t chat_id, const char* dest_path) {
+    return archive_job_add(chat_id, ARCHIVE_JOB_EXPORT, dest_path);
+}
+
+int clear_chat_history(pk_id_t chat_id) {
+    chat_db_t *cdb = chat_db_acquire(chat_id);
+    if (!cdb) return -1;
+    // 句柄保持在池中，只替换底层文件；等待该分片的其他线程会拿到新的空库
+    char path[PATH_MAX];
+    chat_db_close_file(cdb);
+    const char *suffixes[] = { CHAT_DB_SUFFIX, CHAT_DB_SUFFIX "-journal", CHAT_DB_SUFFIX "-wal", CHAT_DB_SUFFIX "-shm", UID_FILTER_SUFFIX };
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        chat_db_path(chat_id, suffixes[i], path, sizeof(path));
+        unlink(path);
+    }
+    int rc = chat_db_open_file(cdb);
+    chat_db_release(cdb);
+    return rc;
+}
+
+// --- 向量时钟 (无锁，由调用者保证) ---
+static void vc_increment(cJSON* clock, const char* node_id) {
+    cJSON* node_clock = cJSON_GetObjectItem(clock, node_id);
+    if (cJSON_IsNumber(node_clock)) {
+        cJSON_SetNumberValue(node_clock, node_clock->valuedouble + 1);
+    } else {
+        cJSON_AddNumberToObject(clock, node_id, 1);
+    }
+}
+
+static void vc_merge(cJSON* local_clock, cJSON* remote_clock) {
+    cJSON *remote_node;
+    cJSON_ArrayForEach(remote_node, remote_clock) {
+        const char* node_id = remote_node->string;
+        cJSON* local_node = cJSON_GetObjectItem(local_clock, node_id);
+        if (cJSON_IsNumber(local_node)) {
+            if (remote_node->valuedouble > local_node->valuedouble) {
+                cJSON_SetNumberValue(local_node, remote_node->valuedouble);
+            }
+        } else {
+            cJSON_AddNumberToObject(local_clock, node_id, remote_node->valuedouble);
+        }
+    }
+}
+
+// --- 身份与好友管理 ---
+static void init_identity() {
+    char path[PATH_MAX];
+    unsigned char my_sk[crypto_box_SECRETKEYBYTES];
+    get_config_path(IDENTITY_FILE, path, sizeof(path));
+    FILE *fp = fopen(path, "rb");
+    if (fp) {
+        fread(my_pk, 1, sizeof(my_pk), fp);
+        fread(my_sk, 1, sizeof(my_sk), fp);
+        fclose(fp);
+    } else {
+        log_msg("[身份] 未找到身份文件。正在生成新身份...");
+        crypto_box_keypair(my_pk, my_sk);
+        fp = fopen(path, "wb");
+        if (fp) {
+            fwrite(my_pk, 1, sizeof(my_pk), fp);
+            fwrite(my_sk, 1, sizeof(my_sk), fp);
+            fclose(fp);
+        } else {
+            log_msg("[错误] 保存身份文件失败: %s", strerror(errno));
+            exit(1);
+        }
+    }
+    key_cache = peer_key_cache_create(my_sk, PEER_KEY_CACHE_SIZE);
+    sodium_memzero(my_sk, sizeof(my_sk));
+    group_keys = group_keyring_create(GROUP_KEYRING_SIZE);
+    group_seen = gossip_seen_create(GROUP_SEEN_CAPACITY);
+    if (!key_cache || !group_keys || !group_seen) {
+        log_msg("[致命错误] 无法分配密钥缓存。");
+        exit(1);
+    }
+    my_id = pk_intern(my_pk);
+    log_msg("==================================================================");
+    log_msg("您的公钥 (ID): %s", pk_hex(my_id));
+    log_msg("==================================================================");
+}
+
+/**
+ * 打开通讯录；首次运行新版本时导入旧的 friends.dat。
+ */
+static void load_friends() {
+    char rel[PATH_MAX], path[PATH_MAX], legacy[PATH_MAX];
+    snprintf(rel, sizeof(rel), "data/%s/" CONTACTS_FILE, pk_hex(my_id));
+    if (contact_store_open(get_config_path(rel, path, sizeof(path))) != 0) {
+        log_msg("[致命错误] 无法打开通讯录 %s", path);
+        exit(1);
+    }
+    get_config_path(FRIENDS_FILE, legacy, sizeof(legacy));
+    if (access(legacy, F_OK) == 0) {
+        int imported = contact_store_import_legacy(legacy);
+        if (imported < 0) {
+            log_msg("[好友] 警告: 导入 %s 失败，下次启动时会重试。", FRIENDS_FILE);
+        } else {
+            char done_path[PATH_MAX];
+            snprintf(done_path, sizeof(done_path), "%s.migrated", legacy);
+            rename(legacy, done_path);
+            log_msg("[好友] 已从 %s 导入 %d 位好友。", FRIENDS_FILE, imported);
+        }
+    }
+    log_msg("[好友] 通讯录中共有 %d 位好友。", contact_store_count());
+}
+
+void add_new_friend(const char* pk_hex_str, const char* name) {
+    unsigned char pk[PK_BYTES];
+    size_t bin_len = 0;
+    if (!pk_hex_str || strlen(pk_hex_str) != PK_HEX_LEN ||
+        sodium_hex2bin(pk, sizeof(pk), pk_hex_str, PK_HEX_LEN, NULL, &bin_len, NULL) != 0 || bin_len != PK_BYTES) {
+        log_msg("[系统] 错误: 公钥格式不正确。");
+        return;
+    }
+    int rc = contact_store_put(pk, name);
+    if (rc == 0) log_msg("[系统] 好友 %s 已添加。", name);
+    else if (rc == 1) log_msg("[系统] 错误: 名字 %s 已被其他好友使用。", name);
+    else log_msg("[系统] 错误: 无法保存好友。");
+}
+
+void delete_friend_by_name(const char* name) {
+    if (contact_store_remove_by_name(name) == 0) log_msg("[系统] 好友 %s 已删除。", name);
+}
+
+int get_friend_count() { return contact_store_count(); }
+
+static pk_id_t get_friend_id_by_name(const char* name) {
+    return contact_store_find_by_name(name);
+}
+
+static const char* get_friend_name(pk_id_t id) {
+    const char *name = contact_store_name(id);
+    return name ? name : "未知用户";
+}
+
+// --- 消息与网络核心逻辑 ---
+static void generate_message_uid(unsigned char uid[MSG_UID_BYTES]) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    for (int i = 0; i < 6; i++) uid[i] = (unsigned char)(ms >> (8 * (5 - i)));
+    randombytes_buf(uid + 6, MSG_UID_BYTES - 6);
+}
+
+static int send_all(int sockfd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sockfd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void write_frame_header(unsigned char* out, uint32_t header) {
+    out[0] = (unsigned char)(header >> 24);
+    out[1] = (unsigned char)(header >> 16);
+    out[2] = (unsigned char)(header >> 8);
+    out[3] = (unsigned char)header;
+}
+
+static uint32_t read_frame_header(const unsigned char* h) {
+    return ((uint32_t)h[0] << 24) | ((uint32_t)h[1] << 16) | ((uint32_t)h[2] << 8) | h[3];
+}
+
+static int send_sealed(peer_t* peer, link_prio_t prio, uint32_t flags, const unsigned char* plain, size_t len);
+
+/**
+ * 把一个完整的帧（含长度头）整体转给中继: 链路帧 [FRAME_RELAY_FLAG][RELAY_KIND_FORWARD][目标公钥][帧]。
+ * 调用者保证虚拟连接在此期间有效，它的中继也就有效（两者在同一临界区内摘除）。
+ */
+static int relay_send(peer_t* vpeer, link_prio_t prio, const unsigned char* frame, size_t len) {
+    unsigned char *wrapped = malloc(RELAY_HEADER_BYTES + len);
+    if (!wrapped) return -1;
+    size_t n = relay_wrap(wrapped, RELAY_KIND_FORWARD, vpeer->pk, frame, len);
+    int rc = send_sealed(vpeer->via, prio, FRAME_RELAY_FLAG, wrapped, n);
+    free(wrapped);
+    return rc;
+}
+
+// 延迟追踪的线程局部状态，只在追踪开启时设置：
+// trace_tx_id 为本线程正在发送的消息（send_sealed 为它记录加密，写线程记录发出），
+// trace_rx_recv_ns/trace_rx_open_ns 为接收线程当前这批帧读出和解密完成的时刻。
+static __thread uint64_t trace_tx_id = 0;
+static __thread uint64_t trace_rx_recv_ns = 0, trace_rx_open_ns = 0;
+static __thread int link_reader = 0; // 本线程是某条直连的接收线程，发送时不等待
+
+/**
+ * 把一个完整的帧放入连接的发送队列（link_mux.h），不等待写入，接收线程因此不会被对端的读取速度卡住。
+ * 其他线程发送同步、大块类帧时，若队列超过 LINK_QUEUE_SOFT_BYTES 先等写线程追上（交互类帧很小，不等），
+ * 调用者因此不能持有 peers_mutex（用 peer_hold 取得引用后释放锁再发送）。
+ * 发送队列超过 LINK_QUEUE_MAX_BYTES 时断开连接，由接收线程照常清理。
+ * @return 已入队返回 0，连接已关闭或被断开返回 -1。
+ */
+static int peer_send_frame(peer_t* peer, link_prio_t prio, const unsigned char* frame, size_t len) {
+    peer->frames_out++;
+    peer->bytes_out += len;
+    if (peer->via) return relay_send(peer, prio, frame, len);
+    if (!link_reader && prio != LINK_PRIO_INTERACTIVE) link_mux_wait_below(&peer->mux, LINK_QUEUE_SOFT_BYTES);
+    if (link_mux_push(&peer->mux, prio, frame, len, trace_tx_id, LINK_QUEUE_MAX_BYTES) == 0) return 0;
+    if (!link_mux_close(&peer->mux)) {
+        log_msg("[系统] %s 长时间没有读取数据，连接已断开。", get_friend_name(peer->id));
+        shutdown(peer->sockfd, SHUT_RDWR);
+    }
+    return -1;
+}
+
+/**
+ * 直连的写线程：按优先级取出发送队列中的帧写入连接（长度头与帧体一次写出，避免两次小写入触发 Nagle 与延迟确认的等待）。
+ * 对方能重组时，超过该类分片上限的帧切成分片 [长度 | FRAME_MUX_FLAG][流号][原帧的一段] 发送，其他类的帧可以插在分片之间。
+ * 写失败时断开连接，接收线程随后退出并释放它。
+ */
+static void *peer_writer(void *arg) {
+    peer_t *peer = arg;
+    unsigned char *buffer = malloc(4 + LINK_MUX_HEADER_BYTES + link_mux_piece_size(LINK_PRIO_SYNC));
+    link_mux_frame_t *f;
+    link_prio_t prio;
+    while (buffer && (f = link_mux_next(&peer->mux, &prio)) != NULL) {
+        size_t piece = link_mux_piece_size(prio), wrote;
+        int rc;
+        if (f->pos == 0 && (f->len <= piece || !atomic_load(&peer->mux_enabled))) {
+            rc = send_all(peer->sockfd, f->data, f->len);
+            wrote = f->len;
+            f->pos = f->len;
+        } else {
+            size_t n = f->len - f->pos < piece ? f->len - f->pos : piece;
+            write_frame_header(buffer, (uint32_t)(LINK_MUX_HEADER_BYTES + n) | FRAME_MUX_FLAG);
+            buffer[4] = (unsigned char)prio | (f->pos + n == f->len ? LINK_MUX_FIN : 0);
+            memcpy(buffer + 4 + LINK_MUX_HEADER_BYTES, f->data + f->pos, n);
+            wrote = 4 + LINK_MUX_HEADER_BYTES + n;
+            rc = send_all(peer->sockfd, buffer, wrote);
+            f->pos += n;
+        }
+        metrics_add(METRIC_BYTES_OUT, wrote);
+        int last = f->pos == f->len;
+        if (last && rc == 0) {
+            metrics_add(METRIC_FRAMES_OUT, 1);
+            if (f->tag) trace_span(f->tag, TRACE_STAGE_SENT, (uint32_t)(f->len - 4));
+        }
+        link_mux_advance(&peer->mux, prio, wrote, last);
+        if (rc != 0) break;
+    }
+    free(buffer);
+    link_mux_close(&peer->mux);
+    shutdown(peer->sockfd, SHUT_RDWR);
+    return NULL;
+}
+
+static int peer_start_writer(peer_t* peer) {
+    if (pthread_create(&peer->send_tid, NULL, peer_writer, peer) != 0) return -1;
+    peer->writer_started = 1;
+    return 0;
+}
+
+/**
+ * 停止写线程，未写出的帧随连接一起丢弃。
+ */
+static void peer_stop_writer(peer_t* peer) {
+    if (!peer->writer_started) return;
+    link_mux_close(&peer->mux);
+    shutdown(peer->sockfd, SHUT_RDWR); // 写线程可能正阻塞在 send 中
+    pthread_join(peer->send_tid, NULL);
+    peer->writer_started = 0;
+}
+
+/**
+ * 加密并发送一个帧: [长度 u32 大端，高两位为帧标志][nonce][密文]。
+ */
+static int send_sealed(peer_t* peer, link_prio_t prio, uint32_t flags, const unsigned char* plain, size_t len) {
+    size_t frame_len = PEER_BOX_OVERHEAD + len;
+    if (frame_len > ((flags & FRAME_RELAY_FLAG) ? MAX_LINK_FRAME_SIZE : MAX_FRAME_SIZE)) {
+        log_msg("[系统] 错误: 报文过大 (%zu 字节)，已丢弃。", frame_len);
+        return -1;
+    }
+    unsigned char *buffer = malloc(4 + frame_len);
+    if (!buffer) return -1;
+    peer_box_frame_t frame = { .in = plain, .in_len = len, .out = buffer + 4 };
+    uint64_t start = metrics_now_ns();
+    if (peer_box_seal_batch(peer->key, &frame, 1) != 1) {
+        free(buffer);
+        return -1;
+    }
+    metrics_observe_since(METRIC_HIST_ENCRYPT, start);
+    if (trace_tx_id) trace_span(trace_tx_id, TRACE_STAGE_ENCRYPTED, (uint32_t)frame_len);
+    write_frame_header(buffer, (uint32_t)frame_len | flags);
+    int rc = peer_send_frame(peer, prio, buffer, 4 + frame_len);
+    free(buffer);
+    return rc;
+}
+
+static void send_encrypted(peer_t* peer, link_prio_t prio, const char* json_string) {
+    send_sealed(peer, prio, 0, (const unsigned char*)json_string, strlen(json_string));
+}
+
+static void send_json(peer_t *peer, cJSON* json);
+static int send_json_to(pk_id_t id, cJSON* json);
+
+void send_chat_message(const char* recipient_name, const char* message) {
+    uint64_t send_ns = trace_active() ? trace_now_ns() : 0;
+    pk_id_t target_id = get_friend_id_by_name(recipient_name);
+    if (target_id == PK_ID_NONE) {
+        log_msg("[系统] 错误：未在好友列表中找到名为 '%s' 的好友。", recipient_name);
+        return;
+    }
+    if (contact_store_is_group(target_id)) {
+        send_group_message(target_id, message);
+        return;
+    }
+    unsigned char uid[MSG_UID_BYTES];
+    char uid_hex[MSG_UID_HEX_LEN + 1];
+    generate_message_uid(uid);
+    uid_to_hex(uid, uid_hex);
+    uint64_t trace_id = send_ns ? trace_id_from_uid(uid) : 0;
+    if (trace_id) trace_span_at(trace_id, TRACE_STAGE_SEND, send_ns, 0);
+    chat_db_t *cdb = chat_db_acquire(target_id);
+    if (!cdb) return;
+    // 读取、递增、写回向量时钟与写入消息在同一把分片锁下完成
+    cJSON* clock = db_get_vector_clock(cdb);
+    vc_increment(clock, pk_hex(my_id));
+    char* clock_str = cJSON_PrintUnformatted(clock);
+    
+    db_save_message(cdb, uid, my_id, message, clock_str);
+    db_save_vector_clock(cdb, clock);
+    chat_db_release(cdb);
+    metrics_add(METRIC_MESSAGES_SENT, 1);
+    if (trace_id) trace_span(trace_id, TRACE_STAGE_PERSISTED, 0);
+    
+    chat_updated(target_id);
+    
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "chat");
+    cJSON_AddStringToObject(json, "uid", uid_hex);
+    cJSON_AddStringToObject(json, "content", message);
+    cJSON_AddStringToObject(json, "vector_clock", clock_str);
+    
+    free(clock_str);
+    cJSON_Delete(clock);
+    
+    trace_tx_id = trace_id;
+    int found = send_json_to(target_id, json) == 0;
+    trace_tx_id = 0;
+    cJSON_Delete(json);
+    if (!found) {
+        log_msg("[系统] 提示：好友 %s 当前不在线，消息已缓存。", recipient_name);
+    }
+}
+
+static void handle_sync_ranges(peer_t *peer, cJSON *json);
+static void handle_sync_want(peer_t *peer, cJSON *json);
+static void handle_sync_resume(peer_t *peer, cJSON *json);
+static void handle_sync_credit(peer_t *peer, cJSON *json);
+static void handle_sync_chunk(peer_t *peer, cJSON *json);
+static void handle_group_update(peer_t *peer, cJSON *json);
+static void handle_group_key(peer_t *peer, cJSON *json);
+static void handle_group_key_want(peer_t *peer, cJSON *json);
+static void handle_group_digest(peer_t *peer, cJSON *json);
+static void handle_group_uids(peer_t *peer, cJSON *json);
+static void handle_group_want(peer_t *peer, cJSON *json);
+static void handle_relay_probe(peer_t *peer, cJSON *json);
+static void handle_relay_probe_ack(peer_t *peer, cJSON *json);
+static void handle_relay_nack(peer_t *peer, cJSON *json);
+
+static void handle_peer_message(peer_t *peer, const char *text) {
+    cJSON *received_json = cJSON_Parse(text);
+    if (!received_json) return;
+    uint64_t parsed_ns = trace_active() ? trace_now_ns() : 0;
+    cJSON *type = cJSON_GetObjectItem(received_json, "type");
+    if (!cJSON_IsString(type)) {
+        cJSON_Delete(received_json);
+        return;
+    }
+    if (strncmp(type->valuestring, "sync_", 5) == 0) {
+        // 任何同步报文都说明本轮同步仍在进行
+        sync_scheduler_touch(peer->id, 0);
+    }
+    if (strcmp(type->valuestring, "chat") == 0) {
+        cJSON *uid = cJSON_GetObjectItem(received_json, "uid");
+        cJSON *content = cJSON_GetObjectItem(received_json, "content");
+        cJSON *vc_str_item = cJSON_GetObjectItem(received_json, "vector_clock");
+        unsigned char uid_bin[MSG_UID_BYTES];
+        chat_db_t *cdb;
+        if (cJSON_IsString(uid) && uid_from_hex(uid->valuestring, uid_bin) == 0 && cJSON_IsString(content) && cJSON_IsString(vc_str_item) &&
+            (cdb = chat_db_acquire(peer->id)) != NULL) {
+            uint64_t trace_id = parsed_ns ? trace_id_from_uid(uid_bin) : 0;
+            if (trace_id) {
+                if (trace_rx_recv_ns) trace_span_at(trace_id, TRACE_STAGE_RECEIVED, trace_rx_recv_ns, 0);
+                if (trace_rx_open_ns) trace_span_at(trace_id, TRACE_STAGE_DECRYPTED, trace_rx_open_ns, 0);
+                trace_span_at(trace_id, TRACE_STAGE_PARSED, parsed_ns, 0);
+            }
+            if (db_save_message(cdb, uid_bin, peer->id, content->valuestring, vc_str_item->valuestring) == 1) {
+                metrics_add(METRIC_MESSAGES_RECEIVED, 1);
+                if (trace_id) trace_span(trace_id, TRACE_STAGE_PERSISTED, 0);
+            }
+            db_merge_vector_clock(cdb, vc_str_item->valuestring);
+            chat_db_release(cdb);
+            chat_updated(peer->id);
+        }
+    } else if (strcmp(type->valuestring, "sync_ranges") == 0) {
+        handle_sync_ranges(peer, received_json);
+    } else if (strcmp(type->valuestring, "sync_want") == 0) {
+        handle_sync_want(peer, received_json);
+    } else if (strcmp(type->valuestring, "sync_resume") == 0) {
+        handle_sync_resume(peer, received_json);
+    } else if (strcmp(type->valuestring, "sync_credit") == 0) {
+        handle_sync_credit(peer, received_json);
+    } else if (strcmp(type->valuestring, "sync_chunk") == 0) {
+        handle_sync_chunk(peer, received_json);
+    } else if (strcmp(type->valuestring, "group_update") == 0) {
+        handle_group_update(peer, received_json);
+    } else if (strcmp(type->valuestring, "group_key") == 0) {
+        handle_group_key(peer, received_json);
+    } else if (strcmp(type->valuestring, "group_key_want") == 0) {
+        handle_group_key_want(peer, received_json);
+    } else if (strcmp(type->valuestring, "group_digest") == 0) {
+        handle_group_digest(peer, received_json);
+    } else if (strcmp(type->valuestring, "group_uids") == 0) {
+        handle_group_uids(peer, received_json);
+    } else if (strcmp(type->valuestring, "group_want") == 0) {
+        handle_group_want(peer, received_json);
+    } else if (strcmp(type->valuestring, "relay_probe") == 0) {
+        handle_relay_probe(peer, received_json);
+    } else if (strcmp(type->valuestring, "relay_probe_ack") == 0) {
+        handle_relay_probe_ack(peer, received_json);
+    } else if (strcmp(type->valuestring, "relay_nack") == 0) {
+        handle_relay_nack(peer, received_json);
+    } else if (strcmp(type->valuestring, "link_mux") == 0) {
+        // 经中继的帧由中继整帧转发，分片只用在直连上
+        if (!peer->via) atomic_store(&peer->mux_enabled, 1);
+    }
+    cJSON_Delete(received_json);
+}
+
+/**
+ * 成批解密一组链路帧并依次处理。
+ */
+static void open_and_dispatch(peer_t *peer, peer_box_frame_t *frames, const int *relayed, size_t count) {
+    uint64_t start = metrics_now_ns();
+    size_t opened = peer_box_open_batch(peer->key, frames, count);
+    trace_rx_open_ns = trace_rx_recv_ns ? trace_now_ns() : 0;
+    if (opened > 0 && peer->supersedes) peer_supersede(peer);
+    uint64_t per_frame = (metrics_now_ns() - start) / count;
+    for (size_t i = 0; i < count; i++) metrics_observe(METRIC_HIST_DECRYPT, per_frame);
+    if (opened < count) metrics_add(METRIC_DECRYPT_FAILED, count - opened);
+    for (size_t i = 0; i < count; i++) {
+        if (!frames[i].ok) continue;
+        if (relayed[i]) {
+            relay_receive(peer, frames[i].out, frames[i].out_len);
+            continue;
+        }
+        frames[i].out[frames[i].out_len] = '\0';
+        handle_peer_message(peer, (const char*)frames[i].out);
+    }
+}
+
+/**
+ * 处理由分片重组出的帧（含长度头），plain 至少能放下它的明文。
+ * @return 帧头无效（应断开连接）返回 -1。
+ */
+static int handle_reassembled_frame(peer_t *peer, const unsigned char *frame, size_t len, unsigned char *plain) {
+    if (len < 4) return -1;
+    uint32_t header = read_frame_header(frame);
+    size_t n = header & ~FRAME_FLAGS;
+    if ((header & FRAME_MUX_FLAG) || n != len - 4 || n > ((header & FRAME_RELAY_FLAG) ? MAX_LINK_FRAME_SIZE : MAX_FRAME_SIZE)) return -1;
+    peer->frames_in++;
+    metrics_add(METRIC_FRAMES_IN, 1);
+    if (header & FRAME_GROUP_FLAG) {
+        handle_group_frame(peer, frame + 4, n);
+        return 0;
+    }
+    if (n < PEER_BOX_OVERHEAD) return 0;
+    peer_box_frame_t box = { .in = frame + 4, .in_len = n, .out = plain };
+    int relayed = (header & FRAME_RELAY_FLAG) != 0;
+    open_and_dispatch(peer, &box, &relayed, 1);
+    return 0;
+}
+
+/**
+ * 接收线程：每次 recv 尽量多读，把缓冲区中所有完整的帧成批解密后依次处理。
+ * 经这条连接中继的虚拟连接的报文也在这里处理。
+ */
+static void *receive_from_peer(void *arg) {
+    peer_t *peer = (peer_t *)arg;
+    link_reader = 1;
+    // 缓冲区至少能放下一个最大帧及其长度头；明文比密文短，按帧依次排在同样大小的缓冲区里
+    const size_t capacity = 2 * (4 + MAX_LINK_FRAME_SIZE);
+    unsigned char *encrypted_buffer = malloc(capacity);
+    unsigned char *decrypted_buffer = malloc(capacity);
+    link_mux_rx_t mux_rx = {0};
+    size_t filled = 0;
+    int broken = !encrypted_buffer || !decrypted_buffer;
+    while (!broken) {
+        ssize_t r = recv(peer->sockfd, encrypted_buffer + filled, capacity - filled, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        trace_rx_recv_ns = trace_active() ? trace_now_ns() : 0;
+        peer->bytes_in += (uint64_t)r;
+        metrics_add(METRIC_BYTES_IN, (uint64_t)r);
+        filled += (size_t)r;
+        size_t pos = 0;
+        while (!broken) {
+            peer_box_frame_t frames[RECV_BATCH_FRAMES];
+            int relayed[RECV_BATCH_FRAMES];
+            size_t count = 0, out_pos = 0;
+            int inline_next = 0;
+            while (count < RECV_BATCH_FRAMES && filled - pos >= 4) {
+                const unsigned char *h = encrypted_buffer + pos;
+                uint32_t header = read_frame_header(h);
+                size_t n = header & ~FRAME_FLAGS;
+                if (n > ((header & FRAME_RELAY_FLAG) ? MAX_LINK_FRAME_SIZE : MAX_FRAME_SIZE)) {
+                    broken = 1;
+                    break;
+                }
+                if (filled - pos - 4 < n) break;
+                if (header & FRAME_MUX_FLAG) {
+                    // 分片: 同样先处理已攒下的帧；最后一片到达后整帧处理，此时解密缓冲区空闲
+                    inline_next = 1;
+                    if (count > 0) break;
+                    const unsigned char *frame;
+                    size_t frame_len;
+                    int done = link_mux_rx_push(&mux_rx, h + 4, n, 4 + MAX_LINK_FRAME_SIZE, &frame, &frame_len);
+                    pos += 4 + n;
+                    if (done < 0 || (done == 1 && handle_reassembled_frame(peer, frame, frame_len, decrypted_buffer) != 0)) {
+                        broken = 1;
+                        break;
+                    }
+                    continue;
+                }
+                peer->frames_in++;
+                metrics_add(METRIC_FRAMES_IN, 1);
+                if (header & FRAME_GROUP_FLAG) {
+                    // 群帧不走链路解密；先处理已攒下的帧，保持到达顺序
+                    inline_next = 1;
+                    if (count > 0) break;
+                    handle_group_frame(peer, h + 4, n);
+                    pos += 4 + n;
+                    continue;
+                }
+                pos += 4 + n;
+                if (n < PEER_BOX_OVERHEAD) continue;
+                frames[count] = (peer_box_frame_t){ .in = h + 4, .in_len = n, .out = decrypted_buffer + out_pos };
+                relayed[count] = (header & FRAME_RELAY_FLAG) != 0;
+                out_pos += n - PEER_BOX_OVERHEAD + 1; // 留一个字节放字符串结尾
+                count++;
+            }
+            if (count == 0) {
+                if (inline_next) continue;
+                break;
+            }
+            open_and_dispatch(peer, frames, relayed, count);
+        }
+        memmove(encrypted_buffer, encrypted_buffer + pos, filled - pos);
+        filled -= pos;
+        relay_reap(peer);
+    }
+    free(encrypted_buffer);
+    free(decrypted_buffer);
+    link_mux_rx_free(&mux_rx);
+    remove_peer(peer->sockfd);
+    pthread_mutex_lock(&peers_mutex);
+    recv_threads--;
+    pthread_cond_broadcast(&peers_cond);
+    pthread_mutex_unlock(&peers_mutex);
+    return NULL;
+}
+
+static void peer_free(peer_t *peer) {
+    peer_stop_writer(peer);
+    if (peer->sockfd >= 0) close(peer->sockfd);
+    free_sync_streams(peer);
+    peer_key_release(key_cache, peer->key);
+    link_mux_destroy(&peer->mux);
+    if (peer->via) peer_put(peer->via);
+    free(peer);
+}
+
+/**
+ * 取得连接的一个引用。在 peers_mutex 内从连接表取出连接后调用，之后可以释放锁再发送。
+ */
+static peer_t* peer_hold(peer_t *peer) {
+    atomic_fetch_add(&peer->refs, 1);
+    return peer;
+}
+
+/**
+ * 释放一个引用，最后一个引用释放时关闭并释放连接。不能在持有 peers_mutex 时调用。
+ */
+static void peer_put(peer_t *peer) {
+    if (peer && atomic_fetch_sub(&peer->refs, 1) == 1) peer_free(peer);
+}
+
+enum { PEER_PATH_NONE, PEER_PATH_RELAY, PEER_PATH_DIRECT };
+
+/**
+ * @return 与好友当前的连接方式。
+ */
+static int peer_path(pk_id_t id) {
+    int path = PEER_PATH_NONE;
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peers[i] && peers[i]->id == id && path != PEER_PATH_DIRECT) path = peers[i]->via ? PEER_PATH_RELAY : PEER_PATH_DIRECT;
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    return path;
+}
+
+/**
+ * 把虚拟连接移出连接表，连接表的引用转给退役链表：它的中继的接收线程可能还在用它，由该线程在处理完当前这批帧后释放。
+ * 调用者持有 peers_mutex。
+ */
+static void relay_retire_locked(int slot) {
+    peer_t *vpeer = peers[slot];
+    peers[slot] = NULL;
+    pthread_mutex_lock(&relay_mutex);
+    vpeer->next_retired = relay_retired;
+    relay_retired = vpeer;
+    pthread_mutex_unlock(&relay_mutex);
+}
+
+/**
+ * 释放经 link 中继、已退役的虚拟连接。只在 link 的接收线程中调用。
+ */
+static void relay_reap(peer_t *link) {
+    peer_t *reaped = NULL;
+    pthread_mutex_lock(&relay_mutex);
+    for (peer_t **p = &relay_retired; *p;) {
+        peer_t *vpeer = *p;
+        if (vpeer->via == link) {
+            *p = vpeer->next_retired;
+            vpeer->next_retired = reaped;
+            reaped = vpeer;
+        } else {
+            p = &vpeer->next_retired;
+        }
+    }
+    pthread_mutex_unlock(&relay_mutex);
+    while (reaped) {
+        peer_t *next = reaped->next_retired;
+        peer_put(reaped);
+        reaped = next;
+    }
+}
+
+static void relay_wake() {
+    pthread_mutex_lock(&relay_mutex);
+    pthread_cond_broadcast(&relay_cond);
+    pthread_mutex_unlock(&relay_mutex);
+}
+
+/**
+ * 好友上线（直连或经中继）后的例行工作：更新联系时间，同步私聊与共同的群。
+ */
+static void peer_online(pk_id_t id) {
+    contact_store_touch(id);
+    request_chat_sync(id);
+    group_sync_with_peer(id);
+}
+
+/**
+ * 直连的发起方公钥，同一好友有两条直连时保留发起方公钥较小的那条，双方据此得出相同的结论。
+ */
+static const unsigned char* peer_initiator(const peer_t *peer) {
+    return peer->outbound ? my_pk : peer->pk;
+}
+
+/**
+ * 新直连解密出第一个帧、确认对端确实持有密钥之后，关闭同一好友按发起方规则输给它的旧直连。
+ * 旧连接的接收线程退出时会把它移出连接表。只在 peer 的接收线程中调用。
+ */
+static void peer_supersede(peer_t *peer) {
+    peer->supersedes = 0;
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        peer_t *other = peers[i];
+        if (!other || other == peer || other->id != peer->id || other->via) continue;
+        if (memcmp(peer_initiator(peer), peer_initiator(other), PK_BYTES) < 0) shutdown(other->sockfd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&peers_mutex);
+}
+
+/**
+ * 登记一条直连并启动它的接收线程。与同一好友已有直连时（双方同时拨号，或中继期间的反向拨号），
+ * 保留由公钥较小的一方发起的那条，双方据此得出相同的结论：新连接输了直接舍弃；
+ * 新连接胜出时旧连接先留着，等新连接解密出第一个帧再关闭（peer_supersede），握手后不通的新连接因此不会顶掉可用的旧连接。
+ * 同一好友的虚拟连接随之退役，之后的流量改走直连。
+ * @return 登记成功返回 0；连接被舍弃或连接表已满时返回 -1，由调用者关闭并释放。
+ */
+static int add_peer(peer_t *peer) {
+    pk_id_t id = peer->id;
+    int slot = -1, replaced = 0, was_relayed = 0;
+    pthread_mutex_lock(&peers_mutex);
+    if (peers_stopping) {
+        pthread_mutex_unlock(&peers_mutex);
+        return -1;
+    }
+    for (int i = 0; i < MAX_PEERS; i++) {
+        peer_t *other = peers[i];
+        if (!other || other->id != id || other->via) continue;
+        if (memcmp(peer_initiator(peer), peer_initiator(other), PK_BYTES) >= 0) {
+            pthread_mutex_unlock(&peers_mutex);
+            return -1;
+        }
+        peer->supersedes = 1;
+        replaced = 1;
+    }
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peers[i] && peers[i]->id == id && peers[i]->via) {
+            relay_retire_locked(i);
+            was_relayed = 1;
+        }
+        if (!peers[i] && slot < 0) slot = i;
+    }
+    // 写线程在登记之前启动，登记之后其他线程就可能往它的队列里放帧
+    if (slot < 0 || peer_start_writer(peer) != 0) {
+        pthread_mutex_unlock(&peers_mutex);
+        return -1;
+    }
+    peers[slot] = peer;
+    recv_threads++;
+    pthread_mutex_unlock(&peers_mutex);
+
+    // 声明本机能重组分片；不认识这个报文的旧版本忽略它，发给它们的帧始终整帧发送
+    cJSON *mux = cJSON_CreateObject();
+    cJSON_AddStringToObject(mux, "type", "link_mux");
+    send_json(peer, mux);
+    cJSON_Delete(mux);
+
+    if (pthread_create(&peer->recv_tid, NULL, receive_from_peer, peer) == 0) {
+        pthread_detach(peer->recv_tid);
+    } else {
+        // 没有接收线程的连接留在表中，关闭时释放
+        pthread_mutex_lock(&peers_mutex);
+        recv_threads--;
+        pthread_cond_broadcast(&peers_cond);
+        pthread_mutex_unlock(&peers_mutex);
+    }
+    relay_wake();
+    if (replaced) return 0;
+    if (was_relayed) {
+        log_msg("[中继] 与好友 %s 的直连已建立，不再经中继转发。", get_friend_name(id));
+        return 0;
+    }
+    log_msg("[系统] 好友 %s 已连接%s。", get_friend_name(id), peer->udp ? "（UDP）" : "");
+    peer_online(id);
+    return 0;
+}
+
+/**
+ * 移出并释放一条直连（由它的接收线程在退出时调用），经它中继的虚拟连接一并释放，
+ * 相应的拨号线程被唤醒，另找中继或等待直连。
+ */
+static void remove_peer(int sockfd) {
+    peer_t *link = NULL, *orphans[MAX_PEERS];
+    int orphan_count = 0;
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peers[i] && !peers[i]->via && peers[i]->sockfd == sockfd) {
+            link = peers[i];
+            peers[i] = NULL;
+            break;
+        }
+    }
+    if (link) {
+        for (int i = 0; i < MAX_PEERS; i++) {
+            if (peers[i] && peers[i]->via == link) {
+                orphans[orphan_count++] = peers[i];
+                peers[i] = NULL;
+            }
+        }
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    if (!link) return;
+    // 其他线程可能还持有引用，写线程现在就停下，之后的发送直接失败
+    peer_stop_writer(link);
+    relay_reap(link);
+
+    char link_name[32];
+    snprintf(link_name, sizeof(link_name), "%s", get_friend_name(link->id));
+    for (int i = 0; i < orphan_count; i++) {
+        pk_id_t id = orphans[i]->id;
+        peer_put(orphans[i]);
+        if (peer_path(id) == PEER_PATH_NONE) {
+            sync_scheduler_cancel(id);
+            log_msg("[中继] 中继 %s 已断开，与好友 %s 的连接中断。", link_name, get_friend_name(id));
+        }
+    }
+    pk_id_t id = link->id;
+    peer_put(link);
+    if (peer_path(id) == PEER_PATH_NONE) {
+        sync_scheduler_cancel(id);
+        log_msg("[系统] 好友 %s 已断开连接。", link_name);
+    }
+    relay_wake();
+}
+
+/**
+ * 为一条已认证对端公钥的直连创建 peer_t。
+ * @return 失败时关闭 fd 并返回 NULL。
+ */
+static peer_t *peer_new_direct(int fd, pk_id_t id, const struct sockaddr_in *addr, int outbound) {
+    peer_t *peer = (peer_t*)calloc(1, sizeof(peer_t));
+    if (!peer) {
+        close(fd);
+        return NULL;
+    }
+    peer->refs = 1;
+    peer->sockfd = fd;
+#ifdef TCP_NOTSENT_LOWAT
+    // 内核里排队的数据越少，插队的聊天帧越早上线；UDP 传输的本地流套接字不支持这个选项，忽略错误
+    int lowat = LINK_NOTSENT_LOWAT;
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+#endif
+    link_mux_init(&peer->mux);
+    memcpy(peer->pk, pk_bytes(id), sizeof(peer->pk));
+    peer->id = id;
+    inet_ntop(AF_INET, &addr->sin_addr, peer->ip, INET_ADDRSTRLEN);
+    peer->port = ntohs(addr->sin_port);
+    peer->outbound = outbound;
+    peer->key = peer_key_acquire(key_cache, peer->pk);
+    if (!peer->key) {
+        close(fd);
+        link_mux_destroy(&peer->mux);
+        free(peer);
+        return NULL;
+    }
+    peer->key_exchanged = 1;
+    return peer;
+}
+
+// --- UDP 传输的入站连接 ---
+typedef struct {
+    int fd;
+    pk_id_t id;
+    struct sockaddr_in addr;
+} udp_accept_t;
+
+static int udp_accept_filter(void *ctx, const unsigned char pk[PK_BYTES]) {
+    (void)ctx;
+    pk_id_t id = contact_store_resolve(pk);
+    return id != PK_ID_NONE && contact_store_contains(id);
+}
+
+/**
+ * 登记入站的 UDP 连接。add_peer 之后的上线流程会向连接写数据，而数据要由引擎线程取走，所以不能在回调里做。
+ */
+static void *udp_accept_thread(void *arg) {
+    udp_accept_t *a = arg;
+    peer_t *peer = peer_new_direct(a->fd, a->id, &a->addr, 0);
+    if (peer) {
+        peer->udp = 1;
+        if (add_peer(peer) != 0) peer_free(peer);
+    }
+    free(a);
+    return NULL;
+}
+
+static void udp_accepted(void *ctx, int fd, const unsigned char pk[PK_BYTES], const struct sockaddr_in *addr) {
+    (void)ctx;
+    udp_accept_t *a = malloc(sizeof(udp_accept_t));
+    pthread_t tid;
+    if (!a) {
+        close(fd);
+        return;
+    }
+    a->fd = fd;
+    a->id = contact_store_resolve(pk);
+    a->addr = *addr;
+    if (pthread_create(&tid, NULL, udp_accept_thread, a) != 0) {
+        close(fd);
+        free(a);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+static void *p2p_listener(void *arg) {
+    int requested_port = *(int*)arg;
+    free(arg); 
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in serv_addr = {0};
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serv_addr.sin_port = htons(requested_port);
+    if (bind(listen_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        log_msg("[致命错误] P2P监听端口绑定失败: %s", strerror(errno));
+        exit(1);
+    }
+    if (requested_port == 0) {
+        socklen_t len = sizeof(serv_addr);
+        getsockname(listen_fd, (struct sockaddr *)&serv_addr, &len);
+    }
+    pthread_mutex_lock(&port_mutex);
+    my_p2p_port = ntohs(serv_addr.sin_port);
+    port_ready = 1;
+    pthread_cond_signal(&port_cond);
+    pthread_mutex_unlock(&port_mutex);
+    listen(listen_fd, 5);
+    log_msg("[系统] P2P服务正在端口 %d 上监听...", my_p2p_port);
+    while(1) {
+        struct sockaddr_in cli_addr;
+        socklen_t cli_len = sizeof(cli_addr);
+        int conn_fd = accept(listen_fd, (struct sockaddr*)&cli_addr, &cli_len);
+        if (conn_fd < 0) continue;
+        unsigned char received_pk[crypto_box_PUBLICKEYBYTES];
+        if (recv(conn_fd, received_pk, sizeof(received_pk), 0) != sizeof(received_pk)) {
+            close(conn_fd);
+            continue;
+        }
+        // 只有好友的公钥会被驻留，陌生公钥不会占用驻留表；群 id 没有对应的私钥，也不能作为连接方
+        pk_id_t id = contact_store_resolve(received_pk);
+        if (id == PK_ID_NONE || !contact_store_contains(id)) {
+            close(conn_fd);
+            continue;
+        }
+        peer_t *new_peer = peer_new_direct(conn_fd, id, &cli_addr, 0);
+        if (new_peer && add_peer(new_peer) != 0) peer_free(new_peer);
+    }
+    close(listen_fd);
+    return NULL;
+}
+
+static void *server_handler(void *arg) {
+    int server_sockfd = *(int*)arg;
+    free(arg);
+    char buffer[BUFFER_SIZE * 2] = {0};
+    int len = 0;
+    while (1) {
+        int n = recv(server_sockfd, buffer + len, sizeof(buffer) - len - 1, 0);
+        if (n <= 0) break;
+        len += n;
+        buffer[len] = '\0';
+        char *line = buffer;
+        while (1) {
+            char *next_line = strchr(line, '\n');
+            if (!next_line) break;
+            *next_line = '\0';
+            char cmd[32], pk_hex_str[PK_HEX_LEN + 1], ip[INET_ADDRSTRLEN];
+            int port;
+            if (sscanf(line, "MY_IP %s", ip) == 1) {
+                strcpy(my_ip, ip);
+            } else if (sscanf(line, "%31s %64s %15s %d", cmd, pk_hex_str, ip, &port) == 4) {
+                // 引导协议是文本行协议，公钥在这里解析一次，之后只使用驻留 id
+                unsigned char peer_pk[PK_BYTES];
+                size_t bin_len = 0;
+                if (sodium_hex2bin(peer_pk, sizeof(peer_pk), pk_hex_str, strlen(pk_hex_str), NULL, &bin_len, NULL) != 0 || bin_len != PK_BYTES) {
+                    line = next_line + 1;
+                    continue;
+                }
+                pk_id_t id = contact_store_resolve(peer_pk);
+                if (id == PK_ID_NONE || !contact_store_contains(id)) {
+                    line = next_line + 1;
+                    continue;
+                }
+                if (strcmp(cmd, "PEER") == 0 || strcmp(cmd, "NEW_PEER") == 0) relay_note_addr(id, ip, port);
+                if ((strcmp(cmd, "PEER") == 0 || strcmp(cmd, "NEW_PEER") == 0) && strlen(my_ip) > 0) {
+                    // 按 (公钥, IP, 端口) 的字典序决定由哪一方主动连接，十六进制与原始字节的顺序一致
+                    int order = memcmp(my_pk, peer_pk, PK_BYTES);
+                    if (order == 0) {
+                        char my_addr[INET_ADDRSTRLEN + 8], peer_addr[INET_ADDRSTRLEN + 8];
+                        sprintf(my_addr, "%s:%d", my_ip, my_p2p_port);
+                        sprintf(peer_addr, "%s:%d", ip, port);
+                        order = strcmp(my_addr, peer_addr);
+                    }
+                    if (order < 0) {
+                         log_msg("[系统] 发现好友 %s，正在尝试连接...", get_friend_name(id));
+                         relay_dial_start(id);
+                    }
+                }
+            }
+            line = next_line + 1;
+        }
+        len = strlen(line);
+        memmove(buffer, line, len + 1);
+    }
+    log_msg("[系统] 与引导服务器的连接已断开。");
+    close(server_sockfd);
+    return NULL;
+}
+
+/**
+ * 直连好友。先试 UDP 传输：最近通信过的好友以 0-RTT 立即连上，否则等 DIAL_UDP_TIMEOUT_MS；
+ * 没有应答再试 TCP，握手在 DIAL_TIMEOUT_MS 内没有完成即放弃（阻塞 connect 在对方被 NAT 丢弃 SYN 时要等两分钟）。
+ * @return 已与对方直连（包括对方的连接先到）返回 0，否则返回 -1。
+ */
+static int connect_to_peer(pk_id_t id, const char *ip, int port) {
+    struct sockaddr_in peer_addr = {0};
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &peer_addr.sin_addr) <= 0) return -1;
+    if (udp_engine) {
+        int zero_rtt = 0;
+        int fd = rudp_connect(udp_engine, pk_bytes(id), &peer_addr, DIAL_UDP_TIMEOUT_MS, &zero_rtt);
+        if (fd >= 0) {
+            peer_t *new_peer = peer_new_direct(fd, id, &peer_addr, 1);
+            if (!new_peer) return -1;
+            new_peer->udp = 1;
+            if (zero_rtt) log_msg("[系统] 以 0-RTT 恢复与好友 %s 的 UDP 连接。", get_friend_name(id));
+            if (add_peer(new_peer) != 0) peer_free(new_peer);
+            return peer_path(id) == PEER_PATH_DIRECT ? 0 : -1;
+        }
+        if (peer_path(id) == PEER_PATH_DIRECT) return 0;
+    }
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) return -1;
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+    int rc = connect(sockfd, (struct sockaddr*)&peer_addr, sizeof(peer_addr));
+    if (rc < 0 && errno == EINPROGRESS) {
+        struct pollfd pfd = { .fd = sockfd, .events = POLLOUT };
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (poll(&pfd, 1, DIAL_TIMEOUT_MS) == 1 && getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0) rc = 0;
+    }
+    fcntl(sockfd, F_SETFL, flags);
+    if (rc < 0 || send_all(sockfd, my_pk, sizeof(my_pk)) != 0) {
+        close(sockfd);
+        return peer_path(id) == PEER_PATH_DIRECT ? 0 : -1;
+    }
+    peer_t *new_peer = peer_new_direct(sockfd, id, &peer_addr, 1);
+    if (!new_peer) return -1;
+    if (add_peer(new_peer) != 0) peer_free(new_peer);
+    return peer_path(id) == PEER_PATH_DIRECT ? 0 : -1;
+}
+
+int connect_and_listen(const char* server_ip, int server_port, int p2p_port) {
+    pthread_t p2p_tid, server_tid;
+    int *p2p_port_ptr = malloc(sizeof(int)); *p2p_port_ptr = p2p_port;
+    pthread_create(&p2p_tid, NULL, p2p_listener, p2p_port_ptr);
+    pthread_detach(p2p_tid);
+    pthread_mutex_lock(&port_mutex);
+    while (!port_ready) {
+        pthread_cond_wait(&port_cond, &port_mutex);
+    }
+    pthread_mutex_unlock(&port_mutex);
+    rudp_callbacks_t udp_callbacks = { udp_accept_filter, udp_accepted, NULL };
+    udp_engine = rudp_create(my_pk, key_cache, my_p2p_port, &udp_callbacks);
+    if (!udp_engine) log_msg("[系统] UDP 端口 %d 不可用，直连只使用 TCP。", my_p2p_port);
+    int server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in serv_addr;
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(server_port);
+    inet_pton(AF_INET, server_ip, &serv_addr.sin_addr);
+    if (connect(server_sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        log_msg("[致命错误] 连接引导服务器失败: %s", strerror(errno));
+        return -1;
+    }
+    log_msg("[系统] 已连接到引导服务器。");
+    char registration_msg[PK_HEX_LEN + 20];
+    sprintf(registration_msg, "%s %d\n", pk_hex(my_id), my_p2p_port);
+    send(server_sockfd, registration_msg, strlen(registration_msg), 0);
+    int *server_sockfd_ptr = malloc(sizeof(int)); *server_sockfd_ptr = server_sockfd;
+    pthread_create(&server_tid, NULL, server_handler, server_sockfd_ptr);
+    pthread_detach(server_tid);
+    return 0;
+}
+
+// --- 二级中继 (Peer Relay) ---
+// 直连失败时，经一位与双方都直连的好友转发: 发送方把完整的帧（已用双方的共享密钥加密）包进 RELAY_KIND_FORWARD，
+// 中继改写为 RELAY_KIND_DELIVER 并附上来源公钥后转给目标。两端各自为对方建立一个虚拟连接 (via 指向中继)，
+// 上层照常按好友收发；中继只看得到双方公钥。拨号线程在中继期间定期重试直连，直连建立后虚拟连接随即退役。
+
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * 查找好友的拨号表项，create 时没有则占用一个空闲（或没有拨号线程的）表项。调用者持有 relay_mutex。
+ */
+static relay_dial_t* relay_dial_find(pk_id_t id, int create) {
+    relay_dial_t *free_slot = NULL;
+    for (int i = 0; i < RELAY_DIAL_SLOTS; i++) {
+        relay_dial_t *d = &relay_dials[i];
+        if (d->target == id) return d;
+        if (!free_slot && (d->target == PK_ID_NONE || !d->dialing)) free_slot = d;
+    }
+    if (!create || !free_slot) return NULL;
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->target = id;
+    free_slot->best = PK_ID_NONE;
+    return free_slot;
+}
+
+static void relay_note_addr(pk_id_t id, const char* ip, int port) {
+    pthread_mutex_lock(&relay_mutex);
+    relay_dial_t *d = relay_dial_find(id, 1);
+    if (d) {
+        snprintf(d->ip, sizeof(d->ip), "%s", ip);
+        d->port = port;
+    }
+    pthread_mutex_unlock(&relay_mutex);
+}
+
+/**
+ * 查找与 pk 直连的连接。调用者持有 peers_mutex。
+ */
+static peer_t* find_direct_peer_locked(const unsigned char pk[PK_BYTES]) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peers[i] && !peers[i]->via && peers[i]->key_exchanged && memcmp(peers[i]->pk, pk, PK_BYTES) == 0) return peers[i];
+    }
+    return NULL;
+}
+
+/**
+ * 取得经 via_id 的直连中继到 pk 的虚拟连接。create 时没有则建立，同一好友经其他中继的虚拟连接随之退役；
+ * 否则只查找已有的，不改动连接表。入站帧只有在用 pk 的密钥解开之后才能以 create 调用。
+ * @return 虚拟连接；pk 不是好友、已与其直连、中继不在线、连接表已满或（不建立时）没有时返回 NULL。
+ *         返回值只在中继的接收线程中可以继续使用。
+ */
+static peer_t* relay_attach(const unsigned char pk[PK_BYTES], pk_id_t via_id, int create) {
+    pk_id_t id = contact_store_resolve(pk);
+    if (id == PK_ID_NONE || id == my_id || id == via_id || !contact_store_contains(id)) return NULL;
+    const PeerKey *key = create ? peer_key_acquire(key_cache, pk) : NULL;
+    if (create && !key) return NULL;
+    peer_t *vpeer = NULL, *link = NULL, *created = NULL;
+    int direct = 0, slot = -1;
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peers[i] && !peers[i]->via && peers[i]->id == via_id) link = peers[i];
+        if (peers[i] && peers[i]->id == id && !peers[i]->via) direct = 1;
+    }
+    for (int i = 0; link && !direct && i < MAX_PEERS; i++) {
+        if (peers[i] && peers[i]->id == id) {
+            if (peers[i]->via == link) vpeer = peers[i];
+            else if (create) relay_retire_locked(i);
+        }
+        if (!peers[i] && slot < 0) slot = i;
+    }
+    if (create && link && !direct && !vpeer && slot >= 0 && (created = calloc(1, sizeof(peer_t))) != NULL) {
+        created->refs = 1;
+        created->sockfd = -1;
+        link_mux_init(&created->mux);
+        memcpy(created->pk, pk, PK_BYTES);
+        created->id = id;
+        created->key = key;
+        created->key_exchanged = 1;
+        created->via = peer_hold(link);
+        peers[slot] = vpeer = created;
+        key = NULL;
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    peer_key_release(key_cache, key);
+    if (created) {
+        log_msg("[中继] 好友 %s 经 %s 中继连接。", get_friend_name(id), get_friend_name(via_id));
+        peer_online(id);
+        relay_dial_start(id); // 对方直连不到本机时，反向直连可能成功
+    }
+    return vpeer;
+}
+
+/**
+ * 中继一侧: 把 FORWARD 包改写为 DELIVER 转给目标，受本机转发带宽的限制；转发不了时告诉来源。
+ */
+static void relay_forward(peer_t* link, const relay_packet_t* pkt) {
+    const char *reason = "unreachable";
+    int sent = 0;
+    unsigned char *wrapped = malloc(RELAY_HEADER_BYTES + pkt->inner_len);
+    if (!wrapped) return;
+    size_t n = relay_wrap(wrapped, RELAY_KIND_DELIVER, link->pk, pkt->inner, pkt->inner_len);
+    pthread_mutex_lock(&peers_mutex);
+    peer_t *target = find_direct_peer_locked(pkt->pk);
+    target = target && target != link ? peer_hold(target) : NULL;
+    pthread_mutex_unlock(&peers_mutex);
+    if (target) {
+        // 目标的发送队列已经积压时不再替他人排队，免得目标链路被转发的流量撑到断开
+        int allowed = link_mux_queued(&target->mux) <= LINK_QUEUE_SOFT_BYTES;
+        pthread_mutex_lock(&relay_mutex);
+        allowed = allowed && relay_budget_take(&relay_budget, n, monotonic_ms());
+        pthread_mutex_unlock(&relay_mutex);
+        // 替他人转发的流量不能挤占本机自己的聊天，与同步数据同一类
+        if (allowed) sent = send_sealed(target, LINK_PRIO_SYNC, FRAME_RELAY_FLAG, wrapped, n) == 0;
+        else reason = "busy";
+        peer_put(target);
+    }
+    free(wrapped);
+    if (sent) return;
+    char target_hex[PK_HEX_LEN + 1];
+    sodium_bin2hex(target_hex, sizeof(target_hex), pkt->pk, PK_BYTES);
+    cJSON *nack = cJSON_CreateObject();
+    cJSON_AddStringToObject(nack, "type", "relay_nack");
+    cJSON_AddStringToObject(nack, "target", target_hex);
+    cJSON_AddStringToObject(nack, "reason", reason);
+    send_json(link, nack);
+    cJSON_Delete(nack);
+}
+
+/**
+ * 接收一侧: 把 DELIVER 包里的内层帧交给来源好友的虚拟连接处理。已与来源直连时丢弃（对方很快也会切到直连，缺的消息由同步补齐）。
+ */
+static void relay_deliver(peer_t* link, const relay_packet_t* pkt) {
+    if (pkt->inner_len < 4) return;
+    uint32_t header = read_frame_header(pkt->inner);
+    size_t n = header & ~FRAME_FLAGS;
+    if ((header & (FRAME_RELAY_FLAG | FRAME_MUX_FLAG)) || n != pkt->inner_len - 4 || n > MAX_FRAME_SIZE) return;
+    const unsigned char *body = pkt->inner + 4;
+    if (header & FRAME_GROUP_FLAG) {
+        // 群帧不经链路加密，证明不了来源：只交给这条中继上已有的虚拟连接，不为它建立或退役任何连接
+        peer_t *vpeer = relay_attach(pkt->pk, link->id, 0);
+        if (!vpeer) return;
+        vpeer->frames_in++;
+        vpeer->bytes_in += pkt->inner_len;
+        handle_group_frame(vpeer, body, n);
+        return;
+    }
+    if (n < PEER_BOX_OVERHEAD || !contact_store_contains(contact_store_resolve(pkt->pk))) return;
+    // 先用来源的密钥解开，确认帧确实来自 pk，才建立虚拟连接、退役经其他中继的连接
+    const PeerKey *key = peer_key_acquire(key_cache, pkt->pk);
+    unsigned char *plain = key ? malloc(n - PEER_BOX_OVERHEAD + 1) : NULL;
+    if (!plain) {
+        peer_key_release(key_cache, key);
+        return;
+    }
+    peer_box_frame_t frame = { .in = body, .in_len = n, .out = plain };
+    uint64_t start = metrics_now_ns();
+    size_t opened = peer_box_open_batch(key, &frame, 1);
+    metrics_observe_since(METRIC_HIST_DECRYPT, start);
+    peer_key_release(key_cache, key);
+    // 经中继的帧：到达时刻是承载它的那批帧读出的时刻
+    trace_rx_open_ns = trace_rx_recv_ns ? trace_now_ns() : 0;
+    peer_t *vpeer = opened == 1 ? relay_attach(pkt->pk, link->id, 1) : NULL;
+    if (opened != 1) metrics_add(METRIC_DECRYPT_FAILED, 1);
+    if (vpeer) {
+        vpeer->frames_in++;
+        vpeer->bytes_in += pkt->inner_len;
+        plain[frame.out_len] = '\0';
+        handle_peer_message(vpeer, (const char*)plain);
+    }
+    free(plain);
+}
+
+static void relay_receive(peer_t *link, const unsigned char* data, size_t len) {
+    relay_packet_t pkt;
+    if (relay_unwrap(data, len, &pkt) != 0) return;
+    if (pkt.kind == RELAY_KIND_FORWARD) relay_forward(link, &pkt);
+    else relay_deliver(link, &pkt);
+}
+
+/**
+ * 候选中继回答自己是否与目标直连，并报告当前的转发负载，原样带回探测编号 t。
+ */
+static void handle_relay_probe(peer_t *peer, cJSON *json) {
+    cJSON *target = cJSON_GetObjectItem(json, "target");
+    cJSON *t = cJSON_GetObjectItem(json, "t");
+    unsigned char pk[PK_BYTES];
+    if (peer->via || !cJSON_IsString(target) || !cJSON_IsNumber(t) || pk_from_hex(target->valuestring, pk) != 0) return;
+    pthread_mutex_lock(&peers_mutex);
+    peer_t *direct = find_direct_peer_locked(pk);
+    int ok = direct && direct != peer;
+    pthread_mutex_unlock(&peers_mutex);
+    pthread_mutex_lock(&relay_mutex);
+    double load = relay_budget_load(&relay_budget, monotonic_ms());
+    pthread_mutex_unlock(&relay_mutex);
+    cJSON *ack = cJSON_CreateObject();
+    cJSON_AddStringToObject(ack, "type", "relay_probe_ack");
+    cJSON_AddStringToObject(ack, "target", target->valuestring);
+    cJSON_AddNumberToObject(ack, "t", t->valuedouble);
+    cJSON_AddBoolToObject(ack, "ok", ok);
+    cJSON_AddNumberToObject(ack, "load", load);
+    send_json(peer, ack);
+    cJSON_Delete(ack);
+}
+
+static void handle_relay_probe_ack(peer_t *peer, cJSON *json) {
+    cJSON *target = cJSON_GetObjectItem(json, "target");
+    cJSON *t = cJSON_GetObjectItem(json, "t");
+    cJSON *load = cJSON_GetObjectItem(json, "load");
+    unsigned char pk[PK_BYTES];
+    if (peer->via || !cJSON_IsTrue(cJSON_GetObjectItem(json, "ok")) || !cJSON_IsString(target) || !cJSON_IsNumber(t) ||
+        !cJSON_IsNumber(load) || pk_from_hex(target->valuestring, pk) != 0) {
+        return;
+    }
+    pk_id_t id = contact_store_resolve(pk);
+    uint64_t now = monotonic_ms();
+    pthread_mutex_lock(&relay_mutex);
+    relay_dial_t *d = id == PK_ID_NONE ? NULL : relay_dial_find(id, 0);
+    // 往返时间按本机记下的发送时间计算，对方带回的只是本轮的编号，谎报不了延迟；每个候选只计一次应答
+    for (int i = 0; d && d->collecting && t->valuedouble == (double)d->probe_id && i < d->probe_count; i++) {
+        if (d->probed[i] != peer->id || d->probe_sent_ms[i] == 0) continue;
+        uint64_t sent = d->probe_sent_ms[i];
+        d->probe_sent_ms[i] = 0;
+        double score = relay_score(now > sent ? (uint32_t)(now - sent) : 0, load->valuedouble);
+        if (d->best == PK_ID_NONE || score < d->best_score) {
+            d->best = peer->id;
+            d->best_score = score;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&relay_mutex);
+}
+
+/**
+ * 中继转发失败（目标已不在中继上，或中继带宽已满）：退役经它到目标的虚拟连接，由拨号线程另选中继。
+ */
+static void handle_relay_nack(peer_t *peer, cJSON *json) {
+    cJSON *target = cJSON_GetObjectItem(json, "target");
+    cJSON *reason = cJSON_GetObjectItem(json, "reason");
+    unsigned char pk[PK_BYTES];
+    if (peer->via || !cJSON_IsString(target) || pk_from_hex(target->valuestring, pk) != 0) return;
+    pk_id_t id = PK_ID_NONE;
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peers[i] && peers[i]->via == peer && memcmp(peers[i]->pk, pk, PK_BYTES) == 0) {
+            id = peers[i]->id;
+            relay_retire_locked(i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    if (id == PK_ID_NONE) return;
+    log_msg("[中继] %s 无法继续转发到好友 %s (%s)，正在另选中继...", get_friend_name(peer->id), get_friend_name(id),
+            cJSON_IsString(reason) ? reason->valuestring : "unknown");
+    if (peer_path(id) == PEER_PATH_NONE) sync_scheduler_cancel(id);
+    relay_wake();
+    relay_dial_start(id);
+}
+
+/**
+ * 向所有直连的好友（最多 RELAY_PROBE_MAX 个）探测能否转发到目标，等待 RELAY_PROBE_WINDOW_MS 后
+ * 选出往返时间与负载综合得分最低的一个建立虚拟连接。
+ * @return 成功返回 0，没有可用的中继返回 -1。
+ */
+static int relay_establish(pk_id_t id) {
+    const unsigned char *pk = pk_bytes(id);
+    if (!pk) return -1;
+    peer_t *candidates[RELAY_PROBE_MAX];
+    int probed = 0;
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < MAX_PEERS && probed < RELAY_PROBE_MAX; i++) {
+        if (peers[i] && !peers[i]->via && peers[i]->key_exchanged && peers[i]->id != id) candidates[probed++] = peer_hold(peers[i]);
+    }
+    pthread_mutex_unlock(&peers_mutex);
+
+    uint32_t probe_id = randombytes_random();
+    pthread_mutex_lock(&relay_mutex);
+    relay_dial_t *d = relay_dial_find(id, 1);
+    if (d) {
+        d->collecting = 1;
+        d->best = PK_ID_NONE;
+        d->probe_id = probe_id;
+        d->probe_count = probed;
+        for (int i = 0; i < probed; i++) {
+            d->probed[i] = candidates[i]->id;
+            d->probe_sent_ms[i] = 0;
+        }
+    }
+    pthread_mutex_unlock(&relay_mutex);
+    if (!d) {
+        for (int i = 0; i < probed; i++) peer_put(candidates[i]);
+        return -1;
+    }
+
+    cJSON *probe = cJSON_CreateObject();
+    cJSON_AddStringToObject(probe, "type", "relay_probe");
+    cJSON_AddStringToObject(probe, "target", pk_hex(id));
+    cJSON_AddNumberToObject(probe, "t", (double)probe_id);
+    for (int i = 0; i < probed; i++) {
+        pthread_mutex_lock(&relay_mutex);
+        d->probe_sent_ms[i] = monotonic_ms();
+        pthread_mutex_unlock(&relay_mutex);
+        send_json(candidates[i], probe);
+        peer_put(candidates[i]);
+    }
+    cJSON_Delete(probe);
+    if (probed > 0) {
+        struct timespec window = { RELAY_PROBE_WINDOW_MS / 1000, (RELAY_PROBE_WINDOW_MS % 1000) * 1000000L };
+        nanosleep(&window, NULL);
+    }
+
+    pthread_mutex_lock(&relay_mutex);
+    d->collecting = 0;
+    pk_id_t best = d->best;
+    pthread_mutex_unlock(&relay_mutex);
+    if (best == PK_ID_NONE) return -1;
+    return relay_attach(pk, best, 1) ? 0 : -1;
+}
+
+/**
+ * 拨号线程（每位好友最多一个）: 先直连；失败则经中继通信，并每隔 RELAY_DIRECT_RETRY_MS 重试直连，
+ * 直连建立后退出。中继失效或连接表变化时被唤醒，立即另选中继。
+ */
+static void *relay_dial_thread(void *arg) {
+    pk_id_t id = *(pk_id_t*)arg;
+    free(arg);
+    uint64_t next_direct = 0;
+    int misses = 0, announced = 0;
+    pthread_mutex_lock(&relay_mutex);
+    while (!relay_stopping) {
+        relay_dial_t *d = relay_dial_find(id, 0);
+        char ip[INET_ADDRSTRLEN];
+        int port = d ? d->port : 0;
+        snprintf(ip, sizeof(ip), "%s", d ? d->ip : "");
+        pthread_mutex_unlock(&relay_mutex);
+
+        int path = peer_path(id);
+        uint64_t now = monotonic_ms();
+        if (path != PEER_PATH_DIRECT && port > 0 && now >= next_direct) {
+            next_direct = now + RELAY_DIRECT_RETRY_MS;
+            if (connect_to_peer(id, ip, port) == 0) path = PEER_PATH_DIRECT;
+        }
+        if (path == PEER_PATH_DIRECT) {
+            pthread_mutex_lock(&relay_mutex);
+            break;
+        }
+        if (path == PEER_PATH_NONE) {
+            if (!announced) {
+                log_msg("[中继] 无法直连好友 %s，正在寻找中继...", get_friend_name(id));
+                announced = 1;
+            }
+            if (relay_establish(id) == 0) {
+                misses = 0;
+            } else if (++misses >= RELAY_MAX_MISSES) {
+                log_msg("[中继] 没有可以转发到好友 %s 的中继，消息将在下次连接时同步。", get_friend_name(id));
+                pthread_mutex_lock(&relay_mutex);
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&relay_mutex);
+        if (relay_stopping) break;
+        uint64_t wait_ms = port > 0 && next_direct > monotonic_ms() ? next_direct - monotonic_ms() : RELAY_DIRECT_RETRY_MS;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)(wait_ms / 1000);
+        deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&relay_cond, &relay_mutex, &deadline);
+    }
+    relay_dial_t *d = relay_dial_find(id, 0);
+    if (d) d->dialing = 0;
+    pthread_cond_broadcast(&relay_cond); // 关闭时等待拨号线程全部退出
+    pthread_mutex_unlock(&relay_mutex);
+    return NULL;
+}
+
+static void relay_dial_start(pk_id_t id) {
+    pthread_mutex_lock(&relay_mutex);
+    relay_dial_t *d = relay_stopping ? NULL : relay_dial_find(id, 1);
+    int start = d && !d->dialing;
+    if (start) d->dialing = 1;
+    pthread_mutex_unlock(&relay_mutex);
+    if (!start) return;
+    pk_id_t *arg = malloc(sizeof(pk_id_t));
+    pthread_t tid;
+    if (arg) *arg = id;
+    if (!arg || pthread_create(&tid, NULL, relay_dial_thread, arg) != 0) {
+        free(arg);
+        pthread_mutex_lock(&relay_mutex);
+        d->dialing = 0;
+        pthread_mutex_unlock(&relay_mutex);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+// --- 同步: 区间集合协调 ---
+typedef struct {
+    sqlite3_int64 count;
+    sqlite3_int64 sum_hi;
+    sqlite3_int64 sum_lo;
+} range_fp_t;
+
+static void send_json_prio(peer_t *peer, link_prio_t prio, cJSON* json) {
+    char *json_string = cJSON_PrintUnformatted(json);
+    if (!json_string) return;
+    send_encrypted(peer, prio, json_string);
+    free(json_string);
+}
+
+static void send_json(peer_t *peer, cJSON* json) {
+    send_json_prio(peer, LINK_PRIO_INTERACTIVE, json);
+}
+
+/**
+ * 向指定公钥的在线好友发送报文（在 peers_mutex 内取得连接的引用，释放锁之后再发送）。
+ * @return 已发送返回 0，对方不在线返回 -1。
+ */
+static int send_json_to(pk_id_t id, cJSON* json) {
+    peer_t *target = NULL;
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < MAX_PEERS && !target; i++) {
+        if (peers[i] && peers[i]->key_exchanged && peers[i]->id == id) target = peer_hold(peers[i]);
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    if (!target) return -1;
+    send_json(target, json);
+    peer_put(target);
+    return 0;
+}
+
+/**
+ * 计算 [lo, hi) 区间的指纹。与叶子桶对齐的区间直接汇总 sync_buckets（归档不改变叶子桶），
+ * 否则扫描热表与归档键的 hkey 索引。
+ */
+static void db_range_fingerprint(pk_id_t chat_id, uint64_t lo, uint64_t hi, range_fp_t* out) {
+    const uint64_t bucket_mask = (1ULL << SYNC_BUCKET_SHIFT) - 1;
+    char *sql;
+    if ((lo & bucket_mask) == 0 && (hi & bucket_mask) == 0) {
+        sql = sqlite3_mprintf("SELECT sum(cnt), sum(sum_hi), sum(sum_lo) FROM sync_buckets WHERE bucket >= %llu AND bucket < %llu;",
+                              (unsigned long long)(lo >> SYNC_BUCKET_SHIFT), (unsigned long long)(hi >> SYNC_BUCKET_SHIFT));
+    } else {
+        sql = sqlite3_mprintf("SELECT count(*), sum(hkey), sum(hlow) FROM ("
+                              "SELECT hkey, hlow FROM messages WHERE hkey >= %llu AND hkey < %llu "
+                              "UNION ALL SELECT hkey, hlow FROM archive_keys WHERE hkey >= %llu AND hkey < %llu);",
+                              (unsigned long long)lo, (unsigned long long)hi, (unsigned long long)lo, (unsigned long long)hi);
+    }
+    memset(out, 0, sizeof(*out));
+    uint64_t start = metrics_now_ns();
+    chat_db_t *cdb = chat_db_acquire(chat_id);
+    if (cdb) {
+        sqlite3_stmt *stmt = chat_db_prepare(cdb, sql);
+        if (stmt && sqlite3_step(stmt) == SQLITE_ROW) {
+            out->count = sqlite3_column_int64(stmt, 0);
+            out->sum_hi = sqlite3_column_int64(stmt, 1);
+            out->sum_lo = sqlite3_column_int64(stmt, 2);
+        }
+        sqlite3_finalize(stmt);
+        chat_db_release(cdb);
+    }
+    metrics_observe_since(METRIC_HIST_DB_FINGERPRINT, start);
+    sqlite3_free(sql);
+}
+
+static void range_fp_hex(const range_fp_t* fp, char out[17]) {
+    unsigned char sums[16], digest[8];
+    for (int i = 0; i < 8; i++) {
+        sums[i] = (unsigned char)((uint64_t)fp->sum_hi >> (8 * i));
+        sums[8 + i] = (unsigned char)((uint64_t)fp->sum_lo >> (8 * i));
+    }
+    crypto_generichash(digest, sizeof(digest), sums, sizeof(sums), NULL, 0);
+    sodium_bin2hex(out, 17, digest, sizeof(digest));
+}
+
+static cJSON* make_fp_range(uint64_t lo, uint64_t hi, const range_fp_t* fp) {
+    char fp_hex[17];
+    range_fp_hex(fp, fp_hex);
+    cJSON *range = cJSON_CreateObject();
+    cJSON_AddNumberToObject(range, "lo", (double)lo);
+    cJSON_AddNumberToObject(range, "hi", (double)hi);
+    cJSON_AddNumberToObject(range, "n", (double)fp->count);
+    cJSON_AddStringToObject(range, "fp", fp_hex);
+    return range;
+}
+
+static cJSON* make_id_range(pk_id_t chat_id, uint64_t lo, uint64_t hi) {
+    cJSON *range = cJSON_CreateObject();
+    cJSON_AddNumberToObject(range, "lo", (double)lo);
+    cJSON_AddNumberToObject(range, "hi", (double)hi);
+    cJSON *ids = cJSON_AddArrayToObject(range, "ids");
+    char *sql = sqlite3_mprintf("SELECT message_uid FROM messages WHERE hkey >= %llu AND hkey < %llu "
+                                "UNION ALL SELECT message_uid FROM archive_keys WHERE hkey >= %llu AND hkey < %llu;",
+                                (unsigned long long)lo, (unsigned long long)hi, (unsigned long long)lo, (unsigned long long)hi);
+    chat_db_t *cdb = chat_db_acquire(chat_id);
+    if (cdb) {
+        sqlite3_stmt *stmt = chat_db_prepare(cdb, sql);
+        if (stmt) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                if (sqlite3_column_bytes(stmt, 0) != MSG_UID_BYTES) continue;
+                char uid_hex[MSG_UID_HEX_LEN + 1];
+                uid_to_hex(sqlite3_column_blob(stmt, 0), uid_hex);
+                cJSON_AddItemToArray(ids, cJSON_CreateString(uid_hex));
+            }
+        }
+        sqlite3_finalize(stmt);
+        chat_db_release(cdb);
+    }
+    sqlite3_free(sql);
+    return range;
+}
+
+/**
+ * 把一组待发送的区间按 SYNC_MAX_RANGES_PER_MSG 分批发出。
+ */
+static void flush_sync_ranges(peer_t *peer, cJSON** ranges, int force) {
+    if (!*ranges) return;
+    int size = cJSON_GetArraySize(*ranges);
+    if (size == 0 || (!force && size < SYNC_MAX_RANGES_PER_MSG)) return;
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "sync_ranges");
+    cJSON_AddItemToObject(json, "ranges", *ranges);
+    send_json(peer, json);
+    cJSON_Delete(json);
+    *ranges = cJSON_CreateArray();
+}
+
+/**
+ * 调用者需持有分片。
+ */
+static int db_has_message(chat_db_t* cdb, const unsigned char message_uid[MSG_UID_BYTES]) {
+    // 过滤器不命中说明一定没有，省去一次查询；命中时以数据库为准
+    uint64_t fingerprint = sync_uid_fingerprint(message_uid);
+    if (!uid_filter_seen(cdb, fingerprint)) return 0;
+    int found = 0;
+    char *sql = sqlite3_mprintf("SELECT 1 FROM messages WHERE message_uid = ?1 "
+                                "UNION ALL SELECT 1 FROM archive_keys WHERE hkey = %lld AND message_uid = ?1 LIMIT 1;",
+                                (sqlite3_int64)(fingerprint >> 32));
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, sql);
+    if (stmt) {
+        sqlite3_bind_blob(stmt, 1, message_uid, MSG_UID_BYTES, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) found = 1;
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+    return found;
+}
+
+// --- 同步: 分块发送 ---
+#define SYNC_ROW_COLUMNS "message_uid, sender_pk, content, timestamp, vector_clock, hkey"
+// 已归档消息的同一组列，正文等字段由 zl_archive_field 从所在的段中读出
+#define SYNC_ARCHIVE_ROW_COLUMNS "message_uid, zl_archive_field(block, message_uid, 0), zl_archive_field(block, message_uid, 1), " \
+                                 "zl_archive_field(block, message_uid, 2), zl_archive_field(block, message_uid, 3), hkey"
+
+typedef struct {
+    cJSON *json;
+    cJSON *messages;
+    size_t bytes;
+    int rows;
+} sync_chunk_t;
+
+static void chunk_begin(sync_chunk_t *chunk) {
+    chunk->json = cJSON_CreateObject();
+    cJSON_AddStringToObject(chunk->json, "type", "sync_chunk");
+    chunk->messages = cJSON_AddArrayToObject(chunk->json, "messages");
+    chunk->bytes = 0;
+    chunk->rows = 0;
+}
+
+static void chunk_add_row(sync_chunk_t *chunk, sqlite3_stmt *stmt) {
+    char uid_hex[MSG_UID_HEX_LEN + 1] = "";
+    if (sqlite3_column_bytes(stmt, 0) == MSG_UID_BYTES) uid_to_hex(sqlite3_column_blob(stmt, 0), uid_hex);
+    const void *sender_pk = sqlite3_column_blob(stmt, 1);
+    const char *content = (const char*)sqlite3_column_text(stmt, 2);
+    const char *vc = (const char*)sqlite3_column_text(stmt, 4);
+    // 线路上仍以十六进制表示公钥，直接取驻留表中缓存的形式
+    pk_id_t sender_id = (sender_pk && sqlite3_column_bytes(stmt, 1) == PK_BYTES) ? pk_lookup(sender_pk) : PK_ID_NONE;
+    cJSON *msg_obj = cJSON_CreateObject();
+    cJSON_AddStringToObject(msg_obj, "uid", uid_hex);
+    cJSON_AddStringToObject(msg_obj, "sender_pk", pk_hex(sender_id));
+    cJSON_AddStringToObject(msg_obj, "content", content ? content : "");
+    cJSON_AddNumberToObject(msg_obj, "timestamp", sqlite3_column_int64(stmt, 3));
+    cJSON_AddStringToObject(msg_obj, "vector_clock", vc ? vc : "");
+    cJSON_AddItemToArray(chunk->messages, msg_obj);
+    // 估算序列化后的大小（字段名、引号与转义的余量按 96 字节计）
+    chunk->bytes += MSG_UID_HEX_LEN + sqlite3_column_bytes(stmt, 1) + sqlite3_column_bytes(stmt, 2) + sqlite3_column_bytes(stmt, 4) + 96;
+    chunk->rows++;
+}
+
+static void chunk_send(peer_t *peer, sync_chunk_t *chunk) {
+    send_json_prio(peer, LINK_PRIO_SYNC, chunk->json);
+    cJSON_Delete(chunk->json);
+    chunk->json = chunk->messages = NULL;
+}
+
+/**
+ * 从游标位置继续读取一块数据并发送。
+ * 游标按 (hkey, message_uid) 有序推进，热表与归档键各自按索引顺序读取后归并，只在读取本块期间持有分片。
+ * @return 流已读完返回 1，否则返回 0。
+ */
+static int sync_stream_send_chunk(peer_t *peer, sync_stream_t *st) {
+    char *where;
+    if (st->has_pos) {
+        where = sqlite3_mprintf("hkey < %llu AND (hkey > %lld OR (hkey = %lld AND message_uid > ?1))",
+                                (unsigned long long)st->hi, (sqlite3_int64)st->pos_hkey, (sqlite3_int64)st->pos_hkey);
+    } else {
+        where = sqlite3_mprintf("hkey >= %llu AND hkey < %llu", (unsigned long long)st->lo, (unsigned long long)st->hi);
+    }
+    char *sql = sqlite3_mprintf("SELECT " SYNC_ROW_COLUMNS " FROM messages WHERE %s "
+                                "UNION ALL SELECT " SYNC_ARCHIVE_ROW_COLUMNS " FROM archive_keys WHERE %s "
+                                "ORDER BY hkey, message_uid LIMIT %d;", where, where, SYNC_CHUNK_ROWS);
+    sqlite3_free(where);
+    sync_chunk_t chunk;
+    chunk_begin(&chunk);
+    int fetched = 0, cut = 0;
+    chat_db_t *cdb = chat_db_acquire(peer->id);
+    sqlite3_stmt *stmt = cdb ? chat_db_prepare(cdb, sql) : NULL;
+    if (stmt) {
+        if (st->has_pos) sqlite3_bind_blob(stmt, 1, st->pos_uid, MSG_UID_BYTES, SQLITE_TRANSIENT);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const unsigned char *uid = sqlite3_column_blob(stmt, 0);
+            if (!uid || sqlite3_column_bytes(stmt, 0) != MSG_UID_BYTES) continue;
+            fetched++;
+            st->pos_hkey = (uint32_t)sqlite3_column_int64(stmt, 5);
+            memcpy(st->pos_uid, uid, MSG_UID_BYTES);
+            st->has_pos = 1;
+
+            int known = 0;
+            uint64_t fingerprint = sync_uid_fingerprint(uid);
+            for (int i = 0; i < st->skip_count; i++) {
+                if (st->skip[i] == fingerprint) {
+                    known = 1;
+                    break;
+                }
+            }
+            if (known) continue;
+            chunk_add_row(&chunk, stmt);
+            if (chunk.bytes >= SYNC_CHUNK_BYTES) {
+                cut = 1;
+                break;
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (cdb) chat_db_release(cdb);
+    sqlite3_free(sql);
+
+    int done = !cut && fetched < SYNC_CHUNK_ROWS;
+    st->sent += chunk.rows;
+    cJSON_AddNumberToObject(chunk.json, "stream", st->id);
+    cJSON_AddNumberToObject(chunk.json, "lo", (double)st->lo);
+    cJSON_AddNumberToObject(chunk.json, "hi", (double)st->hi);
+    if (st->has_pos) {
+        char pos_hex[MSG_UID_HEX_LEN + 1];
+        uid_to_hex(st->pos_uid, pos_hex);
+        cJSON_AddNumberToObject(chunk.json, "pos_hkey", st->pos_hkey);
+        cJSON_AddStringToObject(chunk.json, "pos_uid", pos_hex);
+    }
+    cJSON_AddBoolToObject(chunk.json, "done", done);
+    cJSON_AddBoolToObject(chunk.json, "resume", st->resume);
+    chunk_send(peer, &chunk);
+    return done;
+}
+
+/**
+ * 新建一个发送流，追加在链表尾部。同时进行的流已满时新流排队 (waiting)，由 sync_stream_pump 在前面的流结束后接上。
+ * @return 排队也已满或内存不足时返回 NULL，该区间留给下一轮协调。
+ */
+static sync_stream_t* sync_stream_open(peer_t *peer, uint64_t lo, uint64_t hi) {
+    int count = 0;
+    sync_stream_t **tail = &peer->streams;
+    while (*tail) {
+        count++;
+        tail = &(*tail)->next;
+    }
+    if (count >= SYNC_MAX_STREAMS + SYNC_MAX_WAITING_STREAMS) {
+        log_msg("[同步] %s 请求的区间过多，部分区间留到下一轮同步。", get_friend_name(peer->id));
+        return NULL;
+    }
+    sync_stream_t *st = calloc(1, sizeof(sync_stream_t));
+    if (!st) return NULL;
+    st->id = ++peer->next_stream_id;
+    st->lo = lo;
+    st->hi = hi;
+    st->credits = SYNC_INITIAL_CREDITS;
+    st->waiting = count >= SYNC_MAX_STREAMS;
+    // 对端有发送流即算一次入站同步，与本机发起的同步共用调度器的执行槽
+    if (peer->streams == NULL) sync_scheduler_inbound(1);
+    *tail = st;
+    return st;
+}
+
+static void sync_stream_close(peer_t *peer, sync_stream_t *st) {
+    for (sync_stream_t **it = &peer->streams; *it; it = &(*it)->next) {
+        if (*it == st) {
+            *it = st->next;
+            break;
+        }
+    }
+    free(st);
+    if (peer->streams == NULL) sync_scheduler_inbound(-1);
+}
+
+static void free_sync_streams(peer_t *peer) {
+    if (peer->streams) sync_scheduler_inbound(-1);
+    while (peer->streams) {
+        sync_stream_t *next = peer->streams->next;
+        free(peer->streams);
+        peer->streams = next;
+    }
+}
+
+/**
+ * 在信用允许的范围内推进一个发送流，读完后关闭该流，并接着推进排在最前面的等待流。排队中的流不推进。
+ */
+static void sync_stream_pump(peer_t *peer, sync_stream_t *st) {
+    while (st && !st->waiting && st->credits > 0) {
+        st->credits--;
+        if (!sync_stream_send_chunk(peer, st)) continue;
+        if (st->sent > 0) {
+            log_msg("[同步] 向 %s 发送了 %d 条缺失的消息。", get_friend_name(peer->id), st->sent);
+        }
+        sync_stream_close(peer, st);
+        st = NULL;
+        for (sync_stream_t *it = peer->streams; it; it = it->next) {
+            if (it->waiting) {
+                it->waiting = 0;
+                st = it;
+                break;
+            }
+        }
+    }
+}
+
+// --- 同步: 请求与协调 ---
+static int db_count_sync_progress(pk_id_t chat_id) {
+    chat_db_t *cdb = chat_db_acquire(chat_id);
+    if (!cdb) return 0;
+    int count = (int)db_query_int64(cdb->db, "SELECT count(*) FROM sync_progress;");
+    chat_db_release(cdb);
+    return count;
+}
+
+/**
+ * 若上次同步被中断，则为每个未完成的区间请求从断点续传。
+ * @return 发出的续传请求数。
+ */
+static int request_sync_resume(pk_id_t friend_id) {
+    cJSON *requests = cJSON_CreateArray();
+    char *sql = sqlite3_mprintf("SELECT lo, hi, pos_hkey, pos_uid FROM sync_progress LIMIT %d;", SYNC_MAX_STREAMS);
+    chat_db_t *cdb = chat_db_acquire(friend_id);
+    sqlite3_stmt *stmt = cdb ? chat_db_prepare(cdb, sql) : NULL;
+    if (stmt) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (sqlite3_column_bytes(stmt, 3) != MSG_UID_BYTES) continue;
+            char pos_hex[MSG_UID_HEX_LEN + 1];
+            uid_to_hex(sqlite3_column_blob(stmt, 3), pos_hex);
+            cJSON *req = cJSON_CreateObject();
+            cJSON_AddStringToObject(req, "type", "sync_resume");
+            cJSON_AddNumberToObject(req, "lo", (double)sqlite3_column_int64(stmt, 0));
+            cJSON_AddNumberToObject(req, "hi", (double)sqlite3_column_int64(stmt, 1));
+            cJSON_AddNumberToObject(req, "pos_hkey", (double)sqlite3_column_int64(stmt, 2));
+            cJSON_AddStringToObject(req, "pos_uid", pos_hex);
+            cJSON_AddItemToArray(requests, req);
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (cdb) chat_db_release(cdb);
+    sqlite3_free(sql);
+
+    int sent = 0;
+    cJSON *req;
+    cJSON_ArrayForEach(req, requests) {
+        if (send_json_to(friend_id, req) == 0) sent++;
+    }
+    cJSON_Delete(requests);
+    return sent;
+}
+
+void request_chat_sync(pk_id_t friend_id) {
+    // 区间协调只在会话双方之间进行，群的记录由在线成员直接推送
+    if (contact_store_is_group(friend_id)) return;
+    if (sync_scheduler_submit(friend_id) != 0) log_msg("[同步] 内存不足，未能为 %s 安排同步。", get_friend_name(friend_id));
+}
+
+/**
+ * 由同步调度器调用，真正向对端发起一轮同步。
+ */
+static int start_chat_sync(pk_id_t friend_id) {
+    if (request_sync_resume(friend_id) > 0) {
+        // 续传流全部结束后会自动发起一轮完整协调
+        log_msg("[同步] 正在从中断处继续与 %s 的同步...", get_friend_name(friend_id));
+        return 0;
+    }
+
+    // 只发送根区间的指纹，后续是否细分由双方逐轮比较决定
+    range_fp_t root;
+    db_range_fingerprint(friend_id, 0, SYNC_HASH_SPACE, &root);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "sync_ranges");
+    cJSON *ranges = cJSON_AddArrayToObject(json, "ranges");
+    cJSON_AddItemToArray(ranges, make_fp_range(0, SYNC_HASH_SPACE, &root));
+    int rc = send_json_to(friend_id, json);
+    if (rc == 0) {
+        log_msg("[同步] 已向 %s 发送同步请求...", get_friend_name(friend_id));
+    } else {
+        log_msg("[同步] 无法发送请求: %s 不在线。", get_friend_name(friend_id));
+    }
+    cJSON_Delete(json);
+    return rc;
+}
+
+static int parse_sync_range(cJSON *json, uint64_t *lo, uint64_t *hi) {
+    cJSON *lo_item = cJSON_GetObjectItem(json, "lo");
+    cJSON *hi_item = cJSON_GetObjectItem(json, "hi");
+    if (!cJSON_IsNumber(lo_item) || !cJSON_IsNumber(hi_item)) return -1;
+    if (lo_item->valuedouble < 0 || hi_item->valuedouble > (double)SYNC_HASH_SPACE || lo_item->valuedouble >= hi_item->valuedouble) return -1;
+    *lo = (uint64_t)lo_item->valuedouble;
+    *hi = (uint64_t)hi_item->valuedouble;
+    return 0;
+}
+
+static void handle_sync_ranges(peer_t *peer, cJSON *json) {
+    cJSON *ranges = cJSON_GetObjectItem(json, "ranges");
+    if (!cJSON_IsArray(ranges)) return;
+    pk_id_t chat_id = peer->id;
+
+    cJSON *reply = cJSON_CreateArray();
+    cJSON *wanted = cJSON_CreateArray();
+    cJSON *range;
+    cJSON_ArrayForEach(range, ranges) {
+        uint64_t lo, hi;
+        if (parse_sync_range(range, &lo, &hi) != 0) continue;
+
+        cJSON *ids = cJSON_GetObjectItem(range, "ids");
+        if (cJSON_IsArray(ids)) {
+            // 对方给出了完整的 uid 列表：以流的方式补发对方缺少的，索要自己缺少的
+            sync_stream_t *st = sync_stream_open(peer, lo, hi);
+            chat_db_t *cdb = chat_db_acquire(chat_id);
+            cJSON *id;
+            cJSON_ArrayForEach(id, ids) {
+                unsigned char uid[MSG_UID_BYTES];
+                if (!cJSON_IsString(id) || uid_from_hex(id->valuestring, uid) != 0) continue;
+                if (st && st->skip_count < SYNC_MAX_SKIP) st->skip[st->skip_count++] = sync_uid_fingerprint(uid);
+                if (cdb && !db_has_message(cdb, uid)) {
+                    cJSON_AddItemToArray(wanted, cJSON_CreateString(id->valuestring));
+                }
+            }
+            if (cdb) chat_db_release(cdb);
+            if (st) sync_stream_pump(peer, st);
+            continue;
+        }
+
+        cJSON *n_item = cJSON_GetObjectItem(range, "n");
+        cJSON *fp_item = cJSON_GetObjectItem(range, "fp");
+        if (!cJSON_IsNumber(n_item) || !cJSON_IsString(fp_item)) continue;
+        range_fp_t mine;
+        char mine_hex[17];
+        db_range_fingerprint(chat_id, lo, hi, &mine);
+        range_fp_hex(&mine, mine_hex);
+        if ((double)mine.count == n_item->valuedouble && strcmp(mine_hex, fp_item->valuestring) == 0) continue;
+
+        if (mine.count <= SYNC_ITEM_THRESHOLD || hi - lo <= SYNC_FANOUT) {
+            cJSON_AddItemToArray(reply, make_id_range(chat_id, lo, hi));
+        } else {
+            uint64_t step = (hi - lo) / SYNC_FANOUT;
+            for (int k = 0; k < SYNC_FANOUT; k++) {
+                uint64_t sub_lo = lo + step * k;
+                uint64_t sub_hi = (k == SYNC_FANOUT - 1) ? hi : sub_lo + step;
+                range_fp_t sub;
+                db_range_fingerprint(chat_id, sub_lo, sub_hi, &sub);
+                cJSON_AddItemToArray(reply, make_fp_range(sub_lo, sub_hi, &sub));
+                flush_sync_ranges(peer, &reply, 0);
+            }
+        }
+        flush_sync_ranges(peer, &reply, 0);
+    }
+    flush_sync_ranges(peer, &reply, 1);
+    cJSON_Delete(reply);
+
+    if (cJSON_GetArraySize(wanted) > 0) {
+        cJSON *want = cJSON_CreateObject();
+        cJSON_AddStringToObject(want, "type", "sync_want");
+        cJSON_AddItemToObject(want, "ids", wanted);
+        send_json(peer, want);
+        cJSON_Delete(want);
+    } else {
+        cJSON_Delete(wanted);
+    }
+}
+
+static void handle_sync_want(peer_t *peer, cJSON *json) {
+    cJSON *ids = cJSON_GetObjectItem(json, "ids");
+    if (!cJSON_IsArray(ids)) return;
+
+    // 索要的消息数量有限（来自 uid 列表），不走信用控制，但仍按块大小切分
+    sync_chunk_t chunk;
+    chunk_begin(&chunk);
+    int sent = 0;
+    cJSON *id;
+    cJSON_ArrayForEach(id, ids) {
+        unsigned char uid[MSG_UID_BYTES];
+        if (!cJSON_IsString(id) || uid_from_hex(id->valuestring, uid) != 0) continue;
+        chat_db_t *cdb = chat_db_acquire(peer->id);
+        if (!cdb) break;
+        char *sql = sqlite3_mprintf("SELECT " SYNC_ROW_COLUMNS " FROM messages WHERE message_uid = ?1 "
+                                    "UNION ALL SELECT " SYNC_ARCHIVE_ROW_COLUMNS " FROM archive_keys WHERE hkey = %lld AND message_uid = ?1 LIMIT 1;",
+                                    (sqlite3_int64)(sync_uid_fingerprint(uid) >> 32));
+        sqlite3_stmt *stmt = chat_db_prepare(cdb, sql);
+        if (stmt) {
+            sqlite3_bind_blob(stmt, 1, uid, MSG_UID_BYTES, SQLITE_STATIC);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                chunk_add_row(&chunk, stmt);
+                sent++;
+            }
+        }
+        sqlite3_finalize(stmt);
+        sqlite3_free(sql);
+        chat_db_release(cdb);
+        if (chunk.bytes >= SYNC_CHUNK_BYTES) {
+            chunk_send(peer, &chunk);
+            chunk_begin(&chunk);
+        }
+    }
+    if (chunk.rows > 0) chunk_send(peer, &chunk);
+    else cJSON_Delete(chunk.json);
+    if (sent > 0) {
+        log_msg("[同步] 向 %s 发送了 %d 条缺失的消息。", get_friend_name(peer->id), sent);
+    }
+}
+
+static void handle_sync_resume(peer_t *peer, cJSON *json) {
+    uint64_t lo, hi;
+    cJSON *pos_hkey = cJSON_GetObjectItem(json, "pos_hkey");
+    cJSON *pos_uid = cJSON_GetObjectItem(json, "pos_uid");
+    unsigned char uid[MSG_UID_BYTES];
+    if (parse_sync_range(json, &lo, &hi) != 0 || !cJSON_IsNumber(pos_hkey) || !cJSON_IsString(pos_uid) || uid_from_hex(pos_uid->valuestring, uid) != 0) return;
+    sync_stream_t *st = sync_stream_open(peer, lo, hi);
+    if (!st) return;
+    st->pos_hkey = (uint32_t)pos_hkey->valuedouble;
+    memcpy(st->pos_uid, uid, MSG_UID_BYTES);
+    st->has_pos = 1;
+    st->resume = 1;
+    sync_stream_pump(peer, st);
+}
+
+static void handle_sync_credit(peer_t *peer, cJSON *json) {
+    cJSON *stream = cJSON_GetObjectItem(json, "stream");
+    cJSON *n = cJSON_GetObjectItem(json, "n");
+    if (!cJSON_IsNumber(stream) || !cJSON_IsNumber(n) || n->valuedouble < 1) return;
+    for (sync_stream_t *st = peer->streams; st; st = st->next) {
+        if (st->id == (uint32_t)stream->valuedouble) {
+            st->credits += n->valuedouble > SYNC_INITIAL_CREDITS ? SYNC_INITIAL_CREDITS : (int)n->valuedouble;
+            sync_stream_pump(peer, st);
+            return;
+        }
+    }
+}
+
+/**
+ * 接收一个同步块：落盘消息、记录续传位置，然后向发送方归还一个信用。
+ */
+static void handle_sync_chunk(peer_t *peer, cJSON *json) {
+    cJSON *messages = cJSON_GetObjectItem(json, "messages");
+    if (!cJSON_IsArray(messages)) return;
+    pk_id_t chat_id = peer->id;
+    const char *peer_hex = pk_hex(peer->id), *my_hex = pk_hex(my_id);
+    // 续传流会重放断点附近已经收过的消息，过滤器命中即丢弃，不再访问数据库。
+    // 其他块是精确的差集，不能据此丢弃，否则假阳性的消息将永远无法补齐。
+    cJSON *stream = cJSON_GetObjectItem(json, "stream");
+    int replay = cJSON_IsNumber(stream) && cJSON_IsTrue(cJSON_GetObjectItem(json, "resume"));
+    // 整块在同一把分片锁下、同一个事务内落盘（消息、同步索引、全文索引与续传位置），每块只提交一次，
+    // 其他会话的写入不受影响
+    uint64_t start = metrics_now_ns();
+    chat_db_t *cdb = chat_db_acquire(chat_id);
+    if (!cdb) return;
+    chat_db_exec(cdb, "BEGIN;");
+
+    cJSON *msg_item;
+    int new_messages = 0;
+    cJSON_ArrayForEach(msg_item, messages) {
+        cJSON *uid = cJSON_GetObjectItem(msg_item, "uid");
+        cJSON *sender_pk = cJSON_GetObjectItem(msg_item, "sender_pk");
+        cJSON *content = cJSON_GetObjectItem(msg_item, "content");
+        cJSON *vc_str_item = cJSON_GetObjectItem(msg_item, "vector_clock");
+
+        unsigned char uid_bin[MSG_UID_BYTES];
+        if (cJSON_IsString(uid) && uid_from_hex(uid->valuestring, uid_bin) == 0 && cJSON_IsString(sender_pk) && cJSON_IsString(content) && cJSON_IsString(vc_str_item)) {
+            // 私聊中双方的消息都属于与该好友的会话
+            pk_id_t sender_id;
+            if (strcmp(sender_pk->valuestring, peer_hex) == 0) sender_id = peer->id;
+            else if (strcmp(sender_pk->valuestring, my_hex) == 0) sender_id = my_id;
+            else continue;
+            if (replay && uid_filter_seen(cdb, sync_uid_fingerprint(uid_bin))) continue;
+            if (db_save_message(cdb, uid_bin, sender_id, content->valuestring, vc_str_item->valuestring) != 1) continue;
+            db_merge_vector_clock(cdb, vc_str_item->valuestring);
+            new_messages++;
+        }
+    }
+    peer->sync_received += new_messages;
+    metrics_add(METRIC_SYNC_MESSAGES, (uint64_t)new_messages);
+    sync_scheduler_touch(chat_id, new_messages);
+    // 界面读取新消息时要拿同一把分片锁，读到的一定是提交后的数据
+    if (new_messages > 0) chat_updated(chat_id);
+
+    uint64_t lo, hi;
+    if (!cJSON_IsNumber(stream) || parse_sync_range(json, &lo, &hi) != 0) {
+        // 不属于任何流的块（对 sync_want 的应答）
+        chat_db_exec(cdb, "COMMIT;");
+        chat_db_release(cdb);
+        metrics_observe_since(METRIC_HIST_DB_SYNC_CHUNK, start);
+        if (peer->sync_received > 0) log_msg("[同步] 收到 %d 条历史消息。", peer->sync_received);
+        peer->sync_received = 0;
+        return;
+    }
+
+    int done = cJSON_IsTrue(cJSON_GetObjectItem(json, "done"));
+    cJSON *pos_hkey = cJSON_GetObjectItem(json, "pos_hkey");
+    cJSON *pos_uid = cJSON_GetObjectItem(json, "pos_uid");
+    unsigned char pos_bin[MSG_UID_BYTES];
+    char *sql;
+    if (done) {
+        sql = sqlite3_mprintf("DELETE FROM sync_progress WHERE lo = %lld AND hi = %lld;", (sqlite3_int64)lo, (sqlite3_int64)hi);
+    } else if (cJSON_IsNumber(pos_hkey) && cJSON_IsString(pos_uid) && uid_from_hex(pos_uid->valuestring, pos_bin) == 0) {
+        sql = sqlite3_mprintf("INSERT OR REPLACE INTO sync_progress (lo, hi, pos_hkey, pos_uid) VALUES (%lld, %lld, %lld, ?1);",
+                              (sqlite3_int64)lo, (sqlite3_int64)hi, (sqlite3_int64)pos_hkey->valuedouble);
+    } else {
+        sql = NULL;
+    }
+    if (sql) {
+        sqlite3_stmt *stmt = chat_db_prepare(cdb, sql);
+        if (stmt) {
+            if (!done) sqlite3_bind_blob(stmt, 1, pos_bin, MSG_UID_BYTES, SQLITE_STATIC);
+            sqlite3_step(stmt);
+        }
+        sqlite3_finalize(stmt);
+        sqlite3_free(sql);
+    }
+    chat_db_exec(cdb, "COMMIT;");
+    chat_db_release(cdb);
+    metrics_observe_since(METRIC_HIST_DB_SYNC_CHUNK, start);
+
+    if (!done) {
+        cJSON *credit = cJSON_CreateObject();
+        cJSON_AddStringToObject(credit, "type", "sync_credit");
+        cJSON_AddNumberToObject(credit, "stream", stream->valuedouble);
+        cJSON_AddNumberToObject(credit, "n", 1);
+        send_json(peer, credit);
+        cJSON_Delete(credit);
+        return;
+    }
+
+    if (peer->sync_received > 0) log_msg("[同步] 收到 %d 条历史消息。", peer->sync_received);
+    peer->sync_received = 0;
+    if (cJSON_IsTrue(cJSON_GetObjectItem(json, "resume")) && db_count_sync_progress(chat_id) == 0) {
+        // 续传全部完成，再做一轮完整协调以补齐中断期间产生的差异（仍属于当前同步任务）
+        start_chat_sync(chat_id);
+    }
+}
+
+// --- 群聊 ---
+static int compare_pk(const void* a, const void* b) {
+    return memcmp(a, b, PK_BYTES);
+}
+
+/**
+ * 成员列表按公钥字节序排列（group_roster_normalize / contact_store_group_roster），用二分查找判断成员。
+ */
+static int roster_contains(const unsigned char (*members)[PK_BYTES], int count, const unsigned char pk[PK_BYTES]) {
+    return count > 0 && bsearch(pk, members, (size_t)count, PK_BYTES, compare_pk) != NULL;
+}
+
+static int pk_from_hex(const char* hex, unsigned char out[PK_BYTES]) {
+    size_t bin_len = 0;
+    if (!hex || strlen(hex) != PK_HEX_LEN || sodium_hex2bin(out, PK_BYTES, hex, PK_HEX_LEN, NULL, &bin_len, NULL) != 0 || bin_len != PK_BYTES) return -1;
+    return 0;
+}
+
+static void group_key_id_set(group_key_id_t* id, const unsigned char group_id[GROUP_ID_BYTES], uint32_t epoch, const unsigned char sender[PK_BYTES]) {
+    memcpy(id->group_id, group_id, GROUP_ID_BYTES);
+    id->epoch = epoch;
+    memcpy(id->sender, sender, PK_BYTES);
+}
+
+/**
+ * 取得发送者密钥：先查锁定内存中的密钥环，未命中时从通讯录读取并放入。
+ */
+static const GroupSenderKey* group_key_acquire(const group_key_id_t* id) {
+    const GroupSenderKey *key = group_keyring_acquire(group_keys, id);
+    if (key) return key;
+    group_key_material_t material;
+    if (contact_store_group_key_load(id, &material) == 0) key = group_keyring_put(group_keys, id, &material);
+    sodium_memzero(&material, sizeof(material));
+    return key;
+}
+
+/**
+ * 向成员列表中每个在线的成员（自己和 skip 除外，skip 可以为 NULL）发送同一个报文。
+ * 在线的好友一定已被驻留，未驻留的成员不需要查找连接。
+ */
+static void group_send_json(const unsigned char (*members)[PK_BYTES], int count, cJSON* json, const unsigned char* skip) {
+    for (int i = 0; i < count; i++) {
+        if (memcmp(members[i], my_pk, PK_BYTES) == 0 || (skip && memcmp(members[i], skip, PK_BYTES) == 0)) continue;
+        pk_id_t id = pk_lookup(members[i]);
+        if (id != PK_ID_NONE) send_json_to(id, json);
+    }
+}
+
+static cJSON* group_update_json(const unsigned char group_id[GROUP_ID_BYTES], uint32_t epoch, const unsigned char (*members)[PK_BYTES], int count) {
+    char hex[PK_HEX_LEN + 1];
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "group_update");
+    cJSON_AddStringToObject(json, "group", sodium_bin2hex(hex, sizeof(hex), group_id, GROUP_ID_BYTES));
+    const char *name = contact_store_name(contact_store_resolve(group_id));
+    if (name) cJSON_AddStringToObject(json, "name", name);
+    cJSON_AddNumberToObject(json, "epoch", epoch);
+    cJSON *list = cJSON_AddArrayToObject(json, "members");
+    for (int i = 0; i < count; i++) cJSON_AddItemToArray(list, cJSON_CreateString(sodium_bin2hex(hex, sizeof(hex), members[i], PK_BYTES)));
+    return json;
+}
+
+#define GROUP_KEY_PLAIN_BYTES (GROUP_KEY_BYTES + GROUP_SIGN_PK_BYTES)
+#define GROUP_KEY_BOX_BYTES (PEER_BOX_OVERHEAD + GROUP_KEY_PLAIN_BYTES)
+
+/**
+ * 密钥包：对称密钥和签名公钥用自己与每位成员的共享密钥 (peer_crypto.h) 各加密一份。
+ * 任何成员都可以原样转发整个包，但只有对应的成员能打开属于自己的那一份，并由此确认它出自发送者本人。
+ * 每位成员约占 280 字节，GROUP_MAX_MEMBERS 人的包仍在 MAX_FRAME_SIZE 之内。
+ */
+static cJSON* group_key_bundle_json(const group_key_id_t* id, const group_key_material_t* material, const unsigned char (*members)[PK_BYTES], int count) {
+    unsigned char plain[GROUP_KEY_PLAIN_BYTES], box[GROUP_KEY_BOX_BYTES];
+    char hex[PK_HEX_LEN + 1], box_hex[GROUP_KEY_BOX_BYTES * 2 + 1];
+    memcpy(plain, material->key, GROUP_KEY_BYTES);
+    memcpy(plain + GROUP_KEY_BYTES, material->sign_pk, GROUP_SIGN_PK_BYTES);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "group_key");
+    cJSON_AddStringToObject(json, "group", sodium_bin2hex(hex, sizeof(hex), id->group_id, GROUP_ID_BYTES));
+    cJSON_AddNumberToObject(json, "epoch", id->epoch);
+    cJSON_AddStringToObject(json, "sender", sodium_bin2hex(hex, sizeof(hex), id->sender, PK_BYTES));
+    cJSON *boxes = cJSON_AddArrayToObject(json, "boxes");
+    for (int i = 0; i < count; i++) {
+        if (memcmp(members[i], my_pk, PK_BYTES) == 0) continue;
+        const PeerKey *link = peer_key_acquire(key_cache, members[i]);
+        peer_box_frame_t frame = { .in = plain, .in_len = sizeof(plain), .out = box };
+        int sealed = link && peer_box_seal_batch(link, &frame, 1) == 1;
+        peer_key_release(key_cache, link);
+        if (!sealed) continue;
+        cJSON *entry = cJSON_CreateArray();
+        cJSON_AddItemToArray(entry, cJSON_CreateString(sodium_bin2hex(hex, sizeof(hex), members[i], PK_BYTES)));
+        cJSON_AddItemToArray(entry, cJSON_CreateString(sodium_bin2hex(box_hex, sizeof(box_hex), box, sizeof(box))));
+        cJSON_AddItemToArray(boxes, entry);
+    }
+    sodium_memzero(plain, sizeof(plain));
+    return json;
+}
+
+/**
+ * 把保存的密钥包原样发给对端。
+ * @return 已发送返回 0，没有该密钥包返回 -1。
+ */
+static int group_send_bundle(peer_t* peer, pk_id_t peer_id, const group_key_id_t* id) {
+    char *text = contact_store_group_bundle_load(id);
+    cJSON *bundle = text ? cJSON_Parse(text) : NULL;
+    int rc = -1;
+    if (bundle) rc = peer ? (send_json(peer, bundle), 0) : send_json_to(peer_id, bundle);
+    cJSON_Delete(bundle);
+    free(text);
+    return rc;
+}
+
+/**
+ * 为纪元生成自己的发送者密钥，保存密钥和密钥包后发给在线的成员，由它们继续转发（不在线的成员上线时由 group_sync_with_peer 补发）。
+ * 调用者持有 group_mutex。
+ */
+static void group_rotate_key(const unsigned char group_id[GROUP_ID_BYTES], uint32_t epoch, const unsigned char (*members)[PK_BYTES], int count) {
+    group_key_id_t id;
+    group_key_material_t material;
+    group_key_id_set(&id, group_id, epoch, my_pk);
+    group_key_generate(&material);
+    cJSON *bundle = group_key_bundle_json(&id, &material, members, count);
+    char *text = cJSON_PrintUnformatted(bundle);
+    if (!text || contact_store_group_key_save(&id, &material) != 0 || contact_store_group_bundle_save(&id, text) < 0) {
+        log_msg("[群聊] 错误: 无法保存发送者密钥。");
+    } else {
+        group_keyring_release(group_keys, group_keyring_put(group_keys, &id, &material));
+        group_send_json(members, count, bundle, NULL);
+    }
+    free(text);
+    cJSON_Delete(bundle);
+    sodium_memzero(&material, sizeof(material));
+}
+
+/**
+ * 应用新的纪元和成员列表（members 已规范化）。上一纪元的密钥保留，用来解密成员变动前发出、仍在路上的消息；
+ * 自己不在新列表中时丢弃该群的全部密钥。调用者持有 group_mutex。
+ * @return 成功返回 0，出错返回 -1。
+ */
+static int group_apply_roster(const unsigned char group_id[GROUP_ID_BYTES], uint32_t epoch, const unsigned char digest[GROUP_DIGEST_BYTES],
+                              const unsigned char (*members)[PK_BYTES], int count) {
+    if (contact_store_group_set_roster(group_id, epoch, digest, members, count) != 0) {
+        log_msg("[群聊] 错误: 无法保存群成员列表。");
+        return -1;
+    }
+    uint32_t keep = roster_contains(members, count, my_pk) ? epoch - 1 : UINT32_MAX;
+    contact_store_group_key_prune(group_id, keep);
+    group_keyring_forget(group_keys, group_id, keep);
+    if (keep != UINT32_MAX) group_rotate_key(group_id, epoch, members, count);
+    return 0;
+}
+
+/**
+ * 由本机发起的成员变动：纪元加一，先把新状态发给新旧全部成员（被移出的成员因此得知），再应用并分发新密钥。
+ * 调用者持有 group_mutex。
+ */
+static int group_change_roster(const unsigned char group_id[GROUP_ID_BYTES], uint32_t old_epoch, const unsigned char (*old_members)[PK_BYTES], int old_count,
+                               unsigned char (*members)[PK_BYTES], int count) {
+    unsigned char digest[GROUP_DIGEST_BYTES];
+    count = (int)group_roster_normalize(members, (size_t)count, digest);
+    cJSON *json = group_update_json(group_id, old_epoch + 1, (const unsigned char (*)[PK_BYTES])members, count);
+    group_send_json(old_members, old_count, json, NULL);
+    for (int i = 0; i < count; i++) {
+        if (roster_contains(old_members, old_count, members[i])) continue;
+        pk_id_t id = pk_lookup(members[i]);
+        if (id != PK_ID_NONE) send_json_to(id, json);
+    }
+    cJSON_Delete(json);
+    return group_apply_roster(group_id, old_epoch + 1, digest, (const unsigned char (*)[PK_BYTES])members, count);
+}
+
+/**
+ * 新群邀请的配额：每个未知的群都会驻留一个 id 并写入通讯录，不加限制时任何好友都可以无限制地制造群。
+ * 调用者持有 group_mutex。
+ * @return 允许接受这次邀请返回 1。
+ */
+static int group_invite_allowed(pk_id_t inviter) {
+    static struct {
+        pk_id_t inviter;
+        double tokens;
+        uint64_t at_ms;
+    } buckets[GROUP_INVITE_SLOTS];
+    uint64_t now = monotonic_ms();
+    int slot = 0;
+    for (int i = 0; i < GROUP_INVITE_SLOTS; i++) {
+        if (buckets[i].inviter == inviter) {
+            slot = i;
+            break;
+        }
+        if (buckets[i].at_ms < buckets[slot].at_ms) slot = i;
+    }
+    if (buckets[slot].inviter != inviter) {
+        buckets[slot].inviter = inviter;
+        buckets[slot].tokens = GROUP_INVITE_BURST;
+        buckets[slot].at_ms = now;
+    }
+    double tokens = buckets[slot].tokens + (double)(now - buckets[slot].at_ms) / GROUP_INVITE_INTERVAL_MS;
+    buckets[slot].tokens = tokens > GROUP_INVITE_BURST ? GROUP_INVITE_BURST : tokens;
+    buckets[slot].at_ms = now;
+    if (buckets[slot].tokens < 1) return 0;
+    buckets[slot].tokens -= 1;
+    return 1;
+}
+
+/**
+ * 把群加入通讯录；名字已被其他联系人占用时在前面加上群 id 的前 8 位十六进制。
+ */
+static int group_register(const unsigned char group_id[GROUP_ID_BYTES], const char* name) {
+    if (!name || !*name) name = "群聊";
+    int rc = contact_store_put_group(group_id, name);
+    if (rc == 1) {
+        char hex[9], alt[CONTACT_NAME_SIZE * 2];
+        sodium_bin2hex(hex, sizeof(hex), group_id, 4);
+        snprintf(alt, sizeof(alt), "%s-%s", hex, name);
+        rc = contact_store_put_group(group_id, alt);
+    }
+    return rc;
+}
+
+/**
+ * 读取群的纪元和成员列表。
+ * @return 成员数；不是已知的群或出错返回 -1。
+ */
+static int group_load(const unsigned char group_id[GROUP_ID_BYTES], uint32_t* epoch, unsigned char (*members)[PK_BYTES]) {
+    unsigned char digest[GROUP_DIGEST_BYTES];
+    if (contact_store_group_state(group_id, epoch, digest) != 0) return -1;
+    return contact_store_group_roster(group_id, members, GROUP_MAX_MEMBERS);
+}
+
+/**
+ * 消息发送者的显示名：自己为“我”，联系人为其名字，其他群成员为公钥的前 8 位十六进制。
+ */
+static const char* member_name(const unsigned char pk[PK_BYTES], char* buf, size_t len) {
+    if (memcmp(pk, my_pk, PK_BYTES) == 0) return "我";
+    const char *name = contact_store_name(pk_lookup(pk));
+    if (name) return name;
+    char hex[9];
+    snprintf(buf, len, "%s", sodium_bin2hex(hex, sizeof(hex), pk, 4));
+    return buf;
+}
+
+int create_group(const char* name, const char* const* friend_names, int count) {
+    unsigned char group_id[GROUP_ID_BYTES];
+    unsigned char members[GROUP_MAX_MEMBERS][PK_BYTES];
+    int n = 0;
+    memcpy(members[n++], my_pk, PK_BYTES);
+    for (int i = 0; i < count && n < GROUP_MAX_MEMBERS; i++) {
+        pk_id_t id = get_friend_id_by_name(friend_names[i]);
+        if (id == PK_ID_NONE || !contact_store_contains(id)) {
+            log_msg("[群聊] 错误: 没有名为 '%s' 的好友。", friend_names[i]);
+            return -1;
+        }
+        memcpy(members[n++], pk_bytes(id), PK_BYTES);
+    }
+    randombytes_buf(group_id, sizeof(group_id));
+    int rc = contact_store_put_group(group_id, name);
+    if (rc != 0) {
+        log_msg(rc == 1 ? "[群聊] 错误: 名字 %s 已被其他联系人使用。" : "[群聊] 错误: 无法创建群 %s。", name);
+        return -1;
+    }
+    pthread_mutex_lock(&group_mutex);
+    rc = group_change_roster(group_id, 0, NULL, 0, members, n);
+    pthread_mutex_unlock(&group_mutex);
+    if (rc == 0) log_msg("[群聊] 已创建群 %s，共 %d 位成员。", name, n);
+    return rc;
+}
+
+/**
+ * 加入或移出一位成员。
+ */
+static int group_edit_member(pk_id_t group_id, const unsigned char pk[PK_BYTES], int add) {
+    const unsigned char *gid = pk_bytes(group_id);
+    unsigned char old_members[GROUP_MAX_MEMBERS][PK_BYTES], members[GROUP_MAX_MEMBERS][PK_BYTES];
+    uint32_t epoch;
+    int rc = -1;
+    pthread_mutex_lock(&group_mutex);
+    int count = gid && contact_store_is_group(group_id) ? group_load(gid, &epoch, old_members) : -1;
+    const unsigned char (*old)[PK_BYTES] = (const unsigned char (*)[PK_BYTES])old_members;
+    if (count < 0 || !roster_contains(old, count, my_pk)) {
+        log_msg("[群聊] 错误: 你不在这个群中。");
+    } else if (add ? roster_contains(old, count, pk) : !roster_contains(old, count, pk)) {
+        log_msg(add ? "[群聊] 对方已经在群中。" : "[群聊] 对方不在群中。");
+    } else if (add && count >= GROUP_MAX_MEMBERS) {
+        log_msg("[群聊] 错误: 群成员已达上限 %d。", GROUP_MAX_MEMBERS);
+    } else {
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            if (!add && memcmp(old_members[i], pk, PK_BYTES) == 0) continue;
+            memcpy(members[n++], old_members[i], PK_BYTES);
+        }
+        if (add) memcpy(members[n++], pk, PK_BYTES);
+        rc = group_change_roster(gid, epoch, old, count, members, n);
     }
-    pthread_mutex_lock(&port_mutex);
-    my_p2p_port = ntohs(serv_addr.sin_port);
-    port_ready = 1;
-    pthread_cond_signal(&port_cond);
-    pthread_mutex_unlock(&port_mutex);
-    listen(listen_fd, 5);
-    log_msg("[系统] P2P服务正在端口 %d 上监听...", my_p2p_port);
-    while(1) {
-        struct sockaddr_in cli_addr;
-        socklen_t cli_len = sizeof(cli_addr);
-        int conn_fd = accept(listen_fd, (struct sockaddr*)&cli_addr, &cli_len);
-        if (conn_fd < 0) continue;
-        unsigned char received_pk[crypto_box_PUBLICKEYBYTES];
-        if (recv(conn_fd, received_pk, sizeof(received_pk), 0) != sizeof(received_pk)) {
-            close(conn_fd);
-            continue;
+    pthread_mutex_unlock(&group_mutex);
+    return rc;
+}
+
+int invite_to_group(pk_id_t group_id, const char* friend_name) {
+    pk_id_t id = get_friend_id_by_name(friend_name);
+    if (id == PK_ID_NONE || !contact_store_contains(id)) {
+        log_msg("[群聊] 错误: 没有名为 '%s' 的好友。", friend_name);
+        return -1;
+    }
+    int rc = group_edit_member(group_id, pk_bytes(id), 1);
+    if (rc == 0) log_msg("[群聊] 已邀请 %s 加入群 %s。", friend_name, get_friend_name(group_id));
+    return rc;
+}
+
+int kick_from_group(pk_id_t group_id, const char* member) {
+    // 成员可以用好友名字或公钥十六进制（开头部分即可）指定
+    unsigned char members[GROUP_MAX_MEMBERS][PK_BYTES], target[PK_BYTES];
+    uint32_t epoch;
+    int found = 0;
+    pk_id_t id = get_friend_id_by_name(member);
+    if (id != PK_ID_NONE && contact_store_contains(id)) {
+        memcpy(target, pk_bytes(id), PK_BYTES);
+        found = 1;
+    } else if (pk_bytes(group_id)) {
+        int count = group_load(pk_bytes(group_id), &epoch, members);
+        char hex[PK_HEX_LEN + 1];
+        for (int i = 0; i < count && strlen(member) >= 8; i++) {
+            if (strncmp(sodium_bin2hex(hex, sizeof(hex), members[i], PK_BYTES), member, strlen(member)) != 0) continue;
+            memcpy(target, members[i], PK_BYTES);
+            found++;
         }
-        char pk_hex[PK_HEX_LEN + 1];
-        sodium_bin2hex(pk_hex, sizeof(pk_hex), received_pk, sizeof(received_pk));
-        if (!is_friend(pk_hex)) {
-            close(conn_fd);
-            continue;
+    }
+    if (found != 1 || memcmp(target, my_pk, PK_BYTES) == 0) {
+        log_msg("[群聊] 错误: 无法确定要移出的成员 '%s'。", member);
+        return -1;
+    }
+    int rc = group_edit_member(group_id, target, 0);
+    if (rc == 0) log_msg("[群聊] 已将 %s 移出群 %s。", member, get_friend_name(group_id));
+    return rc;
+}
+
+int leave_group(pk_id_t group_id) {
+    const unsigned char *gid = pk_bytes(group_id);
+    const char *group_name = contact_store_name(group_id);
+    if (!gid || !group_name || !contact_store_is_group(group_id)) return -1;
+    char name[CONTACT_NAME_SIZE];
+    snprintf(name, sizeof(name), "%s", group_name);
+    unsigned char members[GROUP_MAX_MEMBERS][PK_BYTES], rest[GROUP_MAX_MEMBERS][PK_BYTES];
+    uint32_t epoch;
+    pthread_mutex_lock(&group_mutex);
+    int count = group_load(gid, &epoch, members), n = 0;
+    if (count > 0 && roster_contains((const unsigned char (*)[PK_BYTES])members, count, my_pk)) {
+        // 通知其余成员进入新纪元；自己不再参与，因此不生成新密钥
+        for (int i = 0; i < count; i++) {
+            if (memcmp(members[i], my_pk, PK_BYTES) != 0) memcpy(rest[n++], members[i], PK_BYTES);
         }
-        peer_t *new_peer = (peer_t*)malloc(sizeof(peer_t));
-        new_peer->sockfd = conn_fd;
-        memcpy(new_peer->pk, received_pk, sizeof(received_pk));
-        inet_ntop(AF_INET, &cli_addr.sin_addr, new_peer->ip, INET_ADDRSTRLEN);
-        new_peer->port = ntohs(cli_addr.sin_port);
-        if (crypto_box_beforenm(new_peer->shared_key, new_peer->pk, my_sk) != 0) {
-            close(conn_fd);
-            free(new_peer);
-            continue;
+        cJSON *json = group_update_json(gid, epoch + 1, (const unsigned char (*)[PK_BYTES])rest, n);
+        group_send_json((const unsigned char (*)[PK_BYTES])rest, n, json, NULL);
+        cJSON_Delete(json);
+    }
+    group_keyring_forget(group_keys, gid, UINT32_MAX);
+    int rc = contact_store_remove_by_name(name) == 0 ? 0 : -1;
+    pthread_mutex_unlock(&group_mutex);
+    if (rc == 0) log_msg("[群聊] 已退出群 %s，聊天记录保留在本地。", name);
+    return rc;
+}
+
+void list_group_members(pk_id_t group_id) {
+    const unsigned char *gid = pk_bytes(group_id);
+    unsigned char members[GROUP_MAX_MEMBERS][PK_BYTES];
+    uint32_t epoch;
+    int count = gid ? group_load(gid, &epoch, members) : -1;
+    if (count < 0) return;
+    log_msg("[群聊] %s 共 %d 位成员（纪元 %u）:", get_friend_name(group_id), count, epoch);
+    for (int i = 0; i < count; i++) {
+        char buf[16], hex[PK_HEX_LEN + 1];
+        log_msg("[群聊]   %s  %.16s...", member_name(members[i], buf, sizeof(buf)), sodium_bin2hex(hex, sizeof(hex), members[i], PK_BYTES));
+    }
+}
+
+int is_group_chat(pk_id_t chat_id) {
+    return contact_store_is_group(chat_id);
+}
+
+const char* get_sender_name(pk_id_t sender_id, char* buf, size_t len) {
+    const unsigned char *pk = pk_bytes(sender_id);
+    return pk ? member_name(pk, buf, len) : "未知用户";
+}
+
+/**
+ * 把群帧加上长度头（最高位为 FRAME_GROUP_FLAG）写到连接上。调用者保证连接在此期间不会被释放。
+ * 新消息的流言传播为交互类，反熵补发的旧消息为大块类。
+ */
+static int group_send_frame(peer_t* peer, link_prio_t prio, const unsigned char* frame, size_t len) {
+    unsigned char *buffer = malloc(4 + len);
+    if (!buffer) return -1;
+    write_frame_header(buffer, (uint32_t)len | FRAME_GROUP_FLAG);
+    memcpy(buffer + 4, frame, len);
+    int rc = peer_send_frame(peer, prio, buffer, 4 + len);
+    free(buffer);
+    return rc;
+}
+
+/**
+ * 把同一个帧转发给最多 fanout 个随机选出的在线成员，跳过 skip_a、skip_b（帧的来源与发送者，可以为 NULL）。
+ * 在 peers_mutex 内取得候选连接的引用，释放锁之后再发送。
+ * @return 写入的连接数。
+ */
+static int group_gossip_frame(const unsigned char (*members)[PK_BYTES], int count, const unsigned char* frame, size_t len,
+                              const unsigned char* skip_a, const unsigned char* skip_b, size_t fanout) {
+    peer_t *targets[MAX_PEERS];
+    size_t order[MAX_PEERS], n = 0;
+    int delivered = 0;
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        peer_t *peer = peers[i];
+        if (!peer || !peer->key_exchanged || !roster_contains(members, count, peer->pk)) continue;
+        if ((skip_a && memcmp(peer->pk, skip_a, PK_BYTES) == 0) || (skip_b && memcmp(peer->pk, skip_b, PK_BYTES) == 0)) continue;
+        targets[n++] = peer_hold(peer);
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    size_t picked = gossip_pick(n, fanout, order);
+    for (size_t i = 0; i < picked; i++) {
+        if (group_send_frame(targets[order[i]], LINK_PRIO_INTERACTIVE, frame, len) == 0) delivered++;
+    }
+    for (size_t i = 0; i < n; i++) peer_put(targets[i]);
+    return delivered;
+}
+
+static sqlite3_int64 group_frame_bucket(const unsigned char uid[MSG_UID_BYTES]) {
+    uint64_t ms = 0;
+    for (int i = 0; i < 6; i++) ms = (ms << 8) | uid[i];
+    return (sqlite3_int64)(ms / GROUP_FRAME_BUCKET_MS);
+}
+
+/**
+ * 保存群消息的原始帧，供反熵补发。调用者需持有分片。
+ */
+static void db_save_group_frame(chat_db_t* cdb, const unsigned char uid[MSG_UID_BYTES], const unsigned char* frame, size_t len) {
+    uint32_t hkey, hlow;
+    sync_uid_hash(uid, MSG_UID_BYTES, &hkey, &hlow);
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, "INSERT OR IGNORE INTO group_frames (message_uid, bucket, hkey, hlow, frame) VALUES (?1, ?2, ?3, ?4, ?5);");
+    if (stmt) {
+        sqlite3_bind_blob(stmt, 1, uid, MSG_UID_BYTES, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, group_frame_bucket(uid));
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)hkey);
+        sqlite3_bind_int64(stmt, 4, (sqlite3_int64)hlow);
+        sqlite3_bind_blob(stmt, 5, frame, (int)len, SQLITE_STATIC);
+        if (sqlite3_step(stmt) != SQLITE_DONE) log_msg("[数据库错误] 保存群消息帧失败: %s", sqlite3_errmsg(cdb->db));
+    }
+    sqlite3_finalize(stmt);
+}
+
+static void send_group_message(pk_id_t group_id, const char* message) {
+    const unsigned char *gid = pk_bytes(group_id);
+    unsigned char members[GROUP_MAX_MEMBERS][PK_BYTES];
+    uint32_t epoch;
+    int count = group_load(gid, &epoch, members);
+    const unsigned char (*roster)[PK_BYTES] = (const unsigned char (*)[PK_BYTES])members;
+    if (count < 0 || !roster_contains(roster, count, my_pk)) {
+        log_msg("[群聊] 错误: 你已不在群 %s 中。", get_friend_name(group_id));
+        return;
+    }
+    group_key_id_t key_id;
+    group_key_id_set(&key_id, gid, epoch, my_pk);
+    const GroupSenderKey *key = group_key_acquire(&key_id);
+    if (!key) {
+        // 本纪元的密钥丢失（例如通讯录被还原），重新生成并分发
+        pthread_mutex_lock(&group_mutex);
+        group_rotate_key(gid, epoch, roster, count);
+        pthread_mutex_unlock(&group_mutex);
+        key = group_key_acquire(&key_id);
+        if (!key) return;
+    }
+    unsigned char uid[MSG_UID_BYTES];
+    char uid_hex[MSG_UID_HEX_LEN + 1];
+    generate_message_uid(uid);
+    uid_to_hex(uid, uid_hex);
+    chat_db_t *cdb = chat_db_acquire(group_id);
+    if (!cdb) {
+        group_keyring_release(group_keys, key);
+        return;
+    }
+    cJSON* clock = db_get_vector_clock(cdb);
+    vc_increment(clock, pk_hex(my_id));
+    char* clock_str = cJSON_PrintUnformatted(clock);
+    db_save_message(cdb, uid, my_id, message, clock_str);
+    db_save_vector_clock(cdb, clock);
+    chat_db_release(cdb);
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "group_chat");
+    cJSON_AddStringToObject(json, "uid", uid_hex);
+    cJSON_AddStringToObject(json, "content", message);
+    cJSON_AddStringToObject(json, "vector_clock", clock_str);
+    char *payload = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    free(clock_str);
+    cJSON_Delete(clock);
+    metrics_add(METRIC_MESSAGES_SENT, 1);
+    chat_updated(group_id);
+
+    // 只加密、签名一次，所有成员收到的是同一个帧；只发给少数随机成员，由它们继续转发
+    size_t payload_len = payload ? strlen(payload) : 0;
+    unsigned char *frame = payload && payload_len + GROUP_FRAME_OVERHEAD <= MAX_FRAME_SIZE ? malloc(payload_len + GROUP_FRAME_OVERHEAD) : NULL;
+    size_t frame_len = frame ? group_frame_seal(key, (const unsigned char*)payload, payload_len, frame) : 0;
+    group_keyring_release(group_keys, key);
+    free(payload);
+    if (frame_len == 0) {
+        log_msg("[群聊] 错误: 消息过大或加密失败，未发送。");
+        free(frame);
+        return;
+    }
+    if ((cdb = chat_db_acquire(group_id)) != NULL) {
+        db_save_group_frame(cdb, uid, frame, frame_len);
+        chat_db_release(cdb);
+    }
+    gossip_seen_add(group_seen, group_frame_id(frame, frame_len));
+    int delivered = group_gossip_frame(roster, count, frame, frame_len, NULL, NULL, GROUP_GOSSIP_FANOUT);
+    free(frame);
+    if (delivered == 0 && count > 1) log_msg("[群聊] 提示：当前没有在线的成员，消息已保存在本地，成员上线后会自动补发。");
+}
+
+/**
+ * 保存解密后的群消息和它的原始帧。
+ * @return 新插入返回 1，消息已存在返回 0，报文无效或出错返回 -1。
+ */
+static int handle_group_chat(pk_id_t group_id, const unsigned char sender[PK_BYTES], const char* text, const unsigned char* frame, size_t frame_len) {
+    cJSON *json = cJSON_Parse(text);
+    if (!json) return -1;
+    int inserted = -1;
+    cJSON *type = cJSON_GetObjectItem(json, "type");
+    cJSON *uid = cJSON_GetObjectItem(json, "uid");
+    cJSON *content = cJSON_GetObjectItem(json, "content");
+    cJSON *vc_str_item = cJSON_GetObjectItem(json, "vector_clock");
+    unsigned char uid_bin[MSG_UID_BYTES];
+    pk_id_t sender_id;
+    chat_db_t *cdb;
+    if (cJSON_IsString(type) && strcmp(type->valuestring, "group_chat") == 0 && cJSON_IsString(uid) && uid_from_hex(uid->valuestring, uid_bin) == 0 &&
+        cJSON_IsString(content) && cJSON_IsString(vc_str_item) && (sender_id = pk_intern(sender)) != PK_ID_NONE &&
+        (cdb = chat_db_acquire(group_id)) != NULL) {
+        inserted = db_save_message(cdb, uid_bin, sender_id, content->valuestring, vc_str_item->valuestring);
+        if (inserted == 1) db_save_group_frame(cdb, uid_bin, frame, frame_len);
+        db_merge_vector_clock(cdb, vc_str_item->valuestring);
+        chat_db_release(cdb);
+        if (inserted == 1) {
+            metrics_add(METRIC_MESSAGES_RECEIVED, 1);
+            chat_updated(group_id);
         }
-        new_peer->key_exchanged = 1;
-        pthread_create(&new_peer->recv_tid, NULL, receive_from_peer, new_peer);
-        pthread_detach(new_peer->recv_tid);
-        add_peer(new_peer);
     }
-    close(listen_fd);
-    return NULL;
+    cJSON_Delete(json);
+    return inserted;
 }
 
-static void *server_handler(void *arg) {
-    int server_sockfd = *(int*)arg;
-    free(arg);
-    char buffer[BUFFER_SIZE * 2] = {0};
-    int len = 0;
-    while (1) {
-        int n = recv(server_sockfd, buffer + len, sizeof(buffer) - len - 1, 0);
-        if (n <= 0) break;
-        len += n;
-        buffer[len] = '\0';
-        char *line = buffer;
-        while (1) {
-            char *next_line = strchr(line, '\n');
-            if (!next_line) break;
-            *next_line = '\0';
-            char cmd[32], pk_hex[PK_HEX_LEN + 1], ip[INET_ADDRSTRLEN];
-            int port;
-            if (sscanf(line, "MY_IP %s", ip) == 1) {
-                strcpy(my_ip, ip);
-            } else if (sscanf(line, "%s %s %s %d", cmd, pk_hex, ip, &port) == 4) {
-                if (!is_friend(pk_hex)) {
-                    line = next_line + 1;
-                    continue;
-                }
-                if ((strcmp(cmd, "PEER") == 0 || strcmp(cmd, "NEW_PEER") == 0) && strlen(my_ip) > 0) {
-                    char my_addr[PK_HEX_LEN + 30], peer_addr[PK_HEX_LEN + 30];
-                    char my_pk_hex_local[PK_HEX_LEN + 1];
-                    sodium_bin2hex(my_pk_hex_local, sizeof(my_pk_hex_local), my_pk, sizeof(my_pk));
-                    sprintf(my_addr, "%s:%s:%d", my_pk_hex_local, my_ip, my_p2p_port);
-                    sprintf(peer_addr, "%s:%s:%d", pk_hex, ip, port);
-                    if (strcmp(my_addr, peer_addr) < 0) {
-                         log_msg("[系统] 发现好友 %s，正在尝试连接...", get_friend_name_by_hex(pk_hex));
-                         connect_to_peer(pk_hex, ip, port);
-                    }
-                }
+/**
+ * 向对端索取发送者的密钥包。缺少同一把密钥时后续的帧会接连触发索取，同一把密钥在 GROUP_KEY_WANT_INTERVAL 秒内只索取一次。
+ */
+static void group_request_key(peer_t* peer, const group_key_id_t* id) {
+    static group_key_id_t last_id;
+    static time_t last_at = 0;
+    static pthread_mutex_t want_mutex = PTHREAD_MUTEX_INITIALIZER;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&want_mutex);
+    int recent = now - last_at < GROUP_KEY_WANT_INTERVAL && memcmp(&last_id, id, sizeof(last_id)) == 0;
+    if (!recent) {
+        last_id = *id;
+        last_at = now;
+    }
+    pthread_mutex_unlock(&want_mutex);
+    if (recent) return;
+    char hex[PK_HEX_LEN + 1];
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "group_key_want");
+    cJSON_AddStringToObject(json, "group", sodium_bin2hex(hex, sizeof(hex), id->group_id, GROUP_ID_BYTES));
+    cJSON_AddNumberToObject(json, "epoch", id->epoch);
+    cJSON_AddStringToObject(json, "sender", sodium_bin2hex(hex, sizeof(hex), id->sender, PK_BYTES));
+    send_json(peer, json);
+    cJSON_Delete(json);
+}
+
+static void handle_group_frame(peer_t *peer, const unsigned char* frame, size_t len) {
+    group_key_id_t key_id;
+    uint64_t frame_id = group_frame_id(frame, len);
+    // 同一帧会经多位成员先后到达，已验证过的副本直接丢弃
+    if (group_frame_parse(frame, len, &key_id) != 0 || gossip_seen_contains(group_seen, frame_id)) return;
+    pk_id_t group_id = contact_store_resolve(key_id.group_id);
+    // 被移出的成员仍持有上一纪元的密钥，因此还要求发送者在当前成员列表中
+    if (group_id == PK_ID_NONE || !contact_store_is_group(group_id) || !contact_store_group_has_member(key_id.group_id, key_id.sender) ||
+        !contact_store_group_has_member(key_id.group_id, my_pk)) {
+        return;
+    }
+    const GroupSenderKey *key = group_key_acquire(&key_id);
+    if (!key) {
+        // 密钥包和消息经不同的路径传播，可能晚于消息到达。转发者能转发这一帧说明它持有密钥包，向它索取；
+        // 这一帧本身在密钥到达后由反熵补发
+        group_request_key(peer, &key_id);
+        return;
+    }
+    unsigned char *plain = malloc(len - GROUP_FRAME_OVERHEAD + 1);
+    size_t plain_len = 0;
+    int rc = plain ? group_frame_open(key, frame, len, plain, &plain_len) : -1;
+    group_keyring_release(group_keys, key);
+    if (rc == 0) {
+        plain[plain_len] = '\0';
+        gossip_seen_add(group_seen, frame_id);
+        if (handle_group_chat(group_id, key_id.sender, (const char*)plain, frame, len) == 1) {
+            // 第一次收到：转发给少数随机成员（不回传给来源和发送者）
+            unsigned char members[GROUP_MAX_MEMBERS][PK_BYTES];
+            int count = contact_store_group_roster(key_id.group_id, members, GROUP_MAX_MEMBERS);
+            if (count > 0) {
+                group_gossip_frame((const unsigned char (*)[PK_BYTES])members, count, frame, len, peer->pk, key_id.sender, GROUP_GOSSIP_FANOUT);
             }
-            line = next_line + 1;
         }
-        len = strlen(line);
-        memmove(buffer, line, len + 1);
     }
-    log_msg("[系统] 与引导服务器的连接已断开。");
-    close(server_sockfd);
-    return NULL;
+    free(plain);
 }
 
-static void connect_to_peer(const char *pk_hex, const char *ip, int port) {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) return;
-    struct sockaddr_in peer_addr = {0};
-    peer_addr.sin_family = AF_INET;
-    peer_addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, ip, &peer_addr.sin_addr) <= 0) {
-        close(sockfd);
+/**
+ * 收到群状态：对方必须是本地已知成员列表中的成员；未知的群只接受好友发来、把自己和对方都列为成员的邀请，
+ * 每位好友拉本机进新群的次数受 group_invite_allowed 限制。
+ * 纪元更大，或纪元相同而成员列表摘要更大（双方同时修改成员时以此收敛）的状态才会被应用。
+ * 应用前先转发给新列表中其他在线的成员；旧状态不会被再次应用，转发因此会终止。
+ */
+static void handle_group_update(peer_t *peer, cJSON *json) {
+    cJSON *group = cJSON_GetObjectItem(json, "group");
+    cJSON *name = cJSON_GetObjectItem(json, "name");
+    cJSON *epoch_item = cJSON_GetObjectItem(json, "epoch");
+    cJSON *list = cJSON_GetObjectItem(json, "members");
+    unsigned char gid[GROUP_ID_BYTES];
+    if (!cJSON_IsString(group) || pk_from_hex(group->valuestring, gid) != 0 || !cJSON_IsNumber(epoch_item) ||
+        epoch_item->valuedouble < 1 || epoch_item->valuedouble >= UINT32_MAX || !cJSON_IsArray(list) || cJSON_GetArraySize(list) > GROUP_MAX_MEMBERS) {
         return;
     }
-    if (connect(sockfd, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) < 0) {
-        close(sockfd);
+    uint32_t epoch = (uint32_t)epoch_item->valuedouble;
+    unsigned char members[GROUP_MAX_MEMBERS][PK_BYTES], digest[GROUP_DIGEST_BYTES];
+    int count = 0;
+    cJSON *item;
+    cJSON_ArrayForEach(item, list) {
+        if (!cJSON_IsString(item) || pk_from_hex(item->valuestring, members[count]) != 0) return;
+        count++;
+    }
+    count = (int)group_roster_normalize(members, (size_t)count, digest);
+    const unsigned char (*roster)[PK_BYTES] = (const unsigned char (*)[PK_BYTES])members;
+
+    pthread_mutex_lock(&group_mutex);
+    uint32_t local_epoch = 0;
+    unsigned char local_digest[GROUP_DIGEST_BYTES];
+    int known = contact_store_group_state(gid, &local_epoch, local_digest) == 0;
+    int authorized = known ? contact_store_group_has_member(gid, peer->pk)
+                           : roster_contains(roster, count, peer->pk) && roster_contains(roster, count, my_pk);
+    int newer = !known || epoch > local_epoch || (epoch == local_epoch && memcmp(digest, local_digest, GROUP_DIGEST_BYTES) > 0);
+    int was_member = known && contact_store_group_has_member(gid, my_pk);
+    if (!known && authorized && newer) {
+        if (!contact_store_contains(peer->id)) authorized = 0;
+        else if (!group_invite_allowed(peer->id)) {
+            pthread_mutex_unlock(&group_mutex);
+            log_msg("[群聊] 已忽略 %s 发来的新群邀请（过于频繁）。", get_friend_name(peer->id));
+            return;
+        }
+    }
+    int accepted = authorized && newer && (known || group_register(gid, cJSON_IsString(name) ? name->valuestring : NULL) == 0);
+    if (accepted) group_send_json(roster, count, json, peer->pk);
+    int applied = accepted && group_apply_roster(gid, epoch, digest, roster, count) == 0;
+    pthread_mutex_unlock(&group_mutex);
+    if (!applied) return;
+
+    const char *group_name = get_friend_name(pk_intern(gid));
+    int is_member = roster_contains(roster, count, my_pk);
+    if (!was_member && is_member) log_msg("[群聊] %s 邀请你加入了群 %s（%d 位成员）。", get_friend_name(peer->id), group_name, count);
+    else if (was_member && !is_member) log_msg("[群聊] 你已被移出群 %s。", group_name);
+    else log_msg("[群聊] 群 %s 的成员已更新，现有 %d 位成员。", group_name, count);
+}
+
+/**
+ * 收到密钥包：转发者和发送者都必须是当前成员，且纪元不早于上一纪元（更早的已被丢弃）。
+ * 打开属于自己的一份并保存；第一次收到（或内容有变化）时原样转发给其他在线成员，与发送者不直接相连的成员由此拿到密钥。
+ */
+static void handle_group_key(peer_t *peer, cJSON *json) {
+    cJSON *group = cJSON_GetObjectItem(json, "group");
+    cJSON *epoch_item = cJSON_GetObjectItem(json, "epoch");
+    cJSON *sender_item = cJSON_GetObjectItem(json, "sender");
+    cJSON *boxes = cJSON_GetObjectItem(json, "boxes");
+    unsigned char gid[GROUP_ID_BYTES], sender[PK_BYTES], digest[GROUP_DIGEST_BYTES];
+    uint32_t local_epoch;
+    if (!cJSON_IsString(group) || pk_from_hex(group->valuestring, gid) != 0 || !cJSON_IsNumber(epoch_item) ||
+        epoch_item->valuedouble < 1 || epoch_item->valuedouble >= UINT32_MAX || !cJSON_IsString(sender_item) ||
+        pk_from_hex(sender_item->valuestring, sender) != 0 || !cJSON_IsArray(boxes) || memcmp(sender, my_pk, PK_BYTES) == 0) {
         return;
     }
-    send(sockfd, my_pk, sizeof(my_pk), 0);
-    peer_t *new_peer = (peer_t*)malloc(sizeof(peer_t));
-    new_peer->sockfd = sockfd;
-    strcpy(new_peer->ip, ip);
-    new_peer->port = port;
-    sodium_hex2bin(new_peer->pk, sizeof(new_peer->pk), pk_hex, strlen(pk_hex), NULL, NULL, NULL);
-    if (crypto_box_beforenm(new_peer->shared_key, new_peer->pk, my_sk) != 0) {
-        close(sockfd);
-        free(new_peer);
+    uint32_t epoch = (uint32_t)epoch_item->valuedouble;
+    if (contact_store_group_state(gid, &local_epoch, digest) != 0 || epoch + 1 < local_epoch || !contact_store_group_has_member(gid, peer->pk) ||
+        !contact_store_group_has_member(gid, sender) || !contact_store_group_has_member(gid, my_pk)) {
         return;
     }
-    new_peer->key_exchanged = 1;
-    pthread_create(&new_peer->recv_tid, NULL, receive_from_peer, new_peer);
-    pthread_detach(new_peer->recv_tid);
-    add_peer(new_peer);
+    char my_hex[PK_HEX_LEN + 1];
+    unsigned char box[GROUP_KEY_BOX_BYTES], plain[GROUP_KEY_PLAIN_BYTES];
+    size_t box_len = 0;
+    int found = 0;
+    sodium_bin2hex(my_hex, sizeof(my_hex), my_pk, PK_BYTES);
+    cJSON *entry;
+    cJSON_ArrayForEach(entry, boxes) {
+        cJSON *to = cJSON_GetArrayItem(entry, 0), *data = cJSON_GetArrayItem(entry, 1);
+        if (!cJSON_IsString(to) || !cJSON_IsString(data) || strcmp(to->valuestring, my_hex) != 0) continue;
+        found = sodium_hex2bin(box, sizeof(box), data->valuestring, strlen(data->valuestring), NULL, &box_len, NULL) == 0 && box_len == sizeof(box);
+        break;
+    }
+    if (!found) return;
+    const PeerKey *link = peer_key_acquire(key_cache, sender);
+    peer_box_frame_t frame = { .in = box, .in_len = box_len, .out = plain };
+    int opened = link && peer_box_open_batch(link, &frame, 1) == 1 && frame.out_len == sizeof(plain);
+    peer_key_release(key_cache, link);
+    if (opened) {
+        group_key_id_t key_id;
+        group_key_material_t material = {0};
+        memcpy(material.key, plain, GROUP_KEY_BYTES);
+        memcpy(material.sign_pk, plain + GROUP_KEY_BYTES, GROUP_SIGN_PK_BYTES);
+        group_key_id_set(&key_id, gid, epoch, sender);
+        char *text = cJSON_PrintUnformatted(json);
+        if (text && contact_store_group_key_save(&key_id, &material) == 0) {
+            group_keyring_release(group_keys, group_keyring_put(group_keys, &key_id, &material));
+            if (contact_store_group_bundle_save(&key_id, text) == 1) {
+                unsigned char members[GROUP_MAX_MEMBERS][PK_BYTES];
+                int count = contact_store_group_roster(gid, members, GROUP_MAX_MEMBERS);
+                if (count > 0) group_send_json((const unsigned char (*)[PK_BYTES])members, count, json, peer->pk);
+            }
+        }
+        free(text);
+        sodium_memzero(&material, sizeof(material));
+    }
+    sodium_memzero(plain, sizeof(plain));
 }
 
-int connect_and_listen(const char* server_ip, int server_port, int p2p_port) {
-    pthread_t p2p_tid, server_tid;
-    int *p2p_port_ptr = malloc(sizeof(int)); *p2p_port_ptr = p2p_port;
-    pthread_create(&p2p_tid, NULL, p2p_listener, p2p_port_ptr);
-    pthread_detach(p2p_tid);
-    pthread_mutex_lock(&port_mutex);
-    while (!port_ready) {
-        pthread_cond_wait(&port_cond, &port_mutex);
+/**
+ * 对端缺少某位成员的密钥：回复保存的密钥包（不限于自己的，转发来的也可以）。
+ */
+static void handle_group_key_want(peer_t *peer, cJSON *json) {
+    cJSON *group = cJSON_GetObjectItem(json, "group");
+    cJSON *epoch_item = cJSON_GetObjectItem(json, "epoch");
+    cJSON *sender_item = cJSON_GetObjectItem(json, "sender");
+    unsigned char gid[GROUP_ID_BYTES], sender[PK_BYTES];
+    if (!cJSON_IsString(group) || pk_from_hex(group->valuestring, gid) != 0 || !cJSON_IsNumber(epoch_item) ||
+        epoch_item->valuedouble < 1 || epoch_item->valuedouble >= UINT32_MAX || !cJSON_IsString(sender_item) ||
+        pk_from_hex(sender_item->valuestring, sender) != 0 || !contact_store_group_has_member(gid, peer->pk)) {
+        return;
     }
-    pthread_mutex_unlock(&port_mutex);
-    int server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(server_port);
-    inet_pton(AF_INET, server_ip, &serv_addr.sin_addr);
-    if (connect(server_sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        log_msg("[致命错误] 连接引导服务器失败: %s", strerror(errno));
-        return -1;
+    group_key_id_t key_id;
+    group_key_id_set(&key_id, gid, (uint32_t)epoch_item->valuedouble, sender);
+    group_send_bundle(peer, peer->id, &key_id);
+}
+
+// --- 群消息反熵 ---
+typedef struct {
+    sqlite3_int64 bucket, cnt, sum_hkey, sum_hlow;
+} group_bucket_t;
+
+#define GROUP_DIGEST_MAX_BUCKETS (GROUP_FRAME_RETENTION + 24) // 留出时钟偏差产生的“未来”桶
+#define GROUP_OUTBOX_MAX_BYTES (1024 * 1024)  // 一次补发收集的帧字节数上限，其余留给下一轮反熵
+
+static sqlite3_int64 group_frame_window_start() {
+    return (sqlite3_int64)((uint64_t)time(NULL) * 1000 / GROUP_FRAME_BUCKET_MS) - GROUP_FRAME_RETENTION + 1;
+}
+
+/**
+ * 读取保留窗口内各桶的条数与 hkey、hlow 之和。调用者需持有分片。
+ * @return 桶数（按桶号升序）。
+ */
+static int group_load_buckets(chat_db_t* cdb, sqlite3_int64 since, group_bucket_t* out, int max) {
+    int n = 0;
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, "SELECT bucket, COUNT(*), SUM(hkey), SUM(hlow) FROM group_frames WHERE bucket >= ?1 "
+                                              "GROUP BY bucket ORDER BY bucket LIMIT ?2;");
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, since);
+        sqlite3_bind_int(stmt, 2, max);
+        while (n < max && sqlite3_step(stmt) == SQLITE_ROW) {
+            out[n].bucket = sqlite3_column_int64(stmt, 0);
+            out[n].cnt = sqlite3_column_int64(stmt, 1);
+            out[n].sum_hkey = sqlite3_column_int64(stmt, 2);
+            out[n].sum_hlow = sqlite3_column_int64(stmt, 3);
+            n++;
+        }
     }
-    log_msg("[系统] 已连接到引导服务器。");
-    char registration_msg[PK_HEX_LEN + 20];
-    char my_pk_hex_local[PK_HEX_LEN + 1];
-    sodium_bin2hex(my_pk_hex_local, sizeof(my_pk_hex_local), my_pk, sizeof(my_pk));
-    sprintf(registration_msg, "%s %d\n", my_pk_hex_local, my_p2p_port);
-    send(server_sockfd, registration_msg, strlen(registration_msg), 0);
-    int *server_sockfd_ptr = malloc(sizeof(int)); *server_sockfd_ptr = server_sockfd;
-    pthread_create(&server_tid, NULL, server_handler, server_sockfd_ptr);
-    pthread_detach(server_tid);
-    return 0;
+    sqlite3_finalize(stmt);
+    return n;
 }
 
-void request_chat_sync(const char* friend_pk_hex) {
-    if (!friend_pk_hex) return;
-    unsigned char target_pk[crypto_box_PUBLICKEYBYTES];
-    sodium_hex2bin(target_pk, sizeof(target_pk), friend_pk_hex, strlen(friend_pk_hex), NULL, NULL, NULL);
+/**
+ * 删除保留窗口之外的帧，并把窗口内各桶的摘要 (group_digest) 发给对端。
+ */
+static void group_send_digest(const unsigned char gid[GROUP_ID_BYTES], pk_id_t peer_id) {
+    chat_db_t *cdb = chat_db_acquire(pk_intern(gid));
+    if (!cdb) return;
+    sqlite3_int64 since = group_frame_window_start();
+    char *sql = sqlite3_mprintf("DELETE FROM group_frames WHERE bucket < %lld;", since);
+    chat_db_exec(cdb, sql);
+    sqlite3_free(sql);
+    group_bucket_t buckets[GROUP_DIGEST_MAX_BUCKETS];
+    int n = group_load_buckets(cdb, since, buckets, GROUP_DIGEST_MAX_BUCKETS);
+    chat_db_release(cdb);
 
-    int sockfd = -1;
-    unsigned char shared_key[crypto_box_BEFORENMBYTES];
+    char hex[PK_HEX_LEN + 1];
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "group_digest");
+    cJSON_AddStringToObject(json, "group", sodium_bin2hex(hex, sizeof(hex), gid, GROUP_ID_BYTES));
+    cJSON_AddNumberToObject(json, "since", (double)since);
+    cJSON *list = cJSON_AddArrayToObject(json, "buckets");
+    for (int i = 0; i < n; i++) {
+        cJSON *entry = cJSON_CreateArray();
+        cJSON_AddItemToArray(entry, cJSON_CreateNumber((double)buckets[i].bucket));
+        cJSON_AddItemToArray(entry, cJSON_CreateNumber((double)buckets[i].cnt));
+        cJSON_AddItemToArray(entry, cJSON_CreateNumber((double)buckets[i].sum_hkey));
+        cJSON_AddItemToArray(entry, cJSON_CreateNumber((double)buckets[i].sum_hlow));
+        cJSON_AddItemToArray(list, entry);
+    }
+    send_json_to(peer_id, json);
+    cJSON_Delete(json);
+}
 
-    pthread_mutex_lock(&peers_mutex);
-    for (int i = 0; i < MAX_PEERS; i++) {
-        if (peers[i] && peers[i]->key_exchanged && sodium_compare(peers[i]->pk, target_pk, sizeof(target_pk)) == 0) {
-            sockfd = peers[i]->sockfd;
-            memcpy(shared_key, peers[i]->shared_key, sizeof(shared_key));
-            break; 
+/**
+ * 反熵补发的帧先在分片锁内收集到这里 ([长度 u32][帧]...)，释放分片之后再发送，
+ * 慢速链路因此不会让界面对这个群的读写排在网络写入后面。
+ */
+typedef struct {
+    unsigned char *data;
+    size_t len, cap;
+} group_outbox_t;
+
+/**
+ * @return 已收集的字节数达到 GROUP_OUTBOX_MAX_BYTES 或内存不足时返回 -1，调用者停止收集。
+ */
+static int group_outbox_add(group_outbox_t* box, const void* frame, size_t len) {
+    if (box->len + 4 + len > GROUP_OUTBOX_MAX_BYTES && box->len > 0) return -1;
+    if (box->len + 4 + len > box->cap) {
+        size_t cap = box->cap ? box->cap * 2 : 16 * 1024;
+        while (cap < box->len + 4 + len) cap *= 2;
+        unsigned char *grown = realloc(box->data, cap);
+        if (!grown) return -1;
+        box->data = grown;
+        box->cap = cap;
+    }
+    memcpy(box->data + box->len, &(uint32_t){ (uint32_t)len }, 4);
+    memcpy(box->data + box->len + 4, frame, len);
+    box->len += 4 + len;
+    return 0;
+}
+
+/**
+ * 以大块优先级发出收集的帧并释放。调用者不持有任何分片。
+ */
+static void group_outbox_flush(group_outbox_t* box, peer_t* peer) {
+    for (size_t pos = 0; pos < box->len;) {
+        uint32_t len;
+        memcpy(&len, box->data + pos, 4);
+        group_send_frame(peer, LINK_PRIO_BULK, box->data + pos + 4, len);
+        pos += 4 + len;
+    }
+    free(box->data);
+    memset(box, 0, sizeof(*box));
+}
+
+/**
+ * 一个桶内本地帧的 uid 列表 (group_uids)；超过 GROUP_ENTROPY_MAX_UIDS 的部分留给下一轮。调用者需持有分片。
+ */
+static cJSON* group_build_uids(chat_db_t* cdb, const char* group_hex, sqlite3_int64 bucket) {
+    char uid_hex[MSG_UID_HEX_LEN + 1];
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "group_uids");
+    cJSON_AddStringToObject(json, "group", group_hex);
+    cJSON_AddNumberToObject(json, "bucket", (double)bucket);
+    cJSON *list = cJSON_AddArrayToObject(json, "uids");
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, "SELECT message_uid FROM group_frames WHERE bucket = ?1 ORDER BY message_uid LIMIT ?2;");
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, bucket);
+        sqlite3_bind_int(stmt, 2, GROUP_ENTROPY_MAX_UIDS);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (sqlite3_column_bytes(stmt, 0) != MSG_UID_BYTES) continue;
+            uid_to_hex(sqlite3_column_blob(stmt, 0), uid_hex);
+            cJSON_AddItemToArray(list, cJSON_CreateString(uid_hex));
         }
     }
-    pthread_mutex_unlock(&peers_mutex);
+    sqlite3_finalize(stmt);
+    return json;
+}
 
-    if (sockfd != -1) {
-        cJSON* local_clock = db_get_vector_clock(friend_pk_hex);
-        char* local_clock_str = cJSON_PrintUnformatted(local_clock);
-        cJSON *json = cJSON_CreateObject();
-        cJSON_AddStringToObject(json, "type", "sync_request");
-        cJSON_AddStringToObject(json, "vector_clock", local_clock_str);
-        char *json_string = cJSON_PrintUnformatted(json);
-        
-        send_encrypted(sockfd, shared_key, json_string);
-        
-        cJSON_Delete(json);
-        free(json_string);
-        cJSON_Delete(local_clock);
-        free(local_clock_str);
-        log_msg("[同步] 已向 %s 发送同步请求...", get_friend_name_by_hex(friend_pk_hex));
-    } else {
-        log_msg("[同步] 无法发送请求: %s 不在线。", get_friend_name_by_hex(friend_pk_hex));
+/**
+ * 反熵报文共用的检查：群已知、对端和自己都是当前成员。
+ * @return 群会话的驻留 id；不满足时返回 PK_ID_NONE。
+ */
+static pk_id_t group_entropy_target(peer_t* peer, cJSON* json, unsigned char gid[GROUP_ID_BYTES]) {
+    cJSON *group = cJSON_GetObjectItem(json, "group");
+    if (!cJSON_IsString(group) || pk_from_hex(group->valuestring, gid) != 0) return PK_ID_NONE;
+    pk_id_t group_id = contact_store_resolve(gid);
+    if (group_id == PK_ID_NONE || !contact_store_is_group(group_id) || !contact_store_group_has_member(gid, peer->pk) ||
+        !contact_store_group_has_member(gid, my_pk)) {
+        return PK_ID_NONE;
     }
+    return group_id;
 }
 
-static void handle_sync_request(peer_t *peer, cJSON *json) {
-    cJSON *remote_clock_item = cJSON_GetObjectItem(json, "vector_clock");
-    if (!cJSON_IsString(remote_clock_item)) return;
-    cJSON* remote_clock = cJSON_Parse(remote_clock_item->valuestring);
-    if (!remote_clock) return;
+/**
+ * 收到对端的桶摘要：对两边不一致或只有一边有的桶，回复本地的 uid 列表（本地没有时为空列表）。
+ */
+static void handle_group_digest(peer_t *peer, cJSON *json) {
+    unsigned char gid[GROUP_ID_BYTES];
+    cJSON *since_item = cJSON_GetObjectItem(json, "since");
+    cJSON *list = cJSON_GetObjectItem(json, "buckets");
+    pk_id_t group_id = group_entropy_target(peer, json, gid);
+    if (group_id == PK_ID_NONE || !cJSON_IsNumber(since_item) || !cJSON_IsArray(list)) return;
+    chat_db_t *cdb = chat_db_acquire(group_id);
+    if (!cdb) return;
+    // 只比较双方窗口的交集，避免因为两边时钟相差而反复补发窗口边缘的帧
+    sqlite3_int64 since = group_frame_window_start();
+    if ((sqlite3_int64)since_item->valuedouble > since) since = (sqlite3_int64)since_item->valuedouble;
+    group_bucket_t local[GROUP_DIGEST_MAX_BUCKETS];
+    int n = group_load_buckets(cdb, since, local, GROUP_DIGEST_MAX_BUCKETS);
+    int matched[GROUP_DIGEST_MAX_BUCKETS] = {0};
+    char hex[PK_HEX_LEN + 1];
+    sodium_bin2hex(hex, sizeof(hex), gid, GROUP_ID_BYTES);
+    // 回复在释放分片之后发送
+    cJSON *replies_out[GROUP_DIGEST_MAX_BUCKETS];
+    int replies = 0;
+    cJSON *entry;
+    cJSON_ArrayForEach(entry, list) {
+        if (replies >= GROUP_DIGEST_MAX_BUCKETS) break;
+        if (!cJSON_IsArray(entry) || cJSON_GetArraySize(entry) != 4) continue;
+        group_bucket_t remote = {
+            (sqlite3_int64)cJSON_GetArrayItem(entry, 0)->valuedouble, (sqlite3_int64)cJSON_GetArrayItem(entry, 1)->valuedouble,
+            (sqlite3_int64)cJSON_GetArrayItem(entry, 2)->valuedouble, (sqlite3_int64)cJSON_GetArrayItem(entry, 3)->valuedouble
+        };
+        if (remote.bucket < since) continue;
+        int i = 0;
+        while (i < n && local[i].bucket != remote.bucket) i++;
+        if (i < n) {
+            matched[i] = 1;
+            if (local[i].cnt == remote.cnt && local[i].sum_hkey == remote.sum_hkey && local[i].sum_hlow == remote.sum_hlow) continue;
+        }
+        replies_out[replies++] = group_build_uids(cdb, hex, remote.bucket);
+    }
+    for (int i = 0; i < n && replies < GROUP_DIGEST_MAX_BUCKETS; i++) {
+        if (matched[i]) continue;
+        replies_out[replies++] = group_build_uids(cdb, hex, local[i].bucket);
+    }
+    chat_db_release(cdb);
+    for (int i = 0; i < replies; i++) {
+        send_json(peer, replies_out[i]);
+        cJSON_Delete(replies_out[i]);
+    }
+}
 
-    char peer_pk_hex[PK_HEX_LEN + 1];
-    sodium_bin2hex(peer_pk_hex, sizeof(peer_pk_hex), peer->pk, sizeof(peer->pk));
+static int compare_uid(const void* a, const void* b) {
+    return memcmp(a, b, MSG_UID_BYTES);
+}
 
-    cJSON *response = cJSON_CreateObject();
-    cJSON_AddStringToObject(response, "type", "sync_response");
-    cJSON *messages_to_send = cJSON_CreateArray();
-    cJSON_AddItemToObject(response, "messages", messages_to_send);
+/**
+ * 读取报文中的 uid 列表，排序后便于二分查找。
+ * @return 有效的 uid 数。
+ */
+static int group_parse_uids(cJSON* list, unsigned char (*out)[MSG_UID_BYTES], int max) {
+    int n = 0;
+    cJSON *item;
+    cJSON_ArrayForEach(item, list) {
+        if (n >= max) break;
+        if (cJSON_IsString(item) && uid_from_hex(item->valuestring, out[n]) == 0) n++;
+    }
+    qsort(out, (size_t)n, MSG_UID_BYTES, compare_uid);
+    return n;
+}
 
-    pthread_mutex_lock(&db_mutex);
-    char* sql = sqlite3_mprintf("SELECT sender_pk, vector_clock, content, message_uid, timestamp FROM messages WHERE chat_id = '%q';", peer_pk_hex);
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+/**
+ * 收到对端一个桶的 uid 列表：把本地有而对端没有的帧推给对端，对本地缺少的 uid 发出 group_want。
+ */
+static void handle_group_uids(peer_t *peer, cJSON *json) {
+    unsigned char gid[GROUP_ID_BYTES];
+    cJSON *bucket_item = cJSON_GetObjectItem(json, "bucket");
+    cJSON *list = cJSON_GetObjectItem(json, "uids");
+    pk_id_t group_id = group_entropy_target(peer, json, gid);
+    if (group_id == PK_ID_NONE || !cJSON_IsNumber(bucket_item) || !cJSON_IsArray(list)) return;
+    unsigned char (*remote)[MSG_UID_BYTES] = malloc(2 * GROUP_ENTROPY_MAX_UIDS * MSG_UID_BYTES);
+    if (!remote) return;
+    unsigned char (*local)[MSG_UID_BYTES] = remote + GROUP_ENTROPY_MAX_UIDS;
+    int remote_count = group_parse_uids(list, remote, GROUP_ENTROPY_MAX_UIDS), local_count = 0;
+    chat_db_t *cdb = chat_db_acquire(group_id);
+    if (!cdb) {
+        free(remote);
+        return;
+    }
+    group_outbox_t outbox = {0};
+    int full = 0;
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, "SELECT message_uid, frame FROM group_frames WHERE bucket = ?1 ORDER BY message_uid LIMIT ?2;");
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)bucket_item->valuedouble);
+        sqlite3_bind_int(stmt, 2, GROUP_ENTROPY_MAX_UIDS);
         while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const char *sender_pk = (const char*)sqlite3_column_text(stmt, 0);
-            const char *msg_vc_str = (const char*)sqlite3_column_text(stmt, 1);
-            if (!msg_vc_str || msg_vc_str[0] == '\0') continue;
-            cJSON* msg_vc = cJSON_Parse(msg_vc_str);
-            if (!msg_vc) continue;
-            cJSON* msg_sender_entry = cJSON_GetObjectItem(msg_vc, sender_pk);
-            if (!cJSON_IsNumber(msg_sender_entry)) {
-                cJSON_Delete(msg_vc);
-                continue;
-            }
-            cJSON* remote_sender_entry = cJSON_GetObjectItem(remote_clock, sender_pk);
-            if (!remote_sender_entry || msg_sender_entry->valuedouble > cJSON_GetNumberValue(remote_sender_entry)) {
-                 cJSON *msg_obj = cJSON_CreateObject();
-                 cJSON_AddStringToObject(msg_obj, "uid", (const char*)sqlite3_column_text(stmt, 3));
-                 cJSON_AddStringToObject(msg_obj, "sender_pk", sender_pk);
-                 cJSON_AddStringToObject(msg_obj, "content", (const char*)sqlite3_column_text(stmt, 2));
-                 cJSON_AddNumberToObject(msg_obj, "timestamp", sqlite3_column_int64(stmt, 4));
-                 cJSON_AddStringToObject(msg_obj, "vector_clock", msg_vc_str);
-                 cJSON_AddItemToArray(messages_to_send, msg_obj);
-            }
-            cJSON_Delete(msg_vc);
+            if (sqlite3_column_bytes(stmt, 0) != MSG_UID_BYTES) continue;
+            const unsigned char *uid = sqlite3_column_blob(stmt, 0);
+            memcpy(local[local_count++], uid, MSG_UID_BYTES);
+            if (full || (remote_count > 0 && bsearch(uid, remote, (size_t)remote_count, MSG_UID_BYTES, compare_uid))) continue;
+            full = group_outbox_add(&outbox, sqlite3_column_blob(stmt, 1), (size_t)sqlite3_column_bytes(stmt, 1)) != 0;
         }
     }
     sqlite3_finalize(stmt);
-    sqlite3_free(sql);
-    pthread_mutex_unlock(&db_mutex);
+    chat_db_release(cdb);
+    group_outbox_flush(&outbox, peer);
 
-    if (cJSON_GetArraySize(messages_to_send) > 0) {
-        char *response_str = cJSON_PrintUnformatted(response);
-        send_encrypted(peer->sockfd, peer->shared_key, response_str);
-        free(response_str);
-        log_msg("[同步] 向 %s 发送了 %d 条缺失的消息。", get_friend_name(peer->pk), cJSON_GetArraySize(messages_to_send));
+    char uid_hex[MSG_UID_HEX_LEN + 1];
+    cJSON *want = cJSON_CreateObject();
+    cJSON_AddStringToObject(want, "type", "group_want");
+    cJSON_AddItemToObject(want, "group", cJSON_CreateString(cJSON_GetObjectItem(json, "group")->valuestring));
+    cJSON *uids = cJSON_AddArrayToObject(want, "uids");
+    for (int i = 0; i < remote_count; i++) {
+        if (local_count > 0 && bsearch(remote[i], local, (size_t)local_count, MSG_UID_BYTES, compare_uid)) continue;
+        uid_to_hex(remote[i], uid_hex);
+        cJSON_AddItemToArray(uids, cJSON_CreateString(uid_hex));
     }
+    if (cJSON_GetArraySize(uids) > 0) send_json(peer, want);
+    cJSON_Delete(want);
+    free(remote);
+}
 
-    cJSON_Delete(response);
-    cJSON_Delete(remote_clock);
+/**
+ * 对端索取指定的帧。
+ */
+static void handle_group_want(peer_t *peer, cJSON *json) {
+    unsigned char gid[GROUP_ID_BYTES];
+    cJSON *list = cJSON_GetObjectItem(json, "uids");
+    pk_id_t group_id = group_entropy_target(peer, json, gid);
+    if (group_id == PK_ID_NONE || !cJSON_IsArray(list)) return;
+    chat_db_t *cdb = chat_db_acquire(group_id);
+    if (!cdb) return;
+    group_outbox_t outbox = {0};
+    sqlite3_stmt *stmt = chat_db_prepare(cdb, "SELECT frame FROM group_frames WHERE message_uid = ?1;");
+    int sent = 0;
+    cJSON *item;
+    cJSON_ArrayForEach(item, list) {
+        unsigned char uid[MSG_UID_BYTES];
+        if (!stmt || sent >= GROUP_ENTROPY_MAX_UIDS) break;
+        if (!cJSON_IsString(item) || uid_from_hex(item->valuestring, uid) != 0) continue;
+        sqlite3_bind_blob(stmt, 1, uid, MSG_UID_BYTES, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (group_outbox_add(&outbox, sqlite3_column_blob(stmt, 0), (size_t)sqlite3_column_bytes(stmt, 0)) != 0) break;
+            sent++;
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    chat_db_release(cdb);
+    group_outbox_flush(&outbox, peer);
 }
 
-static void handle_sync_response(cJSON *json) {
-    cJSON *messages = cJSON_GetObjectItem(json, "messages");
-    if(!messages) return;
+/**
+ * 一轮反熵：轮流挑选自己所在的一个群，再从在线的成员中随机挑一位交换摘要。
+ */
+static void group_entropy_round() {
+    static unsigned next_group = 0;
+    unsigned char groups[GROUP_SHARED_MAX][PK_BYTES];
+    int n = contact_store_groups_of(my_pk, groups, GROUP_SHARED_MAX);
+    if (n <= 0) return;
+    const unsigned char *gid = groups[next_group++ % (unsigned)n];
+    unsigned char members[GROUP_MAX_MEMBERS][PK_BYTES];
+    int count = contact_store_group_roster(gid, members, GROUP_MAX_MEMBERS);
+    pk_id_t online[MAX_PEERS];
+    uint32_t m = 0;
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peers[i] && peers[i]->key_exchanged && roster_contains((const unsigned char (*)[PK_BYTES])members, count, peers[i]->pk)) {
+            online[m++] = peers[i]->id;
+        }
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    if (m > 0) group_send_digest(gid, online[randombytes_uniform(m)]);
+}
 
-    cJSON *msg_item;
-    int new_messages = 0;
-    cJSON_ArrayForEach(msg_item, messages) {
-        cJSON *uid = cJSON_GetObjectItem(msg_item, "uid");
-        cJSON *sender_pk = cJSON_GetObjectItem(msg_item, "sender_pk");
-        cJSON *content = cJSON_GetObjectItem(msg_item, "content");
-        cJSON *vc_str_item = cJSON_GetObjectItem(msg_item, "vector_clock");
+static void *group_entropy_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&entropy_mutex);
+    while (entropy_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += GROUP_ENTROPY_INTERVAL;
+        pthread_cond_timedwait(&entropy_cond, &entropy_mutex, &deadline);
+        if (!entropy_running) break;
+        pthread_mutex_unlock(&entropy_mutex);
+        group_entropy_round();
+        pthread_mutex_lock(&entropy_mutex);
+    }
+    pthread_mutex_unlock(&entropy_mutex);
+    return NULL;
+}
 
-        if (cJSON_IsString(uid) && cJSON_IsString(sender_pk) && cJSON_IsString(content) && cJSON_IsString(vc_str_item)) {
-            char my_pk_hex_local[PK_HEX_LEN+1];
-            sodium_bin2hex(my_pk_hex_local, sizeof(my_pk_hex_local), my_pk, sizeof(my_pk));
-            const char* chat_id = strcmp(sender_pk->valuestring, my_pk_hex_local) == 0 ? chat_target_pk_hex : sender_pk->valuestring;
-            db_save_message(uid->valuestring, chat_id, sender_pk->valuestring, content->valuestring, vc_str_item->valuestring);
-            cJSON* remote_clock = cJSON_Parse(vc_str_item->valuestring);
-            if (remote_clock) {
-                cJSON* local_clock = db_get_vector_clock(chat_id);
-                vc_merge(local_clock, remote_clock);
-                db_save_vector_clock(chat_id, local_clock);
-                cJSON_Delete(local_clock);
-                cJSON_Delete(remote_clock);
-            }
-            new_messages++;
+static int group_entropy_start() {
+    pthread_mutex_lock(&entropy_mutex);
+    int rc = 0;
+    if (!entropy_running) {
+        entropy_running = 1;
+        if (pthread_create(&entropy_tid, NULL, group_entropy_thread, NULL) != 0) {
+            entropy_running = 0;
+            rc = -1;
         }
     }
-    if (new_messages > 0) {
-        log_msg("[同步] 收到 %d 条历史消息。", new_messages);
+    pthread_mutex_unlock(&entropy_mutex);
+    return rc;
+}
+
+static void group_entropy_stop() {
+    pthread_mutex_lock(&entropy_mutex);
+    int was_running = entropy_running;
+    entropy_running = 0;
+    pthread_cond_signal(&entropy_cond);
+    pthread_mutex_unlock(&entropy_mutex);
+    if (was_running) pthread_join(entropy_tid, NULL);
+}
+
+/**
+ * 好友上线时，把双方共同所在的每个群的状态和自己当前纪元的密钥包发给对方，
+ * 对方据此补上离线期间错过的成员变动和密钥轮换（已是最新的状态会被忽略）；随后立即做一次反熵，补上错过的消息。
+ */
+static void group_sync_with_peer(pk_id_t peer_id) {
+    const unsigned char *peer_pk = pk_bytes(peer_id);
+    if (!peer_pk) return;
+    unsigned char groups[GROUP_SHARED_MAX][PK_BYTES];
+    int n = contact_store_groups_of(peer_pk, groups, GROUP_SHARED_MAX);
+    for (int g = 0; g < n; g++) {
+        unsigned char members[GROUP_MAX_MEMBERS][PK_BYTES];
+        uint32_t epoch;
+        pthread_mutex_lock(&group_mutex);
+        int count = group_load(groups[g], &epoch, members);
+        int member = count > 0 && roster_contains((const unsigned char (*)[PK_BYTES])members, count, my_pk);
+        if (member) {
+            cJSON *json = group_update_json(groups[g], epoch, (const unsigned char (*)[PK_BYTES])members, count);
+            send_json_to(peer_id, json);
+            cJSON_Delete(json);
+            group_key_id_t key_id;
+            group_key_id_set(&key_id, groups[g], epoch, my_pk);
+            group_send_bundle(NULL, peer_id, &key_id);
+        }
+        pthread_mutex_unlock(&group_mutex);
+        if (member) group_send_digest(groups[g], peer_id);
     }
 }
 
 // --- 新增的设置接口实现 ---
 const char* get_my_public_key_hex() {
-    return my_pk_hex;
+    return pk_hex(my_id);
 }
 
 int get_my_p2p_port() {
     return my_p2p_port;
 }
 
+int get_peer_traffic(peer_traffic_t* out, int max) {
+    int n = 0;
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < MAX_PEERS && n < max; i++) {
+        peer_t *peer = peers[i];
+        if (!peer) continue;
+        out[n].id = peer->id;
+        out[n].relayed = peer->via != NULL;
+        out[n].bytes_out = peer->bytes_out;
+        out[n].bytes_in = peer->bytes_in;
+        out[n].frames_out = peer->frames_out;
+        out[n].frames_in = peer->frames_in;
+        n++;
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    return n;
+}
+
+/**
+ * 取指标快照前更新连接数与同步任务数。
+ */
+static void sample_metrics() {
+    int active = 0, queued = 0;
+    sync_scheduler_get_summary(&active, &queued);
+    metrics_gauge_set(METRIC_GAUGE_PEERS, get_online_peer_count());
+    metrics_gauge_set(METRIC_GAUGE_SYNC_ACTIVE, active);
+    metrics_gauge_set(METRIC_GAUGE_SYNC_QUEUED, queued);
+}
+
+void set_archive_age_days(int days) {
+    if (days < 0) days = 0;
+    archive_age_days = days;
+    char path[PATH_MAX];
+    FILE *fp = fopen(archive_age_path(path, sizeof(path)), "w");
+    if (!fp) {
+        log_msg("[系统] 警告: 无法保存归档设置: %s", strerror(errno));
+        return;
+    }
+    fprintf(fp, "%d\n", days);
+    fclose(fp);
+}
+
+int get_archive_age_days() {
+    return archive_age_days;
+}
+
+int is_peer_online(pk_id_t id) {
+    return peer_path(id) != PEER_PATH_NONE;
+}
+
 int get_online_peer_count() {
     int count = 0;
     pthread_mutex_lock(&peers_mutex);
@@ -13,17 +13,126 @@ int init_client_services(const char* exe_path);
 void shutdown_client_services();
 int connect_and_listen(const char* server_ip, int server_port, int p2p_port);
 void send_chat_message(const char* recipient_name, const char* message);
-void add_new_friend(const char* pk_hex, const char* name);
+void add_new_friend(const char* pk_hex_str, const char* name);
 void delete_friend_by_name(const char* name);
-friend_t** get_friends();
 int get_friend_count();
-void db_load_history(const char* chat_id);
 void log_msg(const char *format, ...);
-void request_chat_sync(const char* friend_pk_hex);
+void request_chat_sync(pk_id_t friend_id);
+
+// --- 事件输出：日志和新消息通知交给界面或无界面模式的控制接口，业务逻辑不持有任何界面状态 ---
+/**
+ * @struct client_events_t
+ * @brief 事件接收者。回调在网络线程等任意线程中调用，必须线程安全且不能阻塞。
+ */
+typedef struct {
+    void (*log)(const char* line);         ///< 一条日志
+    void (*chat_updated)(pk_id_t chat_id); ///< 会话写入了新消息，需要时用 read_chat_history 按游标读取
+} client_events_t;
+
+/**
+ * @brief 设置事件接收者（只保存指针，events 须一直有效）。NULL 表示日志输出到标准错误、丢弃新消息通知。
+ */
+void set_client_events(const client_events_t* events);
+
+// --- 聊天记录浏览 ---
+/**
+ * @brief 读到一条已格式化为显示文本的消息时的回调，id 为该会话中的行号。
+ */
+typedef void (*chat_line_fn)(void* ctx, sqlite3_int64 id, const char* line);
+
+/**
+ * @brief 以行号为游标分页读取聊天记录（包括已归档的消息），供聊天视图按需加载。
+ * @param cursor older 为真时读取行号小于 cursor 的消息（0 表示从最新一条开始），按行号降序回调；
+ *               否则读取行号大于 cursor 的消息，按行号升序回调。
+ * @return 读到的消息数，出错返回 -1。
+ */
+int read_chat_history(pk_id_t chat_id, sqlite3_int64 cursor, int older, int limit, chat_line_fn fn, void* ctx);
+
+// --- 单个会话的聊天记录维护（只操作该会话自己的数据库文件），成功返回 0 ---
+/**
+ * @brief 压缩、导出交给归档线程执行，完成或失败时写日志报告。
+ * @return 已安排返回 0，任务队列已满返回 -1。
+ */
+int compact_chat_history(pk_id_t chat_id);
+int export_chat_history(pk_id_t chat_id, const char* dest_path);
+int clear_chat_history(pk_id_t chat_id);
+
+// --- 历史归档：超过保留期的消息压缩存放，同步与历史记录仍可读取，但不参与搜索 ---
+/**
+ * @brief 让归档线程立即逐段归档该会话中所有超过保留期的消息（打开过的会话也会在空闲时归档），
+ *        完成后写日志报告归档条数。
+ * @return 已安排返回 0，任务队列已满返回 -1。
+ */
+int archive_chat_history(pk_id_t chat_id);
+void set_archive_age_days(int days); ///< 0 表示关闭归档；设置会持久化
+int get_archive_age_days();
+
+// --- 聊天记录搜索 ---
+#define SEARCH_SNIPPET_SIZE 256
+
+typedef struct {
+    sqlite3_int64 message_id;
+    pk_id_t sender_id;
+    sqlite3_int64 timestamp;
+    char snippet[SEARCH_SNIPPET_SIZE]; ///< 带【】高亮的摘要
+} search_hit_t;
+
+// search_chat_history 的 truncated 标志：结果可能不完整的原因
+#define SEARCH_TRUNCATED_SCAN 0x1     ///< 查询只含短词，只逐条匹配了最近的消息
+#define SEARCH_TRUNCATED_ARCHIVE 0x2  ///< 会话中有已归档的消息，它们不在搜索范围内
+
+/**
+ * @brief 在一个会话的聊天记录中全文搜索，结果按相关度排序（相同时较新的在前）。已归档的消息不在搜索范围内。
+ * @param query 以空格分隔的关键词，全部包含才算命中；不足 3 个字符的词只在最近的消息中逐条匹配。
+ * @param offset 跳过的结果数，用于翻页。
+ * @param truncated 可为 NULL；否则写入 SEARCH_TRUNCATED_* 标志的组合，没有遗漏时为 0。
+ * @return 写入 hits 的结果数（不超过 max_hits），出错返回 -1。
+ */
+int search_chat_history(pk_id_t chat_id, const char* query, int offset, search_hit_t* hits, int max_hits, int* truncated);
+
+// --- 群聊：群是特殊的联系人，与好友共用名字空间，send_chat_message 对群名同样适用 ---
+/**
+ * @brief 创建群，自己与 friend_names 中的好友为初始成员。
+ * @return 成功返回 0，失败返回 -1（原因已写入日志）。
+ */
+int create_group(const char* name, const char* const* friend_names, int count);
+int invite_to_group(pk_id_t group_id, const char* friend_name);
+/**
+ * @brief 移出成员，member 为好友名字或成员公钥的十六进制开头（至少 8 位）。
+ */
+int kick_from_group(pk_id_t group_id, const char* member);
+/**
+ * @brief 通知其余成员后退出群，群从通讯录删除，本地聊天记录保留。
+ */
+int leave_group(pk_id_t group_id);
+void list_group_members(pk_id_t group_id); ///< 输出到日志
+int is_group_chat(pk_id_t chat_id);
+/**
+ * @brief 消息发送者的显示名：自己为“我”，联系人为其名字，其他人为公钥开头。
+ */
+const char* get_sender_name(pk_id_t sender_id, char* buf, size_t len);
 
 // --- 新增的设置接口 ---
 const char* get_my_public_key_hex();
 int get_my_p2p_port();
 int get_online_peer_count();
+int is_peer_online(pk_id_t id); ///< 直连或经中继连通
+
+/**
+ * @struct peer_traffic_t
+ * @brief 一条连接建立以来的收发统计（含帧头与加密开销）。经中继的连接只计自己的帧，承载它的直连另外计入转发后的帧。
+ */
+typedef struct {
+    pk_id_t id;
+    int relayed;
+    uint64_t bytes_out, bytes_in;
+    uint64_t frames_out, frames_in;
+} peer_traffic_t;
+
+/**
+ * @brief 复制当前各连接的收发统计，整体的计数与耗时见 metrics.h。
+ * @return 写入 out 的连接数（不超过 max）。
+ */
+int get_peer_traffic(peer_traffic_t* out, int max);
 
 #endif //ZEROLINK_CLIENT_LOGIC_H
@@ -0,0 +1,644 @@
+#include "contact_store.h"
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// 主键即公钥（WITHOUT ROWID，按公钥查找只走一棵 B 树），名字上的唯一约束同时充当排序与前缀查找的索引
+static const char *CONTACT_SCHEMA =
+    "PRAGMA journal_mode = WAL;"
+    "PRAGMA synchronous = NORMAL;"
+    "CREATE TABLE IF NOT EXISTS contacts(pk BLOB PRIMARY KEY, name TEXT NOT NULL UNIQUE, added_at INTEGER, last_seen INTEGER, kind INTEGER NOT NULL DEFAULT 0) WITHOUT ROWID;"
+    // 群：成员列表按 (gid, pk) 聚簇，查询某人所在的群走 pk 索引；发送者密钥按 (群, 发送者, 纪元) 保存
+    "CREATE TABLE IF NOT EXISTS groups(gid BLOB PRIMARY KEY, epoch INTEGER NOT NULL, digest BLOB) WITHOUT ROWID;"
+    "CREATE TABLE IF NOT EXISTS group_members(gid BLOB, pk BLOB, PRIMARY KEY(gid, pk)) WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS group_members_pk ON group_members(pk);"
+    "CREATE TABLE IF NOT EXISTS group_keys(gid BLOB, sender BLOB, epoch INTEGER, key BLOB NOT NULL, sign_pk BLOB NOT NULL, sign_sk BLOB, "
+    "PRIMARY KEY(gid, sender, epoch)) WITHOUT ROWID;"
+    // 成员发布的密钥包原文，用于转发给与发布者不直接相连的成员
+    "CREATE TABLE IF NOT EXISTS group_key_bundles(gid BLOB, sender BLOB, epoch INTEGER, bundle TEXT NOT NULL, PRIMARY KEY(gid, sender, epoch)) WITHOUT ROWID;";
+
+// 按驻留 id 缓存联系人类型与名字；驻留表不会删除表项，id 不会被复用。
+// 缓存与驻留表一样按块分配，块不移动，contact_store_name 返回的名字在解锁后仍然有效
+enum { CACHE_UNKNOWN = 0, CACHE_FRIEND, CACHE_GROUP, CACHE_STRANGER };
+#define CACHE_CHUNK_SHIFT 12
+#define CACHE_CHUNK_SIZE (1u << CACHE_CHUNK_SHIFT)
+#define CACHE_CHUNK_COUNT (PK_INTERN_MAX / CACHE_CHUNK_SIZE)
+
+typedef struct {
+    unsigned char state;
+    char name[CONTACT_NAME_SIZE];
+} cache_entry_t;
+
+static sqlite3 *db = NULL;
+static int total = 0;
+static cache_entry_t *cache_chunks[CACHE_CHUNK_COUNT];
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * 截断到 CONTACT_NAME_SIZE - 1 字节，不切断 UTF-8 字符。
+ */
+static void copy_name(char* out, const char* name) {
+    size_t len = strlen(name);
+    if (len >= CONTACT_NAME_SIZE) {
+        len = CONTACT_NAME_SIZE - 1;
+        while (len > 0 && ((unsigned char)name[len] & 0xC0) == 0x80) len--;
+    }
+    memcpy(out, name, len);
+    out[len] = '\0';
+}
+
+// 以下函数要求调用者持有 store_mutex
+static sqlite3_stmt* prepare(const char* sql) {
+    sqlite3_stmt *stmt = NULL;
+    if (!db || sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return NULL;
+    }
+    return stmt;
+}
+
+static void count_all() {
+    sqlite3_stmt *stmt = prepare("SELECT count(*) FROM contacts;");
+    total = (stmt && sqlite3_step(stmt) == SQLITE_ROW) ? sqlite3_column_int(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+}
+
+/**
+ * @return id 的缓存项，所在的块按需分配；id 无效或内存不足时返回 NULL。
+ */
+static cache_entry_t* cache_entry(pk_id_t id) {
+    if (id == PK_ID_NONE || id >= PK_INTERN_MAX) return NULL;
+    cache_entry_t **chunk = &cache_chunks[id >> CACHE_CHUNK_SHIFT];
+    if (!*chunk && !(*chunk = calloc(CACHE_CHUNK_SIZE, sizeof(cache_entry_t)))) return NULL;
+    return &(*chunk)[id & (CACHE_CHUNK_SIZE - 1)];
+}
+
+/**
+ * 清空缓存的类型（名字随之失效），块保留。
+ */
+static void cache_reset() {
+    for (size_t i = 0; i < CACHE_CHUNK_COUNT; i++) {
+        if (!cache_chunks[i]) continue;
+        for (size_t j = 0; j < CACHE_CHUNK_SIZE; j++) cache_chunks[i][j].state = CACHE_UNKNOWN;
+    }
+}
+
+/**
+ * @param kind 联系人类型；name 为 NULL 时表示不是联系人，kind 被忽略。
+ */
+static void cache_set(pk_id_t id, const char* name, int kind) {
+    cache_entry_t *entry = cache_entry(id);
+    if (!entry) return;
+    if (name) copy_name(entry->name, name);
+    entry->state = !name ? CACHE_STRANGER : kind == CONTACT_KIND_GROUP ? CACHE_GROUP : CACHE_FRIEND;
+}
+
+/**
+ * 查询公钥对应的名字写入 name。
+ * @return 联系人类型；不是联系人返回 -1。
+ */
+static int query_name(const unsigned char pk[PK_BYTES], char name[CONTACT_NAME_SIZE]) {
+    int kind = -1;
+    sqlite3_stmt *stmt = prepare("SELECT name, kind FROM contacts WHERE pk = ?1;");
+    if (stmt) {
+        sqlite3_bind_blob(stmt, 1, pk, PK_BYTES, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            copy_name(name, (const char*)sqlite3_column_text(stmt, 0));
+            kind = sqlite3_column_int(stmt, 1);
+        }
+    }
+    sqlite3_finalize(stmt);
+    return kind;
+}
+
+/**
+ * @return 该 id 的缓存状态（CACHE_FRIEND / CACHE_GROUP / CACHE_STRANGER）。
+ */
+static int cache_fill(pk_id_t id) {
+    cache_entry_t *entry = pk_bytes(id) ? cache_entry(id) : NULL;
+    if (!entry) return CACHE_STRANGER;
+    if (entry->state == CACHE_UNKNOWN) {
+        char name[CONTACT_NAME_SIZE];
+        int kind = query_name(pk_bytes(id), name);
+        cache_set(id, kind >= 0 ? name : NULL, kind);
+    }
+    return entry->state;
+}
+
+/**
+ * 执行只绑定一个公钥参数 (?1) 的语句。
+ */
+static int exec_pk(const char* sql, const unsigned char pk[PK_BYTES]) {
+    sqlite3_stmt *stmt = prepare(sql);
+    if (!stmt) return -1;
+    sqlite3_bind_blob(stmt, 1, pk, PK_BYTES, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt) == SQLITE_DONE ? 0 : -1;
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+/**
+ * 旧版本的通讯录没有 kind 列，打开时补上（已有的联系人都是好友）。
+ */
+static int migrate_kind_column() {
+    sqlite3_stmt *stmt = prepare("SELECT 1 FROM pragma_table_info('contacts') WHERE name = 'kind';");
+    if (!stmt) return -1;
+    int exists = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    if (exists) return 0;
+    return sqlite3_exec(db, "ALTER TABLE contacts ADD COLUMN kind INTEGER NOT NULL DEFAULT 0;", 0, 0, 0) == SQLITE_OK ? 0 : -1;
+}
+
+/**
+ * 把前缀转换为名字区间 [prefix, upper)：upper 为前缀最后一个可递增字节加一，前缀全为 0xFF 时没有上界。
+ * @return 有上界返回 1。
+ */
+static int prefix_upper(const char* prefix, char* upper, size_t upper_size) {
+    size_t len = strlen(prefix);
+    if (len >= upper_size) len = upper_size - 1;
+    memcpy(upper, prefix, len);
+    while (len > 0 && (unsigned char)upper[len - 1] == 0xFF) len--;
+    if (len == 0) return 0;
+    upper[len - 1]++;
+    upper[len] = '\0';
+    return 1;
+}
+
+/**
+ * 预编译带前缀条件的查询。sql_fmt 中的 %s 会被替换为 WHERE 子句：?1/?2 为前缀区间，
+ * extra 不为 NULL 时作为附加条件（其参数从 ?3 开始）。
+ */
+static sqlite3_stmt* prepare_prefix(const char* sql_fmt, const char* prefix, const char* extra, char* upper, size_t upper_size) {
+    int filtered = prefix && *prefix, bounded = 0;
+    if (filtered) bounded = prefix_upper(prefix, upper, upper_size);
+    char where[128];
+    snprintf(where, sizeof(where), "%s%s%s%s%s",
+             filtered || extra ? "WHERE " : "",
+             filtered ? "name >= ?1" : "",
+             bounded ? " AND name < ?2" : "",
+             filtered && extra ? " AND " : "",
+             extra ? extra : "");
+    char sql[256];
+    snprintf(sql, sizeof(sql), sql_fmt, where);
+    sqlite3_stmt *stmt = prepare(sql);
+    if (stmt && filtered) {
+        sqlite3_bind_text(stmt, 1, prefix, -1, SQLITE_STATIC);
+        if (bounded) sqlite3_bind_text(stmt, 2, upper, -1, SQLITE_STATIC);
+    }
+    return stmt;
+}
+
+int contact_store_open(const char* path) {
+    pthread_mutex_lock(&store_mutex);
+    int rc = 0;
+    if (sqlite3_open(path, &db) != SQLITE_OK || sqlite3_exec(db, CONTACT_SCHEMA, 0, 0, 0) != SQLITE_OK || migrate_kind_column() != 0) {
+        sqlite3_close(db);
+        db = NULL;
+        rc = -1;
+    } else {
+        sqlite3_busy_timeout(db, 5000);
+        count_all();
+    }
+    pthread_mutex_unlock(&store_mutex);
+    return rc;
+}
+
+void contact_store_close() {
+    pthread_mutex_lock(&store_mutex);
+    sqlite3_close(db);
+    db = NULL;
+    total = 0;
+    cache_reset();
+    pthread_mutex_unlock(&store_mutex);
+}
+
+int contact_store_import_legacy(const char* path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    pthread_mutex_lock(&store_mutex);
+    int imported = -1;
+    sqlite3_stmt *stmt = prepare("INSERT OR IGNORE INTO contacts (pk, name, added_at, last_seen) VALUES (?1, ?2, ?3, 0);");
+    if (stmt && sqlite3_exec(db, "BEGIN;", 0, 0, 0) == SQLITE_OK) {
+        imported = 0;
+        char line[512];
+        while (fgets(line, sizeof(line), fp)) {
+            char *comma = strchr(line, ',');
+            if (!comma) continue;
+            *comma = '\0';
+            char *name = comma + 1;
+            name[strcspn(name, "\r\n")] = '\0';
+            unsigned char pk[PK_BYTES];
+            size_t bin_len = 0;
+            if (strlen(line) != PK_BYTES * 2 || sodium_hex2bin(pk, sizeof(pk), line, PK_BYTES * 2, NULL, &bin_len, NULL) != 0 || bin_len != PK_BYTES) continue;
+            char short_name[CONTACT_NAME_SIZE];
+            copy_name(short_name, name);
+            sqlite3_bind_blob(stmt, 1, pk, PK_BYTES, SQLITE_TRANSIENT);
+            sqlite3_bind_text(stmt, 2, short_name, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(NULL));
+            if (sqlite3_step(stmt) == SQLITE_DONE) imported += sqlite3_changes(db);
+            sqlite3_reset(stmt);
+        }
+        if (sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            imported = -1;
+        }
+        count_all();
+        cache_reset();
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+    fclose(fp);
+    return imported;
+}
+
+/**
+ * 添加联系人或修改其名字；已存在的联系人保持原有类型。
+ */
+static int put_contact(const unsigned char pk[PK_BYTES], const char* name, int kind) {
+    char short_name[CONTACT_NAME_SIZE], old_name[CONTACT_NAME_SIZE];
+    copy_name(short_name, name);
+    pthread_mutex_lock(&store_mutex);
+    int rc = -1;
+    int old_kind = query_name(pk, old_name);
+    sqlite3_stmt *stmt = prepare("INSERT INTO contacts (pk, name, added_at, last_seen, kind) VALUES (?1, ?2, ?3, 0, ?4) "
+                                 "ON CONFLICT(pk) DO UPDATE SET name = excluded.name;");
+    if (stmt) {
+        sqlite3_bind_blob(stmt, 1, pk, PK_BYTES, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, short_name, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(NULL));
+        sqlite3_bind_int(stmt, 4, kind);
+        int step = sqlite3_step(stmt);
+        if (step == SQLITE_DONE) rc = 0;
+        else if (sqlite3_extended_errcode(db) == SQLITE_CONSTRAINT_UNIQUE) rc = 1;
+    }
+    sqlite3_finalize(stmt);
+    if (rc == 0) {
+        if (old_kind < 0) total++;
+        cache_set(pk_lookup(pk), short_name, old_kind >= 0 ? old_kind : kind);
+    }
+    pthread_mutex_unlock(&store_mutex);
+    return rc;
+}
+
+int contact_store_put(const unsigned char pk[PK_BYTES], const char* name) {
+    return put_contact(pk, name, CONTACT_KIND_FRIEND);
+}
+
+int contact_store_put_group(const unsigned char group_id[PK_BYTES], const char* name) {
+    return put_contact(group_id, name, CONTACT_KIND_GROUP);
+}
+
+int contact_store_remove_by_name(const char* name) {
+    pthread_mutex_lock(&store_mutex);
+    int rc = -1;
+    unsigned char pk[PK_BYTES];
+    sqlite3_stmt *stmt = prepare("SELECT pk FROM contacts WHERE name = ?1;");
+    if (stmt) {
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        int step = sqlite3_step(stmt);
+        if (step == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == PK_BYTES) {
+            memcpy(pk, sqlite3_column_blob(stmt, 0), PK_BYTES);
+            rc = 0;
+        } else if (step == SQLITE_DONE) {
+            rc = 1;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (rc == 0 && sqlite3_exec(db, "BEGIN;", 0, 0, 0) == SQLITE_OK) {
+        // 群的成员列表与密钥随群一起删除；好友的公钥不会出现在这几张表的 gid 列中
+        if (exec_pk("DELETE FROM contacts WHERE pk = ?1;", pk) != 0 ||
+            exec_pk("DELETE FROM groups WHERE gid = ?1;", pk) != 0 ||
+            exec_pk("DELETE FROM group_members WHERE gid = ?1;", pk) != 0 ||
+            exec_pk("DELETE FROM group_keys WHERE gid = ?1;", pk) != 0 ||
+            exec_pk("DELETE FROM group_key_bundles WHERE gid = ?1;", pk) != 0 ||
+            sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            rc = -1;
+        }
+    } else if (rc == 0) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        total--;
+        cache_set(pk_lookup(pk), NULL, 0);
+    }
+    pthread_mutex_unlock(&store_mutex);
+    return rc;
+}
+
+pk_id_t contact_store_find_by_name(const char* name) {
+    pthread_mutex_lock(&store_mutex);
+    pk_id_t id = PK_ID_NONE;
+    sqlite3_stmt *stmt = prepare("SELECT pk, name, kind FROM contacts WHERE name = ?1;");
+    if (stmt) {
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == PK_BYTES) {
+            id = pk_intern(sqlite3_column_blob(stmt, 0));
+            cache_set(id, (const char*)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2));
+        }
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+    return id;
+}
+
+pk_id_t contact_store_resolve(const unsigned char pk[PK_BYTES]) {
+    pthread_mutex_lock(&store_mutex);
+    pk_id_t id = pk_lookup(pk);
+    if (id != PK_ID_NONE) {
+        if (cache_fill(id) == CACHE_STRANGER) id = PK_ID_NONE;
+    } else {
+        char name[CONTACT_NAME_SIZE];
+        int kind = query_name(pk, name);
+        if (kind >= 0) {
+            id = pk_intern(pk);
+            cache_set(id, name, kind);
+        }
+    }
+    pthread_mutex_unlock(&store_mutex);
+    return id;
+}
+
+int contact_store_contains(pk_id_t id) {
+    pthread_mutex_lock(&store_mutex);
+    int found = cache_fill(id) == CACHE_FRIEND;
+    pthread_mutex_unlock(&store_mutex);
+    return found;
+}
+
+int contact_store_is_group(pk_id_t id) {
+    pthread_mutex_lock(&store_mutex);
+    int found = cache_fill(id) == CACHE_GROUP;
+    pthread_mutex_unlock(&store_mutex);
+    return found;
+}
+
+const char* contact_store_name(pk_id_t id) {
+    pthread_mutex_lock(&store_mutex);
+    int state = cache_fill(id);
+    const char *name = state == CACHE_FRIEND || state == CACHE_GROUP ? cache_entry(id)->name : NULL;
+    pthread_mutex_unlock(&store_mutex);
+    return name;
+}
+
+int contact_store_count() {
+    pthread_mutex_lock(&store_mutex);
+    int n = total;
+    pthread_mutex_unlock(&store_mutex);
+    return n;
+}
+
+int contact_store_count_prefix(const char* prefix) {
+    if (!prefix || !*prefix) return contact_store_count();
+    char upper[CONTACT_NAME_SIZE * 4];
+    pthread_mutex_lock(&store_mutex);
+    int n = 0;
+    sqlite3_stmt *stmt = prepare_prefix("SELECT count(*) FROM contacts %s;", prefix, NULL, upper, sizeof(upper));
+    if (stmt && sqlite3_step(stmt) == SQLITE_ROW) n = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+    return n;
+}
+
+static int list_page(const char* sql_fmt, const char* prefix, const char* cursor_cond, const char* cursor, contact_t* out, int max) {
+    char upper[CONTACT_NAME_SIZE * 4];
+    pthread_mutex_lock(&store_mutex);
+    int n = -1;
+    sqlite3_stmt *stmt = prepare_prefix(sql_fmt, prefix, cursor ? cursor_cond : NULL, upper, sizeof(upper));
+    if (stmt) {
+        n = 0;
+        if (cursor) sqlite3_bind_text(stmt, 3, cursor, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 4, max);
+        while (n < max && sqlite3_step(stmt) == SQLITE_ROW) {
+            if (sqlite3_column_bytes(stmt, 0) != PK_BYTES) continue;
+            memcpy(out[n].pk, sqlite3_column_blob(stmt, 0), PK_BYTES);
+            out[n].id = pk_lookup(out[n].pk);
+            copy_name(out[n].name, (const char*)sqlite3_column_text(stmt, 1));
+            out[n].kind = sqlite3_column_int(stmt, 2);
+            n++;
+        }
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+    return n;
+}
+
+int contact_store_list(const char* prefix, const char* after, contact_t* out, int max) {
+    return list_page("SELECT pk, name, kind FROM contacts %s ORDER BY name LIMIT ?4;", prefix, "name > ?3", after, out, max);
+}
+
+int contact_store_list_before(const char* prefix, const char* before, contact_t* out, int max) {
+    return list_page("SELECT pk, name, kind FROM contacts %s ORDER BY name DESC LIMIT ?4;", prefix, "name < ?3", before, out, max);
+}
+
+int contact_store_get_info(const unsigned char pk[PK_BYTES], contact_info_t* out) {
+    pthread_mutex_lock(&store_mutex);
+    int rc = -1;
+    sqlite3_stmt *stmt = prepare("SELECT added_at, last_seen FROM contacts WHERE pk = ?1;");
+    if (stmt) {
+        sqlite3_bind_blob(stmt, 1, pk, PK_BYTES, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            out->added_at = sqlite3_column_int64(stmt, 0);
+            out->last_seen = sqlite3_column_int64(stmt, 1);
+            rc = 0;
+        }
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+    return rc;
+}
+
+void contact_store_touch(pk_id_t id) {
+    const unsigned char *pk = pk_bytes(id);
+    if (!pk) return;
+    pthread_mutex_lock(&store_mutex);
+    sqlite3_stmt *stmt = prepare("UPDATE contacts SET last_seen = ?1 WHERE pk = ?2;");
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)time(NULL));
+        sqlite3_bind_blob(stmt, 2, pk, PK_BYTES, SQLITE_STATIC);
+        sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+}
+
+// --- 群 ---
+
+int contact_store_group_state(const unsigned char group_id[PK_BYTES], uint32_t* epoch, unsigned char digest[GROUP_DIGEST_BYTES]) {
+    pthread_mutex_lock(&store_mutex);
+    int rc = -1;
+    sqlite3_stmt *stmt = prepare("SELECT epoch, digest FROM groups WHERE gid = ?1;");
+    if (stmt) {
+        sqlite3_bind_blob(stmt, 1, group_id, PK_BYTES, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            *epoch = (uint32_t)sqlite3_column_int64(stmt, 0);
+            if (sqlite3_column_bytes(stmt, 1) == GROUP_DIGEST_BYTES) memcpy(digest, sqlite3_column_blob(stmt, 1), GROUP_DIGEST_BYTES);
+            else memset(digest, 0, GROUP_DIGEST_BYTES);
+            rc = 0;
+        }
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+    return rc;
+}
+
+int contact_store_group_set_roster(const unsigned char group_id[PK_BYTES], uint32_t epoch, const unsigned char digest[GROUP_DIGEST_BYTES],
+                                   const unsigned char (*members)[PK_BYTES], int count) {
+    pthread_mutex_lock(&store_mutex);
+    int rc = -1;
+    sqlite3_stmt *state = prepare("INSERT OR REPLACE INTO groups (gid, epoch, digest) VALUES (?1, ?2, ?3);");
+    sqlite3_stmt *insert = prepare("INSERT OR IGNORE INTO group_members (gid, pk) VALUES (?1, ?2);");
+    if (state && insert && sqlite3_exec(db, "BEGIN;", 0, 0, 0) == SQLITE_OK) {
+        sqlite3_bind_blob(state, 1, group_id, PK_BYTES, SQLITE_STATIC);
+        sqlite3_bind_int64(state, 2, epoch);
+        sqlite3_bind_blob(state, 3, digest, GROUP_DIGEST_BYTES, SQLITE_STATIC);
+        rc = sqlite3_step(state) == SQLITE_DONE && exec_pk("DELETE FROM group_members WHERE gid = ?1;", group_id) == 0 ? 0 : -1;
+        sqlite3_bind_blob(insert, 1, group_id, PK_BYTES, SQLITE_STATIC);
+        for (int i = 0; rc == 0 && i < count; i++) {
+            sqlite3_bind_blob(insert, 2, members[i], PK_BYTES, SQLITE_STATIC);
+            if (sqlite3_step(insert) != SQLITE_DONE) rc = -1;
+            sqlite3_reset(insert);
+        }
+        if (rc != 0 || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            rc = -1;
+        }
+    }
+    sqlite3_finalize(state);
+    sqlite3_finalize(insert);
+    pthread_mutex_unlock(&store_mutex);
+    return rc;
+}
+
+/**
+ * 读取第一列为公钥的查询结果，参数 ?1 为 key。
+ */
+static int query_pk_column(const char* sql, const unsigned char key[PK_BYTES], unsigned char (*out)[PK_BYTES], int max) {
+    pthread_mutex_lock(&store_mutex);
+    int n = -1;
+    sqlite3_stmt *stmt = prepare(sql);
+    if (stmt) {
+        n = 0;
+        sqlite3_bind_blob(stmt, 1, key, PK_BYTES, SQLITE_STATIC);
+        while (n < max && sqlite3_step(stmt) == SQLITE_ROW) {
+            if (sqlite3_column_bytes(stmt, 0) != PK_BYTES) continue;
+            memcpy(out[n++], sqlite3_column_blob(stmt, 0), PK_BYTES);
+        }
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+    return n;
+}
+
+int contact_store_group_roster(const unsigned char group_id[PK_BYTES], unsigned char (*out)[PK_BYTES], int max) {
+    return query_pk_column("SELECT pk FROM group_members WHERE gid = ?1 ORDER BY pk;", group_id, out, max);
+}
+
+int contact_store_groups_of(const unsigned char pk[PK_BYTES], unsigned char (*out)[PK_BYTES], int max) {
+    return query_pk_column("SELECT gid FROM group_members WHERE pk = ?1;", pk, out, max);
+}
+
+int contact_store_group_has_member(const unsigned char group_id[PK_BYTES], const unsigned char pk[PK_BYTES]) {
+    pthread_mutex_lock(&store_mutex);
+    int found = 0;
+    sqlite3_stmt *stmt = prepare("SELECT 1 FROM group_members WHERE gid = ?1 AND pk = ?2;");
+    if (stmt) {
+        sqlite3_bind_blob(stmt, 1, group_id, PK_BYTES, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 2, pk, PK_BYTES, SQLITE_STATIC);
+        found = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+    return found;
+}
+
+int contact_store_group_key_save(const group_key_id_t* id, const group_key_material_t* material) {
+    pthread_mutex_lock(&store_mutex);
+    int rc = -1;
+    sqlite3_stmt *stmt = prepare("INSERT OR REPLACE INTO group_keys (gid, sender, epoch, key, sign_pk, sign_sk) VALUES (?1, ?2, ?3, ?4, ?5, ?6);");
+    if (stmt) {
+        sqlite3_bind_blob(stmt, 1, id->group_id, GROUP_ID_BYTES, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 2, id->sender, PK_BYTES, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, id->epoch);
+        sqlite3_bind_blob(stmt, 4, material->key, GROUP_KEY_BYTES, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 5, material->sign_pk, GROUP_SIGN_PK_BYTES, SQLITE_STATIC);
+        if (material->has_sign_sk) sqlite3_bind_blob(stmt, 6, material->sign_sk, GROUP_SIGN_SK_BYTES, SQLITE_STATIC);
+        else sqlite3_bind_null(stmt, 6);
+        if (sqlite3_step(stmt) == SQLITE_DONE) rc = 0;
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+    return rc;
+}
+
+int contact_store_group_key_load(const group_key_id_t* id, group_key_material_t* out) {
+    pthread_mutex_lock(&store_mutex);
+    int rc = -1;
+    sqlite3_stmt *stmt = prepare("SELECT key, sign_pk, sign_sk FROM group_keys WHERE gid = ?1 AND sender = ?2 AND epoch = ?3;");
+    if (stmt) {
+        sqlite3_bind_blob(stmt, 1, id->group_id, GROUP_ID_BYTES, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 2, id->sender, PK_BYTES, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, id->epoch);
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == GROUP_KEY_BYTES &&
+            sqlite3_column_bytes(stmt, 1) == GROUP_SIGN_PK_BYTES) {
+            memcpy(out->key, sqlite3_column_blob(stmt, 0), GROUP_KEY_BYTES);
+            memcpy(out->sign_pk, sqlite3_column_blob(stmt, 1), GROUP_SIGN_PK_BYTES);
+            out->has_sign_sk = sqlite3_column_bytes(stmt, 2) == GROUP_SIGN_SK_BYTES;
+            if (out->has_sign_sk) memcpy(out->sign_sk, sqlite3_column_blob(stmt, 2), GROUP_SIGN_SK_BYTES);
+            rc = 0;
+        }
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+    return rc;
+}
+
+void contact_store_group_key_prune(const unsigned char group_id[PK_BYTES], uint32_t min_epoch) {
+    static const char *sql[] = { "DELETE FROM group_keys WHERE gid = ?1 AND epoch < ?2;", "DELETE FROM group_key_bundles WHERE gid = ?1 AND epoch < ?2;" };
+    pthread_mutex_lock(&store_mutex);
+    for (int i = 0; i < 2; i++) {
+        sqlite3_stmt *stmt = prepare(sql[i]);
+        if (stmt) {
+            sqlite3_bind_blob(stmt, 1, group_id, PK_BYTES, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 2, min_epoch);
+            sqlite3_step(stmt);
+        }
+        sqlite3_finalize(stmt);
+    }
+    pthread_mutex_unlock(&store_mutex);
+}
+
+int contact_store_group_bundle_save(const group_key_id_t* id, const char* bundle) {
+    pthread_mutex_lock(&store_mutex);
+    int rc = -1;
+    sqlite3_stmt *stmt = prepare("INSERT INTO group_key_bundles (gid, sender, epoch, bundle) VALUES (?1, ?2, ?3, ?4) "
+                                 "ON CONFLICT(gid, sender, epoch) DO UPDATE SET bundle = excluded.bundle WHERE bundle <> excluded.bundle;");
+    if (stmt) {
+        sqlite3_bind_blob(stmt, 1, id->group_id, GROUP_ID_BYTES, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 2, id->sender, PK_BYTES, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, id->epoch);
+        sqlite3_bind_text(stmt, 4, bundle, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_DONE) rc = sqlite3_changes(db) > 0;
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+    return rc;
+}
+
+char* contact_store_group_bundle_load(const group_key_id_t* id) {
+    pthread_mutex_lock(&store_mutex);
+    char *bundle = NULL;
+    sqlite3_stmt *stmt = prepare("SELECT bundle FROM group_key_bundles WHERE gid = ?1 AND sender = ?2 AND epoch = ?3;");
+    if (stmt) {
+        sqlite3_bind_blob(stmt, 1, id->group_id, GROUP_ID_BYTES, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 2, id->sender, PK_BYTES, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, id->epoch);
+        if (sqlite3_step(stmt) == SQLITE_ROW) bundle = strdup((const char*)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&store_mutex);
+    return bundle;
+}
@@ -0,0 +1,196 @@
+#ifndef ZEROLINK_CONTACT_STORE_H
+#define ZEROLINK_CONTACT_STORE_H
+
+#include "../../core/models/friend.h"
+#include "../../core/crypto/group_crypto.h"
+#include <stdint.h>
+
+/**
+ * @file contact_store.h
+ * @brief 好友通讯录：保存在 SQLite 中，按公钥和名字建索引，每次增删改只写一行。
+ *
+ * 启动时不读取整张表。好友的驻留 id 与名字在第一次用到时查询并缓存（按驻留 id 索引），
+ * 因此只有真正出现过的好友（连接、发消息、打开会话）才会占用公钥驻留表；
+ * 界面通过按名字排序、可带前缀过滤、以名字为游标的分页接口浏览列表，添加时间等元数据按需读取。
+ * 群是一种特殊的联系人：公钥的位置存放随机生成的群 id，与好友共用名字空间和列表，
+ * 成员列表、纪元和发送者密钥 (group_crypto.h) 保存在同一个数据库的群表中。
+ * 所有函数线程安全。
+ */
+
+#define CONTACT_NAME_SIZE 32
+#define CONTACT_KIND_FRIEND 0
+#define CONTACT_KIND_GROUP 1
+#define GROUP_MAX_MEMBERS 256
+
+/**
+ * @struct contact_t
+ * @brief 列表中的一项。列表不驻留公钥，id 只有在该好友已被驻留时才有效，否则为 PK_ID_NONE。
+ */
+typedef struct {
+    unsigned char pk[PK_BYTES];
+    pk_id_t id;
+    char name[CONTACT_NAME_SIZE];
+    int kind; ///< CONTACT_KIND_FRIEND 或 CONTACT_KIND_GROUP
+} contact_t;
+
+/**
+ * @struct contact_info_t
+ * @brief 好友的元数据，只在需要显示时读取。时间为 Unix 秒，0 表示没有记录。
+ */
+typedef struct {
+    int64_t added_at;
+    int64_t last_seen;
+} contact_info_t;
+
+/**
+ * @brief 打开（不存在时创建）通讯录数据库。
+ * @return 成功返回 0，失败返回 -1。
+ */
+int contact_store_open(const char* path);
+
+void contact_store_close();
+
+/**
+ * @brief 从旧版 friends.dat（每行 "公钥十六进制,名字"）导入，整个文件在一个事务中写入，已存在的公钥保持不变。
+ * @return 导入的好友数，出错返回 -1。
+ */
+int contact_store_import_legacy(const char* path);
+
+/**
+ * @brief 添加好友；公钥已存在时改为更新其名字。名字超过 CONTACT_NAME_SIZE - 1 字节时被截断。
+ * @return 成功返回 0，名字已被其他好友使用返回 1，出错返回 -1。
+ */
+int contact_store_put(const unsigned char pk[PK_BYTES], const char* name);
+
+/**
+ * @brief 添加群（或修改已有群的名字）。
+ * @return 成功返回 0，名字已被其他联系人使用返回 1，出错返回 -1。
+ */
+int contact_store_put_group(const unsigned char group_id[PK_BYTES], const char* name);
+
+/**
+ * @brief 按名字删除好友或群；删除群时连同其成员列表与密钥一起删除。
+ * @return 删除成功返回 0，不存在返回 1，出错返回 -1。
+ */
+int contact_store_remove_by_name(const char* name);
+
+/**
+ * @brief 按名字查找好友并驻留其公钥。
+ * @return 好友的驻留 id；不存在时返回 PK_ID_NONE。
+ */
+pk_id_t contact_store_find_by_name(const char* name);
+
+/**
+ * @brief 若公钥属于联系人（好友或群），驻留并返回其 id；陌生公钥不会被驻留，返回 PK_ID_NONE。
+ */
+pk_id_t contact_store_resolve(const unsigned char pk[PK_BYTES]);
+
+/**
+ * @brief 判断已驻留的 id 是否是好友，结果会被缓存。
+ */
+int contact_store_contains(pk_id_t id);
+
+/**
+ * @brief 判断已驻留的 id 是否是群，结果会被缓存。
+ */
+int contact_store_is_group(pk_id_t id);
+
+/**
+ * @brief 好友或群的名字；不是联系人时返回 NULL。返回的缓冲区按 id 固定分配，不会被释放。
+ */
+const char* contact_store_name(pk_id_t id);
+
+/**
+ * @brief 联系人（好友与群）总数（内存中维护，O(1)）。
+ */
+int contact_store_count();
+
+/**
+ * @brief 名字以 prefix 开头的好友数；prefix 为 NULL 或空串时等同于 contact_store_count()。
+ */
+int contact_store_count_prefix(const char* prefix);
+
+/**
+ * @brief 按名字（字节序）升序列出名字排在 after 之后的好友。按名字定位而不是按序号跳过，翻到列表末尾也只需一次索引查找。
+ * @param prefix 名字前缀，NULL 或空串表示不过滤。
+ * @param after 只返回名字大于它的好友，NULL 表示从头开始。
+ * @return 写入 out 的条数，出错返回 -1。
+ */
+int contact_store_list(const char* prefix, const char* after, contact_t* out, int max);
+
+/**
+ * @brief 列出名字排在 before 之前的好友，按名字降序（离 before 最近的在前），用于向上翻页。
+ * @return 写入 out 的条数，出错返回 -1。
+ */
+int contact_store_list_before(const char* prefix, const char* before, contact_t* out, int max);
+
+/**
+ * @brief 读取好友的元数据。
+ * @return 成功返回 0，不是好友返回 -1。
+ */
+int contact_store_get_info(const unsigned char pk[PK_BYTES], contact_info_t* out);
+
+/**
+ * @brief 记录与好友的最近一次连接时间。
+ */
+void contact_store_touch(pk_id_t id);
+
+// --- 群 ---
+
+/**
+ * @brief 读取群的纪元和成员列表摘要。
+ * @return 已知的群返回 0，否则返回 -1。
+ */
+int contact_store_group_state(const unsigned char group_id[PK_BYTES], uint32_t* epoch, unsigned char digest[GROUP_DIGEST_BYTES]);
+
+/**
+ * @brief 在一个事务中替换群的成员列表并记录新的纪元与摘要。
+ * @return 成功返回 0，出错返回 -1。
+ */
+int contact_store_group_set_roster(const unsigned char group_id[PK_BYTES], uint32_t epoch, const unsigned char digest[GROUP_DIGEST_BYTES],
+                                   const unsigned char (*members)[PK_BYTES], int count);
+
+/**
+ * @brief 按公钥字节序列出群成员。
+ * @return 写入 out 的成员数，出错返回 -1。
+ */
+int contact_store_group_roster(const unsigned char group_id[PK_BYTES], unsigned char (*out)[PK_BYTES], int max);
+
+/**
+ * @brief 列出某个公钥所在的群。
+ * @return 写入 out 的群 id 数，出错返回 -1。
+ */
+int contact_store_groups_of(const unsigned char pk[PK_BYTES], unsigned char (*out)[PK_BYTES], int max);
+
+int contact_store_group_has_member(const unsigned char group_id[PK_BYTES], const unsigned char pk[PK_BYTES]);
+
+/**
+ * @brief 保存（或替换）一把发送者密钥。
+ * @return 成功返回 0，出错返回 -1。
+ */
+int contact_store_group_key_save(const group_key_id_t* id, const group_key_material_t* material);
+
+/**
+ * @brief 读取一把发送者密钥。
+ * @return 成功返回 0，不存在返回 -1。
+ */
+int contact_store_group_key_load(const group_key_id_t* id, group_key_material_t* out);
+
+/**
+ * @brief 删除群中纪元小于 min_epoch 的发送者密钥与密钥包。
+ */
+void contact_store_group_key_prune(const unsigned char group_id[PK_BYTES], uint32_t min_epoch);
+
+/**
+ * @brief 保存成员发布的密钥包原文（每个成员一份加密给自己的密钥），供转发和补发使用。
+ * @return 新保存或内容有变化（发送者重新生成了同一纪元的密钥）返回 1，与已保存的相同返回 0，出错返回 -1。
+ */
+int contact_store_group_bundle_save(const group_key_id_t* id, const char* bundle);
+
+/**
+ * @brief 读取密钥包原文。
+ * @return 调用者负责 free；不存在时返回 NULL。
+ */
+char* contact_store_group_bundle_load(const group_key_id_t* id);
+
+#endif //ZEROLINK_CONTACT_STORE_H
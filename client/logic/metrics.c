@@ -0,0 +1,221 @@
+#include "metrics.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    _Atomic uint64_t buckets[METRIC_HIST_BUCKETS];
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+} metric_hist_data_t;
+
+static _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+static _Atomic int64_t gauges[METRIC_GAUGE_COUNT];
+static metric_hist_data_t hists[METRIC_HIST_COUNT];
+static _Atomic uint64_t started_ns = 0;
+static void (*_Atomic sampler)(void) = NULL;
+
+static const char* const counter_names[METRIC_COUNTER_COUNT] = {
+    "bytes_out", "bytes_in", "frames_out", "frames_in", "decrypt_failed",
+    "messages_sent", "messages_received", "sync_jobs", "sync_messages",
+    "log_dropped", "chat_event_dropped",
+};
+static const char* const gauge_names[METRIC_GAUGE_COUNT] = {
+    "peers", "sync_active", "sync_queued", "event_queue",
+};
+static const char* const hist_names[METRIC_HIST_COUNT] = {
+    "encrypt", "decrypt", "db_save", "db_history", "db_fingerprint", "db_sync_chunk", "sync_duration",
+};
+
+// --- 定时写文件 ---
+static FILE *dump_fp = NULL;
+static int dump_interval_s = 0;
+static int dump_running = 0;
+static pthread_t dump_tid;
+static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_cond = PTHREAD_COND_INITIALIZER;
+
+uint64_t metrics_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    // 第一次调用时记下起点，作为运行时长的零点
+    uint64_t unset = 0;
+    atomic_compare_exchange_strong(&started_ns, &unset, now);
+    return now;
+}
+
+void metrics_add(metric_counter_t counter, uint64_t n) {
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+uint64_t metrics_counter(metric_counter_t counter) {
+    return atomic_load_explicit(&counters[counter], memory_order_relaxed);
+}
+
+void metrics_gauge_set(metric_gauge_t gauge, int64_t value) {
+    atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+}
+
+void metrics_observe(metric_hist_t hist, uint64_t ns) {
+    metric_hist_data_t *h = &hists[hist];
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= METRIC_HIST_BUCKETS) bucket = METRIC_HIST_BUCKETS - 1;
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&h->max_ns, &max, ns, memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+void metrics_observe_since(metric_hist_t hist, uint64_t start_ns) {
+    uint64_t now = metrics_now_ns();
+    metrics_observe(hist, now > start_ns ? now - start_ns : 0);
+}
+
+/**
+ * 第 rank 个（从 1 开始）样本所在桶的上界，不超过最大值。
+ */
+static uint64_t bucket_rank(const uint64_t* buckets, uint64_t rank, uint64_t max) {
+    uint64_t seen = 0;
+    for (int k = 0; k < METRIC_HIST_BUCKETS; k++) {
+        seen += buckets[k];
+        if (seen >= rank) {
+            uint64_t upper = (2ULL << k) - 1;
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+void metrics_set_sampler(void (*fn)(void)) {
+    atomic_store(&sampler, fn);
+}
+
+void metrics_snapshot(metrics_snapshot_t* out) {
+    void (*sample)(void) = atomic_load(&sampler);
+    if (sample) sample();
+    memset(out, 0, sizeof(*out));
+    uint64_t now = metrics_now_ns();
+    out->uptime_ms = (now - atomic_load(&started_ns)) / 1000000;
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) out->counters[i] = atomic_load_explicit(&counters[i], memory_order_relaxed);
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) out->gauges[i] = atomic_load_explicit(&gauges[i], memory_order_relaxed);
+    for (int i = 0; i < METRIC_HIST_COUNT; i++) {
+        uint64_t buckets[METRIC_HIST_BUCKETS], count = 0;
+        for (int k = 0; k < METRIC_HIST_BUCKETS; k++) {
+            buckets[k] = atomic_load_explicit(&hists[i].buckets[k], memory_order_relaxed);
+            count += buckets[k];
+        }
+        metric_hist_summary_t *s = &out->hists[i];
+        s->count = count;
+        s->sum_ns = atomic_load_explicit(&hists[i].sum_ns, memory_order_relaxed);
+        s->max_ns = atomic_load_explicit(&hists[i].max_ns, memory_order_relaxed);
+        if (count == 0) continue;
+        s->p50_ns = bucket_rank(buckets, (count + 1) / 2, s->max_ns);
+        s->p90_ns = bucket_rank(buckets, count - count / 10, s->max_ns);
+        s->p99_ns = bucket_rank(buckets, count - count / 100, s->max_ns);
+    }
+}
+
+const char* metrics_counter_name(metric_counter_t counter) {
+    return counter_names[counter];
+}
+
+const char* metrics_gauge_name(metric_gauge_t gauge) {
+    return gauge_names[gauge];
+}
+
+const char* metrics_hist_name(metric_hist_t hist) {
+    return hist_names[hist];
+}
+
+cJSON* metrics_snapshot_json(const metrics_snapshot_t* snap) {
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "uptime_ms", (double)snap->uptime_ms);
+    cJSON *counters_json = cJSON_AddObjectToObject(json, "counters");
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) cJSON_AddNumberToObject(counters_json, counter_names[i], (double)snap->counters[i]);
+    cJSON *gauges_json = cJSON_AddObjectToObject(json, "gauges");
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) cJSON_AddNumberToObject(gauges_json, gauge_names[i], (double)snap->gauges[i]);
+    cJSON *hists_json = cJSON_AddObjectToObject(json, "hists");
+    for (int i = 0; i < METRIC_HIST_COUNT; i++) {
+        const metric_hist_summary_t *s = &snap->hists[i];
+        cJSON *h = cJSON_AddObjectToObject(hists_json, hist_names[i]);
+        cJSON_AddNumberToObject(h, "count", (double)s->count);
+        cJSON_AddNumberToObject(h, "sum_ns", (double)s->sum_ns);
+        cJSON_AddNumberToObject(h, "p50_ns", (double)s->p50_ns);
+        cJSON_AddNumberToObject(h, "p90_ns", (double)s->p90_ns);
+        cJSON_AddNumberToObject(h, "p99_ns", (double)s->p99_ns);
+        cJSON_AddNumberToObject(h, "max_ns", (double)s->max_ns);
+    }
+    return json;
+}
+
+static void dump_once() {
+    metrics_snapshot_t snap;
+    metrics_snapshot(&snap);
+    cJSON *json = metrics_snapshot_json(&snap);
+    cJSON_AddNumberToObject(json, "time", (double)time(NULL));
+    char *text = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (!text) return;
+    fprintf(dump_fp, "%s\n", text);
+    fflush(dump_fp);
+    free(text);
+}
+
+static void *dump_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&dump_mutex);
+    while (dump_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += dump_interval_s;
+        int rc = 0;
+        while (dump_running && rc != ETIMEDOUT) rc = pthread_cond_timedwait(&dump_cond, &dump_mutex, &deadline);
+        dump_once();
+    }
+    pthread_mutex_unlock(&dump_mutex);
+    return NULL;
+}
+
+int metrics_dump_start(const char* path, int interval_s) {
+    pthread_mutex_lock(&dump_mutex);
+    if (dump_running) {
+        pthread_mutex_unlock(&dump_mutex);
+        return -1;
+    }
+    dump_fp = fopen(path, "a");
+    if (!dump_fp) {
+        pthread_mutex_unlock(&dump_mutex);
+        return -1;
+    }
+    dump_interval_s = interval_s > 0 ? interval_s : 1;
+    dump_running = 1;
+    if (pthread_create(&dump_tid, NULL, dump_thread, NULL) != 0) {
+        dump_running = 0;
+        fclose(dump_fp);
+        dump_fp = NULL;
+        pthread_mutex_unlock(&dump_mutex);
+        return -1;
+    }
+    pthread_mutex_unlock(&dump_mutex);
+    return 0;
+}
+
+void metrics_dump_stop() {
+    pthread_mutex_lock(&dump_mutex);
+    if (!dump_running) {
+        pthread_mutex_unlock(&dump_mutex);
+        return;
+    }
+    // 线程醒来时先写最后一行再看到停止标志
+    dump_running = 0;
+    pthread_cond_signal(&dump_cond);
+    pthread_mutex_unlock(&dump_mutex);
+    pthread_join(dump_tid, NULL);
+    fclose(dump_fp);
+    dump_fp = NULL;
+}
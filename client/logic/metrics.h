@@ -0,0 +1,119 @@
+#ifndef ZEROLINK_METRICS_H
+#define ZEROLINK_METRICS_H
+
+#include <stdint.h>
+#include <cjson/cJSON.h>
+
+/**
+ * @file metrics.h
+ * @brief 进程内指标：固定集合的计数器、瞬时值和耗时直方图。
+ *
+ * 记录只是几次无锁的原子操作，可以在网络线程和数据库路径上随时调用；
+ * 读取时各项分别取值，彼此之间不保证是同一时刻的。直方图按 2 的幂分桶（第 k 个桶为 [2^k, 2^(k+1)) 纳秒），
+ * 百分位取所在桶的上界，误差在两倍以内。
+ */
+
+typedef enum {
+    METRIC_BYTES_OUT,            ///< 写到直连链路上的字节数（含帧头与加密开销）
+    METRIC_BYTES_IN,
+    METRIC_FRAMES_OUT,           ///< 直连链路上的帧数，经本机中继的报文也计入
+    METRIC_FRAMES_IN,
+    METRIC_DECRYPT_FAILED,       ///< 认证失败被丢弃的帧
+    METRIC_MESSAGES_SENT,        ///< 本机发出的私聊与群消息
+    METRIC_MESSAGES_RECEIVED,    ///< 实时收到并写入的新消息（不含同步补齐的）
+    METRIC_SYNC_JOBS,            ///< 结束的同步任务数
+    METRIC_SYNC_MESSAGES,        ///< 同步补齐的新消息数
+    METRIC_LOG_DROPPED,          ///< 事件队列已满时丢弃的日志
+    METRIC_CHAT_EVENT_DROPPED,   ///< 事件队列已满时丢弃的新消息通知
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+typedef enum {
+    METRIC_GAUGE_PEERS,          ///< 当前连接数（直连与经中继的）
+    METRIC_GAUGE_SYNC_ACTIVE,    ///< 执行中的同步任务
+    METRIC_GAUGE_SYNC_QUEUED,    ///< 排队中的同步任务
+    METRIC_GAUGE_EVENT_QUEUE,    ///< 界面或控制接口每轮处理前事件队列中的事件数
+    METRIC_GAUGE_COUNT
+} metric_gauge_t;
+
+typedef enum {
+    METRIC_HIST_ENCRYPT,         ///< 加密一帧
+    METRIC_HIST_DECRYPT,         ///< 解密一帧（按批解密，取批内平均）
+    METRIC_HIST_DB_SAVE,         ///< 写入一条消息（含同步索引与全文索引）
+    METRIC_HIST_DB_HISTORY,      ///< 读取一页聊天记录
+    METRIC_HIST_DB_FINGERPRINT,  ///< 计算一个同步区间的指纹
+    METRIC_HIST_DB_SYNC_CHUNK,   ///< 一个同步块的整个写事务
+    METRIC_HIST_SYNC_DURATION,   ///< 一次同步任务从启动到最后一次收到数据
+    METRIC_HIST_COUNT
+} metric_hist_t;
+
+#define METRIC_HIST_BUCKETS 48
+
+/**
+ * @struct metric_hist_summary_t
+ * @brief 直方图的摘要，单位为纳秒。
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+} metric_hist_summary_t;
+
+/**
+ * @struct metrics_snapshot_t
+ * @brief 某一时刻所有指标的取值。
+ */
+typedef struct {
+    uint64_t uptime_ms;
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    int64_t gauges[METRIC_GAUGE_COUNT];
+    metric_hist_summary_t hists[METRIC_HIST_COUNT];
+} metrics_snapshot_t;
+
+uint64_t metrics_now_ns();
+
+void metrics_add(metric_counter_t counter, uint64_t n);
+uint64_t metrics_counter(metric_counter_t counter);
+void metrics_gauge_set(metric_gauge_t gauge, int64_t value);
+
+/**
+ * @brief 记录一次耗时。
+ */
+void metrics_observe(metric_hist_t hist, uint64_t ns);
+
+/**
+ * @brief 记录从 start_ns（metrics_now_ns 的返回值）到现在的耗时。
+ */
+void metrics_observe_since(metric_hist_t hist, uint64_t start_ns);
+
+/**
+ * @brief 设置取快照前调用的采样函数，由它把连接数、同步任务数等各模块自己维护的数量写成瞬时值；NULL 表示不采样。
+ */
+void metrics_set_sampler(void (*fn)(void));
+
+void metrics_snapshot(metrics_snapshot_t* out);
+
+const char* metrics_counter_name(metric_counter_t counter);
+const char* metrics_gauge_name(metric_gauge_t gauge);
+const char* metrics_hist_name(metric_hist_t hist);
+
+/**
+ * @brief 把快照转为 JSON 对象: {"uptime_ms":..,"counters":{..},"gauges":{..},"hists":{"名字":{"count":..,"p50_ns":..}}}。
+ */
+cJSON* metrics_snapshot_json(const metrics_snapshot_t* snap);
+
+/**
+ * @brief 启动后台线程，每隔 interval_s 秒向 path 追加一行快照 JSON（带 "time" 字段的 Unix 时间），供离线分析。
+ * @return 成功返回 0，无法打开文件或创建线程返回 -1。
+ */
+int metrics_dump_start(const char* path, int interval_s);
+
+/**
+ * @brief 写入最后一行快照并停止后台线程。
+ */
+void metrics_dump_stop();
+
+#endif //ZEROLINK_METRICS_H
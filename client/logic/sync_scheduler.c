@@ -0,0 +1,312 @@
+#include "sync_scheduler.h"
+#include "metrics.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SYNC_SCHED_INITIAL_JOBS 64  // 任务表的初始大小，满了之后翻倍
+#define SYNC_SCHED_IDLE_MS 2000      // 没有同步流量超过该时长即认为本轮同步完成
+#define SYNC_SCHED_TIMEOUT_MS 120000 // 单轮同步的最长时间，防止异常对端长期占用执行槽
+#define SYNC_SCHED_TICK_MS 200
+
+typedef struct {
+    pk_id_t friend_id;
+    SyncJobState state;
+    uint64_t seq;           // 提交顺序，用于同优先级下的先进先出
+    int rerun;              // 执行期间又收到了请求
+    int received;
+    uint64_t started_ms;
+    uint64_t last_activity_ms;
+} sync_job_t;
+
+static sync_job_t *jobs = NULL;
+static int job_slots = 0;
+static int max_active_jobs = 1;
+static int inbound_active = 0;  // 进行中的入站同步
+static sync_start_fn start_fn = NULL;
+static pk_id_t focus_id = PK_ID_NONE;
+static uint64_t next_seq = 0;
+static unsigned int generation = 0;
+static sync_notify_fn notify_fn = NULL;
+static int running = 0;
+static pthread_t scheduler_tid;
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 以下函数均要求调用者持有 sched_mutex
+static void changed() {
+    generation++;
+    if (notify_fn) notify_fn();
+}
+
+static sync_job_t* find_job(pk_id_t friend_id) {
+    for (int i = 0; i < job_slots; i++) {
+        if (jobs[i].state != SYNC_JOB_NONE && jobs[i].friend_id == friend_id) return &jobs[i];
+    }
+    return NULL;
+}
+
+static int count_active() {
+    int n = 0;
+    for (int i = 0; i < job_slots; i++) {
+        if (jobs[i].state == SYNC_JOB_ACTIVE) n++;
+    }
+    return n;
+}
+
+static void enqueue(sync_job_t* job) {
+    job->state = SYNC_JOB_QUEUED;
+    job->seq = next_seq++;
+    job->rerun = 0;
+    changed();
+}
+
+/**
+ * 结束超时或空闲的任务；执行期间又被请求过的任务重新排队。
+ */
+static void reap_jobs(uint64_t now) {
+    for (int i = 0; i < job_slots; i++) {
+        sync_job_t* job = &jobs[i];
+        if (job->state != SYNC_JOB_ACTIVE) continue;
+        if (now - job->last_activity_ms < SYNC_SCHED_IDLE_MS && now - job->started_ms < SYNC_SCHED_TIMEOUT_MS) continue;
+        // 空闲等待不算在同步时长里
+        metrics_observe(METRIC_HIST_SYNC_DURATION, (job->last_activity_ms - job->started_ms) * 1000000ULL);
+        metrics_add(METRIC_SYNC_JOBS, 1);
+        if (job->rerun) {
+            enqueue(job);
+        } else {
+            job->state = SYNC_JOB_NONE;
+            changed();
+        }
+    }
+}
+
+/**
+ * 选出下一个可以启动的任务：焦点会话优先，其余按提交顺序。
+ * 焦点会话在执行槽已满时仍可额外占用一个槽。入站同步计入已占用的槽，但最多占 max_active_jobs - 1 个。
+ */
+static sync_job_t* pick_job() {
+    int inbound = inbound_active < max_active_jobs - 1 ? inbound_active : max_active_jobs - 1;
+    int active = count_active() + inbound;
+    sync_job_t* best = NULL;
+    for (int i = 0; i < job_slots; i++) {
+        sync_job_t* job = &jobs[i];
+        if (job->state != SYNC_JOB_QUEUED) continue;
+        if (focus_id != PK_ID_NONE && job->friend_id == focus_id) {
+            return active <= max_active_jobs ? job : NULL;
+        }
+        if (!best || job->seq < best->seq) best = job;
+    }
+    return active < max_active_jobs ? best : NULL;
+}
+
+static void *scheduler_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&sched_mutex);
+    while (running) {
+        uint64_t now = now_ms();
+        reap_jobs(now);
+
+        sync_job_t* job = pick_job();
+        if (job) {
+            pk_id_t friend_id = job->friend_id;
+            job->state = SYNC_JOB_ACTIVE;
+            job->received = 0;
+            job->started_ms = job->last_activity_ms = now;
+            changed();
+
+            pthread_mutex_unlock(&sched_mutex);
+            int rc = start_fn(friend_id);
+            pthread_mutex_lock(&sched_mutex);
+
+            // 启动失败的任务直接结束（期间可能已被取消或复用）
+            job = find_job(friend_id);
+            if (rc != 0 && job && job->state == SYNC_JOB_ACTIVE && !job->rerun) {
+                job->state = SYNC_JOB_NONE;
+                changed();
+            }
+            continue;
+        }
+
+        if (count_active() == 0) {
+            // 没有执行中的任务就没有需要计时的东西，等提交或停止时再醒来
+            pthread_cond_wait(&sched_cond, &sched_mutex);
+            continue;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SYNC_SCHED_TICK_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&sched_cond, &sched_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return NULL;
+}
+
+int sync_scheduler_start(int max_active, sync_start_fn start) {
+    pthread_mutex_lock(&sched_mutex);
+    if (running) {
+        pthread_mutex_unlock(&sched_mutex);
+        return 0;
+    }
+    jobs = calloc(SYNC_SCHED_INITIAL_JOBS, sizeof(sync_job_t));
+    if (!jobs) {
+        pthread_mutex_unlock(&sched_mutex);
+        return -1;
+    }
+    job_slots = SYNC_SCHED_INITIAL_JOBS;
+    inbound_active = 0;
+    max_active_jobs = max_active > 0 ? max_active : 1;
+    start_fn = start;
+    running = 1;
+    if (pthread_create(&scheduler_tid, NULL, scheduler_thread, NULL) != 0) {
+        running = 0;
+        free(jobs);
+        jobs = NULL;
+        job_slots = 0;
+        pthread_mutex_unlock(&sched_mutex);
+        return -1;
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return 0;
+}
+
+void sync_scheduler_stop() {
+    pthread_mutex_lock(&sched_mutex);
+    if (!running) {
+        pthread_mutex_unlock(&sched_mutex);
+        return;
+    }
+    running = 0;
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_mutex);
+    pthread_join(scheduler_tid, NULL);
+    pthread_mutex_lock(&sched_mutex);
+    free(jobs);
+    jobs = NULL;
+    job_slots = 0;
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+/**
+ * 取得一个空闲的任务槽，没有时把任务表扩大一倍。调用者需持有 sched_mutex。
+ */
+static sync_job_t* alloc_job() {
+    for (int i = 0; i < job_slots; i++) {
+        if (jobs[i].state == SYNC_JOB_NONE) return &jobs[i];
+    }
+    if (job_slots == 0) return NULL; // 调度器未启动
+    sync_job_t *grown = realloc(jobs, (size_t)job_slots * 2 * sizeof(sync_job_t));
+    if (!grown) return NULL;
+    memset(grown + job_slots, 0, (size_t)job_slots * sizeof(sync_job_t));
+    jobs = grown;
+    job_slots *= 2;
+    return &jobs[job_slots / 2];
+}
+
+int sync_scheduler_submit(pk_id_t friend_id) {
+    if (friend_id == PK_ID_NONE) return 0;
+    int rc = 0;
+    pthread_mutex_lock(&sched_mutex);
+    sync_job_t* job = find_job(friend_id);
+    if (job) {
+        if (job->state == SYNC_JOB_ACTIVE) job->rerun = 1;
+    } else if ((job = alloc_job()) != NULL) {
+        job->friend_id = friend_id;
+        enqueue(job);
+    } else {
+        rc = -1;
+    }
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_mutex);
+    return rc;
+}
+
+void sync_scheduler_inbound(int delta) {
+    pthread_mutex_lock(&sched_mutex);
+    inbound_active += delta;
+    if (inbound_active < 0) inbound_active = 0;
+    // 入站同步结束会空出执行槽
+    if (delta < 0) pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+void sync_scheduler_set_focus(pk_id_t friend_id) {
+    pthread_mutex_lock(&sched_mutex);
+    focus_id = friend_id;
+    changed();
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+void sync_scheduler_touch(pk_id_t friend_id, int received) {
+    pthread_mutex_lock(&sched_mutex);
+    sync_job_t* job = find_job(friend_id);
+    if (job && job->state == SYNC_JOB_ACTIVE) {
+        job->last_activity_ms = now_ms();
+        if (received > 0) {
+            job->received += received;
+            changed();
+        }
+    }
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+void sync_scheduler_cancel(pk_id_t friend_id) {
+    pthread_mutex_lock(&sched_mutex);
+    sync_job_t* job = find_job(friend_id);
+    if (job) {
+        job->state = SYNC_JOB_NONE;
+        changed();
+        pthread_cond_signal(&sched_cond);
+    }
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+SyncJobState sync_scheduler_get_state(pk_id_t friend_id, int* received) {
+    SyncJobState state = SYNC_JOB_NONE;
+    pthread_mutex_lock(&sched_mutex);
+    sync_job_t* job = find_job(friend_id);
+    if (job) {
+        state = job->state;
+        if (received) *received = job->received;
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return state;
+}
+
+void sync_scheduler_get_summary(int* active, int* queued) {
+    int a = 0, q = 0;
+    pthread_mutex_lock(&sched_mutex);
+    for (int i = 0; i < job_slots; i++) {
+        if (jobs[i].state == SYNC_JOB_ACTIVE) a++;
+        else if (jobs[i].state == SYNC_JOB_QUEUED) q++;
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    if (active) *active = a;
+    if (queued) *queued = q;
+}
+
+void sync_scheduler_set_notify(sync_notify_fn fn) {
+    pthread_mutex_lock(&sched_mutex);
+    notify_fn = fn;
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+unsigned int sync_scheduler_generation() {
+    pthread_mutex_lock(&sched_mutex);
+    unsigned int g = generation;
+    pthread_mutex_unlock(&sched_mutex);
+    return g;
+}
@@ -0,0 +1,95 @@
+#ifndef ZEROLINK_SYNC_SCHEDULER_H
+#define ZEROLINK_SYNC_SCHEDULER_H
+
+#include "../../core/models/friend.h"
+
+/**
+ * @file sync_scheduler.h
+ * @brief 同步任务调度器。
+ *
+ * 每个好友最多对应一个同步任务：重复的请求会被合并，正在执行的任务收到新请求时只标记为“结束后再跑一轮”。
+ * 同时执行的任务数有上限，当前聊天界面中的会话优先出队，并且可以占用一个额外的执行槽。
+ * 对端发起、由本机提供数据的同步（入站）也占用执行槽，但至少留一个槽给本机发起的任务。
+ * 任务表按需扩容，排队的任务数只受好友数限制。
+ * 同步协议没有显式的结束报文，任务在一段时间内没有任何同步流量后视为完成。
+ */
+
+typedef enum {
+    SYNC_JOB_NONE = 0,  // 没有任务
+    SYNC_JOB_QUEUED,    // 排队中
+    SYNC_JOB_ACTIVE     // 正在同步
+} SyncJobState;
+
+/**
+ * @brief 启动一次同步的回调，在调度线程中调用，调用时不持有调度器的锁。
+ * @return 成功发出同步请求返回 0，失败（例如对端不在线）返回非 0，任务随即结束。
+ */
+typedef int (*sync_start_fn)(pk_id_t friend_id);
+
+/**
+ * @brief 调度状态变化的通知回调，在持有调度器的锁时调用，必须立即返回且不能回调调度器。
+ */
+typedef void (*sync_notify_fn)(void);
+
+/**
+ * @brief 启动调度线程。
+ * @param max_active 同时执行的任务上限。
+ * @param start 启动同步的回调。
+ * @return 成功返回 0，失败返回 -1。
+ */
+int sync_scheduler_start(int max_active, sync_start_fn start);
+
+/**
+ * @brief 停止调度线程并丢弃所有任务。
+ */
+void sync_scheduler_stop();
+
+/**
+ * @brief 为好友提交一个同步任务，已排队或正在执行时不会重复创建。
+ * @return 成功（含合并到已有任务）返回 0；任务表无法扩容时返回 -1，请求被丢弃。
+ */
+int sync_scheduler_submit(pk_id_t friend_id);
+
+/**
+ * @brief 报告入站同步的开始 (delta = 1) 或结束 (delta = -1)。
+ */
+void sync_scheduler_inbound(int delta);
+
+/**
+ * @brief 设置当前聊天界面中的会话，传 PK_ID_NONE 表示没有打开的会话。
+ */
+void sync_scheduler_set_focus(pk_id_t friend_id);
+
+/**
+ * @brief 报告一次同步流量，刷新任务的空闲计时。
+ * @param received 本次新写入的消息数。
+ */
+void sync_scheduler_touch(pk_id_t friend_id, int received);
+
+/**
+ * @brief 取消好友的任务（例如连接断开）。
+ */
+void sync_scheduler_cancel(pk_id_t friend_id);
+
+/**
+ * @brief 查询好友的任务状态。
+ * @param received 若非 NULL，写入本轮已接收的消息数。
+ */
+SyncJobState sync_scheduler_get_state(pk_id_t friend_id, int* received);
+
+/**
+ * @brief 查询正在执行和排队中的任务数（不含入站同步）。
+ */
+void sync_scheduler_get_summary(int* active, int* queued);
+
+/**
+ * @brief 调度状态的版本号，任何任务状态或进度变化都会使其递增，供界面判断是否需要重绘。
+ */
+unsigned int sync_scheduler_generation();
+
+/**
+ * @brief 设置状态变化的通知回调（界面据此唤醒主循环，不必定时轮询版本号），传 NULL 取消。
+ */
+void sync_scheduler_set_notify(sync_notify_fn fn);
+
+#endif //ZEROLINK_SYNC_SCHEDULER_H
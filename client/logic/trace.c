@@ -0,0 +1,85 @@
+#include "trace.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+_Atomic int trace_enabled = 0;
+
+static trace_file_header_t *trace_header = NULL;
+static trace_record_t *trace_records = NULL;
+static size_t trace_map_size = 0;
+
+static const char* const stage_names[TRACE_STAGE_COUNT] = {
+    "send", "encrypted", "sent", "received", "decrypted", "parsed", "persisted", "displayed",
+};
+
+int trace_start(const char* path, uint64_t records, const char* node) {
+    if (trace_header) return -1;
+    if (records == 0) records = TRACE_DEFAULT_RECORDS;
+    size_t size = sizeof(trace_file_header_t) + records * sizeof(trace_record_t);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    // 新文件的内容全为 0，所有记录的 seq 都是“未写入”
+    trace_header = map;
+    memcpy(trace_header->magic, TRACE_MAGIC, sizeof(trace_header->magic));
+    trace_header->version = TRACE_VERSION;
+    trace_header->record_size = sizeof(trace_record_t);
+    trace_header->capacity = records;
+    atomic_store(&trace_header->next, 0);
+    snprintf(trace_header->node, sizeof(trace_header->node), "%s", node ? node : "");
+    trace_records = (trace_record_t*)(trace_header + 1);
+    trace_map_size = size;
+    atomic_store(&trace_enabled, 1);
+    return 0;
+}
+
+void trace_stop() {
+    if (!trace_header) return;
+    atomic_store(&trace_enabled, 0);
+    msync(trace_header, trace_map_size, MS_SYNC);
+}
+
+uint64_t trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t trace_id_from_uid(const unsigned char* uid) {
+    uint64_t id = 0;
+    for (int i = 0; i < 8; i++) id = (id << 8) | uid[i];
+    return id;
+}
+
+void trace_span_at(uint64_t trace_id, trace_stage_t stage, uint64_t ts_ns, uint32_t arg) {
+    if (!trace_active()) return;
+    uint64_t seq = atomic_fetch_add_explicit(&trace_header->next, 1, memory_order_relaxed);
+    trace_record_t *r = &trace_records[seq % trace_header->capacity];
+    // 先作废槽位再写内容，读者看到的 seq 与内容总是一致的
+    atomic_store_explicit(&r->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    r->trace_id = trace_id;
+    r->ts_ns = ts_ns;
+    r->stage = (uint32_t)stage;
+    r->arg = arg;
+    atomic_store_explicit(&r->seq, seq + 1, memory_order_release);
+}
+
+void trace_span(uint64_t trace_id, trace_stage_t stage, uint32_t arg) {
+    if (!trace_active()) return;
+    trace_span_at(trace_id, stage, trace_now_ns(), arg);
+}
+
+const char* trace_stage_name(trace_stage_t stage) {
+    return stage < TRACE_STAGE_COUNT ? stage_names[stage] : "?";
+}
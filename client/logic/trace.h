@@ -0,0 +1,100 @@
+#ifndef ZEROLINK_TRACE_H
+#define ZEROLINK_TRACE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/**
+ * @file trace.h
+ * @brief 单条消息的延迟追踪：消息经过发送、加密、发出、收到、解密、解析、写库、显示各阶段时记一个时间点。
+ *
+ * 时间点写进一个内存映射的环形文件（定长记录，写满后覆盖最早的），进程崩溃也不丢已写的部分；
+ * 离线用 tools/trace_dump 合并收发两端的文件，按消息还原时间线。
+ * 追踪 ID 取消息 UID 的前 8 个字节，收发两端不需要额外协商；时间用 CLOCK_REALTIME，同一台机器上的多个进程可以直接对比。
+ * 未开启时每个记录点只多一次原子读。
+ */
+
+#define TRACE_MAGIC "ZLTRACE1"
+#define TRACE_VERSION 1
+#define TRACE_NODE_SIZE 32
+#define TRACE_DEFAULT_RECORDS 65536
+
+typedef enum {
+    TRACE_STAGE_SEND,       ///< 进入 send_chat_message
+    TRACE_STAGE_ENCRYPTED,  ///< 加密完成，arg 为帧长度
+    TRACE_STAGE_SENT,       ///< 帧已交给 socket，arg 为帧长度
+    TRACE_STAGE_RECEIVED,   ///< 所在的数据从 socket 读出
+    TRACE_STAGE_DECRYPTED,  ///< 所在的一批帧解密完成
+    TRACE_STAGE_PARSED,     ///< JSON 解析完成
+    TRACE_STAGE_PERSISTED,  ///< 写入数据库完成（发送方写的是自己的副本）
+    TRACE_STAGE_DISPLAYED,  ///< 作为新消息被界面或控制接口读出
+    TRACE_STAGE_COUNT
+} trace_stage_t;
+
+/**
+ * @struct trace_file_header_t
+ * @brief 环形文件头，其后紧跟 capacity 条 trace_record_t。
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    _Atomic uint64_t next;          ///< 下一条记录的序号，对 capacity 取余即槽位
+    char node[TRACE_NODE_SIZE];     ///< 写入者的标识（本机公钥开头）
+} trace_file_header_t;
+
+/**
+ * @struct trace_record_t
+ * @brief 一个时间点。seq 为序号加一，最后写入：为 0 或与槽位对不上的记录尚未写完或已被覆盖。
+ */
+typedef struct {
+    _Atomic uint64_t seq;
+    uint64_t trace_id;
+    uint64_t ts_ns;
+    uint32_t stage;
+    uint32_t arg;
+} trace_record_t;
+
+extern _Atomic int trace_enabled;
+
+/**
+ * @brief 追踪是否开启；记录点先检查它，未开启时不取时间也不计算追踪 ID。
+ */
+static inline int trace_active() {
+    return atomic_load_explicit(&trace_enabled, memory_order_relaxed);
+}
+
+/**
+ * @brief 创建（覆盖）环形文件并开始追踪。
+ * @param records 环中的记录数，0 表示 TRACE_DEFAULT_RECORDS。
+ * @param node 写入文件头的本端标识。
+ * @return 成功返回 0，失败返回 -1。
+ */
+int trace_start(const char* path, uint64_t records, const char* node);
+
+/**
+ * @brief 停止追踪并把映射写回文件。映射保留到进程退出，仍在运行的网络线程不会写到已解除的内存。
+ */
+void trace_stop();
+
+uint64_t trace_now_ns();
+
+/**
+ * @brief 由消息 UID 得到追踪 ID。
+ */
+uint64_t trace_id_from_uid(const unsigned char* uid);
+
+/**
+ * @brief 记录一个时间点，ts_ns 为 trace_now_ns 的返回值。未开启时什么也不做。
+ */
+void trace_span_at(uint64_t trace_id, trace_stage_t stage, uint64_t ts_ns, uint32_t arg);
+
+/**
+ * @brief 以当前时间记录一个时间点。
+ */
+void trace_span(uint64_t trace_id, trace_stage_t stage, uint32_t arg);
+
+const char* trace_stage_name(trace_stage_t stage);
+
+#endif //ZEROLINK_TRACE_H
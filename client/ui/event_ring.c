@@ -0,0 +1,108 @@
+#include "event_ring.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    atomic_size_t seq;   // 等于写入位置时空闲可写，等于写入位置 + 1 时已发布可读
+    ui_event_t event;
+} ring_slot_t;
+
+struct EventRing {
+    ring_slot_t *slots;
+    size_t mask;
+    size_t log_limit;                   // 日志最多占用的槽位数
+    _Alignas(64) atomic_size_t head;    // 下一个写入位置，生产者竞争
+    _Alignas(64) atomic_size_t tail;    // 下一个读取位置，只有消费者写
+    atomic_uint_fast64_t drops[UI_EVENT_TYPES];
+};
+
+EventRing* event_ring_create(size_t capacity) {
+    size_t size = 16;
+    while (size < capacity) size <<= 1;
+    EventRing *ring = calloc(1, sizeof(EventRing));
+    if (!ring) return NULL;
+    ring->slots = calloc(size, sizeof(ring_slot_t));
+    if (!ring->slots) {
+        free(ring);
+        return NULL;
+    }
+    for (size_t i = 0; i < size; i++) atomic_init(&ring->slots[i].seq, i);
+    ring->mask = size - 1;
+    ring->log_limit = size - size / 4;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    for (int t = 0; t < UI_EVENT_TYPES; t++) atomic_init(&ring->drops[t], 0);
+    return ring;
+}
+
+void event_ring_destroy(EventRing* ring) {
+    if (!ring) return;
+    free(ring->slots);
+    free(ring);
+}
+
+// 复制文本，截断时不留下半个 UTF-8 字符
+static void copy_text(char* dst, const char* src) {
+    size_t len = strlen(src);
+    if (len >= UI_EVENT_TEXT_BYTES) {
+        len = UI_EVENT_TEXT_BYTES - 1;
+        while (len > 0 && ((unsigned char)src[len] & 0xC0) == 0x80) len--;
+    }
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+int event_ring_push(EventRing* ring, ui_event_type_t type, pk_id_t chat_id, const char* text) {
+    size_t limit = type == UI_EVENT_LOG ? ring->log_limit : ring->mask + 1;
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring_slot_t *slot;
+    for (;;) {
+        // 占用数只是估计值（消费者可能同时在归还），只用于溢出策略
+        intptr_t used = (intptr_t)(pos - atomic_load_explicit(&ring->tail, memory_order_acquire));
+        if (used >= (intptr_t)limit) goto full;
+        slot = &ring->slots[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            goto full; // 消费者还没有归还这个槽位
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+    slot->event.type = type;
+    slot->event.chat_id = chat_id;
+    copy_text(slot->event.text, text ? text : "");
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 0;
+full:
+    atomic_fetch_add_explicit(&ring->drops[type], 1, memory_order_relaxed);
+    return -1;
+}
+
+const ui_event_t* event_ring_peek(EventRing* ring) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring_slot_t *slot = &ring->slots[pos & ring->mask];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) return NULL;
+    return &slot->event;
+}
+
+void event_ring_pop(EventRing* ring) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring_slot_t *slot = &ring->slots[pos & ring->mask];
+    // 槽位下一次被写入时的位置是 pos + 容量
+    atomic_store_explicit(&slot->seq, pos + ring->mask + 1, memory_order_release);
+    atomic_store_explicit(&ring->tail, pos + 1, memory_order_release);
+}
+
+uint64_t event_ring_take_drops(EventRing* ring, ui_event_type_t type) {
+    return atomic_exchange_explicit(&ring->drops[type], 0, memory_order_relaxed);
+}
+
+size_t event_ring_size(EventRing* ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    return head > tail ? head - tail : 0;
+}
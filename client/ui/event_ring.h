@@ -0,0 +1,74 @@
+#ifndef ZEROLINK_EVENT_RING_H
+#define ZEROLINK_EVENT_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../../core/models/pk_intern.h"
+
+/**
+ * @file event_ring.h
+ * @brief 后台线程向界面线程投递事件的无锁环形队列（多生产者、单消费者）。
+ *
+ * 槽位在创建时一次分配，事件的文本直接写进槽位，投递过程不加锁、不分配内存，队列满时立即丢弃并计数，
+ * 网络线程永远不会等待界面。每个槽位带一个序号：生产者用 CAS 抢占写入位置，写完后发布序号；
+ * 消费者按序号判断槽位是否已写完，可以原地读取后再归还。
+ * 溢出策略：日志只能占用 3/4 的槽位，剩下的留给聊天消息和状态通知，日志刷屏时聊天消息仍能显示。
+ */
+
+#define UI_EVENT_TEXT_BYTES 1024  // 超长的文本在 UTF-8 字符边界处截断（聊天记录本身不受影响）
+
+typedef enum {
+    UI_EVENT_LOG = 0,   ///< 系统日志
+    UI_EVENT_CHAT,      ///< 某个会话写入了新消息（不带文本），该会话打开时从数据库读取
+    UI_EVENT_STATUS,    ///< 同步等状态变化，界面重绘相应部分
+    UI_EVENT_TYPES
+} ui_event_type_t;
+
+/**
+ * @struct ui_event_t
+ * @brief 一个事件槽位的内容。
+ */
+typedef struct {
+    ui_event_type_t type;
+    pk_id_t chat_id;                 ///< UI_EVENT_CHAT 所属的会话
+    char text[UI_EVENT_TEXT_BYTES];
+} ui_event_t;
+
+typedef struct EventRing EventRing;
+
+/**
+ * @brief 创建队列，capacity 向上取整为 2 的幂。
+ * @return 内存不足时返回 NULL。
+ */
+EventRing* event_ring_create(size_t capacity);
+
+void event_ring_destroy(EventRing* ring);
+
+/**
+ * @brief (线程安全，无锁) 投递一个事件。text 可以为 NULL。
+ * @return 成功返回 0；超出该类型可用的槽位时丢弃并计数，返回 -1。
+ */
+int event_ring_push(EventRing* ring, ui_event_type_t type, pk_id_t chat_id, const char* text);
+
+/**
+ * @brief (仅消费者) 取得队首事件，在 event_ring_pop 之前一直有效。
+ * @return 队列为空时返回 NULL。
+ */
+const ui_event_t* event_ring_peek(EventRing* ring);
+
+/**
+ * @brief (仅消费者) 归还队首事件的槽位。
+ */
+void event_ring_pop(EventRing* ring);
+
+/**
+ * @brief 取出并清零某类事件自上次调用以来被丢弃的数量。
+ */
+uint64_t event_ring_take_drops(EventRing* ring, ui_event_type_t type);
+
+/**
+ * @brief 队列中的事件数。生产者可能同时在写入，只是估计值，用于统计。
+ */
+size_t event_ring_size(EventRing* ring);
+
+#endif //ZEROLINK_EVENT_RING_H
@@ -1,5 +1,10 @@
+#define _GNU_SOURCE // wcwidth
 #include "ui.h"
 #include "../logic/client_logic.h"
+#include "../logic/sync_scheduler.h"
+#include "../logic/contact_store.h"
+#include "../logic/metrics.h"
+#include "event_ring.h"
 #include <ncurses.h>
 #include <string.h>
 #include <stdlib.h>
@@ -7,34 +12,90 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <locale.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <stdatomic.h>
+#include <wchar.h>
 
 // --- 全局UI状态变量定义 ---
 UIState current_ui_state = UI_STATE_MAIN;
 int main_tab_index = 0;
 int friend_list_index = 0;
 char chat_target_name[32];
-char chat_target_pk_hex[PK_HEX_LEN + 1];
+pk_id_t chat_target_id = PK_ID_NONE;
 
 // --- 内部UI组件和状态 ---
 static WINDOW *log_win, *content_win, *input_win;
 static WINDOW *log_border, *content_border, *input_border;
 static volatile sig_atomic_t ui_needs_resize = 0;
+static unsigned int sync_view_generation = 0; // 界面上显示的同步状态对应的版本号
+static int event_fd = -1;                      // 后台线程与信号处理函数唤醒主循环用的 eventfd
 const char* TABS[] = {"好友", "添加好友", "设置", "退出"};
 const int NUM_TABS = sizeof(TABS)/sizeof(TABS[0]);
 
-// --- 日志队列 ---
-#define MAX_LOG_MESSAGES 100
-static char *log_queue[MAX_LOG_MESSAGES];
-static int log_queue_head = 0, log_queue_tail = 0;
-static pthread_mutex_t log_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+// --- 好友列表：以名字为游标分页读取，可按前缀筛选 ---
+#define FRIEND_PAGE_MAX 128
+static char friend_filter[CONTACT_NAME_SIZE];
+static char friend_page_after[CONTACT_NAME_SIZE]; // 窗口第一行之前那位好友的名字，空串表示从头显示
+static contact_t friend_page[FRIEND_PAGE_MAX];    // 当前窗口中的好友，绘制时更新
+static int friend_page_count = 0;
+static int friend_page_rows = 1;
+
+// --- 搜索翻页 ---
+#define SEARCH_PAGE_SIZE 10
+static char search_query[256];
+static int search_offset = 0;
+
+// --- 事件队列（后台线程 -> 界面线程）---
+#define UI_EVENT_CAPACITY 1024
+#define UI_EVENT_BATCH 256          // 每轮最多处理的事件数，剩下的留到下一轮，先响应按键
+static EventRing *events = NULL;
+static pthread_once_t events_once = PTHREAD_ONCE_INIT;
+static atomic_int wake_pending = 0;     // 已写 eventfd、主循环尚未处理
+static atomic_int status_pending = 0;   // 队列中已有一个未处理的状态通知
+static int frame_dirty = 0;             // 本轮有窗口已 wnoutrefresh，等待 doupdate
+
+// --- 聊天视图：已格式化的行保存在内存环形缓冲中，按行号游标从数据库分页加载，只绘制可见的部分 ---
+#define CHAT_VIEW_LINES 2000 // 内存中最多保留的行数，超出后丢弃离视口较远的一端
+#define CHAT_PAGE_LOAD 200   // 每次从数据库加载的消息数
+
+typedef struct {
+    sqlite3_int64 id; // 消息在会话中的行号，日志行为 0
+    char *text;
+    int rows;         // 按 rows_width 列折行后占的屏幕行数，宽度变化时重新计算
+    int rows_width;
+} chat_line_t;
+
+static chat_line_t chat_lines[CHAT_VIEW_LINES];
+static int chat_first = 0, chat_count = 0; // chat_first 为最早一行在环中的位置
+static int chat_scroll = 0;    // 视口底部到最新一行底部之间的屏幕行数，0 表示跟随最新消息
+static int chat_has_older = 0; // 最早一行之前数据库中还有消息
+static int chat_has_newer = 0; // 最新一行之后数据库中还有消息（查看旧消息时较新的行被丢弃，或新消息尚未载入）
+static int chat_dirty = 0;
+static int chat_title_hint = -1; // 标题上当前显示的提示，变化时才重绘标题
+
+// --- 设置页的运行统计 ---
+#define SETTINGS_TAB 2
+#define STATS_REFRESH_MS 1000
+#define STATS_PEERS_MAX 32
+static uint64_t stats_drawn_ns = 0; // 上次绘制运行统计的时刻
 
 // --- 内部函数原型 ---
 static void draw_main_view();
+static void draw_stats(int row);
 static void draw_chat_view();
+static void draw_chat_title();
+static void refresh_sync_status();
 static void handle_winch(int sig);
 static void draw_tabs();
 static void add_line_to_window(WINDOW *win, const char* msg);
 static void delete_windows();
+static void show_search_page();
+static void friend_list_move(int delta);
+static void chat_view_clear();
+static void chat_view_open();
+static void ui_flush();
 
 void init_ui() {
     setlocale(LC_ALL, "");
@@ -48,13 +109,51 @@ void init_ui() {
     init_pair(2, COLOR_GREEN, -1);
     init_pair(3, COLOR_YELLOW, -1);
     init_pair(4, COLOR_WHITE, COLOR_CYAN); // 高亮标签
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     signal(SIGWINCH, handle_winch);
     keypad(stdscr, TRUE);
+    static const client_events_t ui_events = { queue_log_message, queue_chat_update };
+    set_client_events(&ui_events);
+    sync_scheduler_set_notify(ui_status_changed);
     redraw_ui();
+    ui_flush();
 }
 
 void destroy_ui() {
+    sync_scheduler_set_notify(NULL);
+    set_client_events(NULL);
+    chat_view_clear();
     endwin();
+    if (event_fd >= 0) close(event_fd);
+    event_fd = -1;
+}
+
+int ui_event_fd() {
+    return event_fd;
+}
+
+void ui_notify() {
+    // 只用到原子操作和一次 write 系统调用，可以在信号处理函数中使用；主循环处理之前的重复通知不再写 eventfd
+    if (event_fd < 0 || atomic_exchange(&wake_pending, 1)) return;
+    uint64_t one = 1;
+    ssize_t n = write(event_fd, &one, sizeof(one));
+    (void)n;
+}
+
+void ui_clear_events() {
+    uint64_t count;
+    // 先清标志再读队列：之后投递的事件要么在本轮被读到，要么会再次写 eventfd
+    atomic_store(&wake_pending, 0);
+    while (event_fd >= 0 && read(event_fd, &count, sizeof(count)) == sizeof(count)) {}
+}
+
+static void events_init() {
+    events = event_ring_create(UI_EVENT_CAPACITY);
+}
+
+static void post_event(ui_event_type_t type, pk_id_t chat_id, const char* text) {
+    pthread_once(&events_once, events_init);
+    if (events && event_ring_push(events, type, chat_id, text) == 0) ui_notify();
 }
 
 static void delete_windows() {
@@ -70,8 +169,238 @@ static void delete_windows() {
 static void add_line_to_window(WINDOW *win, const char* msg) {
     if (win) {
         wprintw(win, "%s\n", msg);
-        wrefresh(win);
+        wnoutrefresh(win); // 一帧中的所有日志只在最后 doupdate 一次
+        frame_dirty = 1;
+    }
+}
+
+/**
+ * 取 s 开头一个屏幕行放得下的部分（按显示宽度计算，至少一个字符），遇到换行符截止。
+ * @return 这部分的字节数，*next 指向下一行的开头。
+ */
+static size_t wrap_segment(const char* s, int width, const char** next) {
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+    size_t len = 0;
+    int cols = 0;
+    while (s[len] && s[len] != '\n') {
+        wchar_t wc;
+        size_t n = mbrtowc(&wc, s + len, MB_CUR_MAX, &state);
+        int w = 1;
+        if (n == (size_t)-1 || n == (size_t)-2) {
+            // 无效的字节按一列处理
+            n = 1;
+            memset(&state, 0, sizeof(state));
+        } else {
+            w = wcwidth(wc);
+            if (w < 0) w = 1;
+        }
+        if (cols + w > width && len > 0) break;
+        cols += w;
+        len += n;
+    }
+    *next = s + len + (s[len] == '\n');
+    return len;
+}
+
+static chat_line_t* chat_line_at(int i) {
+    return &chat_lines[(chat_first + i) % CHAT_VIEW_LINES];
+}
+
+static int chat_line_rows(chat_line_t* line, int width) {
+    if (line->rows_width != width) {
+        const char *s = line->text;
+        line->rows = 0;
+        do {
+            wrap_segment(s, width, &s);
+            line->rows++;
+        } while (*s);
+        line->rows_width = width;
     }
+    return line->rows;
+}
+
+static int chat_view_width() {
+    int width = content_win ? getmaxx(content_win) : 80;
+    return width > 0 ? width : 1;
+}
+
+static int chat_view_height() {
+    int height = content_win ? getmaxy(content_win) : 1;
+    return height > 0 ? height : 1;
+}
+
+static void chat_view_clear() {
+    for (int i = 0; i < chat_count; i++) free(chat_line_at(i)->text);
+    chat_first = chat_count = 0;
+    chat_scroll = 0;
+    chat_has_older = chat_has_newer = 0;
+    chat_dirty = 1;
+}
+
+/**
+ * 在最新一行之后追加。缓冲区满时丢弃最早一行；查看旧消息时视口随之上移，画面保持不动。
+ */
+static void chat_push_back(sqlite3_int64 id, const char* text) {
+    char *copy = strdup(text);
+    if (!copy) return;
+    if (chat_count == CHAT_VIEW_LINES) {
+        chat_line_t *oldest = chat_line_at(0);
+        if (oldest->id > 0) chat_has_older = 1;
+        free(oldest->text);
+        chat_first = (chat_first + 1) % CHAT_VIEW_LINES;
+        chat_count--;
+    }
+    chat_line_t *line = chat_line_at(chat_count++);
+    *line = (chat_line_t){ id, copy, 0, 0 };
+    if (chat_scroll > 0) chat_scroll += chat_line_rows(line, chat_view_width());
+    chat_dirty = 1;
+}
+
+/**
+ * 在最早一行之前插入。缓冲区满时丢弃最新一行，之后需要时再从数据库读回。
+ */
+static void chat_push_front(sqlite3_int64 id, const char* text) {
+    char *copy = strdup(text);
+    if (!copy) return;
+    if (chat_count == CHAT_VIEW_LINES) {
+        chat_line_t *newest = chat_line_at(chat_count - 1);
+        chat_scroll -= chat_line_rows(newest, chat_view_width());
+        if (chat_scroll < 0) chat_scroll = 0;
+        chat_has_newer = 1;
+        free(newest->text);
+        chat_count--;
+    }
+    chat_first = (chat_first + CHAT_VIEW_LINES - 1) % CHAT_VIEW_LINES;
+    chat_count++;
+    *chat_line_at(0) = (chat_line_t){ id, copy, 0, 0 };
+    chat_dirty = 1;
+}
+
+static void push_front_row(void* ctx, sqlite3_int64 id, const char* line) {
+    (void)ctx;
+    chat_push_front(id, line);
+}
+
+static void push_back_row(void* ctx, sqlite3_int64 id, const char* line) {
+    (void)ctx;
+    chat_push_back(id, line);
+}
+
+/**
+ * 以缓冲区中最早一条消息的行号为游标，向前加载一页。
+ */
+static void chat_load_older() {
+    sqlite3_int64 cursor = 0;
+    for (int i = 0; i < chat_count && cursor == 0; i++) cursor = chat_line_at(i)->id;
+    if (cursor == 0 && chat_count > 0) return; // 缓冲区里只有日志行，打开会话时已确认没有更早的消息
+    int n = read_chat_history(chat_target_id, cursor, 1, CHAT_PAGE_LOAD, push_front_row, NULL);
+    if (n >= 0) chat_has_older = n == CHAT_PAGE_LOAD;
+}
+
+/**
+ * 以缓冲区中最新一条消息的行号为游标，向后加载一页。
+ * @return 这一页是否已读到数据库中的最新消息。
+ */
+static int chat_load_newer() {
+    sqlite3_int64 cursor = 0;
+    for (int i = chat_count - 1; i >= 0 && cursor == 0; i--) cursor = chat_line_at(i)->id;
+    if (cursor == 0 && chat_has_older) {
+        // 缓冲区里的消息都已被日志挤掉，无从接续，重新读最新的一页
+        chat_view_open();
+        return 1;
+    }
+    int n = read_chat_history(chat_target_id, cursor, 0, CHAT_PAGE_LOAD, push_back_row, NULL);
+    if (n < 0) return 1;
+    chat_has_newer = n == CHAT_PAGE_LOAD;
+    return !chat_has_newer;
+}
+
+/**
+ * 打开当前会话：丢弃缓冲区，从最新的消息开始加载一页。
+ */
+static void chat_view_open() {
+    chat_view_clear();
+    chat_load_older();
+}
+
+/**
+ * 回到最新消息。缓冲区与最新消息之间有缺口时重新打开，不逐页读完中间的消息。
+ */
+static void chat_view_follow() {
+    if (chat_has_newer) chat_view_open();
+    chat_scroll = 0;
+    chat_dirty = 1;
+}
+
+/**
+ * 会话写入了新消息：跟随最新消息或缓冲区中已有最新消息时读入，否则只在标题上提示。
+ * 一次同步写入上万条消息时只读最后一页。
+ */
+static void chat_view_updated() {
+    if (chat_has_newer) {
+        chat_dirty = 1;
+        return;
+    }
+    if (!chat_load_newer() && chat_scroll == 0) chat_view_open();
+}
+
+/**
+ * 视口上移 delta 行（负数为下移）。接近已加载部分的顶端时向前加载，回到底部时向后加载。
+ */
+static void chat_view_scroll(int delta) {
+    int width = chat_view_width(), height = chat_view_height();
+    if (delta > 0) {
+        int total = 0;
+        for (int i = 0; i < chat_count; i++) total += chat_line_rows(chat_line_at(i), width);
+        if (chat_has_older && chat_scroll + delta + height > total) {
+            int before = chat_count;
+            chat_load_older();
+            for (int i = 0; i < chat_count - before; i++) total += chat_line_rows(chat_line_at(i), width);
+        }
+        chat_scroll += delta;
+        if (chat_scroll > total - height) chat_scroll = total > height ? total - height : 0;
+    } else {
+        chat_scroll += delta;
+        if (chat_scroll < 0) chat_scroll = 0;
+        if (chat_scroll == 0 && chat_has_newer) {
+            // 保持画面不动：新读入的行都在视口下方
+            chat_scroll = 1;
+            chat_load_newer();
+            if (chat_scroll > 0) chat_scroll--;
+        }
+    }
+    chat_dirty = 1;
+}
+
+/**
+ * 只绘制视口内的行：从最新一行往上，跳过视口下方的 chat_scroll 行，画满窗口为止。
+ */
+static void render_chat_view() {
+    int width = chat_view_width(), height = chat_view_height();
+    int skip = chat_scroll, bottom = height;
+    werase(content_win);
+    for (int i = chat_count - 1; i >= 0 && bottom > 0; i--) {
+        chat_line_t *line = chat_line_at(i);
+        int rows = chat_line_rows(line, width);
+        if (skip >= rows) {
+            skip -= rows;
+            continue;
+        }
+        int top = bottom - (rows - skip);
+        const char *s = line->text;
+        for (int r = 0; r < rows - skip; r++) {
+            const char *next;
+            size_t len = wrap_segment(s, width, &next);
+            if (top + r >= 0) mvwaddnstr(content_win, top + r, 0, s, (int)len);
+            s = next;
+        }
+        skip = 0;
+        bottom = top;
+    }
+    wnoutrefresh(content_win);
+    chat_dirty = 0;
+    frame_dirty = 1;
 }
 
 static void draw_tabs() {
@@ -94,35 +423,199 @@ static void draw_tabs() {
         x_offset++;
     }
     wattroff(content_border, COLOR_PAIR(1));
-    wrefresh(content_border);
+    wnoutrefresh(content_border);
+    frame_dirty = 1;
+}
+
+static void format_ns(uint64_t ns, char* buf, size_t len) {
+    if (ns < 1000) snprintf(buf, len, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000) snprintf(buf, len, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, len, "%.1fms", ns / 1e6);
+    else snprintf(buf, len, "%.1fs", ns / 1e9);
+}
+
+static void format_bytes(uint64_t bytes, char* buf, size_t len) {
+    if (bytes < 1024) snprintf(buf, len, "%lluB", (unsigned long long)bytes);
+    else if (bytes < 1024 * 1024) snprintf(buf, len, "%.1fK", bytes / 1024.0);
+    else if (bytes < 1024ULL * 1024 * 1024) snprintf(buf, len, "%.1fM", bytes / (1024.0 * 1024));
+    else snprintf(buf, len, "%.2fG", bytes / (1024.0 * 1024 * 1024));
+}
+
+/**
+ * 在设置页从第 row 行起绘制运行统计：总体计数、耗时分布和各连接的流量，放不下的部分省略。
+ */
+static void draw_stats(int row) {
+    int bottom = getmaxy(content_win);
+    metrics_snapshot_t snap;
+    metrics_snapshot(&snap);
+    stats_drawn_ns = metrics_now_ns();
+    char out[16], in[16];
+
+    if (row >= bottom) return;
+    wattron(content_win, COLOR_PAIR(3));
+    mvwprintw(content_win, row++, 2, "--- 运行统计 (每秒刷新，已运行 %llu 秒) ---", (unsigned long long)(snap.uptime_ms / 1000));
+    wattroff(content_win, COLOR_PAIR(3));
+    if (row >= bottom) return;
+    format_bytes(snap.counters[METRIC_BYTES_OUT], out, sizeof(out));
+    format_bytes(snap.counters[METRIC_BYTES_IN], in, sizeof(in));
+    mvwprintw(content_win, row++, 2, "链路: 发送 %s / %llu 帧, 接收 %s / %llu 帧, 解密失败 %llu",
+              out, (unsigned long long)snap.counters[METRIC_FRAMES_OUT],
+              in, (unsigned long long)snap.counters[METRIC_FRAMES_IN],
+              (unsigned long long)snap.counters[METRIC_DECRYPT_FAILED]);
+    if (row >= bottom) return;
+    mvwprintw(content_win, row++, 2, "消息: 发出 %llu, 实时收到 %llu, 同步补齐 %llu (同步任务已完成 %llu 个)",
+              (unsigned long long)snap.counters[METRIC_MESSAGES_SENT],
+              (unsigned long long)snap.counters[METRIC_MESSAGES_RECEIVED],
+              (unsigned long long)snap.counters[METRIC_SYNC_MESSAGES],
+              (unsigned long long)snap.counters[METRIC_SYNC_JOBS]);
+    if (row >= bottom) return;
+    mvwprintw(content_win, row++, 2, "事件队列: 当前 %lld, 丢弃日志 %llu, 丢弃新消息通知 %llu",
+              (long long)snap.gauges[METRIC_GAUGE_EVENT_QUEUE],
+              (unsigned long long)snap.counters[METRIC_LOG_DROPPED],
+              (unsigned long long)snap.counters[METRIC_CHAT_EVENT_DROPPED]);
+
+    if (++row >= bottom) return;
+    mvwprintw(content_win, row++, 2, "%-16s %10s %10s %10s %10s", "耗时", "次数", "p50", "p99", "最大");
+    for (int i = 0; i < METRIC_HIST_COUNT && row < bottom; i++) {
+        const metric_hist_summary_t *h = &snap.hists[i];
+        char p50[16], p99[16], max[16];
+        format_ns(h->p50_ns, p50, sizeof(p50));
+        format_ns(h->p99_ns, p99, sizeof(p99));
+        format_ns(h->max_ns, max, sizeof(max));
+        mvwprintw(content_win, row++, 2, "%-16s %10llu %10s %10s %10s", metrics_hist_name((metric_hist_t)i),
+                  (unsigned long long)h->count, p50, p99, max);
+    }
+
+    if (++row >= bottom) return;
+    peer_traffic_t traffic[STATS_PEERS_MAX];
+    int n = get_peer_traffic(traffic, STATS_PEERS_MAX);
+    mvwprintw(content_win, row++, 2, "连接 (%d):", n);
+    for (int i = 0; i < n && row < bottom; i++) {
+        char name[16];
+        const char *contact = contact_store_name(traffic[i].id);
+        format_bytes(traffic[i].bytes_out, out, sizeof(out));
+        format_bytes(traffic[i].bytes_in, in, sizeof(in));
+        mvwprintw(content_win, row++, 4, "%-16s %-4s 发送 %8s / %-7llu 接收 %8s / %llu",
+                  contact ? contact : get_sender_name(traffic[i].id, name, sizeof(name)),
+                  traffic[i].relayed ? "中继" : "直连",
+                  out, (unsigned long long)traffic[i].frames_out,
+                  in, (unsigned long long)traffic[i].frames_in);
+    }
 }
 
 static void draw_main_view() {
     werase(content_win);
     
     if (main_tab_index == 0) { // 好友
-        int friend_count = get_friend_count();
-        friend_t** friends = get_friends();
-        for (int i = 0; i < friend_count; i++) {
-            if (i == friend_list_index) wattron(content_win, A_REVERSE);
-            mvwprintw(content_win, 1 + i, 2, "%s", friends[i]->name);
-            if (i == friend_list_index) wattroff(content_win, A_REVERSE);
+        // 最后两行留给筛选条件和选中好友的信息
+        friend_page_rows = getmaxy(content_win) - 4;
+        if (friend_page_rows > FRIEND_PAGE_MAX) friend_page_rows = FRIEND_PAGE_MAX;
+        if (friend_page_rows < 1) friend_page_rows = 1;
+        friend_page_count = contact_store_list(friend_filter, friend_page_after[0] ? friend_page_after : NULL, friend_page, friend_page_rows);
+        if (friend_page_count < 0) friend_page_count = 0;
+        if (friend_list_index >= friend_page_count) friend_list_index = friend_page_count > 0 ? friend_page_count - 1 : 0;
+        int n = friend_page_count;
+        contact_t *page = friend_page;
+        for (int i = 0; i < n; i++) {
+            int selected = i == friend_list_index;
+            if (selected) wattron(content_win, A_REVERSE);
+            mvwprintw(content_win, 1 + i, 2, page[i].kind == CONTACT_KIND_GROUP ? "[群] %s" : "%s", page[i].name);
+            if (selected) wattroff(content_win, A_REVERSE);
+            int received = 0;
+            SyncJobState sync_state = page[i].id != PK_ID_NONE ? sync_scheduler_get_state(page[i].id, &received) : SYNC_JOB_NONE;
+            if (sync_state == SYNC_JOB_ACTIVE) {
+                wattron(content_win, COLOR_PAIR(3));
+                wprintw(content_win, "  [同步中: 已接收 %d 条]", received);
+                wattroff(content_win, COLOR_PAIR(3));
+            } else if (sync_state == SYNC_JOB_QUEUED) {
+                wprintw(content_win, "  [等待同步]");
+            }
+        }
+        int bottom = getmaxy(content_win) - 2;
+        if (friend_filter[0]) mvwprintw(content_win, bottom, 2, "筛选: %s (%d 位匹配，退格删除)", friend_filter, contact_store_count_prefix(friend_filter));
+        else mvwprintw(content_win, bottom, 2, "共 %d 个联系人（含群），直接输入名字开头可筛选", contact_store_count());
+        // 元数据只为选中的好友读取
+        contact_info_t info;
+        if (friend_list_index < n && contact_store_get_info(page[friend_list_index].pk, &info) == 0) {
+            char added[32] = "未知", seen[32] = "从未连接";
+            time_t ts;
+            if (info.added_at > 0) { ts = (time_t)info.added_at; strftime(added, sizeof(added), "%Y-%m-%d", localtime(&ts)); }
+            if (info.last_seen > 0) { ts = (time_t)info.last_seen; strftime(seen, sizeof(seen), "%Y-%m-%d %H:%M", localtime(&ts)); }
+            mvwprintw(content_win, bottom + 1, 2, "添加于 %s，最近连接 %s", added, seen);
         }
     } else if (main_tab_index == 1) { // 添加好友
         mvwprintw(content_win, 1, 2, "按回车键进入添加好友流程。");
-    } else if (main_tab_index == 2) { // 设置
+    } else if (main_tab_index == SETTINGS_TAB) { // 设置
         mvwprintw(content_win, 1, 2, "本机公钥 (ID): %s", get_my_public_key_hex());
         mvwprintw(content_win, 2, 2, "P2P 监听端口: %d", get_my_p2p_port());
         mvwprintw(content_win, 3, 2, "在线好友数: %d / %d", get_online_peer_count(), get_friend_count());
+        int active = 0, queued = 0;
+        sync_scheduler_get_summary(&active, &queued);
+        mvwprintw(content_win, 4, 2, "同步任务: 进行中 %d, 排队 %d", active, queued);
+        if (get_archive_age_days() > 0) mvwprintw(content_win, 5, 2, "历史归档: 超过 %d 天的消息 (聊天中 /archive [天数] 修改)", get_archive_age_days());
+        else mvwprintw(content_win, 5, 2, "历史归档: 已关闭");
+        draw_stats(7);
     } else if (main_tab_index == 3) { // 退出
         mvwprintw(content_win, 1, 2, "按回车键退出程序。");
     }
-    wrefresh(content_win);
+    wnoutrefresh(content_win);
+    frame_dirty = 1;
 }
 
 static void draw_chat_view() {
-    werase(content_win);
-    db_load_history(chat_target_pk_hex);
+    if (chat_count == 0) chat_view_open();
+    render_chat_view();
+}
+
+static void draw_chat_title() {
+    int received = 0;
+    SyncJobState sync_state = sync_scheduler_get_state(chat_target_id, &received);
+    box(content_border, 0, 0);
+    wattron(content_border, COLOR_PAIR(2));
+    if (sync_state == SYNC_JOB_ACTIVE) {
+        mvwprintw(content_border, 0, 2, " 正在与 %s 聊天 - 同步中, 已接收 %d 条 ", chat_target_name, received);
+    } else if (sync_state == SYNC_JOB_QUEUED) {
+        mvwprintw(content_border, 0, 2, " 正在与 %s 聊天 - 等待同步 ", chat_target_name);
+    } else {
+        mvwprintw(content_border, 0, 2, " 正在与 %s 聊天 ", chat_target_name);
+    }
+    wattroff(content_border, COLOR_PAIR(2));
+    chat_title_hint = chat_has_newer ? 2 : chat_scroll > 0;
+    if (chat_title_hint) {
+        wattron(content_border, COLOR_PAIR(3));
+        wprintw(content_border, chat_title_hint == 2 ? " 有新消息，按 End 回到最新 " : " 查看历史中，按 End 回到最新 ");
+        wattroff(content_border, COLOR_PAIR(3));
+    }
+    wnoutrefresh(content_border);
+    frame_dirty = 1;
+}
+
+/**
+ * 输出本帧的全部变化：聊天视图有变化时重绘视口，然后只调用一次 doupdate。
+ */
+static void ui_flush() {
+    if (current_ui_state == UI_STATE_CHATTING && content_win && content_border) {
+        if (chat_dirty) render_chat_view();
+        if (chat_title_hint != (chat_has_newer ? 2 : chat_scroll > 0)) draw_chat_title();
+    }
+    if (!frame_dirty) return;
+    if (current_ui_state != UI_STATE_MAIN && input_win) wnoutrefresh(input_win); // 把光标还给输入框
+    doupdate();
+    frame_dirty = 0;
+}
+
+/**
+ * 同步调度状态变化时，只重绘显示同步状态的部分。
+ */
+static void refresh_sync_status() {
+    unsigned int generation = sync_scheduler_generation();
+    if (generation == sync_view_generation) return;
+    sync_view_generation = generation;
+    if (current_ui_state == UI_STATE_MAIN && (main_tab_index == 0 || main_tab_index == 2)) {
+        draw_main_view();
+    } else if (current_ui_state == UI_STATE_CHATTING && content_border) {
+        draw_chat_title();
+    }
 }
 
 void redraw_ui() {
@@ -131,7 +624,8 @@ void redraw_ui() {
 
     delete_windows();
     clear();
-    refresh();
+    wnoutrefresh(stdscr);
+    if (current_ui_state != UI_STATE_CHATTING) chat_view_clear();
 
     if (current_ui_state == UI_STATE_MAIN) {
         log_border = newwin(4, width, 0, 0);
@@ -159,7 +653,8 @@ void redraw_ui() {
 
         box(content_border, 0, 0);
         box(input_border, 0, 0);
-        scrollok(content_win, TRUE);
+        // 聊天视图自己折行、只绘制视口，窗口不滚动
+        scrollok(content_win, current_ui_state != UI_STATE_CHATTING);
         keypad(input_win, TRUE);
 
         wattron(input_border, COLOR_PAIR(1));
@@ -167,10 +662,8 @@ void redraw_ui() {
         wattroff(input_border, COLOR_PAIR(1));
         
         if (current_ui_state == UI_STATE_CHATTING) {
-            wattron(content_border, COLOR_PAIR(2));
-            mvwprintw(content_border, 0, 2, " 正在与 %s 聊天 ", chat_target_name);
-            wattroff(content_border, COLOR_PAIR(2));
             draw_chat_view();
+            draw_chat_title();
         } else if (current_ui_state == UI_STATE_ADD_FRIEND_PK) {
             wattron(content_border, COLOR_PAIR(3));
             mvwprintw(content_border, 0, 2, " 添加好友 - 请输入公钥 ");
@@ -183,39 +676,119 @@ void redraw_ui() {
         wclear(input_win);
     }
 
-    if(log_border) wrefresh(log_border);
-    if(content_border) wrefresh(content_border);
-    if(input_border) wrefresh(input_border);
-    if(log_win) wrefresh(log_win);
-    if(content_win) wrefresh(content_win);
-    if(input_win) wrefresh(input_win);
+    // 窗口的内容由本帧结束时的 doupdate 一次输出
+    if(log_border) wnoutrefresh(log_border);
+    if(content_border) wnoutrefresh(content_border);
+    if(input_border) wnoutrefresh(input_border);
+    if(log_win) wnoutrefresh(log_win);
+    if(content_win) wnoutrefresh(content_win);
+    if(input_win) wnoutrefresh(input_win);
+    frame_dirty = 1;
     
     ui_needs_resize = 0;
 }
 
 static void handle_winch(int sig) {
+    (void)sig;
     ui_needs_resize = 1;
+    ui_notify();
 }
 
-void handle_input_and_events() {
-    static char input_buffer[4096] = {0};
-    static int i = 0;
-    static char add_friend_pk_buf[PK_HEX_LEN + 1];
+/**
+ * 在好友列表中上下移动一行，到达窗口边缘时以相邻好友的名字为游标滚动一行。
+ */
+static void friend_list_move(int delta) {
+    contact_t next;
+    if (delta < 0) {
+        if (friend_list_index > 0) {
+            friend_list_index--;
+        } else if (friend_page_after[0]) {
+            // 原来的“前一位”成为第一行，再往前找一位作为新的游标
+            contact_t before;
+            if (contact_store_list_before(friend_filter, friend_page_after, &before, 1) == 1) snprintf(friend_page_after, sizeof(friend_page_after), "%s", before.name);
+            else friend_page_after[0] = '\0';
+        } else {
+            return;
+        }
+    } else {
+        if (friend_list_index < friend_page_count - 1) {
+            friend_list_index++;
+        } else if (friend_page_count == friend_page_rows &&
+                   contact_store_list(friend_filter, friend_page[friend_page_count - 1].name, &next, 1) == 1) {
+            snprintf(friend_page_after, sizeof(friend_page_after), "%s", friend_page[0].name);
+        } else {
+            return;
+        }
+    }
+    draw_main_view();
+}
+
+/**
+ * 结果到底时说明搜索没有覆盖的范围，免得把“没有找到”当成记录里确实没有。
+ */
+static void show_search_scope(int truncated) {
+    if (truncated & SEARCH_TRUNCATED_SCAN) log_msg("[搜索] 不足 3 个字符的关键词只在最近的消息中查找，更早的消息可能也有匹配。");
+    if (truncated & SEARCH_TRUNCATED_ARCHIVE) log_msg("[搜索] 已归档的较早消息不在搜索范围内，可在历史记录中翻阅。");
+}
+
+/**
+ * 显示当前搜索的下一页结果，结果输出到日志窗口。
+ */
+static void show_search_page() {
+    search_hit_t hits[SEARCH_PAGE_SIZE];
+    int truncated = 0;
+    int n = search_chat_history(chat_target_id, search_query, search_offset, hits, SEARCH_PAGE_SIZE, &truncated);
+    if (n < 0) return;
+    if (n == 0) {
+        log_msg(search_offset == 0 ? "[搜索] 没有找到 \"%s\"。" : "[搜索] \"%s\" 没有更多结果了。", search_query);
+        show_search_scope(truncated);
+        return;
+    }
+    for (int k = 0; k < n; k++) {
+        char when[32];
+        time_t ts = (time_t)hits[k].timestamp;
+        strftime(when, sizeof(when), "%m-%d %H:%M", localtime(&ts));
+        char name[16];
+        log_msg("[搜索] %d. %s [%s]: %s", search_offset + k + 1, when, get_sender_name(hits[k].sender_id, name, sizeof(name)), hits[k].snippet);
+    }
+    search_offset += n;
+    if (n == SEARCH_PAGE_SIZE) log_msg("[搜索] 输入 /more 查看更多结果。");
+    else show_search_scope(truncated);
+}
 
+static void handle_key(int ch);
+
+void handle_input_and_events() {
     if (ui_needs_resize) {
         redraw_ui();
     }
 
-    int ch;
-    if (current_ui_state == UI_STATE_MAIN) {
-        wtimeout(stdscr, 100);
-        ch = getch();
-    } else {
-        wtimeout(input_win, 100);
-        ch = wgetch(input_win);
+    // 读完 ncurses 已缓冲的全部按键，否则它们不会再让标准输入变为可读
+    while (current_ui_state != UI_STATE_EXITING) {
+        WINDOW *win = current_ui_state == UI_STATE_MAIN ? stdscr : input_win;
+        wtimeout(win, 0);
+        int ch = wgetch(win);
+        if (ch == ERR) break;
+        handle_key(ch);
     }
+    // 设置页上的运行统计按时刷新，不依赖事件
+    if (current_ui_state == UI_STATE_MAIN && main_tab_index == SETTINGS_TAB &&
+        metrics_now_ns() - stats_drawn_ns >= STATS_REFRESH_MS * 1000000ULL) {
+        draw_main_view();
+    }
+    ui_flush();
+}
 
-    if (ch == ERR) return;
+int ui_poll_timeout_ms() {
+    if (current_ui_state != UI_STATE_MAIN || main_tab_index != SETTINGS_TAB) return -1;
+    uint64_t elapsed_ms = (metrics_now_ns() - stats_drawn_ns) / 1000000;
+    return elapsed_ms >= STATS_REFRESH_MS ? 0 : (int)(STATS_REFRESH_MS - elapsed_ms);
+}
+
+static void handle_key(int ch) {
+    static char input_buffer[4096] = {0};
+    static int i = 0;
+    static char add_friend_pk_buf[PK_HEX_LEN + 1];
 
     if (current_ui_state == UI_STATE_MAIN) {
         switch(ch) {
@@ -226,19 +799,22 @@ void handle_input_and_events() {
                 if (main_tab_index < NUM_TABS - 1) { main_tab_index++; draw_tabs(); draw_main_view(); }
                 break;
             case KEY_UP:
-                if (main_tab_index == 0 && friend_list_index > 0) { friend_list_index--; draw_main_view(); }
+                if (main_tab_index == 0) friend_list_move(-1);
                 break;
             case KEY_DOWN:
-                if (main_tab_index == 0 && friend_list_index < get_friend_count() - 1) { friend_list_index++; draw_main_view(); }
+                if (main_tab_index == 0) friend_list_move(1);
                 break;
             case '\n':
                 if (main_tab_index == 0) {
-                    if (get_friend_count() > 0) {
-                        friend_t** friends = get_friends();
-                        strcpy(chat_target_name, friends[friend_list_index]->name);
-                        strcpy(chat_target_pk_hex, friends[friend_list_index]->pk_hex);
+                    if (friend_list_index < friend_page_count) {
+                        contact_t *selected = &friend_page[friend_list_index];
+                        // 列表不驻留公钥，打开会话时才驻留
+                        chat_target_id = selected->id != PK_ID_NONE ? selected->id : contact_store_resolve(selected->pk);
+                        if (chat_target_id == PK_ID_NONE) break;
+                        strcpy(chat_target_name, selected->name);
                         current_ui_state = UI_STATE_CHATTING;
-                        request_chat_sync(chat_target_pk_hex);
+                        sync_scheduler_set_focus(chat_target_id);
+                        request_chat_sync(chat_target_id);
                         redraw_ui();
                     }
                 } else if (main_tab_index == 1) {
@@ -248,19 +824,103 @@ void handle_input_and_events() {
                     current_ui_state = UI_STATE_EXITING;
                 }
                 break;
+            case KEY_BACKSPACE:
+            case 127:
+                if (main_tab_index == 0 && friend_filter[0]) {
+                    friend_filter[strlen(friend_filter) - 1] = '\0';
+                    friend_list_index = 0;
+                    friend_page_after[0] = '\0';
+                    draw_main_view();
+                }
+                break;
+            default:
+                // 好友标签页中输入的字符作为名字前缀筛选列表
+                if (main_tab_index == 0 && ch >= 32 && ch <= 126 && strlen(friend_filter) < sizeof(friend_filter) - 1) {
+                    size_t len = strlen(friend_filter);
+                    friend_filter[len] = (char)ch;
+                    friend_filter[len + 1] = '\0';
+                    friend_list_index = 0;
+                    friend_page_after[0] = '\0';
+                    draw_main_view();
+                }
+                break;
         }
+    } else if (current_ui_state == UI_STATE_CHATTING && (ch == KEY_PPAGE || ch == KEY_NPAGE || ch == KEY_UP || ch == KEY_DOWN || ch == KEY_END)) {
+        int page = chat_view_height() - 1 > 0 ? chat_view_height() - 1 : 1;
+        if (ch == KEY_PPAGE) chat_view_scroll(page);
+        else if (ch == KEY_NPAGE) chat_view_scroll(-page);
+        else if (ch == KEY_UP) chat_view_scroll(1);
+        else if (ch == KEY_DOWN) chat_view_scroll(-1);
+        else chat_view_follow();
     } else {
         if (ch == '\n') {
             if (i > 0) {
                 input_buffer[i] = '\0';
                 UIState previous_state = current_ui_state;
+                // 发送消息或指令时回到最新消息，才能看到结果
+                if (current_ui_state == UI_STATE_CHATTING) chat_view_follow();
 
                 if (current_ui_state == UI_STATE_CHATTING) {
                     if (input_buffer[0] == '/') {
                         if (strcmp(input_buffer, "/back") == 0) {
                             current_ui_state = UI_STATE_MAIN;
+                            search_query[0] = '\0';
+                            sync_scheduler_set_focus(PK_ID_NONE);
                         } else if (strcmp(input_buffer, "/help") == 0) {
-                            log_msg("[指令] 可用指令: /back, /help");
+                            log_msg("[指令] 翻页查看历史: PageUp/PageDown/↑/↓，End 回到最新消息。");
+                            log_msg("[指令] 可用指令: /back, /help, /search <关键词>, /more, /archive [天数], /compact, /export <路径>, /clear, /newgroup <群名> <好友>...");
+                            if (is_group_chat(chat_target_id)) log_msg("[指令] 群聊指令: /members, /invite <好友>, /kick <成员>, /leave");
+                        } else if (strncmp(input_buffer, "/newgroup ", 10) == 0) {
+                            // 以空格分隔：第一个词为群名，其余为好友名字
+                            const char *words[GROUP_MAX_MEMBERS];
+                            int n = 0;
+                            for (char *w = strtok(input_buffer + 10, " "); w && n < GROUP_MAX_MEMBERS; w = strtok(NULL, " ")) words[n++] = w;
+                            if (n < 2) log_msg("[指令] 用法: /newgroup <群名> <好友> [好友...]");
+                            else create_group(words[0], words + 1, n - 1);
+                        } else if (strcmp(input_buffer, "/members") == 0 && is_group_chat(chat_target_id)) {
+                            list_group_members(chat_target_id);
+                        } else if (strncmp(input_buffer, "/invite ", 8) == 0 && input_buffer[8] && is_group_chat(chat_target_id)) {
+                            invite_to_group(chat_target_id, input_buffer + 8);
+                        } else if (strncmp(input_buffer, "/kick ", 6) == 0 && input_buffer[6] && is_group_chat(chat_target_id)) {
+                            kick_from_group(chat_target_id, input_buffer + 6);
+                        } else if (strcmp(input_buffer, "/leave") == 0 && is_group_chat(chat_target_id)) {
+                            if (leave_group(chat_target_id) == 0) {
+                                current_ui_state = UI_STATE_MAIN;
+                                search_query[0] = '\0';
+                                sync_scheduler_set_focus(PK_ID_NONE);
+                            }
+                        } else if (strncmp(input_buffer, "/search ", 8) == 0 && input_buffer[8]) {
+                            snprintf(search_query, sizeof(search_query), "%s", input_buffer + 8);
+                            search_offset = 0;
+                            show_search_page();
+                        } else if (strcmp(input_buffer, "/more") == 0) {
+                            if (search_query[0]) show_search_page();
+                            else log_msg("[指令] 请先使用 /search <关键词> 搜索。");
+                        } else if (strcmp(input_buffer, "/archive") == 0 || strncmp(input_buffer, "/archive ", 9) == 0) {
+                            int days;
+                            if (input_buffer[8] == ' ' && (sscanf(input_buffer + 9, "%d", &days) != 1 || days < 0)) {
+                                log_msg("[指令] 用法: /archive [天数]，天数为 0 时关闭归档。");
+                            } else {
+                                if (input_buffer[8] == ' ') set_archive_age_days(days);
+                                if (get_archive_age_days() == 0) {
+                                    log_msg("[系统] 已关闭历史归档。");
+                                } else if (archive_chat_history(chat_target_id) == 0) {
+                                    log_msg("[系统] 正在后台归档与 %s 的聊天记录...", chat_target_name);
+                                } else {
+                                    log_msg("[系统] 后台任务较多，请稍后再试。");
+                                }
+                            }
+                        } else if (strcmp(input_buffer, "/compact") == 0) {
+                            if (compact_chat_history(chat_target_id) == 0) log_msg("[系统] 正在后台压缩与 %s 的聊天记录...", chat_target_name);
+                            else log_msg("[系统] 后台任务较多，请稍后再试。");
+                        } else if (strncmp(input_buffer, "/export ", 8) == 0 && input_buffer[8]) {
+                            if (export_chat_history(chat_target_id, input_buffer + 8) == 0) log_msg("[系统] 正在后台导出聊天记录到 %s...", input_buffer + 8);
+                            else log_msg("[系统] 后台任务较多，请稍后再试。");
+                        } else if (strcmp(input_buffer, "/clear") == 0) {
+                            if (clear_chat_history(chat_target_id) == 0) {
+                                chat_view_open();
+                                log_msg("[系统] 已清空与 %s 的聊天记录。", chat_target_name);
+                            }
                         } else {
                             log_msg("[指令] 未知指令: %s", input_buffer);
                         }
@@ -284,12 +944,13 @@ void handle_input_and_events() {
                 if (previous_state != current_ui_state) redraw_ui();
                 else {
                     wclear(input_win);
-                    wrefresh(input_win);
+                    wnoutrefresh(input_win);
+                    frame_dirty = 1;
                 }
             }
         } else if (ch == KEY_BACKSPACE || ch == 127) {
             if (i > 0) { i--; mvwdelch(input_win, 0, i); }
-        } else if (i < sizeof(input_buffer) - 1 && ch >= 32 && ch <= 126) {
+        } else if (i < (int)sizeof(input_buffer) - 1 && ch >= 32 && ch <= 126) {
             if (i == 0) wclear(input_win);
             input_buffer[i++] = ch;
             waddch(input_win, ch);
@@ -298,26 +959,62 @@ void handle_input_and_events() {
 }
 
 void queue_log_message(const char *msg) {
-    pthread_mutex_lock(&log_queue_mutex);
-    if ((log_queue_head + 1) % MAX_LOG_MESSAGES != log_queue_tail) {
-        log_queue[log_queue_head] = strdup(msg);
-        log_queue_head = (log_queue_head + 1) % MAX_LOG_MESSAGES;
+    post_event(UI_EVENT_LOG, PK_ID_NONE, msg);
+}
+
+void queue_chat_update(pk_id_t chat_id) {
+    post_event(UI_EVENT_CHAT, chat_id, NULL);
+}
+
+void ui_status_changed() {
+    // 状态通知只需要一个在队列中：界面处理时读取的是最新状态
+    if (atomic_exchange(&status_pending, 1)) return;
+    pthread_once(&events_once, events_init);
+    if (events && event_ring_push(events, UI_EVENT_STATUS, PK_ID_NONE, NULL) == 0) ui_notify();
+    else atomic_store(&status_pending, 0);
+}
+
+static void show_line(const char* text) {
+    if (current_ui_state == UI_STATE_MAIN && log_win) {
+        add_line_to_window(log_win, text);
+    } else if (current_ui_state == UI_STATE_CHATTING) {
+        chat_push_back(0, text);
+    } else if (content_win) {
+        add_line_to_window(content_win, text);
     }
-    pthread_mutex_unlock(&log_queue_mutex);
 }
 
 void update_logs_from_queue() {
-    pthread_mutex_lock(&log_queue_mutex);
-    if (log_queue_tail != log_queue_head) {
-        while (log_queue_tail != log_queue_head) {
-            if (current_ui_state == UI_STATE_MAIN && log_win) {
-                add_line_to_window(log_win, log_queue[log_queue_tail]);
-            } else if (content_win) {
-                add_line_to_window(content_win, log_queue[log_queue_tail]);
-            }
-            free(log_queue[log_queue_tail]);
-            log_queue_tail = (log_queue_tail + 1) % MAX_LOG_MESSAGES;
+    pthread_once(&events_once, events_init);
+    if (!events) return;
+    int status = 0, updated = 0, n = 0;
+    const ui_event_t *ev;
+    metrics_gauge_set(METRIC_GAUGE_EVENT_QUEUE, (int64_t)event_ring_size(events));
+    while (n < UI_EVENT_BATCH && (ev = event_ring_peek(events)) != NULL) {
+        if (ev->type == UI_EVENT_LOG) {
+            show_line(ev->text);
+        } else if (ev->type == UI_EVENT_CHAT) {
+            // 其他会话的消息已在数据库中，打开时再读；同一批的多次通知只读一次数据库
+            if (current_ui_state == UI_STATE_CHATTING && ev->chat_id == chat_target_id) updated = 1;
+        } else if (ev->type == UI_EVENT_STATUS) {
+            atomic_store(&status_pending, 0);
+            status = 1;
         }
+        event_ring_pop(events);
+        n++;
+    }
+    if (n == UI_EVENT_BATCH) ui_notify();
+    uint64_t dropped_logs = event_ring_take_drops(events, UI_EVENT_LOG);
+    uint64_t dropped_chats = event_ring_take_drops(events, UI_EVENT_CHAT);
+    metrics_add(METRIC_LOG_DROPPED, dropped_logs);
+    metrics_add(METRIC_CHAT_EVENT_DROPPED, dropped_chats);
+    // 被丢弃的新消息通知不知道属于哪个会话，当作当前会话有更新
+    if (dropped_chats && current_ui_state == UI_STATE_CHATTING) updated = 1;
+    if (dropped_logs) {
+        char line[128];
+        snprintf(line, sizeof(line), "[系统] 界面处理不过来，略过了 %llu 条日志的显示。", (unsigned long long)dropped_logs);
+        show_line(line);
     }
-    pthread_mutex_unlock(&log_queue_mutex);
+    if (updated) chat_view_updated();
+    if (status) refresh_sync_status();
 }
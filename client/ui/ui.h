@@ -18,22 +18,56 @@ extern UIState current_ui_state;
 extern int main_tab_index;      // 主界面当前选中的标签 (0-3)
 extern int friend_list_index; // 主界面好友列表中选中的好友
 extern char chat_target_name[32];
-extern char chat_target_pk_hex[PK_HEX_LEN + 1];
+extern pk_id_t chat_target_id;
 
 // --- 函数原型 ---
 void init_ui();
 void destroy_ui();
 void redraw_ui();
+/**
+ * @brief 处理窗口尺寸与同步状态的变化，读完所有已到达的按键（不阻塞），
+ *        最后把本轮所有窗口的变化用一次 doupdate 输出到终端。每轮主循环在 update_logs_from_queue 之后调用。
+ */
 void handle_input_and_events();
 
 /**
- * @brief 从日志队列中取出消息并更新到UI上。
+ * @brief 成批处理事件队列中的日志、新消息和状态通知，更新到各窗口（输出到终端由 handle_input_and_events 完成）。
  */
 void update_logs_from_queue();
 
 /**
- * @brief (线程安全) 将一条日志消息放入队列，等待UI线程处理。
+ * @brief (线程安全，不阻塞) 将一条日志消息放入队列，等待UI线程处理。队列满时丢弃并计数。
  */
 void queue_log_message(const char *msg);
 
+/**
+ * @brief (线程安全，不阻塞) 通知UI某个会话有新消息；该会话打开时从数据库读取并显示。
+ */
+void queue_chat_update(pk_id_t chat_id);
+
+/**
+ * @brief (线程安全，不阻塞) 通知UI同步等状态已变化，多次通知在处理前合并为一次。
+ */
+void ui_status_changed();
+
+/**
+ * @brief 主循环等待的通知描述符 (eventfd)，与标准输入一起 poll。
+ */
+int ui_event_fd();
+
+/**
+ * @brief (线程安全，可在信号处理函数中调用) 通知主循环有日志、状态变化或窗口尺寸变化需要处理。
+ */
+void ui_notify();
+
+/**
+ * @brief 清除已收到的通知，在处理本轮事件之前调用。
+ */
+void ui_clear_events();
+
+/**
+ * @brief 主循环 poll 的超时（毫秒）：设置页显示运行统计时为 1000 以便每秒刷新，其余时候为 -1，只在有事件时醒来。
+ */
+int ui_poll_timeout_ms();
+
 #endif //ZEROLINK_UI_H
@@ -0,0 +1,60 @@
+#include "block_crypto.h"
+#include <string.h>
+
+static void put_le64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+void chat_block_digest(const ChatBlockView* block, unsigned char digest[HASH_BYTES]) {
+    unsigned char header[8 + HASH_BYTES + crypto_box_PUBLICKEYBYTES + 8 + 8];
+    unsigned char *p = header;
+    put_le64(p, block->index); p += 8;
+    memcpy(p, block->prev_hash, HASH_BYTES); p += HASH_BYTES;
+    memcpy(p, block->sender_pubkey, crypto_box_PUBLICKEYBYTES); p += crypto_box_PUBLICKEYBYTES;
+    put_le64(p, block->timestamp); p += 8;
+    put_le64(p, block->ciphertext_len);
+
+    crypto_hash_sha256_state state;
+    crypto_hash_sha256_init(&state);
+    crypto_hash_sha256_update(&state, header, sizeof(header));
+    if (block->ciphertext_len) crypto_hash_sha256_update(&state, block->ciphertext, block->ciphertext_len);
+    crypto_hash_sha256_final(&state, digest);
+}
+
+void chat_block_hash_from_digest(const unsigned char digest[HASH_BYTES], const unsigned char* signature, unsigned char hash[HASH_BYTES]) {
+    unsigned char buf[HASH_BYTES + SIGNATURE_BYTES];
+    memcpy(buf, digest, HASH_BYTES);
+    memcpy(buf + HASH_BYTES, signature, SIGNATURE_BYTES);
+    crypto_hash_sha256(hash, buf, sizeof(buf));
+}
+
+void chat_block_hash(const ChatBlockView* block, unsigned char hash[HASH_BYTES]) {
+    unsigned char digest[HASH_BYTES];
+    chat_block_digest(block, digest);
+    chat_block_hash_from_digest(digest, block->signature, hash);
+}
+
+int chat_block_sign(ChatBlock* block, const unsigned char sign_sk[crypto_sign_SECRETKEYBYTES]) {
+    if (crypto_sign_ed25519_sk_to_pk(block->sender_pubkey, sign_sk) != 0) return -1;
+    ChatBlockView view;
+    chat_block_view(block, &view);
+    unsigned char digest[HASH_BYTES];
+    chat_block_digest(&view, digest);
+    return crypto_sign_detached(block->signature, NULL, digest, sizeof(digest), sign_sk);
+}
+
+int chat_block_verify_signature(const ChatBlockView* block) {
+    unsigned char digest[HASH_BYTES];
+    chat_block_digest(block, digest);
+    return crypto_sign_verify_detached(block->signature, digest, sizeof(digest), block->sender_pubkey);
+}
+
+void chat_block_view(const ChatBlock* block, ChatBlockView* out) {
+    out->index = block->index;
+    out->timestamp = block->timestamp;
+    out->prev_hash = block->prev_hash;
+    out->sender_pubkey = block->sender_pubkey;
+    out->signature = block->signature;
+    out->ciphertext = block->ciphertext;
+    out->ciphertext_len = block->ciphertext_len;
+}
@@ -0,0 +1,48 @@
+#ifndef ZEROLINK_BLOCK_CRYPTO_H
+#define ZEROLINK_BLOCK_CRYPTO_H
+
+#include "../models/chat_block.h"
+
+/**
+ * @file block_crypto.h
+ * @brief ChatBlock 的哈希与签名辅助函数。
+ *
+ * 签名摘要 = SHA-256(index || prev_hash || sender_pubkey || timestamp || ciphertext_len || ciphertext)，
+ * 整数均为小端 64 位。签名使用 Ed25519 对该摘要进行签名，sender_pubkey 即发送者的 Ed25519 签名公钥。
+ * 区块哈希 = SHA-256(签名摘要 || signature)，下一个区块的 prev_hash 即为该值。
+ * 创世区块 (index 0) 的 prev_hash 全部为零。
+ */
+
+/**
+ * @brief 计算区块视图的签名摘要。
+ */
+void chat_block_digest(const ChatBlockView* block, unsigned char digest[HASH_BYTES]);
+
+/**
+ * @brief 由签名摘要与签名计算区块哈希（即下一个区块的 prev_hash）。
+ */
+void chat_block_hash_from_digest(const unsigned char digest[HASH_BYTES], const unsigned char* signature, unsigned char hash[HASH_BYTES]);
+
+/**
+ * @brief 直接计算区块视图的哈希。
+ */
+void chat_block_hash(const ChatBlockView* block, unsigned char hash[HASH_BYTES]);
+
+/**
+ * @brief 用发送者的 Ed25519 私钥为区块签名，同时填充 sender_pubkey。
+ * @return 成功返回 0，失败返回非 0。
+ */
+int chat_block_sign(ChatBlock* block, const unsigned char sign_sk[crypto_sign_SECRETKEYBYTES]);
+
+/**
+ * @brief 校验单个区块的签名。
+ * @return 签名有效返回 0，否则返回非 0。
+ */
+int chat_block_verify_signature(const ChatBlockView* block);
+
+/**
+ * @brief 为内存中的 ChatBlock 生成一个只读视图（不复制数据）。
+ */
+void chat_block_view(const ChatBlock* block, ChatBlockView* out);
+
+#endif //ZEROLINK_BLOCK_CRYPTO_H
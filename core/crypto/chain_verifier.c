@@ -0,0 +1,361 @@
+#include "chain_verifier.h"
+#include "block_crypto.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#define VERIFY_BATCH 64         // 每个签名任务批包含的区块数
+#define VERIFY_QUEUE_BATCHES 16 // 有界队列容量（批）
+#define CHECKPOINT_MAGIC "ZLCP"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_SIGNED_BYTES (4 + 4 + 8 + HASH_BYTES)
+#define CHECKPOINT_BYTES (CHECKPOINT_SIGNED_BYTES + crypto_sign_BYTES)
+
+typedef struct {
+    uint64_t index;
+    unsigned char digest[HASH_BYTES];
+    const unsigned char *signature;
+    const unsigned char *sender_pubkey;
+} SigJob;
+
+typedef struct {
+    SigJob jobs[VERIFY_BATCH];
+    int count;
+} SigBatch;
+
+struct ChainVerifier {
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t run_lock;   // 同一时刻只允许一次验证
+    pthread_mutex_t lock;       // 保护下列队列状态
+    pthread_cond_t has_work;
+    pthread_cond_t has_space;
+    pthread_cond_t drained;
+    SigBatch queue[VERIFY_QUEUE_BATCHES];
+    int head, tail, queued, in_flight;
+    uint64_t first_bad;         // 签名失败的最小索引，UINT64_MAX 表示尚无失败
+    int stopping;
+};
+
+/**
+ * 区块来源：日志游标或内存数组。
+ */
+typedef struct {
+    DbBlockCursor cursor;
+    DatabaseHandle *handle;
+    const ChatBlock *blocks;
+    size_t count, pos;
+    uint64_t first_index;
+} BlockSource;
+
+static int source_next(BlockSource *src, ChatBlockView *out) {
+    if (src->blocks) {
+        if (src->pos >= src->count) return 0;
+        chat_block_view(&src->blocks[src->pos++], out);
+        return 1;
+    }
+    return db_cursor_next(&src->cursor, out);
+}
+
+static int source_get(BlockSource *src, uint64_t index, ChatBlockView *out) {
+    if (src->blocks) {
+        if (index < src->first_index || index - src->first_index >= src->count) return -1;
+        chat_block_view(&src->blocks[index - src->first_index], out);
+        return 0;
+    }
+    return db_get_block_by_index(src->handle, index, out);
+}
+
+// --- 工作线程池 ---
+static void *verify_worker(void *arg) {
+    ChainVerifier *v = (ChainVerifier*)arg;
+    SigBatch batch;
+    pthread_mutex_lock(&v->lock);
+    while (1) {
+        while (!v->stopping && v->queued == 0) pthread_cond_wait(&v->has_work, &v->lock);
+        if (v->stopping && v->queued == 0) break;
+        batch = v->queue[v->tail];
+        v->tail = (v->tail + 1) % VERIFY_QUEUE_BATCHES;
+        v->queued--;
+        v->in_flight++;
+        uint64_t known_bad = v->first_bad;
+        pthread_cond_signal(&v->has_space);
+        pthread_mutex_unlock(&v->lock);
+
+        uint64_t bad = UINT64_MAX;
+        for (int i = 0; i < batch.count; i++) {
+            const SigJob *job = &batch.jobs[i];
+            if (job->index >= known_bad) break; // 已有更早的失败，后续结果不再重要
+            if (crypto_sign_verify_detached(job->signature, job->digest, HASH_BYTES, job->sender_pubkey) != 0) {
+                bad = job->index;
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&v->lock);
+        if (bad < v->first_bad) v->first_bad = bad;
+        v->in_flight--;
+        if (v->queued == 0 && v->in_flight == 0) pthread_cond_broadcast(&v->drained);
+    }
+    pthread_mutex_unlock(&v->lock);
+    return NULL;
+}
+
+ChainVerifier* chain_verifier_create(int workers) {
+    if (workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (int)cpus : 1;
+    }
+    ChainVerifier *v = calloc(1, sizeof(ChainVerifier));
+    if (!v) return NULL;
+    v->threads = calloc(workers, sizeof(pthread_t));
+    if (!v->threads) {
+        free(v);
+        return NULL;
+    }
+    pthread_mutex_init(&v->run_lock, NULL);
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->has_work, NULL);
+    pthread_cond_init(&v->has_space, NULL);
+    pthread_cond_init(&v->drained, NULL);
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&v->threads[i], NULL, verify_worker, v) != 0) break;
+        v->thread_count++;
+    }
+    if (v->thread_count == 0) {
+        chain_verifier_destroy(v);
+        return NULL;
+    }
+    return v;
+}
+
+void chain_verifier_destroy(ChainVerifier* verifier) {
+    if (!verifier) return;
+    pthread_mutex_lock(&verifier->lock);
+    verifier->stopping = 1;
+    pthread_cond_broadcast(&verifier->has_work);
+    pthread_mutex_unlock(&verifier->lock);
+    for (int i = 0; i < verifier->thread_count; i++) pthread_join(verifier->threads[i], NULL);
+    free(verifier->threads);
+    pthread_mutex_destroy(&verifier->run_lock);
+    pthread_mutex_destroy(&verifier->lock);
+    pthread_cond_destroy(&verifier->has_work);
+    pthread_cond_destroy(&verifier->has_space);
+    pthread_cond_destroy(&verifier->drained);
+    free(verifier);
+}
+
+/**
+ * 将一批签名任务放入有界队列；队列满时阻塞，形成背压。
+ * @return 队列中已出现更早的签名失败时返回 1，提示生产者停止。
+ */
+static int submit_batch(ChainVerifier *v, SigBatch *batch) {
+    pthread_mutex_lock(&v->lock);
+    while (v->queued == VERIFY_QUEUE_BATCHES) pthread_cond_wait(&v->has_space, &v->lock);
+    v->queue[v->head] = *batch;
+    v->head = (v->head + 1) % VERIFY_QUEUE_BATCHES;
+    v->queued++;
+    int failed = v->first_bad != UINT64_MAX;
+    pthread_cond_signal(&v->has_work);
+    pthread_mutex_unlock(&v->lock);
+    batch->count = 0;
+    return failed;
+}
+
+static uint64_t wait_drained(ChainVerifier *v) {
+    pthread_mutex_lock(&v->lock);
+    while (v->queued > 0 || v->in_flight > 0) pthread_cond_wait(&v->drained, &v->lock);
+    uint64_t bad = v->first_bad;
+    pthread_mutex_unlock(&v->lock);
+    return bad;
+}
+
+/**
+ * 核心流水线：从 src 顺序读取区块，单遍校验哈希链，并把签名校验分发给线程池。
+ */
+static int run_pipeline(ChainVerifier *v, BlockSource *src, uint64_t first_index,
+                        const unsigned char prev_hash[HASH_BYTES], ChainVerifyResult *out) {
+    pthread_mutex_lock(&v->lock);
+    v->first_bad = UINT64_MAX;
+    pthread_mutex_unlock(&v->lock);
+
+    unsigned char expected_prev[HASH_BYTES];
+    unsigned char digest[HASH_BYTES];
+    memcpy(expected_prev, prev_hash, HASH_BYTES);
+
+    SigBatch batch = {.count = 0};
+    uint64_t next = first_index;
+    uint64_t link_bad = UINT64_MAX;
+    ChainVerifyStatus link_status = CHAIN_VERIFY_OK;
+    ChatBlockView view;
+    int status;
+    while ((status = source_next(src, &view)) == 1) {
+        if (view.index != next || sodium_memcmp(view.prev_hash, expected_prev, HASH_BYTES) != 0) {
+            link_bad = next;
+            link_status = CHAIN_VERIFY_BAD_LINK;
+            break;
+        }
+        chat_block_digest(&view, digest);
+        chat_block_hash_from_digest(digest, view.signature, expected_prev);
+
+        SigJob *job = &batch.jobs[batch.count++];
+        job->index = view.index;
+        memcpy(job->digest, digest, HASH_BYTES);
+        job->signature = view.signature;
+        job->sender_pubkey = view.sender_pubkey;
+        next++;
+        if (batch.count == VERIFY_BATCH && submit_batch(v, &batch)) break;
+    }
+    if (status < 0) {
+        link_bad = next;
+        link_status = CHAIN_VERIFY_IO_ERROR;
+    }
+    if (batch.count > 0) submit_batch(v, &batch);
+    uint64_t sig_bad = wait_drained(v);
+
+    out->checked = next - first_index;
+    if (sig_bad < link_bad) {
+        out->status = CHAIN_VERIFY_BAD_SIGNATURE;
+        out->verified_count = sig_bad;
+    } else if (link_bad != UINT64_MAX) {
+        out->status = link_status;
+        out->verified_count = link_bad;
+    } else {
+        out->status = CHAIN_VERIFY_OK;
+        out->verified_count = next;
+    }
+
+    if (out->verified_count == next) {
+        memcpy(out->last_hash, expected_prev, HASH_BYTES);
+    } else if (out->verified_count == first_index) {
+        memcpy(out->last_hash, prev_hash, HASH_BYTES);
+    } else {
+        // 签名失败点落后于链扫描位置，回读前一个区块重新计算其哈希
+        if (source_get(src, out->verified_count - 1, &view) != 0) {
+            out->status = CHAIN_VERIFY_IO_ERROR;
+            return -1;
+        }
+        chat_block_hash(&view, out->last_hash);
+    }
+    return out->status == CHAIN_VERIFY_OK ? 0 : -1;
+}
+
+// --- 检查点 ---
+static void put_le32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_le64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+/**
+ * 读取并校验检查点。
+ * @return 检查点有效且与日志一致时返回已验证的区块数（N + 1），否则返回 0。
+ */
+static uint64_t load_checkpoint(const char *path, DatabaseHandle *handle,
+                                const unsigned char sign_sk[crypto_sign_SECRETKEYBYTES], unsigned char hash_out[HASH_BYTES]) {
+    unsigned char buf[CHECKPOINT_BYTES];
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    size_t n = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    if (n != sizeof(buf) || memcmp(buf, CHECKPOINT_MAGIC, 4) != 0 || buf[4] != CHECKPOINT_VERSION) return 0;
+
+    unsigned char pk[crypto_sign_PUBLICKEYBYTES];
+    crypto_sign_ed25519_sk_to_pk(pk, sign_sk);
+    if (crypto_sign_verify_detached(buf + CHECKPOINT_SIGNED_BYTES, buf, CHECKPOINT_SIGNED_BYTES, pk) != 0) return 0;
+
+    uint64_t index = get_le64(buf + 8);
+    const unsigned char *hash = buf + 16;
+    // 检查点只证明“曾经验证过”，还需确认日志中的该区块没有被替换
+    ChatBlockView view;
+    unsigned char actual[HASH_BYTES];
+    if (db_get_block_by_index(handle, index, &view) != 0) return 0;
+    chat_block_hash(&view, actual);
+    if (sodium_memcmp(actual, hash, HASH_BYTES) != 0) return 0;
+    memcpy(hash_out, hash, HASH_BYTES);
+    return index + 1;
+}
+
+static int save_checkpoint(const char *path, uint64_t index, const unsigned char hash[HASH_BYTES],
+                           const unsigned char sign_sk[crypto_sign_SECRETKEYBYTES]) {
+    unsigned char buf[CHECKPOINT_BYTES] = {0};
+    memcpy(buf, CHECKPOINT_MAGIC, 4);
+    put_le32(buf + 4, CHECKPOINT_VERSION);
+    put_le64(buf + 8, index);
+    memcpy(buf + 16, hash, HASH_BYTES);
+    if (crypto_sign_detached(buf + CHECKPOINT_SIGNED_BYTES, NULL, buf, CHECKPOINT_SIGNED_BYTES, sign_sk) != 0) return -1;
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    int ok = write(fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf) && fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// --- 公共接口 ---
+int chain_verify_log(ChainVerifier* verifier, DatabaseHandle* handle, const char* checkpoint_path,
+                     const unsigned char sign_sk[crypto_sign_SECRETKEYBYTES], ChainVerifyResult* out) {
+    memset(out, 0, sizeof(*out));
+    if (!verifier || !handle) {
+        out->status = CHAIN_VERIFY_IO_ERROR;
+        return -1;
+    }
+    unsigned char prev_hash[HASH_BYTES] = {0};
+    uint64_t start = checkpoint_path ? load_checkpoint(checkpoint_path, handle, sign_sk, prev_hash) : 0;
+    uint64_t total = db_get_block_count(handle);
+    if (start >= total) {
+        out->verified_count = start;
+        memcpy(out->last_hash, prev_hash, HASH_BYTES);
+        return 0;
+    }
+
+    BlockSource src = {.handle = handle};
+    if (db_cursor_open(handle, start, total - 1, &src.cursor) != 0) {
+        out->status = CHAIN_VERIFY_IO_ERROR;
+        out->verified_count = start;
+        return -1;
+    }
+    pthread_mutex_lock(&verifier->run_lock);
+    int rc = run_pipeline(verifier, &src, start, prev_hash, out);
+    pthread_mutex_unlock(&verifier->run_lock);
+
+    if (checkpoint_path && out->verified_count > start) {
+        if (save_checkpoint(checkpoint_path, out->verified_count - 1, out->last_hash, sign_sk) != 0 && rc == 0) {
+            out->status = CHAIN_VERIFY_IO_ERROR;
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+int chain_verify_blocks(ChainVerifier* verifier, const unsigned char prev_hash[HASH_BYTES], uint64_t first_index,
+                        const ChatBlock* blocks, size_t count, ChainVerifyResult* out) {
+    memset(out, 0, sizeof(*out));
+    if (!verifier || (!blocks && count)) {
+        out->status = CHAIN_VERIFY_IO_ERROR;
+        return -1;
+    }
+    BlockSource src = {.blocks = blocks, .count = count, .first_index = first_index};
+    pthread_mutex_lock(&verifier->run_lock);
+    int rc = run_pipeline(verifier, &src, first_index, prev_hash, out);
+    pthread_mutex_unlock(&verifier->run_lock);
+    return rc;
+}
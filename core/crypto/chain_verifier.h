@@ -0,0 +1,85 @@
+#ifndef ZEROLINK_CHAIN_VERIFIER_H
+#define ZEROLINK_CHAIN_VERIFIER_H
+
+#include "../models/chat_block.h"
+#include "../storage/database.h"
+
+/**
+ * @file chain_verifier.h
+ * @brief ChatBlock 哈希链与签名的并行、可断点续验引擎。
+ *
+ * 验证分两条流水线：
+ *   - 主线程按索引顺序单遍扫描区块，计算摘要与区块哈希并校验 prev_hash 链接；
+ *   - 签名校验（Ed25519，CPU 密集）以批为单位投递到固定的工作线程池并行完成。
+ * 投递队列有界，整个过程内存占用与链长无关。
+ *
+ * 完成后会持久化一个签名检查点“已验证到索引 N，其哈希为 H”，
+ * 重启或增量同步后只需验证 N 之后的新区块。
+ */
+
+typedef struct ChainVerifier ChainVerifier;
+
+typedef enum {
+    CHAIN_VERIFY_OK = 0,
+    CHAIN_VERIFY_BAD_LINK,      // prev_hash 与前一区块哈希不符，或索引不连续
+    CHAIN_VERIFY_BAD_SIGNATURE, // 签名无效
+    CHAIN_VERIFY_IO_ERROR       // 读取日志或写检查点失败
+} ChainVerifyStatus;
+
+/**
+ * @struct ChainVerifyResult
+ * @brief 一次验证的结果。
+ */
+typedef struct {
+    ChainVerifyStatus status;
+    /// @brief 已验证的区块数，即第一个未通过（或尚未验证）的区块索引。
+    uint64_t verified_count;
+    /// @brief 本次实际检查的区块数（不含检查点之前的区块）。
+    uint64_t checked;
+    /// @brief 最后一个已验证区块的哈希；verified_count 为 0 时全为零。
+    unsigned char last_hash[HASH_BYTES];
+} ChainVerifyResult;
+
+/**
+ * @brief 创建验证引擎并启动工作线程。
+ * @param workers 工作线程数，<= 0 时使用在线 CPU 数。
+ * @return 成功返回引擎句柄，失败返回 NULL。
+ */
+ChainVerifier* chain_verifier_create(int workers);
+
+/**
+ * @brief 停止工作线程并释放引擎。
+ */
+void chain_verifier_destroy(ChainVerifier* verifier);
+
+/**
+ * @brief 增量验证一个本地区块日志。
+ *
+ * 若 checkpoint_path 处存在由 sign_sk 签名且与日志内容一致的检查点，则从检查点之后继续；
+ * 否则从创世区块开始。验证推进后会原子地重写检查点。
+ *
+ * @param verifier 验证引擎。
+ * @param handle 区块日志。
+ * @param checkpoint_path 检查点文件路径。
+ * @param sign_sk 本机的 Ed25519 私钥，用于签名和校验检查点。
+ * @param out 验证结果。
+ * @return 整条链有效返回 0，否则返回非 0（详情见 out->status）。
+ */
+int chain_verify_log(ChainVerifier* verifier, DatabaseHandle* handle, const char* checkpoint_path,
+                     const unsigned char sign_sk[crypto_sign_SECRETKEYBYTES], ChainVerifyResult* out);
+
+/**
+ * @brief 验证一批尚未写入日志的连续区块（例如同步收到的区块）。
+ *
+ * @param verifier 验证引擎。
+ * @param prev_hash 本地最新区块的哈希（链为空时传全零）。
+ * @param first_index 本批第一个区块应有的索引。
+ * @param blocks 区块数组。
+ * @param count 区块数量。
+ * @param out 验证结果，verified_count 为绝对索引。
+ * @return 整批有效返回 0，否则返回非 0；调用者可以只追加前 out->verified_count - first_index 个区块。
+ */
+int chain_verify_blocks(ChainVerifier* verifier, const unsigned char prev_hash[HASH_BYTES], uint64_t first_index,
+                        const ChatBlock* blocks, size_t count, ChainVerifyResult* out);
+
+#endif //ZEROLINK_CHAIN_VERIFIER_H
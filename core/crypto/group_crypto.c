@@ -0,0 +1,196 @@
+#include "group_crypto.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NONCE_BYTES crypto_aead_xchacha20poly1305_ietf_NPUBBYTES
+
+struct GroupSenderKey {
+    group_key_id_t id;
+    group_key_material_t material;
+    int used;
+    int stale;  // 已被替换或丢弃，不再被查到，最后一个使用者释放后清零
+    int refs;
+    uint64_t last_used;
+};
+
+// 结构体本身在普通内存中，表项（含密钥材料）在 sodium_malloc 分配的区域里
+struct GroupKeyring {
+    struct GroupSenderKey *entries;
+    size_t capacity;
+    uint64_t clock;
+    pthread_mutex_t lock;
+};
+
+void group_key_generate(group_key_material_t* out) {
+    crypto_aead_xchacha20poly1305_ietf_keygen(out->key);
+    crypto_sign_keypair(out->sign_pk, out->sign_sk);
+    out->has_sign_sk = 1;
+}
+
+GroupKeyring* group_keyring_create(size_t capacity) {
+    if (capacity == 0) return NULL;
+    GroupKeyring *ring = calloc(1, sizeof(GroupKeyring));
+    if (!ring) return NULL;
+    ring->entries = sodium_allocarray(capacity, sizeof(struct GroupSenderKey));
+    if (!ring->entries) {
+        free(ring);
+        return NULL;
+    }
+    sodium_memzero(ring->entries, capacity * sizeof(struct GroupSenderKey));
+    ring->capacity = capacity;
+    pthread_mutex_init(&ring->lock, NULL);
+    return ring;
+}
+
+void group_keyring_destroy(GroupKeyring* ring) {
+    if (!ring) return;
+    sodium_free(ring->entries); // sodium_free 会先清零
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+}
+
+static int id_equal(const group_key_id_t* a, const group_key_id_t* b) {
+    return a->epoch == b->epoch && memcmp(a->group_id, b->group_id, GROUP_ID_BYTES) == 0 && memcmp(a->sender, b->sender, PK_BYTES) == 0;
+}
+
+// 以下函数要求调用者持有 ring->lock
+static struct GroupSenderKey* find_live(GroupKeyring* ring, const group_key_id_t* id) {
+    for (size_t i = 0; i < ring->capacity; i++) {
+        struct GroupSenderKey *e = &ring->entries[i];
+        if (e->used && !e->stale && id_equal(&e->id, id)) return e;
+    }
+    return NULL;
+}
+
+static void retire(struct GroupSenderKey* e) {
+    if (e->refs > 0) e->stale = 1;
+    else sodium_memzero(e, sizeof(*e));
+}
+
+const GroupSenderKey* group_keyring_put(GroupKeyring* ring, const group_key_id_t* id, const group_key_material_t* material) {
+    pthread_mutex_lock(&ring->lock);
+    struct GroupSenderKey *old = find_live(ring, id), *victim = NULL;
+    if (old && old->refs == 0) {
+        victim = old;
+    } else {
+        for (size_t i = 0; i < ring->capacity; i++) {
+            struct GroupSenderKey *e = &ring->entries[i];
+            if (e->refs > 0) continue;
+            if (!victim || !e->used || (victim->used && e->last_used < victim->last_used)) victim = e;
+        }
+    }
+    if (victim) {
+        if (old && old != victim) retire(old);
+        sodium_memzero(victim, sizeof(*victim));
+        victim->id = *id;
+        victim->material = *material;
+        victim->used = 1;
+        victim->refs = 1;
+        victim->last_used = ++ring->clock;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return victim;
+}
+
+const GroupSenderKey* group_keyring_acquire(GroupKeyring* ring, const group_key_id_t* id) {
+    pthread_mutex_lock(&ring->lock);
+    struct GroupSenderKey *e = find_live(ring, id);
+    if (e) {
+        e->refs++;
+        e->last_used = ++ring->clock;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return e;
+}
+
+void group_keyring_release(GroupKeyring* ring, const GroupSenderKey* key) {
+    if (!key) return;
+    pthread_mutex_lock(&ring->lock);
+    struct GroupSenderKey *e = (struct GroupSenderKey*)key;
+    if (e->refs > 0) e->refs--;
+    if (e->refs == 0 && e->stale) sodium_memzero(e, sizeof(*e));
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void group_keyring_forget(GroupKeyring* ring, const unsigned char group_id[GROUP_ID_BYTES], uint32_t min_epoch) {
+    pthread_mutex_lock(&ring->lock);
+    for (size_t i = 0; i < ring->capacity; i++) {
+        struct GroupSenderKey *e = &ring->entries[i];
+        if (!e->used || e->stale || memcmp(e->id.group_id, group_id, GROUP_ID_BYTES) != 0) continue;
+        if (min_epoch == UINT32_MAX || e->id.epoch < min_epoch) retire(e);
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static void write_header(unsigned char* out, const group_key_id_t* id) {
+    out[0] = GROUP_FRAME_VERSION;
+    memcpy(out + 1, id->group_id, GROUP_ID_BYTES);
+    unsigned char *p = out + 1 + GROUP_ID_BYTES;
+    p[0] = (unsigned char)(id->epoch >> 24);
+    p[1] = (unsigned char)(id->epoch >> 16);
+    p[2] = (unsigned char)(id->epoch >> 8);
+    p[3] = (unsigned char)id->epoch;
+    memcpy(p + 4, id->sender, PK_BYTES);
+}
+
+size_t group_frame_seal(const GroupSenderKey* key, const unsigned char* plaintext, size_t len, unsigned char* out) {
+    if (!key->material.has_sign_sk) return 0;
+    write_header(out, &key->id);
+    unsigned char *nonce = out + GROUP_FRAME_HEADER_BYTES - NONCE_BYTES;
+    randombytes_buf(nonce, NONCE_BYTES);
+    unsigned long long clen = 0;
+    crypto_aead_xchacha20poly1305_ietf_encrypt(out + GROUP_FRAME_HEADER_BYTES, &clen, plaintext, len,
+                                               out, GROUP_FRAME_HEADER_BYTES, NULL, nonce, key->material.key);
+    size_t signed_len = GROUP_FRAME_HEADER_BYTES + (size_t)clen;
+    crypto_sign_detached(out + signed_len, NULL, out, signed_len, key->material.sign_sk);
+    return signed_len + crypto_sign_BYTES;
+}
+
+int group_frame_parse(const unsigned char* frame, size_t len, group_key_id_t* id) {
+    if (len < GROUP_FRAME_OVERHEAD || frame[0] != GROUP_FRAME_VERSION) return -1;
+    memcpy(id->group_id, frame + 1, GROUP_ID_BYTES);
+    const unsigned char *p = frame + 1 + GROUP_ID_BYTES;
+    id->epoch = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    memcpy(id->sender, p + 4, PK_BYTES);
+    return 0;
+}
+
+int group_frame_open(const GroupSenderKey* key, const unsigned char* frame, size_t len, unsigned char* out, size_t* out_len) {
+    group_key_id_t id;
+    if (group_frame_parse(frame, len, &id) != 0 || !id_equal(&id, &key->id)) return -1;
+    size_t signed_len = len - crypto_sign_BYTES;
+    if (crypto_sign_verify_detached(frame + signed_len, frame, signed_len, key->material.sign_pk) != 0) return -1;
+    unsigned long long mlen = 0;
+    if (crypto_aead_xchacha20poly1305_ietf_decrypt(out, &mlen, NULL, frame + GROUP_FRAME_HEADER_BYTES, signed_len - GROUP_FRAME_HEADER_BYTES,
+                                                   frame, GROUP_FRAME_HEADER_BYTES, frame + GROUP_FRAME_HEADER_BYTES - NONCE_BYTES,
+                                                   key->material.key) != 0) {
+        return -1;
+    }
+    *out_len = (size_t)mlen;
+    return 0;
+}
+
+uint64_t group_frame_id(const unsigned char* frame, size_t len) {
+    if (len < crypto_sign_BYTES) return 0;
+    const unsigned char *sig = frame + len - crypto_sign_BYTES;
+    uint64_t id = 0;
+    for (int i = 0; i < 8; i++) id = (id << 8) | sig[i];
+    return id;
+}
+
+static int compare_pk(const void* a, const void* b) {
+    return memcmp(a, b, PK_BYTES);
+}
+
+size_t group_roster_normalize(unsigned char (*members)[PK_BYTES], size_t count, unsigned char digest[GROUP_DIGEST_BYTES]) {
+    qsort(members, count, PK_BYTES, compare_pk);
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (n > 0 && memcmp(members[n - 1], members[i], PK_BYTES) == 0) continue;
+        if (n != i) memcpy(members[n], members[i], PK_BYTES);
+        n++;
+    }
+    crypto_generichash(digest, GROUP_DIGEST_BYTES, (const unsigned char*)members, n * PK_BYTES, NULL, 0);
+    return n;
+}
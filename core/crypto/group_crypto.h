@@ -0,0 +1,120 @@
+#ifndef ZEROLINK_GROUP_CRYPTO_H
+#define ZEROLINK_GROUP_CRYPTO_H
+
+#include <sodium.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "../models/pk_intern.h"
+
+/**
+ * @file group_crypto.h
+ * @brief 群聊的发送者密钥 (sender key)：每个成员为每个群、每个纪元生成一把对称密钥和一对签名密钥，
+ *        通过两两加密的链路分发给其他成员。群消息只加密、签名一次，同一个密文帧原样发给所有成员，
+ *        因此每条消息的计算量与群的人数无关。
+ *
+ * 成员变动时纪元加一，所有成员换用新密钥，被移出的成员拿不到新纪元的密钥。
+ * 帧格式: [版本 1][群 id 32][纪元 u32 大端][发送者公钥 32][nonce 24][XChaCha20-Poly1305 密文][Ed25519 签名 64]，
+ * 帧头作为附加数据参与认证，签名覆盖签名之前的全部字节，持有同一把对称密钥的其他成员无法冒充发送者。
+ * 密钥环与 peer_crypto.h 的共享密钥缓存一样放在 sodium_malloc 分配的锁定内存中。
+ */
+
+#define GROUP_ID_BYTES PK_BYTES
+#define GROUP_KEY_BYTES crypto_aead_xchacha20poly1305_ietf_KEYBYTES
+#define GROUP_SIGN_PK_BYTES crypto_sign_PUBLICKEYBYTES
+#define GROUP_SIGN_SK_BYTES crypto_sign_SECRETKEYBYTES
+#define GROUP_DIGEST_BYTES 32
+#define GROUP_FRAME_VERSION 1
+#define GROUP_FRAME_HEADER_BYTES (1 + GROUP_ID_BYTES + 4 + PK_BYTES + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES)
+#define GROUP_FRAME_OVERHEAD (GROUP_FRAME_HEADER_BYTES + crypto_aead_xchacha20poly1305_ietf_ABYTES + crypto_sign_BYTES)
+
+/**
+ * @struct group_key_id_t
+ * @brief 一把发送者密钥的标识，也是群帧的帧头内容。
+ */
+typedef struct {
+    unsigned char group_id[GROUP_ID_BYTES];
+    uint32_t epoch;
+    unsigned char sender[PK_BYTES];
+} group_key_id_t;
+
+/**
+ * @struct group_key_material_t
+ * @brief 发送者密钥的导出形式，用于分发和持久化。只有自己的密钥带签名私钥；用完后应 sodium_memzero。
+ */
+typedef struct {
+    unsigned char key[GROUP_KEY_BYTES];
+    unsigned char sign_pk[GROUP_SIGN_PK_BYTES];
+    unsigned char sign_sk[GROUP_SIGN_SK_BYTES];
+    int has_sign_sk;
+} group_key_material_t;
+
+typedef struct GroupKeyring GroupKeyring;
+typedef struct GroupSenderKey GroupSenderKey;
+
+/**
+ * @brief 生成一把新的发送者密钥（对称密钥 + 签名密钥对）。
+ */
+void group_key_generate(group_key_material_t* out);
+
+/**
+ * @brief 创建密钥环。
+ * @param capacity 最多缓存的发送者密钥数；未缓存的密钥由调用者从持久化存储重新放入。
+ * @return 成功返回密钥环，内存不足时返回 NULL。
+ */
+GroupKeyring* group_keyring_create(size_t capacity);
+
+/**
+ * @brief 清零并释放密钥环。调用前所有取得的密钥都应已释放。
+ */
+void group_keyring_destroy(GroupKeyring* ring);
+
+/**
+ * @brief 放入（或替换同一标识的）发送者密钥并取得它。被替换的旧密钥若仍被占用，会在释放后回收。
+ * @return 成功返回密钥；所有表项都被占用时返回 NULL。
+ */
+const GroupSenderKey* group_keyring_put(GroupKeyring* ring, const group_key_id_t* id, const group_key_material_t* material);
+
+/**
+ * @brief 取得已缓存的发送者密钥，在 group_keyring_release 之前不会被淘汰。
+ * @return 未缓存时返回 NULL。
+ */
+const GroupSenderKey* group_keyring_acquire(GroupKeyring* ring, const group_key_id_t* id);
+
+void group_keyring_release(GroupKeyring* ring, const GroupSenderKey* key);
+
+/**
+ * @brief 丢弃一个群中纪元小于 min_epoch 的全部密钥（min_epoch 为 UINT32_MAX 时丢弃该群全部密钥），正在使用的在释放后回收。
+ */
+void group_keyring_forget(GroupKeyring* ring, const unsigned char group_id[GROUP_ID_BYTES], uint32_t min_epoch);
+
+/**
+ * @brief 用自己的发送者密钥加密并签名一条群消息。out 至少 len + GROUP_FRAME_OVERHEAD 字节。
+ * @return 帧长度；密钥不带签名私钥时返回 0。
+ */
+size_t group_frame_seal(const GroupSenderKey* key, const unsigned char* plaintext, size_t len, unsigned char* out);
+
+/**
+ * @brief 读取帧头，用于查找对应的发送者密钥。
+ * @return 成功返回 0，帧过短或版本不符返回 -1。
+ */
+int group_frame_parse(const unsigned char* frame, size_t len, group_key_id_t* id);
+
+/**
+ * @brief 验证签名并解密。out 至少 len - GROUP_FRAME_OVERHEAD 字节。
+ * @return 成功返回 0，帧头与密钥不符、签名或认证失败返回 -1。
+ */
+int group_frame_open(const GroupSenderKey* key, const unsigned char* frame, size_t len, unsigned char* out, size_t* out_len);
+
+/**
+ * @brief 帧的 64 位标识（签名的前 8 字节），用于在验证签名之前挡住重复到达的副本。
+ *        只应在帧验证通过后记录，否则伪造的帧可以抢先占用合法帧的标识。
+ */
+uint64_t group_frame_id(const unsigned char* frame, size_t len);
+
+/**
+ * @brief 把成员列表按字节序排序、去重，并计算其摘要（纪元相同的两份成员列表以摘要较大者为准）。
+ * @return 去重后的成员数。
+ */
+size_t group_roster_normalize(unsigned char (*members)[PK_BYTES], size_t count, unsigned char digest[GROUP_DIGEST_BYTES]);
+
+#endif //ZEROLINK_GROUP_CRYPTO_H
@@ -0,0 +1,115 @@
+#include "peer_crypto.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define PEER_NONCE_BATCH 32 // 一次随机数调用生成的 nonce 数
+
+struct PeerKey {
+    unsigned char key[crypto_box_BEFORENMBYTES];
+    unsigned char pk[PK_BYTES];
+    int used;
+    int refs;
+    uint64_t last_used;
+};
+
+// 结构体本身在普通内存中，密钥材料都在 secrets 指向的 sodium_malloc 区域里
+struct PeerKeyCache {
+    struct Secrets {
+        unsigned char my_sk[crypto_box_SECRETKEYBYTES];
+        struct PeerKey entries[];
+    } *secrets;
+    size_t capacity;
+    uint64_t clock;
+    pthread_mutex_t lock;
+};
+
+PeerKeyCache* peer_key_cache_create(const unsigned char my_sk[crypto_box_SECRETKEYBYTES], size_t capacity) {
+    if (capacity == 0) return NULL;
+    PeerKeyCache *cache = calloc(1, sizeof(PeerKeyCache));
+    if (!cache) return NULL;
+    size_t size = sizeof(struct Secrets) + capacity * sizeof(struct PeerKey);
+    cache->secrets = sodium_malloc(size);
+    if (!cache->secrets) {
+        free(cache);
+        return NULL;
+    }
+    sodium_memzero(cache->secrets, size);
+    memcpy(cache->secrets->my_sk, my_sk, crypto_box_SECRETKEYBYTES);
+    cache->capacity = capacity;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void peer_key_cache_destroy(PeerKeyCache* cache) {
+    if (!cache) return;
+    sodium_free(cache->secrets); // sodium_free 会先清零
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+const PeerKey* peer_key_acquire(PeerKeyCache* cache, const unsigned char peer_pk[PK_BYTES]) {
+    pthread_mutex_lock(&cache->lock);
+    struct PeerKey *hit = NULL, *victim = NULL;
+    for (size_t i = 0; i < cache->capacity; i++) {
+        struct PeerKey *e = &cache->secrets->entries[i];
+        if (e->used && sodium_memcmp(e->pk, peer_pk, PK_BYTES) == 0) {
+            hit = e;
+            break;
+        }
+        if (e->refs > 0) continue;
+        if (!victim || !e->used || (victim->used && e->last_used < victim->last_used)) victim = e;
+    }
+    if (!hit && victim) {
+        sodium_memzero(victim, sizeof(*victim));
+        if (crypto_box_beforenm(victim->key, peer_pk, cache->secrets->my_sk) == 0) {
+            memcpy(victim->pk, peer_pk, PK_BYTES);
+            victim->used = 1;
+            hit = victim;
+        }
+    }
+    if (hit) {
+        hit->refs++;
+        hit->last_used = ++cache->clock;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+void peer_key_release(PeerKeyCache* cache, const PeerKey* key) {
+    if (!key) return;
+    pthread_mutex_lock(&cache->lock);
+    struct PeerKey *e = (struct PeerKey*)key;
+    if (e->refs > 0) e->refs--;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+size_t peer_box_seal_batch(const PeerKey* key, peer_box_frame_t* frames, size_t count) {
+    unsigned char nonces[PEER_NONCE_BATCH][crypto_box_NONCEBYTES];
+    size_t ok = 0;
+    for (size_t base = 0; base < count; base += PEER_NONCE_BATCH) {
+        size_t n = count - base < PEER_NONCE_BATCH ? count - base : PEER_NONCE_BATCH;
+        randombytes_buf(nonces, n * crypto_box_NONCEBYTES);
+        for (size_t i = 0; i < n; i++) {
+            peer_box_frame_t *f = &frames[base + i];
+            memcpy(f->out, nonces[i], crypto_box_NONCEBYTES);
+            f->ok = crypto_box_easy_afternm(f->out + crypto_box_NONCEBYTES, f->in, f->in_len, nonces[i], key->key) == 0;
+            f->out_len = f->ok ? f->in_len + PEER_BOX_OVERHEAD : 0;
+            ok += f->ok;
+        }
+    }
+    return ok;
+}
+
+size_t peer_box_open_batch(const PeerKey* key, peer_box_frame_t* frames, size_t count) {
+    size_t ok = 0;
+    for (size_t i = 0; i < count; i++) {
+        peer_box_frame_t *f = &frames[i];
+        f->ok = f->in_len >= PEER_BOX_OVERHEAD &&
+                crypto_box_open_easy_afternm(f->out, f->in + crypto_box_NONCEBYTES, f->in_len - crypto_box_NONCEBYTES, f->in, key->key) == 0;
+        f->out_len = f->ok ? f->in_len - PEER_BOX_OVERHEAD : 0;
+        ok += f->ok;
+    }
+    return ok;
+}
@@ -0,0 +1,69 @@
+#ifndef ZEROLINK_PEER_CRYPTO_H
+#define ZEROLINK_PEER_CRYPTO_H
+
+#include <sodium.h>
+#include <stddef.h>
+#include "../models/pk_intern.h"
+
+/**
+ * @file peer_crypto.h
+ * @brief 点对点链路的帧加密：本机私钥、按对端缓存的共享密钥，以及成批的加密/解密。
+ *
+ * 共享密钥 (crypto_box_beforenm) 需要一次 X25519 运算，缓存后同一好友断线重连不必重新计算。
+ * 本机私钥和所有共享密钥都放在 sodium_malloc 分配的内存中：该内存被锁定（不会换出到磁盘）、
+ * 前后有保护页，淘汰的表项与销毁时的整块内存都会被清零。
+ * 帧格式: [nonce][crypto_box_easy_afternm 密文]，即 PEER_BOX_OVERHEAD 字节的开销。
+ */
+
+#define PEER_BOX_OVERHEAD (crypto_box_NONCEBYTES + crypto_box_MACBYTES)
+
+typedef struct PeerKeyCache PeerKeyCache;
+typedef struct PeerKey PeerKey;
+
+/**
+ * @struct peer_box_frame_t
+ * @brief 批量加密/解密中的一帧。out 由调用者提供：加密时至少 in_len + PEER_BOX_OVERHEAD 字节，
+ *        解密时至少 in_len - PEER_BOX_OVERHEAD 字节。
+ */
+typedef struct {
+    const unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len; ///< 输出的实际长度；失败时为 0
+    int ok;         ///< 成功为 1；解密时认证失败或帧过短为 0
+} peer_box_frame_t;
+
+/**
+ * @brief 创建共享密钥缓存，本机私钥被复制进锁定内存，调用者可以随即清除自己的副本。
+ * @param capacity 最多缓存的对端数。
+ * @return 成功返回缓存，内存不足时返回 NULL。
+ */
+PeerKeyCache* peer_key_cache_create(const unsigned char my_sk[crypto_box_SECRETKEYBYTES], size_t capacity);
+
+/**
+ * @brief 清零并释放缓存。调用前所有 peer_key_acquire 取得的密钥都应已释放。
+ */
+void peer_key_cache_destroy(PeerKeyCache* cache);
+
+/**
+ * @brief 取得与对端的共享密钥，未缓存时计算并放入缓存（淘汰最久未用且未被占用的表项）。
+ *        取得的密钥在 peer_key_release 之前不会被淘汰，可以不加锁使用。
+ * @return 成功返回密钥；公钥无效或所有表项都被占用时返回 NULL。
+ */
+const PeerKey* peer_key_acquire(PeerKeyCache* cache, const unsigned char peer_pk[PK_BYTES]);
+
+void peer_key_release(PeerKeyCache* cache, const PeerKey* key);
+
+/**
+ * @brief 用同一个共享密钥加密一批帧，所有 nonce 由一次随机数调用生成。
+ * @return 成功的帧数。
+ */
+size_t peer_box_seal_batch(const PeerKey* key, peer_box_frame_t* frames, size_t count);
+
+/**
+ * @brief 用同一个共享密钥解密一批帧，认证失败的帧 ok 为 0，不影响其余帧。
+ * @return 成功的帧数。
+ */
+size_t peer_box_open_batch(const PeerKey* key, peer_box_frame_t* frames, size_t count);
+
+#endif //ZEROLINK_PEER_CRYPTO_H
@@ -38,4 +38,21 @@ typedef struct {
 
 } ChatBlock;
 
+/**
+ * @struct ChatBlockView
+ * @brief 指向已持久化区块的只读视图（零拷贝）。
+ *
+ * 由存储层填充，所有指针都直接指向 mmap 映射的日志段，不做任何堆分配。
+ * 视图在对应的 DatabaseHandle 关闭之前一直有效，调用者不得修改或释放其中的指针。
+ */
+typedef struct {
+    uint64_t index;
+    uint64_t timestamp;
+    const unsigned char *prev_hash;
+    const unsigned char *sender_pubkey;
+    const unsigned char *signature;
+    const unsigned char *ciphertext;
+    size_t ciphertext_len;
+} ChatBlockView;
+
 #endif //ZEROLINK_CHAT_BLOCK_H
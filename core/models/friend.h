@@ -2,17 +2,11 @@
 #define ZEROLINK_FRIEND_H
 
 #include <sodium.h>
+#include "pk_intern.h"
 
 // 统一的公钥十六进制长度定义
 #define PK_HEX_LEN (crypto_box_PUBLICKEYBYTES * 2)
 
-/**
- * @struct friend_t
- * @brief 代表一个好友的信息。
- */
-typedef struct {
-    char name[32];
-    char pk_hex[PK_HEX_LEN + 1];
-} friend_t;
+// 好友本身保存在客户端的通讯录中，见 client/logic/contact_store.h。
 
 #endif //ZEROLINK_FRIEND_H
@@ -0,0 +1,120 @@
+#include "pk_intern.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PK_HEX_CHARS (PK_BYTES * 2)
+#define PK_CHUNK_SHIFT 12
+#define PK_CHUNK_SIZE (1u << PK_CHUNK_SHIFT)
+#define PK_CHUNK_COUNT (PK_INTERN_MAX / PK_CHUNK_SIZE)
+#define PK_INITIAL_SLOTS 8192        // 装载因子不超过 1/2，超过时散列表加倍
+
+typedef struct {
+    unsigned char pk[PK_BYTES];
+    char hex[PK_HEX_CHARS + 1];
+} pk_entry_t;
+
+// 表项按块分配，块一旦分配就不再移动，pk_bytes/pk_hex 返回的指针因此始终有效。
+// entry_count 在表项写完之后才递增（释放语义），读者先读它再读表项，不需要加锁。
+// id 0 保留给 PK_ID_NONE
+static _Atomic(pk_entry_t*) chunks[PK_CHUNK_COUNT];
+static _Atomic uint32_t entry_count = 1;
+// 开放寻址散列表，由 intern_lock 保护
+static pk_id_t *slots = NULL;
+static uint32_t slot_count = 0;
+static pthread_rwlock_t intern_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pk_entry_t* entry_at(pk_id_t id) {
+    pk_entry_t *chunk = atomic_load_explicit(&chunks[id >> PK_CHUNK_SHIFT], memory_order_acquire);
+    return &chunk[id & (PK_CHUNK_SIZE - 1)];
+}
+
+// 公钥本身是均匀随机的，直接取前 4 字节作为哈希
+static uint32_t pk_slot(const unsigned char pk[PK_BYTES], uint32_t count) {
+    uint32_t h;
+    memcpy(&h, pk, sizeof(h));
+    return h & (count - 1);
+}
+
+// 调用者需持有读锁或写锁
+static pk_id_t find_locked(const unsigned char pk[PK_BYTES], uint32_t* slot_out) {
+    if (!slots) return PK_ID_NONE;
+    uint32_t slot = pk_slot(pk, slot_count);
+    while (slots[slot] != PK_ID_NONE) {
+        if (memcmp(entry_at(slots[slot])->pk, pk, PK_BYTES) == 0) return slots[slot];
+        slot = (slot + 1) & (slot_count - 1);
+    }
+    if (slot_out) *slot_out = slot;
+    return PK_ID_NONE;
+}
+
+/**
+ * 保证散列表还能再放一个表项而装载因子不超过 1/2，必要时加倍并重新散列。调用者持有写锁。
+ */
+static int reserve_locked(uint32_t count) {
+    if (slots && (uint64_t)(count + 1) * 2 <= slot_count) return 0;
+    uint32_t grown_count = slot_count ? slot_count * 2 : PK_INITIAL_SLOTS;
+    pk_id_t *grown = calloc(grown_count, sizeof(pk_id_t));
+    if (!grown) return -1;
+    for (pk_id_t id = 1; id < count; id++) {
+        uint32_t slot = pk_slot(entry_at(id)->pk, grown_count);
+        while (grown[slot] != PK_ID_NONE) slot = (slot + 1) & (grown_count - 1);
+        grown[slot] = id;
+    }
+    free(slots);
+    slots = grown;
+    slot_count = grown_count;
+    return 0;
+}
+
+pk_id_t pk_lookup(const unsigned char pk[PK_BYTES]) {
+    pthread_rwlock_rdlock(&intern_lock);
+    pk_id_t id = find_locked(pk, NULL);
+    pthread_rwlock_unlock(&intern_lock);
+    return id;
+}
+
+pk_id_t pk_intern(const unsigned char pk[PK_BYTES]) {
+    pk_id_t id = pk_lookup(pk);
+    if (id != PK_ID_NONE) return id;
+
+    pthread_rwlock_wrlock(&intern_lock);
+    uint32_t slot, count = atomic_load_explicit(&entry_count, memory_order_relaxed);
+    id = find_locked(pk, NULL); // 获取写锁期间可能已被其他线程驻留
+    if (id == PK_ID_NONE && count < PK_INTERN_MAX && reserve_locked(count) == 0) {
+        pk_entry_t *chunk = atomic_load_explicit(&chunks[count >> PK_CHUNK_SHIFT], memory_order_relaxed);
+        if (!chunk && (chunk = calloc(PK_CHUNK_SIZE, sizeof(pk_entry_t))) != NULL) {
+            atomic_store_explicit(&chunks[count >> PK_CHUNK_SHIFT], chunk, memory_order_release);
+        }
+        if (chunk) {
+            id = count;
+            pk_entry_t *entry = &chunk[id & (PK_CHUNK_SIZE - 1)];
+            memcpy(entry->pk, pk, PK_BYTES);
+            sodium_bin2hex(entry->hex, sizeof(entry->hex), pk, PK_BYTES);
+            find_locked(pk, &slot);
+            slots[slot] = id;
+            atomic_store_explicit(&entry_count, count + 1, memory_order_release);
+        }
+    }
+    pthread_rwlock_unlock(&intern_lock);
+    return id;
+}
+
+pk_id_t pk_intern_hex(const char* pk_hex) {
+    unsigned char pk[PK_BYTES];
+    size_t bin_len = 0;
+    if (!pk_hex || strlen(pk_hex) != PK_HEX_CHARS) return PK_ID_NONE;
+    if (sodium_hex2bin(pk, sizeof(pk), pk_hex, PK_HEX_CHARS, NULL, &bin_len, NULL) != 0 || bin_len != PK_BYTES) return PK_ID_NONE;
+    return pk_intern(pk);
+}
+
+const unsigned char* pk_bytes(pk_id_t id) {
+    if (id == PK_ID_NONE || id >= atomic_load_explicit(&entry_count, memory_order_acquire)) return NULL;
+    return entry_at(id)->pk;
+}
+
+const char* pk_hex(pk_id_t id) {
+    if (id == PK_ID_NONE || id >= atomic_load_explicit(&entry_count, memory_order_acquire)) return "";
+    return entry_at(id)->hex;
+}
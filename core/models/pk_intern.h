@@ -0,0 +1,50 @@
+#ifndef ZEROLINK_PK_INTERN_H
+#define ZEROLINK_PK_INTERN_H
+
+#include <stdint.h>
+#include <sodium.h>
+
+/**
+ * @file pk_intern.h
+ * @brief 公钥驻留表：把 32 字节公钥映射为进程内唯一的小整数 id。
+ *
+ * 内存中的好友、连接和会话只保存 id，比较和查找都是整数运算；
+ * 原始公钥和十六进制形式在驻留时各计算一次并缓存，之后只在界面或线路边界读取。
+ * 表项从不删除，返回的指针在进程生命周期内有效，可以不加锁使用。
+ * 表按块增长，上限为 PK_INTERN_MAX 个公钥；已分配的表项不会移动。
+ */
+
+typedef uint32_t pk_id_t;
+
+#define PK_ID_NONE 0
+#define PK_BYTES crypto_box_PUBLICKEYBYTES
+#define PK_INTERN_MAX (1u << 22)  // id 的上限（约 400 万），同时决定按 id 索引的块表大小
+
+/**
+ * @brief 驻留一个公钥，已存在时返回原有 id。
+ * @return 公钥对应的 id；达到 PK_INTERN_MAX 或内存不足时返回 PK_ID_NONE。
+ */
+pk_id_t pk_intern(const unsigned char pk[PK_BYTES]);
+
+/**
+ * @brief 解析十六进制公钥并驻留（仅用于界面输入、配置文件等边界）。
+ * @return 公钥对应的 id；格式错误、达到上限或内存不足时返回 PK_ID_NONE。
+ */
+pk_id_t pk_intern_hex(const char* pk_hex);
+
+/**
+ * @brief 查找公钥的 id，不存在时不创建。
+ */
+pk_id_t pk_lookup(const unsigned char pk[PK_BYTES]);
+
+/**
+ * @brief 取得 id 对应的原始公钥；id 无效时返回 NULL。
+ */
+const unsigned char* pk_bytes(pk_id_t id);
+
+/**
+ * @brief 取得 id 对应的十六进制公钥（驻留时缓存）；id 无效时返回空串。
+ */
+const char* pk_hex(pk_id_t id);
+
+#endif //ZEROLINK_PK_INTERN_H
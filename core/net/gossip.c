@@ -0,0 +1,103 @@
+#include "gossip.h"
+#include <pthread.h>
+#include <sodium.h>
+#include <stdlib.h>
+
+// 开放寻址的 64 位整数集合，装载率不超过 1/2；0 用作空槽，id 为 0 时按 1 记录
+typedef struct {
+    uint64_t *slots;
+    size_t mask;
+    size_t count;
+} id_set_t;
+
+struct GossipSeen {
+    id_set_t gen[2]; // gen[current] 接收新 id，另一代只用于查询
+    int current;
+    size_t capacity;
+    pthread_mutex_t lock;
+};
+
+static int set_init(id_set_t* set, size_t capacity) {
+    size_t size = 16;
+    while (size < capacity * 2) size <<= 1;
+    set->slots = calloc(size, sizeof(uint64_t));
+    set->mask = size - 1;
+    set->count = 0;
+    return set->slots ? 0 : -1;
+}
+
+static size_t set_slot(const id_set_t* set, uint64_t id) {
+    size_t i = (size_t)(id * 0x9E3779B97F4A7C15ULL) & set->mask;
+    while (set->slots[i] != 0 && set->slots[i] != id) i = (i + 1) & set->mask;
+    return i;
+}
+
+GossipSeen* gossip_seen_create(size_t capacity) {
+    if (capacity == 0) return NULL;
+    GossipSeen *seen = calloc(1, sizeof(GossipSeen));
+    if (!seen) return NULL;
+    if (set_init(&seen->gen[0], capacity) != 0 || set_init(&seen->gen[1], capacity) != 0) {
+        gossip_seen_destroy(seen);
+        return NULL;
+    }
+    seen->capacity = capacity;
+    pthread_mutex_init(&seen->lock, NULL);
+    return seen;
+}
+
+void gossip_seen_destroy(GossipSeen* seen) {
+    if (!seen) return;
+    free(seen->gen[0].slots);
+    free(seen->gen[1].slots);
+    if (seen->capacity) pthread_mutex_destroy(&seen->lock);
+    free(seen);
+}
+
+static int contains_locked(GossipSeen* seen, uint64_t id) {
+    for (int g = 0; g < 2; g++) {
+        const id_set_t *set = &seen->gen[g];
+        if (set->slots[set_slot(set, id)] == id) return 1;
+    }
+    return 0;
+}
+
+int gossip_seen_contains(GossipSeen* seen, uint64_t id) {
+    if (id == 0) id = 1;
+    pthread_mutex_lock(&seen->lock);
+    int found = contains_locked(seen, id);
+    pthread_mutex_unlock(&seen->lock);
+    return found;
+}
+
+int gossip_seen_add(GossipSeen* seen, uint64_t id) {
+    if (id == 0) id = 1;
+    pthread_mutex_lock(&seen->lock);
+    int added = !contains_locked(seen, id);
+    if (added) {
+        id_set_t *set = &seen->gen[seen->current];
+        if (set->count >= seen->capacity) {
+            // 新一代已满：清空旧一代并让它接收新 id
+            seen->current ^= 1;
+            set = &seen->gen[seen->current];
+            for (size_t i = 0; i <= set->mask; i++) set->slots[i] = 0;
+            set->count = 0;
+        }
+        set->slots[set_slot(set, id)] = id;
+        set->count++;
+    }
+    pthread_mutex_unlock(&seen->lock);
+    return added;
+}
+
+size_t gossip_pick(size_t n, size_t k, size_t* out) {
+    if (k > n) k = n;
+    for (size_t i = 0; i < n; i++) out[i] = i;
+    // 部分 Fisher-Yates 洗牌：只确定前 k 个位置
+    for (size_t i = 0; i < k; i++) {
+        size_t j = i + (size_t)randombytes_uniform((uint32_t)(n - i));
+        size_t tmp = out[i];
+        out[i] = out[j];
+        out[j] = tmp;
+    }
+    return k;
+}
@@ -0,0 +1,42 @@
+#ifndef ZEROLINK_GOSSIP_H
+#define ZEROLINK_GOSSIP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file gossip.h
+ * @brief 流言式 (epidemic) 传播的公共部件：去重集合与随机扇出。
+ *
+ * 每个节点只把第一次收到、并已验证通过的数据转发给少数随机选出的邻居，
+ * 重复到达的副本在验证之前就被去重集合挡住。少量没被覆盖到的节点由周期性的反熵 (anti-entropy) 补齐。
+ * 这样发送者的上传量与群的人数无关，送达需要 O(log N) 跳。
+ */
+
+#define GOSSIP_DEFAULT_FANOUT 3
+
+typedef struct GossipSeen GossipSeen;
+
+/**
+ * @brief 创建去重集合。集合分新旧两代，新一代记满 capacity 个后旧一代被丢弃，因此最多记住最近 2 * capacity 个 id。
+ * @return 成功返回集合，内存不足时返回 NULL。
+ */
+GossipSeen* gossip_seen_create(size_t capacity);
+
+void gossip_seen_destroy(GossipSeen* seen);
+
+int gossip_seen_contains(GossipSeen* seen, uint64_t id);
+
+/**
+ * @brief 记录一个 id。
+ * @return 新记录返回 1，已存在返回 0。
+ */
+int gossip_seen_add(GossipSeen* seen, uint64_t id);
+
+/**
+ * @brief 从 n 个候选中不放回地均匀随机选出 min(k, n) 个，下标写入 out（out 至少 n 个元素，用作洗牌的工作区）。
+ * @return 选出的个数。
+ */
+size_t gossip_pick(size_t n, size_t k, size_t* out);
+
+#endif //ZEROLINK_GOSSIP_H
@@ -0,0 +1,151 @@
+#include "link_mux.h"
+#include <stdlib.h>
+#include <string.h>
+
+// 权重之比即带宽之比：三类都有帧等待时，交互 : 同步 : 大块 = 64 : 8 : 1。
+// 交互类的帧很小，实际效果是它总在当前这一片写完后立即发出
+static const uint64_t weights[LINK_PRIO_COUNT] = { 64, 8, 1 };
+#define WEIGHT_MAX 64
+
+// 分片上限：交互类的帧从不切开；同步与大块的一片在 1 MB/s 的链路上分别占用约 16 ms 与 4 ms
+static const size_t piece_sizes[LINK_PRIO_COUNT] = { SIZE_MAX, 16 * 1024, 4 * 1024 };
+
+void link_mux_init(link_mux_t* mux) {
+    memset(mux, 0, sizeof(*mux));
+    pthread_mutex_init(&mux->mutex, NULL);
+    pthread_cond_init(&mux->cond, NULL);
+}
+
+void link_mux_destroy(link_mux_t* mux) {
+    for (int p = 0; p < LINK_PRIO_COUNT; p++) {
+        while (mux->head[p]) {
+            link_mux_frame_t *next = mux->head[p]->next;
+            free(mux->head[p]);
+            mux->head[p] = next;
+        }
+        mux->tail[p] = NULL;
+    }
+    mux->queued = 0;
+    pthread_mutex_destroy(&mux->mutex);
+    pthread_cond_destroy(&mux->cond);
+}
+
+size_t link_mux_piece_size(link_prio_t prio) {
+    return piece_sizes[prio];
+}
+
+/**
+ * 有帧等待的类中虚拟时间最小的一类，相同时优先级高的先；都空闲时返回 -1。调用者持有锁。
+ */
+static int pick_class(const link_mux_t* mux) {
+    int best = -1;
+    for (int p = 0; p < LINK_PRIO_COUNT; p++) {
+        if (!mux->head[p]) continue;
+        if (best < 0 || mux->vtime[p] < mux->vtime[best]) best = p;
+    }
+    return best;
+}
+
+int link_mux_push(link_mux_t* mux, link_prio_t prio, const unsigned char* frame, size_t len, uint64_t tag, size_t limit) {
+    link_mux_frame_t *f = malloc(sizeof(link_mux_frame_t) + len);
+    if (!f) return -1;
+    f->next = NULL;
+    f->tag = tag;
+    f->len = len;
+    f->pos = 0;
+    memcpy(f->data, frame, len);
+    pthread_mutex_lock(&mux->mutex);
+    if (mux->closed || mux->queued + len > limit) {
+        pthread_mutex_unlock(&mux->mutex);
+        free(f);
+        return -1;
+    }
+    // 空闲过的类不能攒下额度：从当前的虚拟时间重新开始
+    if (!mux->head[prio]) {
+        if (mux->vtime[prio] < mux->link_vtime) mux->vtime[prio] = mux->link_vtime;
+        mux->head[prio] = f;
+    } else {
+        mux->tail[prio]->next = f;
+    }
+    mux->tail[prio] = f;
+    mux->queued += len;
+    pthread_cond_broadcast(&mux->cond);
+    pthread_mutex_unlock(&mux->mutex);
+    return 0;
+}
+
+size_t link_mux_queued(link_mux_t* mux) {
+    pthread_mutex_lock(&mux->mutex);
+    size_t queued = mux->queued;
+    pthread_mutex_unlock(&mux->mutex);
+    return queued;
+}
+
+void link_mux_wait_below(link_mux_t* mux, size_t bytes) {
+    pthread_mutex_lock(&mux->mutex);
+    while (!mux->closed && mux->queued > bytes) pthread_cond_wait(&mux->cond, &mux->mutex);
+    pthread_mutex_unlock(&mux->mutex);
+}
+
+link_mux_frame_t* link_mux_next(link_mux_t* mux, link_prio_t* prio) {
+    pthread_mutex_lock(&mux->mutex);
+    int p = -1;
+    while (!mux->closed && (p = pick_class(mux)) < 0) {
+        pthread_cond_wait(&mux->cond, &mux->mutex);
+    }
+    link_mux_frame_t *f = NULL;
+    if (!mux->closed) {
+        mux->link_vtime = mux->vtime[p];
+        *prio = (link_prio_t)p;
+        f = mux->head[p];
+    }
+    pthread_mutex_unlock(&mux->mutex);
+    return f;
+}
+
+void link_mux_advance(link_mux_t* mux, link_prio_t prio, size_t bytes, int last) {
+    pthread_mutex_lock(&mux->mutex);
+    mux->vtime[prio] += (uint64_t)bytes * (WEIGHT_MAX / weights[prio]);
+    link_mux_frame_t *f = mux->head[prio];
+    if (last && f) {
+        mux->head[prio] = f->next;
+        if (!f->next) mux->tail[prio] = NULL;
+        mux->queued -= f->len;
+        pthread_cond_broadcast(&mux->cond);
+    }
+    pthread_mutex_unlock(&mux->mutex);
+    if (last) free(f);
+}
+
+int link_mux_close(link_mux_t* mux) {
+    pthread_mutex_lock(&mux->mutex);
+    int was_closed = mux->closed;
+    mux->closed = 1;
+    pthread_cond_broadcast(&mux->cond);
+    pthread_mutex_unlock(&mux->mutex);
+    return was_closed;
+}
+
+int link_mux_rx_push(link_mux_rx_t* rx, const unsigned char* body, size_t len, size_t max_frame,
+                     const unsigned char** frame, size_t* frame_len) {
+    if (len < LINK_MUX_HEADER_BYTES) return -1;
+    int stream = body[0] & ~LINK_MUX_FIN, fin = (body[0] & LINK_MUX_FIN) != 0;
+    size_t n = len - LINK_MUX_HEADER_BYTES;
+    if (stream >= LINK_PRIO_COUNT || rx->len[stream] + n > max_frame) return -1;
+    if (!rx->buf[stream] && !(rx->buf[stream] = malloc(max_frame))) return -1;
+    memcpy(rx->buf[stream] + rx->len[stream], body + LINK_MUX_HEADER_BYTES, n);
+    rx->len[stream] += n;
+    if (!fin) return 0;
+    *frame = rx->buf[stream];
+    *frame_len = rx->len[stream];
+    rx->len[stream] = 0;
+    return 1;
+}
+
+void link_mux_rx_free(link_mux_rx_t* rx) {
+    for (int p = 0; p < LINK_PRIO_COUNT; p++) {
+        free(rx->buf[p]);
+        rx->buf[p] = NULL;
+        rx->len[p] = 0;
+    }
+}
@@ -0,0 +1,126 @@
+#ifndef ZEROLINK_LINK_MUX_H
+#define ZEROLINK_LINK_MUX_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file link_mux.h
+ * @brief 一条连接上按优先级复用的多个逻辑流：发送队列与接收端的分片重组。
+ *
+ * 发送方把帧放进所属优先级类（交互、同步、大块）的队列后立即返回，由连接的写线程取出写入，
+ * 任何线程都不必等待 socket 可写。同一类的帧按先后顺序发送，不同类之间按权重公平排队
+ * (WFQ)：每类有一个虚拟时间，发出 n 字节后前进 n / 权重，轮到发送的总是有帧等待、虚拟时间最小的一类。
+ * 超过该类分片上限的帧被切成分片，分片之间可以插入其他类的帧，大块数据因此不会让聊天消息排在它后面等待。
+ * 每类同时只有一个帧在分片发送，接收端为每类保留一个重组缓冲即可。
+ *
+ * 分片的帧体: [流号 1]([LINK_MUX_FIN] 标记最后一片)[原帧的一段]，原帧含自己的长度头。
+ * 队列只决定轮到谁写，写入与分片的帧头由写线程完成。
+ */
+
+typedef enum {
+    LINK_PRIO_INTERACTIVE,   ///< 聊天消息与各种控制报文
+    LINK_PRIO_SYNC,          ///< 离线同步的数据块、替他人中继的帧
+    LINK_PRIO_BULK,          ///< 后台补发（群消息反熵）以及今后的文件传输
+    LINK_PRIO_COUNT
+} link_prio_t;
+
+#define LINK_MUX_FIN 0x80
+#define LINK_MUX_HEADER_BYTES 1
+
+/**
+ * @struct link_mux_frame_t
+ * @brief 排队中的一个帧（含长度头）。
+ */
+typedef struct link_mux_frame {
+    struct link_mux_frame *next;
+    uint64_t tag;                               ///< 调用者附带的值（例如追踪 id），写完时交还给写线程
+    size_t len;
+    size_t pos;                                 ///< 已写出的字节数，非零表示正在分片发送，只由写线程修改
+    unsigned char data[];
+} link_mux_frame_t;
+
+/**
+ * @struct link_mux_t
+ * @brief 一条连接的发送队列与调度状态。
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;                        ///< 有帧入队、队列变短或连接关闭
+    link_mux_frame_t *head[LINK_PRIO_COUNT];
+    link_mux_frame_t *tail[LINK_PRIO_COUNT];
+    size_t queued;                              ///< 排队中的字节数
+    int closed;
+    uint64_t vtime[LINK_PRIO_COUNT];
+    uint64_t link_vtime;                        ///< 最近一次开始发送时的虚拟时间，空闲的类重新排队时从这里算起
+} link_mux_t;
+
+void link_mux_init(link_mux_t* mux);
+
+/**
+ * @brief 释放仍在排队的帧。调用时写线程必须已经退出。
+ */
+void link_mux_destroy(link_mux_t* mux);
+
+/**
+ * @brief 该类帧的分片上限（字节，含原帧的长度头）。不超过它的帧整帧发送。
+ */
+size_t link_mux_piece_size(link_prio_t prio);
+
+/**
+ * @brief 复制一个帧放入队列，不等待。
+ * @param limit 入队后排队的字节数上限。
+ * @return 成功返回 0；连接已关闭、超过 limit 或内存不足返回 -1。
+ */
+int link_mux_push(link_mux_t* mux, link_prio_t prio, const unsigned char* frame, size_t len, uint64_t tag, size_t limit);
+
+/**
+ * @brief 排队中的字节数（含正在分片发送的帧）。
+ */
+size_t link_mux_queued(link_mux_t* mux);
+
+/**
+ * @brief 等到排队字节数不超过 bytes 或队列关闭，用于接收线程以外的发送方的背压。
+ */
+void link_mux_wait_below(link_mux_t* mux, size_t bytes);
+
+/**
+ * @brief 写线程取下一个要写的帧：等到有帧排队，按 WFQ 选出一类并返回它队首的帧（仍留在队列中）。
+ *        之后写出一片或整帧，再调用 link_mux_advance。
+ * @return 连接已关闭时返回 NULL，写线程应当退出。
+ */
+link_mux_frame_t* link_mux_next(link_mux_t* mux, link_prio_t* prio);
+
+/**
+ * @brief 一片写完（bytes 为写到连接上的字节数）。last 表示整个帧已写完（或放弃），帧出队并释放。
+ */
+void link_mux_advance(link_mux_t* mux, link_prio_t prio, size_t bytes, int last);
+
+/**
+ * @brief 关闭队列：之后的 link_mux_push 失败，写线程从 link_mux_next 返回 NULL。
+ * @return 之前已经关闭过返回 1，否则返回 0。
+ */
+int link_mux_close(link_mux_t* mux);
+
+/**
+ * @struct link_mux_rx_t
+ * @brief 接收端每类一个的重组缓冲，只由连接的接收线程访问。
+ */
+typedef struct {
+    unsigned char *buf[LINK_PRIO_COUNT];
+    size_t len[LINK_PRIO_COUNT];
+} link_mux_rx_t;
+
+/**
+ * @brief 收下一个分片的帧体。
+ * @param max_frame 重组后的帧（含长度头）的上限。
+ * @param frame 返回 1 时指向重组完成的帧，在下一次调用之前有效。
+ * @return 帧已完整返回 1，还需要后续分片返回 0，流号无效、超长或内存不足返回 -1（连接应当断开）。
+ */
+int link_mux_rx_push(link_mux_rx_t* rx, const unsigned char* body, size_t len, size_t max_frame,
+                     const unsigned char** frame, size_t* frame_len);
+
+void link_mux_rx_free(link_mux_rx_t* rx);
+
+#endif //ZEROLINK_LINK_MUX_H
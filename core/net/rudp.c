@@ -0,0 +1,1107 @@
+#include "rudp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sodium.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+// 报文: [类型 1][连接 id 8]([发起方公钥 32])[peer_box 密文]，密文解开为 [类型 1][连接 id 8][报文编号 8][帧...]
+// 密文里带一份类型与连接 id，解开后与明文报文头核对，报文头因此也受认证，改写 id 的重放报文会被拒绝
+#define PKT_INIT 1                   // 发起方在收到第一个应答之前发出的报文，带公钥
+#define PKT_DATA 2
+#define HEADER_BYTES 9
+#define INIT_HEADER_BYTES (HEADER_BYTES + PK_BYTES)
+#define MAX_BODY (RUDP_MAX_DATAGRAM - INIT_HEADER_BYTES - PEER_BOX_OVERHEAD)
+
+// 帧
+#define FRAME_STREAM 1               // [偏移 8][长度 2][数据]
+#define FRAME_ACK 2                  // [连续收到的流偏移 8][流量控制上限 8][确认延迟 us 4][区间数 1]{[最大编号 8][最小编号 8]}
+#define FRAME_PING 3                 // 只为引出确认
+#define FRAME_CLOSE 4
+#define FRAME_HELLO 5                // [Unix 毫秒时间 8]，只在 PKT_INIT 中
+
+#define ACK_RANGES 8                 // 一个确认帧最多携带的区间
+#define ACK_FRAME_MAX (22 + ACK_RANGES * 16)
+#define STREAM_MSS 1000              // 每个报文的流数据上限，留出确认帧与 HELLO 的位置
+_Static_assert(HEADER_BYTES + 8 + ACK_FRAME_MAX + 9 + 11 + STREAM_MSS <= MAX_BODY, "报文放不下满载的确认帧与流数据");
+
+#define SEND_BUFFER (1u << 20)       // 已从上层读入、尚未被确认的数据
+#define UNSENT_MAX (16 * 1024)       // 已读入、尚未发出的数据上限：其余留在上层，上层的优先级调度（link_mux.h）才有效
+#define APP_SNDBUF (16 * 1024)       // 上层一端的套接字发送缓冲，同样为了不让大块数据在上层看不到的地方排队
+#define RECV_WINDOW (1u << 20)       // 已收到、尚未交给上层的数据
+#define SENT_SLOTS 2048              // 同时在途的报文
+#define RETX_SLOTS SENT_SLOTS
+#define RECV_RANGES 64               // 乱序到达、尚未连续的流区间
+#define PN_RANGES 32                 // 记住的已收报文编号区间
+#define MAX_CONNS 256
+#define CLOSED_IDS 256
+#define INIT_NONCES 1024             // 重放窗口内记住的入站发起报文 nonce，满了之后新的入站连接被拒绝
+#define RESUME_SLOTS 64
+#define RESUME_TTL_MS (10 * 60 * 1000)
+#define DATAGRAM_BATCH 256           // 每轮最多读取的报文，避免饿死其他工作
+#define SEND_BURST 64                // 每个连接每轮最多发出的报文
+
+#define INITIAL_RTT_US 100000
+#define MAX_ACK_DELAY_US 5000
+#define MIN_CWND (2 * RUDP_MAX_DATAGRAM)
+#define INITIAL_CWND (10 * RUDP_MAX_DATAGRAM)
+#define MAX_CWND (SENT_SLOTS / 2 * RUDP_MAX_DATAGRAM)
+#define RESUME_CWND_MAX (64 * RUDP_MAX_DATAGRAM)
+#define MAX_PTO 8                    // 连续这么多次探测超时即认为连接已断
+
+enum { CONN_INIT, CONN_OPEN };
+
+typedef struct {
+    uint64_t pn;
+    uint64_t offset;                 // 携带的流数据，len 为 0 表示没有
+    uint32_t len;
+    uint32_t bytes;                  // 报文长度，计入在途字节
+    uint64_t sent_us;
+    int in_flight;                   // 未确认且未判定丢失
+} sent_packet_t;
+
+typedef struct {
+    uint64_t lo, hi;                 // 流区间 [lo, hi)
+} stream_range_t;
+
+typedef struct {
+    uint64_t hi, lo;                 // 报文编号区间 [lo, hi]
+} pn_range_t;
+
+typedef struct RudpConn {
+    uint64_t id;
+    int outbound;
+    int state;
+    unsigned char pk[PK_BYTES];
+    const PeerKey *key;
+    struct sockaddr_in addr;
+    int eng_fd;                      // socketpair 中引擎的一端
+    int app_fd;                      // 交给上层之前的另一端，交出后为 -1
+    int dead;
+    int abort;                       // 发起方放弃等待，由引擎关闭
+    int connect_waiting;             // rudp_connect 仍持有指针，暂不释放
+    uint64_t init_deadline_us;
+
+    // 发送
+    unsigned char *sbuf;             // 环形缓冲，存放 [snd_una, snd_end)
+    uint64_t snd_una, snd_nxt, snd_end;
+    uint64_t peer_max_offset;
+    int app_eof;
+    stream_range_t retx[RETX_SLOTS]; // 待重传的流区间（环形队列）
+    int retx_head, retx_count;
+    sent_packet_t sent[SENT_SLOTS];
+    uint64_t next_pn, sent_lo, largest_acked;
+    int have_acked;
+    uint64_t bytes_in_flight, cwnd, ssthresh;
+    int in_flight_count;
+    uint64_t recovery_start_us;
+    uint64_t srtt_us, rttvar_us, min_rtt_us, latest_rtt_us;
+    int have_rtt;
+    int pto_count;
+    uint64_t last_eliciting_sent_us, last_sent_us;
+    int probe_pending;
+
+    // 接收
+    unsigned char *rbuf;             // 环形缓冲，存放 [rcv_delivered, rcv_delivered + RECV_WINDOW)
+    uint64_t rcv_delivered, rcv_nxt, advertised_max;
+    stream_range_t rranges[RECV_RANGES];
+    int rrange_count;
+    pn_range_t pn_ranges[PN_RANGES];
+    int pn_range_count;
+    uint64_t pn_floor;               // 低于它的编号一律当作已收到
+    uint64_t largest_rcvd_us;
+    int have_rcvd;
+    int ack_pending;                 // 上次确认之后收到的需确认报文数
+    int ack_immediate;
+    uint64_t ack_deadline_us;
+    uint64_t last_rx_us;
+
+    struct RudpConn *next;
+} RudpConn;
+
+typedef struct {
+    int used;
+    unsigned char pk[PK_BYTES];
+    struct sockaddr_in addr;
+    uint64_t srtt_us, rttvar_us, cwnd;
+    uint64_t saved_ms;
+} resume_entry_t;
+
+typedef struct {
+    unsigned char nonce[crypto_box_NONCEBYTES];
+    uint64_t expires_ms;             // 发起报文的时间戳加上重放窗口，之后同一报文会因时间戳被拒绝，表项可以复用
+} init_nonce_t;
+
+struct RudpEngine {
+    unsigned char my_pk[PK_BYTES];
+    PeerKeyCache *keys;
+    rudp_callbacks_t callbacks;
+    int udp_fd;
+    int wake_fd;
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;             // 发起方等待第一个应答
+    int stopping;
+    RudpConn *conns;
+    int conn_count;
+    uint64_t closed_ids[CLOSED_IDS];
+    int closed_next;
+    init_nonce_t init_nonces[INIT_NONCES];
+    resume_entry_t resume[RESUME_SLOTS];
+    rudp_stats_t stats;
+};
+
+// --- 工具函数 ---
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t wall_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void put_u64(unsigned char* p, uint64_t v) {
+    for (int i = 7; i >= 0; i--) { p[i] = (unsigned char)v; v >>= 8; }
+}
+
+static uint64_t get_u64(const unsigned char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = (v << 8) | p[i];
+    return v;
+}
+
+static void put_u32(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24); p[1] = (unsigned char)(v >> 16); p[2] = (unsigned char)(v >> 8); p[3] = (unsigned char)v;
+}
+
+static uint32_t get_u32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int same_addr(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void wake_engine(RudpEngine* e) {
+    uint64_t one = 1;
+    ssize_t rc = write(e->wake_fd, &one, sizeof(one));
+    (void)rc;
+}
+
+/**
+ * 从环形缓冲的 pos 处复制 len 字节（可能跨过末尾）。
+ */
+static void ring_read(const unsigned char* ring, size_t size, uint64_t pos, unsigned char* out, size_t len) {
+    size_t at = (size_t)(pos % size), first = size - at < len ? size - at : len;
+    memcpy(out, ring + at, first);
+    memcpy(out + first, ring, len - first);
+}
+
+static void ring_write(unsigned char* ring, size_t size, uint64_t pos, const unsigned char* in, size_t len) {
+    size_t at = (size_t)(pos % size), first = size - at < len ? size - at : len;
+    memcpy(ring + at, in, first);
+    memcpy(ring, in + first, len - first);
+}
+
+// --- 0-RTT 缓存与已关闭的连接 id（调用者持有 mutex）---
+static resume_entry_t* resume_find(RudpEngine* e, const unsigned char pk[PK_BYTES]) {
+    for (int i = 0; i < RESUME_SLOTS; i++) {
+        if (e->resume[i].used && memcmp(e->resume[i].pk, pk, PK_BYTES) == 0) return &e->resume[i];
+    }
+    return NULL;
+}
+
+static void resume_save(RudpEngine* e, const RudpConn* c) {
+    resume_entry_t *r = resume_find(e, c->pk);
+    if (!r) {
+        r = &e->resume[0];
+        for (int i = 0; i < RESUME_SLOTS; i++) {
+            if (!e->resume[i].used) { r = &e->resume[i]; break; }
+            if (e->resume[i].saved_ms < r->saved_ms) r = &e->resume[i];
+        }
+    }
+    r->used = 1;
+    memcpy(r->pk, c->pk, PK_BYTES);
+    r->addr = c->addr;
+    r->srtt_us = c->srtt_us;
+    r->rttvar_us = c->rttvar_us;
+    r->cwnd = c->cwnd;
+    r->saved_ms = wall_ms();
+}
+
+static void resume_forget(RudpEngine* e, const unsigned char pk[PK_BYTES]) {
+    resume_entry_t *r = resume_find(e, pk);
+    if (r) r->used = 0;
+}
+
+static int closed_contains(RudpEngine* e, uint64_t id) {
+    for (int i = 0; i < CLOSED_IDS; i++) {
+        if (e->closed_ids[i] == id) return 1;
+    }
+    return 0;
+}
+
+/**
+ * 记下一个已认证的入站发起报文的 nonce。
+ * @return 首次出现返回 0；窗口内出现过（重放）或表已满返回 -1。
+ */
+static int init_nonce_record(RudpEngine* e, const unsigned char* nonce, uint64_t hello_ms, uint64_t wall) {
+    init_nonce_t *free_slot = NULL;
+    for (int i = 0; i < INIT_NONCES; i++) {
+        init_nonce_t *n = &e->init_nonces[i];
+        if (n->expires_ms < wall) {
+            if (!free_slot) free_slot = n;
+        } else if (sodium_memcmp(n->nonce, nonce, crypto_box_NONCEBYTES) == 0) {
+            return -1;
+        }
+    }
+    if (!free_slot) return -1;
+    memcpy(free_slot->nonce, nonce, crypto_box_NONCEBYTES);
+    free_slot->expires_ms = hello_ms + RUDP_REPLAY_WINDOW_MS;
+    return 0;
+}
+
+static RudpConn* conn_find(RudpEngine* e, uint64_t id) {
+    for (RudpConn *c = e->conns; c; c = c->next) {
+        if (c->id == id) return c;
+    }
+    return NULL;
+}
+
+// --- 连接的建立与释放 ---
+static RudpConn* conn_create(RudpEngine* e, uint64_t id, const unsigned char pk[PK_BYTES], const PeerKey* key,
+                             const struct sockaddr_in* addr, int outbound) {
+    if (e->conn_count >= MAX_CONNS) return NULL;
+    RudpConn *c = calloc(1, sizeof(RudpConn));
+    if (!c) return NULL;
+    c->sbuf = malloc(SEND_BUFFER);
+    c->rbuf = malloc(RECV_WINDOW);
+    int sv[2];
+    if (!c->sbuf || !c->rbuf || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        free(c->sbuf);
+        free(c->rbuf);
+        free(c);
+        return NULL;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+    int sndbuf = APP_SNDBUF;
+    setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    c->eng_fd = sv[0];
+    c->app_fd = sv[1];
+    c->id = id;
+    c->outbound = outbound;
+    c->state = outbound ? CONN_INIT : CONN_OPEN;
+    memcpy(c->pk, pk, PK_BYTES);
+    c->key = key;
+    c->addr = *addr;
+    c->peer_max_offset = RECV_WINDOW;
+    c->advertised_max = RECV_WINDOW;
+    c->cwnd = INITIAL_CWND;
+    c->ssthresh = UINT64_MAX;
+    c->srtt_us = INITIAL_RTT_US;
+    c->rttvar_us = INITIAL_RTT_US / 2;
+    c->min_rtt_us = UINT64_MAX;
+    uint64_t now = now_us();
+    c->last_rx_us = now;
+    c->last_sent_us = now;
+    c->next = e->conns;
+    e->conns = c;
+    e->conn_count++;
+    e->stats.connections++;
+    return c;
+}
+
+/**
+ * 关闭连接：上层随即读到 EOF。send_close 时尽力通知对端（不重传）。
+ */
+static void conn_send_packets(RudpEngine* e, RudpConn* c, uint64_t now, int closing);
+
+static void conn_close(RudpEngine* e, RudpConn* c, int send_close) {
+    if (c->dead) return;
+    if (send_close) conn_send_packets(e, c, now_us(), 1);
+    c->dead = 1;
+    close(c->eng_fd);
+    c->eng_fd = -1;
+    // 通过的连接（不论怎样断开）留下 0-RTT 缓存；发起后一直没有应答的，缓存作废
+    if (c->state == CONN_OPEN) resume_save(e, c);
+    else resume_forget(e, c->pk);
+    e->closed_ids[e->closed_next] = c->id;
+    e->closed_next = (e->closed_next + 1) % CLOSED_IDS;
+}
+
+static void conn_free(RudpEngine* e, RudpConn* c) {
+    if (c->eng_fd >= 0) close(c->eng_fd);
+    if (c->app_fd >= 0) close(c->app_fd);
+    peer_key_release(e->keys, c->key);
+    free(c->sbuf);
+    free(c->rbuf);
+    free(c);
+}
+
+static void reap_conns(RudpEngine* e) {
+    RudpConn **p = &e->conns;
+    while (*p) {
+        RudpConn *c = *p;
+        if (c->dead && !c->connect_waiting) {
+            *p = c->next;
+            e->conn_count--;
+            conn_free(e, c);
+        } else {
+            p = &c->next;
+        }
+    }
+}
+
+// --- 发送 ---
+static void retx_push(RudpConn* c, uint64_t offset, uint32_t len) {
+    if (c->retx_count == RETX_SLOTS) return; // 不会发生：待重传的区间不超过在途报文数
+    c->retx[(c->retx_head + c->retx_count) % RETX_SLOTS] = (stream_range_t){ offset, offset + len };
+    c->retx_count++;
+}
+
+/**
+ * 取出下一段要发送的流数据：先是待重传的（跳过已被连续确认的部分），再是新数据。
+ * @return 数据长度，0 表示没有。
+ */
+static uint32_t next_stream_chunk(RudpConn* c, uint64_t* offset, int* retransmit) {
+    while (c->retx_count > 0) {
+        stream_range_t *r = &c->retx[c->retx_head];
+        if (r->lo < c->snd_una) r->lo = c->snd_una;
+        if (r->lo >= r->hi) {
+            c->retx_head = (c->retx_head + 1) % RETX_SLOTS;
+            c->retx_count--;
+            continue;
+        }
+        uint64_t len = r->hi - r->lo < STREAM_MSS ? r->hi - r->lo : STREAM_MSS;
+        *offset = r->lo;
+        *retransmit = 1;
+        r->lo += len;
+        return (uint32_t)len;
+    }
+    uint64_t limit = c->snd_end < c->peer_max_offset ? c->snd_end : c->peer_max_offset;
+    if (c->snd_nxt >= limit) return 0;
+    uint64_t len = limit - c->snd_nxt < STREAM_MSS ? limit - c->snd_nxt : STREAM_MSS;
+    *offset = c->snd_nxt;
+    *retransmit = 0;
+    c->snd_nxt += len;
+    return (uint32_t)len;
+}
+
+static size_t write_ack_frame(RudpConn* c, unsigned char* p, uint64_t now) {
+    unsigned char *start = p;
+    *p++ = FRAME_ACK;
+    put_u64(p, c->rcv_nxt); p += 8;
+    c->advertised_max = c->rcv_delivered + RECV_WINDOW;
+    put_u64(p, c->advertised_max); p += 8;
+    uint64_t delay = now - c->largest_rcvd_us;
+    put_u32(p, delay > UINT32_MAX ? UINT32_MAX : (uint32_t)delay); p += 4;
+    int n = c->pn_range_count < ACK_RANGES ? c->pn_range_count : ACK_RANGES;
+    *p++ = (unsigned char)n;
+    for (int i = 0; i < n; i++) {
+        put_u64(p, c->pn_ranges[i].hi); p += 8;
+        put_u64(p, c->pn_ranges[i].lo); p += 8;
+    }
+    c->ack_pending = 0;
+    c->ack_immediate = 0;
+    return (size_t)(p - start);
+}
+
+/**
+ * 组装、加密并发出一个报文。body 的前 HEADER_BYTES 字节留给报文头的副本，由本函数填写。
+ * @return 报文长度，失败返回 0。
+ */
+static size_t send_datagram(RudpEngine* e, RudpConn* c, unsigned char* body, size_t body_len) {
+    unsigned char datagram[RUDP_MAX_DATAGRAM];
+    size_t header = c->state == CONN_INIT ? INIT_HEADER_BYTES : HEADER_BYTES;
+    datagram[0] = c->state == CONN_INIT ? PKT_INIT : PKT_DATA;
+    put_u64(datagram + 1, c->id);
+    memcpy(body, datagram, HEADER_BYTES);
+    if (c->state == CONN_INIT) memcpy(datagram + HEADER_BYTES, e->my_pk, PK_BYTES);
+    peer_box_frame_t frame = { .in = body, .in_len = body_len, .out = datagram + header };
+    if (peer_box_seal_batch(c->key, &frame, 1) != 1) return 0;
+    size_t len = header + frame.out_len;
+    if (sendto(e->udp_fd, datagram, len, 0, (const struct sockaddr*)&c->addr, sizeof(c->addr)) < 0) return 0;
+    e->stats.datagrams_sent++;
+    e->stats.bytes_sent += len;
+    return len;
+}
+
+/**
+ * 发出连接当前能发的报文：拥塞窗口内的流数据（先重传），需要时单独的确认、探测或保活报文。
+ * closing 时只发一个带 CLOSE 的报文。
+ */
+static void conn_send_packets(RudpEngine* e, RudpConn* c, uint64_t now, int closing) {
+    if (!c->probe_pending && now - c->last_sent_us >= (uint64_t)RUDP_KEEPALIVE_MS * 1000) c->probe_pending = 1;
+    for (int burst = 0; burst < SEND_BURST; burst++) {
+        int need_ack = c->have_rcvd && (c->ack_immediate || c->ack_pending >= 2 || (c->ack_pending > 0 && now >= c->ack_deadline_us));
+        int window_open = c->bytes_in_flight + RUDP_MAX_DATAGRAM <= c->cwnd || c->probe_pending;
+        int slot_free = c->next_pn - c->sent_lo < SENT_SLOTS;
+        uint64_t offset = 0;
+        uint32_t len = 0;
+        int retransmit = 0;
+        if (!closing && window_open && slot_free) len = next_stream_chunk(c, &offset, &retransmit);
+        int ping = !closing && !len && c->probe_pending && slot_free;
+        if (!closing && !len && !ping && !need_ack) break;
+
+        unsigned char body[MAX_BODY], *p = body + HEADER_BYTES;
+        uint64_t pn = c->next_pn++;
+        put_u64(p, pn); p += 8;
+        if (c->have_rcvd) p += write_ack_frame(c, p, now);
+        if (c->state == CONN_INIT) {
+            *p++ = FRAME_HELLO;
+            put_u64(p, wall_ms()); p += 8;
+        }
+        if (closing) {
+            *p++ = FRAME_CLOSE;
+        } else if (len) {
+            *p++ = FRAME_STREAM;
+            put_u64(p, offset); p += 8;
+            p[0] = (unsigned char)(len >> 8); p[1] = (unsigned char)len; p += 2;
+            ring_read(c->sbuf, SEND_BUFFER, offset, p, len);
+            p += len;
+        } else if (ping) {
+            *p++ = FRAME_PING;
+        }
+        size_t bytes = send_datagram(e, c, body, (size_t)(p - body));
+        c->last_sent_us = now;
+        if (closing) return;
+        if (!len && !ping) continue; // 单独的确认不需要被确认，也不计入在途
+        // 需确认的报文即使没发出去也按在途处理，由丢失判定或探测超时重传
+        sent_packet_t *s = &c->sent[pn % SENT_SLOTS];
+        *s = (sent_packet_t){ pn, offset, len, bytes ? (uint32_t)bytes : RUDP_MAX_DATAGRAM, now, 1 };
+        c->bytes_in_flight += s->bytes;
+        c->in_flight_count++;
+        c->last_eliciting_sent_us = now;
+        c->probe_pending = 0;
+        if (retransmit) e->stats.retransmitted++;
+    }
+}
+
+// --- 确认与丢失判定 ---
+static void packet_done(RudpConn* c, sent_packet_t* s) {
+    s->in_flight = 0;
+    c->bytes_in_flight -= s->bytes;
+    c->in_flight_count--;
+}
+
+static void advance_sent_lo(RudpConn* c) {
+    while (c->sent_lo < c->next_pn) {
+        sent_packet_t *s = &c->sent[c->sent_lo % SENT_SLOTS];
+        if (s->pn == c->sent_lo && s->in_flight) break;
+        c->sent_lo++;
+    }
+}
+
+static void on_packet_lost(RudpEngine* e, RudpConn* c, sent_packet_t* s, uint64_t now, int congestion) {
+    packet_done(c, s);
+    e->stats.lost++;
+    if (s->len && s->offset + s->len > c->snd_una) retx_push(c, s->offset, s->len);
+    // 每个恢复期只减一次窗口：恢复开始之前发出的报文再丢失不再减
+    if (congestion && s->sent_us > c->recovery_start_us) {
+        c->recovery_start_us = now;
+        c->cwnd = c->cwnd / 2 > MIN_CWND ? c->cwnd / 2 : MIN_CWND;
+        c->ssthresh = c->cwnd;
+    }
+}
+
+static uint64_t loss_delay_us(const RudpConn* c) {
+    uint64_t rtt = c->srtt_us > c->latest_rtt_us ? c->srtt_us : c->latest_rtt_us;
+    rtt = rtt * 9 / 8;
+    return rtt > 1000 ? rtt : 1000;
+}
+
+/**
+ * 比已确认的最大编号早发出的报文，编号落后 3 个以上或发出已超过 9/8 个往返即判定丢失。
+ */
+static void detect_losses(RudpEngine* e, RudpConn* c, uint64_t now) {
+    if (!c->have_acked) return;
+    uint64_t delay = loss_delay_us(c);
+    for (uint64_t pn = c->sent_lo; pn < c->largest_acked; pn++) {
+        sent_packet_t *s = &c->sent[pn % SENT_SLOTS];
+        if (s->pn != pn || !s->in_flight) continue;
+        if (c->largest_acked >= pn + 3 || now - s->sent_us >= delay) on_packet_lost(e, c, s, now, 1);
+    }
+    advance_sent_lo(c);
+}
+
+static void update_rtt(RudpConn* c, uint64_t sample, uint64_t ack_delay) {
+    if (sample < c->min_rtt_us) c->min_rtt_us = sample;
+    if (ack_delay > MAX_ACK_DELAY_US) ack_delay = MAX_ACK_DELAY_US;
+    if (sample >= c->min_rtt_us + ack_delay) sample -= ack_delay;
+    c->latest_rtt_us = sample;
+    if (!c->have_rtt) {
+        c->srtt_us = sample;
+        c->rttvar_us = sample / 2;
+        c->have_rtt = 1;
+        return;
+    }
+    uint64_t diff = c->srtt_us > sample ? c->srtt_us - sample : sample - c->srtt_us;
+    c->rttvar_us = (3 * c->rttvar_us + diff) / 4;
+    c->srtt_us = (7 * c->srtt_us + sample) / 8;
+}
+
+static void on_ack_frame(RudpEngine* e, RudpConn* c, const unsigned char* f, uint64_t now) {
+    uint64_t cum = get_u64(f), max_offset = get_u64(f + 8);
+    uint32_t ack_delay = get_u32(f + 16);
+    int n = c->next_pn > 0 ? f[20] : 0;
+    const unsigned char *r = f + 21;
+    if (cum > c->snd_una && cum <= c->snd_nxt) c->snd_una = cum;
+    if (max_offset > c->peer_max_offset) c->peer_max_offset = max_offset;
+    for (int i = 0; i < n; i++, r += 16) {
+        uint64_t hi = get_u64(r), lo = get_u64(r + 8);
+        if (hi >= c->next_pn) hi = c->next_pn - 1;
+        if (lo < c->sent_lo) lo = c->sent_lo;
+        if (i == 0 && hi < c->next_pn && (!c->have_acked || hi > c->largest_acked)) {
+            sent_packet_t *s = &c->sent[hi % SENT_SLOTS];
+            if (s->pn == hi && s->in_flight) update_rtt(c, now - s->sent_us, ack_delay);
+            c->largest_acked = hi;
+            c->have_acked = 1;
+        }
+        for (uint64_t pn = lo; pn <= hi && hi < c->next_pn; pn++) {
+            sent_packet_t *s = &c->sent[pn % SENT_SLOTS];
+            if (s->pn != pn || !s->in_flight) continue;
+            packet_done(c, s);
+            if (s->sent_us <= c->recovery_start_us) continue;
+            if (c->cwnd < c->ssthresh) c->cwnd += s->bytes;
+            else c->cwnd += (uint64_t)RUDP_MAX_DATAGRAM * s->bytes / c->cwnd;
+            if (c->cwnd > MAX_CWND) c->cwnd = MAX_CWND;
+        }
+    }
+    c->pto_count = 0;
+    detect_losses(e, c, now);
+}
+
+// --- 接收 ---
+/**
+ * 记录收到的报文编号。
+ * @return 新编号返回 1，重复或过旧返回 0。
+ */
+static int pn_record(RudpConn* c, uint64_t pn) {
+    if (pn < c->pn_floor) return 0;
+    pn_range_t *r = c->pn_ranges;
+    int n = c->pn_range_count, i = 0;
+    for (; i < n; i++) {
+        if (pn >= r[i].lo && pn <= r[i].hi) return 0;
+        if (pn == r[i].hi + 1) {
+            r[i].hi = pn;
+            if (i > 0 && r[i - 1].lo == pn + 1) {
+                r[i - 1].lo = r[i].lo;
+                memmove(&r[i], &r[i + 1], (size_t)(n - i - 1) * sizeof(pn_range_t));
+                c->pn_range_count--;
+            }
+            return 1;
+        }
+        if (pn + 1 == r[i].lo) {
+            r[i].lo = pn;
+            if (i + 1 < n && r[i + 1].hi + 1 == pn) {
+                r[i].lo = r[i + 1].lo;
+                memmove(&r[i + 1], &r[i + 2], (size_t)(n - i - 2) * sizeof(pn_range_t));
+                c->pn_range_count--;
+            }
+            return 1;
+        }
+        if (pn > r[i].hi) break;
+    }
+    if (n == PN_RANGES) {
+        // 丢掉最旧的区间，它之前的编号都当作已收到
+        if (i == n) return 0;
+        c->pn_floor = r[n - 1].hi + 1;
+        n = --c->pn_range_count;
+        if (pn < c->pn_floor) return 0;
+    }
+    memmove(&r[i + 1], &r[i], (size_t)(n - i) * sizeof(pn_range_t));
+    r[i] = (pn_range_t){ pn, pn };
+    c->pn_range_count++;
+    return 1;
+}
+
+/**
+ * 检查流数据能否收下（在接收窗口内，乱序区间表放得下）。
+ */
+static int stream_acceptable(const RudpConn* c, uint64_t offset, uint32_t len) {
+    uint64_t end = offset + len;
+    if (end <= c->rcv_nxt) return 1;
+    if (end > c->rcv_delivered + RECV_WINDOW) return 0;
+    if (c->rrange_count < RECV_RANGES) return 1;
+    uint64_t lo = offset > c->rcv_nxt ? offset : c->rcv_nxt;
+    if (lo == c->rcv_nxt) return 1;
+    for (int i = 0; i < c->rrange_count; i++) {
+        if (lo <= c->rranges[i].hi && end >= c->rranges[i].lo) return 1;
+    }
+    return 0;
+}
+
+static void stream_receive(RudpConn* c, uint64_t offset, const unsigned char* data, uint32_t len) {
+    uint64_t end = offset + len, lo = offset > c->rcv_nxt ? offset : c->rcv_nxt;
+    if (end <= lo) return;
+    ring_write(c->rbuf, RECV_WINDOW, lo, data + (lo - offset), (size_t)(end - lo));
+    if (lo == c->rcv_nxt) {
+        c->rcv_nxt = end;
+    } else {
+        // 插入并合并乱序区间（按 lo 升序）
+        stream_range_t *r = c->rranges;
+        int i = 0;
+        while (i < c->rrange_count && r[i].hi < lo) i++;
+        if (i < c->rrange_count && r[i].lo <= end) {
+            if (lo < r[i].lo) r[i].lo = lo;
+            if (end > r[i].hi) r[i].hi = end;
+            while (i + 1 < c->rrange_count && r[i + 1].lo <= r[i].hi) {
+                if (r[i + 1].hi > r[i].hi) r[i].hi = r[i + 1].hi;
+                memmove(&r[i + 1], &r[i + 2], (size_t)(c->rrange_count - i - 2) * sizeof(stream_range_t));
+                c->rrange_count--;
+            }
+        } else {
+            memmove(&r[i + 1], &r[i], (size_t)(c->rrange_count - i) * sizeof(stream_range_t));
+            r[i] = (stream_range_t){ lo, end };
+            c->rrange_count++;
+        }
+    }
+    while (c->rrange_count > 0 && c->rranges[0].lo <= c->rcv_nxt) {
+        if (c->rranges[0].hi > c->rcv_nxt) c->rcv_nxt = c->rranges[0].hi;
+        memmove(&c->rranges[0], &c->rranges[1], (size_t)(c->rrange_count - 1) * sizeof(stream_range_t));
+        c->rrange_count--;
+    }
+}
+
+/**
+ * 把连续收到的数据写给上层，上层读得慢时留在缓冲中，腾出的窗口较多时立即通告。
+ */
+static void conn_deliver(RudpConn* c) {
+    while (c->rcv_delivered < c->rcv_nxt) {
+        size_t at = (size_t)(c->rcv_delivered % RECV_WINDOW);
+        uint64_t avail = c->rcv_nxt - c->rcv_delivered;
+        size_t len = RECV_WINDOW - at < avail ? RECV_WINDOW - at : (size_t)avail;
+        ssize_t n = send(c->eng_fd, c->rbuf + at, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EPIPE) {
+            c->rcv_delivered = c->rcv_nxt; // 上层已关闭，收到的数据直接丢弃
+            break;
+        }
+        if (n <= 0) break;
+        c->rcv_delivered += (uint64_t)n;
+    }
+    if (c->rcv_delivered + RECV_WINDOW - c->advertised_max >= RECV_WINDOW / 4) c->ack_immediate = 1;
+}
+
+/**
+ * 可以从上层读入更多数据：发送缓冲未满，且尚未发出的数据不超过 UNSENT_MAX。
+ */
+static int conn_wants_app(const RudpConn* c) {
+    return c->snd_end - c->snd_una < SEND_BUFFER && c->snd_end - c->snd_nxt < UNSENT_MAX;
+}
+
+/**
+ * 从上层读入待发送的数据，直到 conn_wants_app 不再成立。上层关闭时返回 -1。
+ */
+static int conn_read_app(RudpConn* c) {
+    while (conn_wants_app(c)) {
+        size_t at = (size_t)(c->snd_end % SEND_BUFFER);
+        uint64_t room = SEND_BUFFER - (c->snd_end - c->snd_una);
+        if (room > UNSENT_MAX - (c->snd_end - c->snd_nxt)) room = UNSENT_MAX - (c->snd_end - c->snd_nxt);
+        size_t len = SEND_BUFFER - at < room ? SEND_BUFFER - at : (size_t)room;
+        ssize_t n = recv(c->eng_fd, c->sbuf + at, len, 0);
+        if (n == 0) return -1;
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        c->snd_end += (uint64_t)n;
+    }
+    return 0;
+}
+
+typedef struct {
+    const unsigned char *ack;
+    const unsigned char *stream;
+    uint64_t stream_offset;
+    uint32_t stream_len;
+    int ping, close, eliciting;
+    int has_hello;
+    uint64_t hello_ms;
+} parsed_body_t;
+
+static int parse_body(const unsigned char* p, size_t len, parsed_body_t* out) {
+    memset(out, 0, sizeof(*out));
+    const unsigned char *end = p + len;
+    while (p < end) {
+        int type = *p++;
+        if (type == FRAME_STREAM) {
+            if (end - p < 10) return -1;
+            out->stream_offset = get_u64(p);
+            out->stream_len = ((uint32_t)p[8] << 8) | p[9];
+            p += 10;
+            if ((size_t)(end - p) < out->stream_len) return -1;
+            out->stream = p;
+            p += out->stream_len;
+            out->eliciting = 1;
+        } else if (type == FRAME_ACK) {
+            if (end - p < 21 || (size_t)(end - p) < 21 + (size_t)p[20] * 16) return -1;
+            out->ack = p;
+            p += 21 + (size_t)p[20] * 16;
+        } else if (type == FRAME_PING) {
+            out->ping = out->eliciting = 1;
+        } else if (type == FRAME_CLOSE) {
+            out->close = 1;
+        } else if (type == FRAME_HELLO) {
+            if (end - p < 8) return -1;
+            out->has_hello = out->eliciting = 1;
+            out->hello_ms = get_u64(p);
+            p += 8;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 解开报文 d 的密文（从 header 处开始），核对其中的报文头副本。
+ * out 得到 [报文编号 8][帧...]。
+ */
+static int open_body(const PeerKey* key, const unsigned char* d, size_t header, size_t len, unsigned char* out, size_t* out_len) {
+    unsigned char plain[RUDP_MAX_DATAGRAM];
+    peer_box_frame_t frame = { .in = d + header, .in_len = len - header, .out = plain };
+    if (len - header < PEER_BOX_OVERHEAD + HEADER_BYTES + 8 || peer_box_open_batch(key, &frame, 1) != 1) return -1;
+    if (frame.out_len < HEADER_BYTES + 8 || memcmp(plain, d, HEADER_BYTES) != 0) return -1;
+    *out_len = frame.out_len - HEADER_BYTES;
+    memcpy(out, plain + HEADER_BYTES, *out_len);
+    return 0;
+}
+
+static void on_datagram(RudpEngine* e, const unsigned char* d, size_t len, const struct sockaddr_in* from, uint64_t now) {
+    if (len < HEADER_BYTES + PEER_BOX_OVERHEAD || (d[0] != PKT_INIT && d[0] != PKT_DATA)) return;
+    int init = d[0] == PKT_INIT;
+    if (init && len < INIT_HEADER_BYTES + PEER_BOX_OVERHEAD) return;
+    uint64_t id = get_u64(d + 1);
+    size_t header = init ? INIT_HEADER_BYTES : HEADER_BYTES;
+    unsigned char body[RUDP_MAX_DATAGRAM];
+    size_t body_len = 0;
+    parsed_body_t pb;
+    RudpConn *c = conn_find(e, id);
+    if (c && c->dead) return;
+    if (!c) {
+        // 新的入站连接：第一个报文就要能解密、时间戳在窗口内，且不是已关闭连接或窗口内发起报文的重放
+        const unsigned char *pk = d + HEADER_BYTES;
+        if (!init || closed_contains(e, id) || !e->callbacks.accept || !e->callbacks.accept(e->callbacks.ctx, pk)) {
+            e->stats.rejected++;
+            return;
+        }
+        const PeerKey *key = peer_key_acquire(e->keys, pk);
+        if (!key) return;
+        uint64_t wall = wall_ms();
+        if (open_body(key, d, header, len, body, &body_len) != 0 || parse_body(body + 8, body_len - 8, &pb) != 0 ||
+            !pb.has_hello || pb.hello_ms + RUDP_REPLAY_WINDOW_MS < wall || pb.hello_ms > wall + RUDP_REPLAY_WINDOW_MS ||
+            init_nonce_record(e, d + header, pb.hello_ms, wall) != 0) {
+            peer_key_release(e->keys, key);
+            e->stats.rejected++;
+            return;
+        }
+        c = conn_create(e, id, pk, key, from, 0);
+        if (!c) {
+            peer_key_release(e->keys, key);
+            return;
+        }
+    } else {
+        if (init && memcmp(d + HEADER_BYTES, c->pk, PK_BYTES) != 0) return;
+        if (open_body(c->key, d, header, len, body, &body_len) != 0 || parse_body(body + 8, body_len - 8, &pb) != 0) {
+            e->stats.rejected++;
+            return;
+        }
+    }
+    e->stats.datagrams_received++;
+    e->stats.bytes_received += len;
+    uint64_t pn = get_u64(body);
+    if (pb.stream && !stream_acceptable(c, pb.stream_offset, pb.stream_len)) return; // 不确认，对方会重传
+    int had_rcvd = c->have_rcvd && c->pn_range_count > 0;
+    uint64_t prev_largest = had_rcvd ? c->pn_ranges[0].hi : 0;
+    if (!pn_record(c, pn)) {
+        // 重复的报文：对方可能没收到确认
+        if (pb.eliciting) c->ack_immediate = 1;
+        return;
+    }
+    if (!had_rcvd || pn > prev_largest) {
+        if (had_rcvd && !same_addr(&c->addr, from)) {
+            // 只有编号更大的合法报文能迁移连接，重放的旧报文不能把连接引到别处
+            c->addr = *from;
+            e->stats.migrations++;
+        }
+        if (had_rcvd && pn != prev_largest + 1) c->ack_immediate = 1; // 中间有缺口
+        c->largest_rcvd_us = now;
+    } else {
+        c->ack_immediate = 1; // 补上了缺口
+    }
+    c->have_rcvd = 1;
+    c->last_rx_us = now;
+    if (c->state == CONN_INIT) {
+        c->state = CONN_OPEN;
+        resume_save(e, c);
+        pthread_cond_broadcast(&e->cond);
+    }
+    if (pb.ack) on_ack_frame(e, c, pb.ack, now);
+    if (pb.stream) stream_receive(c, pb.stream_offset, pb.stream, pb.stream_len);
+    if (pb.eliciting) {
+        if (c->ack_pending++ == 0) c->ack_deadline_us = now + MAX_ACK_DELAY_US;
+        if (pb.has_hello) c->ack_immediate = 1;
+    }
+    if (pb.close) {
+        conn_close(e, c, 0);
+        return;
+    }
+    conn_deliver(c);
+    if (!c->outbound && c->app_fd >= 0) {
+        // 入站连接在第一个报文处理完之后交给上层
+        int fd = c->app_fd;
+        c->app_fd = -1;
+        e->callbacks.accepted(e->callbacks.ctx, fd, c->pk, &c->addr);
+    }
+}
+
+// --- 定时器 ---
+static uint64_t pto_us(const RudpConn* c) {
+    uint64_t var = 4 * c->rttvar_us > 1000 ? 4 * c->rttvar_us : 1000;
+    int shift = c->pto_count < 6 ? c->pto_count : 6;
+    return (c->srtt_us + var + MAX_ACK_DELAY_US) << shift;
+}
+
+static uint64_t conn_deadline(const RudpConn* c, uint64_t now) {
+    uint64_t t = c->last_rx_us + (uint64_t)RUDP_IDLE_TIMEOUT_MS * 1000;
+    uint64_t keepalive = c->last_sent_us + (uint64_t)RUDP_KEEPALIVE_MS * 1000;
+    if (keepalive < t) t = keepalive;
+    if (c->state == CONN_INIT && c->init_deadline_us < t) t = c->init_deadline_us;
+    if (c->ack_pending > 0 && c->ack_deadline_us < t) t = c->ack_deadline_us;
+    if (c->ack_immediate || c->probe_pending) t = now;
+    if (c->in_flight_count > 0) {
+        uint64_t pto = c->last_eliciting_sent_us + pto_us(c);
+        if (pto < t) t = pto;
+        if (c->have_acked) {
+            // 比已确认的最大编号早、还没到丢失时限的报文
+            uint64_t delay = loss_delay_us(c);
+            for (uint64_t pn = c->sent_lo; pn < c->largest_acked; pn++) {
+                const sent_packet_t *s = &c->sent[pn % SENT_SLOTS];
+                if (s->pn != pn || !s->in_flight) continue;
+                if (s->sent_us + delay < t) t = s->sent_us + delay;
+                break;
+            }
+        }
+    }
+    return t;
+}
+
+static void conn_service(RudpEngine* e, RudpConn* c, uint64_t now) {
+    if (c->abort || (c->app_eof && c->snd_una == c->snd_end)) {
+        conn_close(e, c, 1);
+        return;
+    }
+    if (now - c->last_rx_us >= (uint64_t)RUDP_IDLE_TIMEOUT_MS * 1000 || (c->state == CONN_INIT && now >= c->init_deadline_us)) {
+        conn_close(e, c, 1);
+        return;
+    }
+    detect_losses(e, c, now);
+    if (c->in_flight_count > 0 && now >= c->last_eliciting_sent_us + pto_us(c)) {
+        if (++c->pto_count > MAX_PTO) {
+            conn_close(e, c, 1);
+            return;
+        }
+        // 探测：重发最早的在途数据（不减拥塞窗口），没有数据时发 PING
+        for (uint64_t pn = c->sent_lo; pn < c->next_pn; pn++) {
+            sent_packet_t *s = &c->sent[pn % SENT_SLOTS];
+            if (s->pn == pn && s->in_flight && s->len) {
+                on_packet_lost(e, c, s, now, 0);
+                break;
+            }
+        }
+        advance_sent_lo(c);
+        c->probe_pending = 1;
+        c->last_eliciting_sent_us = now; // 下一次探测从现在起算
+    }
+    conn_deliver(c);
+    conn_send_packets(e, c, now, 0);
+}
+
+// --- 引擎线程 ---
+static void* engine_thread(void* arg) {
+    RudpEngine *e = arg;
+    struct pollfd fds[2 + MAX_CONNS];
+    RudpConn *owners[2 + MAX_CONNS];
+    unsigned char datagram[RUDP_MAX_DATAGRAM + 1];
+    pthread_mutex_lock(&e->mutex);
+    while (!e->stopping) {
+        uint64_t now = now_us(), deadline = now + 1000000;
+        int n = 0;
+        fds[n++] = (struct pollfd){ .fd = e->udp_fd, .events = POLLIN };
+        fds[n++] = (struct pollfd){ .fd = e->wake_fd, .events = POLLIN };
+        for (RudpConn *c = e->conns; c; c = c->next) {
+            if (c->dead) continue;
+            short events = 0;
+            if (!c->app_eof && conn_wants_app(c)) events |= POLLIN;
+            if (c->rcv_delivered < c->rcv_nxt) events |= POLLOUT;
+            if (events) {
+                owners[n] = c;
+                fds[n++] = (struct pollfd){ .fd = c->eng_fd, .events = events };
+            }
+            uint64_t t = conn_deadline(c, now);
+            if (t < deadline) deadline = t;
+        }
+        int timeout = deadline > now ? (int)((deadline - now + 999) / 1000) : 0;
+        pthread_mutex_unlock(&e->mutex);
+        poll(fds, (nfds_t)n, timeout);
+        pthread_mutex_lock(&e->mutex);
+        if (e->stopping) break;
+        now = now_us();
+        if (fds[0].revents & POLLIN) {
+            for (int i = 0; i < DATAGRAM_BATCH; i++) {
+                struct sockaddr_in from;
+                socklen_t from_len = sizeof(from);
+                ssize_t r = recvfrom(e->udp_fd, datagram, sizeof(datagram), MSG_DONTWAIT, (struct sockaddr*)&from, &from_len);
+                if (r < 0) break;
+                if ((size_t)r <= RUDP_MAX_DATAGRAM) on_datagram(e, datagram, (size_t)r, &from, now);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            ssize_t rc = read(e->wake_fd, &count, sizeof(count));
+            (void)rc;
+        }
+        for (int i = 2; i < n; i++) {
+            RudpConn *c = owners[i];
+            if (c->dead || !fds[i].revents) continue;
+            // 上层关闭了连接：已读入的数据发完并被确认后再关闭（conn_service）
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && conn_read_app(c) != 0) c->app_eof = 1;
+            if (fds[i].revents & POLLOUT) conn_deliver(c);
+        }
+        for (RudpConn *c = e->conns; c; c = c->next) {
+            if (!c->dead) conn_service(e, c, now);
+        }
+        reap_conns(e);
+    }
+    pthread_mutex_unlock(&e->mutex);
+    return NULL;
+}
+
+// --- 公共接口 ---
+RudpEngine* rudp_create(const unsigned char my_pk[PK_BYTES], PeerKeyCache* keys, int port, const rudp_callbacks_t* callbacks) {
+    RudpEngine *e = calloc(1, sizeof(RudpEngine));
+    if (!e) return NULL;
+    memcpy(e->my_pk, my_pk, PK_BYTES);
+    e->keys = keys;
+    e->callbacks = *callbacks;
+    e->udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    e->wake_fd = eventfd(0, EFD_NONBLOCK);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (e->udp_fd < 0 || e->wake_fd < 0 || bind(e->udp_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        if (e->udp_fd >= 0) close(e->udp_fd);
+        if (e->wake_fd >= 0) close(e->wake_fd);
+        free(e);
+        return NULL;
+    }
+    int buf = 4 << 20;
+    setsockopt(e->udp_fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+    setsockopt(e->udp_fd, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+    pthread_mutex_init(&e->mutex, NULL);
+    pthread_cond_init(&e->cond, NULL);
+    if (pthread_create(&e->tid, NULL, engine_thread, e) != 0) {
+        close(e->udp_fd);
+        close(e->wake_fd);
+        pthread_mutex_destroy(&e->mutex);
+        pthread_cond_destroy(&e->cond);
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+void rudp_destroy(RudpEngine* e) {
+    if (!e) return;
+    pthread_mutex_lock(&e->mutex);
+    e->stopping = 1;
+    pthread_mutex_unlock(&e->mutex);
+    wake_engine(e);
+    pthread_join(e->tid, NULL);
+    for (RudpConn *c = e->conns; c; c = c->next) {
+        if (!c->dead) conn_close(e, c, 1);
+    }
+    while (e->conns) {
+        RudpConn *next = e->conns->next;
+        conn_free(e, e->conns);
+        e->conns = next;
+    }
+    close(e->udp_fd);
+    close(e->wake_fd);
+    pthread_mutex_destroy(&e->mutex);
+    pthread_cond_destroy(&e->cond);
+    free(e);
+}
+
+int rudp_connect(RudpEngine* e, const unsigned char pk[PK_BYTES], const struct sockaddr_in* addr, int timeout_ms, int* zero_rtt) {
+    const PeerKey *key = peer_key_acquire(e->keys, pk);
+    if (!key) return -1;
+    uint64_t id;
+    randombytes_buf(&id, sizeof(id));
+    pthread_mutex_lock(&e->mutex);
+    RudpConn *c = e->stopping ? NULL : conn_create(e, id, pk, key, addr, 1);
+    if (!c) {
+        pthread_mutex_unlock(&e->mutex);
+        peer_key_release(e->keys, key);
+        return -1;
+    }
+    uint64_t now = now_us();
+    c->init_deadline_us = now + (uint64_t)timeout_ms * 1000;
+    c->probe_pending = 1; // 没有数据也立即发出第一个报文
+    resume_entry_t *r = resume_find(e, pk);
+    int resumed = r && same_addr(&r->addr, addr) && wall_ms() - r->saved_ms < RESUME_TTL_MS;
+    if (resumed) {
+        c->srtt_us = r->srtt_us;
+        c->rttvar_us = r->rttvar_us;
+        c->cwnd = r->cwnd < INITIAL_CWND ? INITIAL_CWND : r->cwnd > RESUME_CWND_MAX ? RESUME_CWND_MAX : r->cwnd;
+        e->stats.zero_rtt++;
+    }
+    wake_engine(e);
+    if (!resumed) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += timeout_ms / 1000;
+        until.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) { until.tv_sec++; until.tv_nsec -= 1000000000; }
+        c->connect_waiting = 1;
+        while (c->state == CONN_INIT && !c->dead && !e->stopping) {
+            if (pthread_cond_timedwait(&e->cond, &e->mutex, &until) == ETIMEDOUT) break;
+        }
+        c->connect_waiting = 0;
+    }
+    int ok = resumed || (c->state == CONN_OPEN && !c->dead);
+    int fd = c->app_fd;
+    c->app_fd = -1;
+    if (!ok) {
+        c->abort = 1;
+        wake_engine(e);
+    }
+    pthread_mutex_unlock(&e->mutex);
+    if (!ok) {
+        close(fd);
+        return -1;
+    }
+    if (zero_rtt) *zero_rtt = resumed;
+    return fd;
+}
+
+void rudp_forget(RudpEngine* e, const unsigned char pk[PK_BYTES]) {
+    pthread_mutex_lock(&e->mutex);
+    resume_forget(e, pk);
+    pthread_mutex_unlock(&e->mutex);
+}
+
+void rudp_get_stats(RudpEngine* e, rudp_stats_t* out) {
+    pthread_mutex_lock(&e->mutex);
+    *out = e->stats;
+    pthread_mutex_unlock(&e->mutex);
+}
@@ -0,0 +1,91 @@
+#ifndef ZEROLINK_RUDP_H
+#define ZEROLINK_RUDP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "../models/pk_intern.h"
+#include "../crypto/peer_crypto.h"
+
+/**
+ * @file rudp.h
+ * @brief 好友之间基于 UDP 的可靠加密传输，作为 TCP 直连之外的另一种链路。
+ *
+ * 每条连接对上层表现为一个本地流套接字（socketpair 的一端），读写、shutdown 与关闭都和 TCP 连接一样，
+ * 上层的帧格式与收发线程不需要改变。一个引擎占用一个 UDP 端口，由一个线程处理所有连接。
+ *
+ * - 每个报文都用双方的共享密钥整体加密认证（与帧加密相同的 peer_box），报文头只有类型和连接 id；
+ *   发起方的报文附带自己的公钥，接收方据此取得共享密钥。共享密钥由长期密钥算出并且已缓存，
+ *   所以第一个报文就可以携带数据，不需要握手。
+ * - 报文按编号确认，确认帧携带多个已收区间（选择确认），按编号差和时间判定丢失后只重传丢失的部分；
+ *   没有确认时按探测超时 (PTO) 重传最早的未确认数据。
+ * - 拥塞控制为 NewReno：慢启动、每个恢复期减半一次；接收方用窗口做流量控制。
+ * - 连接以 id 而不是地址识别，对端地址变化（换网络）后，编号更大的合法报文会把连接迁移到新地址。
+ * - 0-RTT 恢复：最近与某好友在同一地址通信过的连接状态（往返时间、拥塞窗口）会被缓存，
+ *   再次连接时不等对方应答就把连接交给上层，数据随第一个报文发出，拥塞窗口也从缓存的值开始。
+ *   对方不可达时连接在超时后关闭，缓存作废。
+ * - 重放：报文头（类型与连接 id）在密文里另有一份，解开后核对，改写过的报文头无法通过认证。
+ *   发起报文带时间戳，超出 RUDP_REPLAY_WINDOW_MS 的被拒绝；窗口内新连接的发起报文按 nonce 记住，
+ *   最近关闭的连接 id 也会被记住，重放的报文都不能重新打开连接。
+ *   窗口内重放的 0-RTT 数据可能被重复交付，上层的消息按 UID 去重。
+ */
+
+#define RUDP_MAX_DATAGRAM 1280          // 单个报文的上限，IPv6 的最小 MTU，绝大多数路径不会分片
+#define RUDP_REPLAY_WINDOW_MS 30000
+#define RUDP_IDLE_TIMEOUT_MS 20000      // 这么久收不到对方任何报文即认为连接已断
+#define RUDP_KEEPALIVE_MS 5000
+
+typedef struct RudpEngine RudpEngine;
+
+/**
+ * @struct rudp_callbacks_t
+ * @brief 入站连接的回调，在引擎线程中调用，不能阻塞，也不能调用本模块的函数。
+ */
+typedef struct {
+    /** 是否接受这个公钥发起的连接（只接受好友）。 */
+    int (*accept)(void* ctx, const unsigned char pk[PK_BYTES]);
+    /** 新的入站连接：fd 为上层的流套接字，由上层负责关闭。 */
+    void (*accepted)(void* ctx, int fd, const unsigned char pk[PK_BYTES], const struct sockaddr_in* addr);
+    void *ctx;
+} rudp_callbacks_t;
+
+/**
+ * @struct rudp_stats_t
+ * @brief 引擎建立以来的累计统计。
+ */
+typedef struct {
+    uint64_t datagrams_sent, datagrams_received;
+    uint64_t bytes_sent, bytes_received;    ///< UDP 负载字节
+    uint64_t retransmitted;                 ///< 重传的流数据报文
+    uint64_t lost;                          ///< 判定丢失的报文
+    uint64_t rejected;                      ///< 无法认证、被拒绝或重放的报文
+    uint64_t connections, zero_rtt;         ///< 建立的连接数，其中由本机以 0-RTT 发起的
+    uint64_t migrations;                    ///< 对端地址变化后迁移的次数
+} rudp_stats_t;
+
+/**
+ * @brief 在 port 上创建引擎并启动它的线程。my_pk 随发起报文发出；共享密钥从 keys 中取得（引擎持有自己的引用）。
+ * @return 成功返回引擎；端口绑定失败等情况返回 NULL。
+ */
+RudpEngine* rudp_create(const unsigned char my_pk[PK_BYTES], PeerKeyCache* keys, int port, const rudp_callbacks_t* callbacks);
+
+/**
+ * @brief 停止线程，向所有连接的对端发送关闭通知并释放。上层持有的流套接字随后读到 EOF。
+ */
+void rudp_destroy(RudpEngine* engine);
+
+/**
+ * @brief 连接好友。有可用的 0-RTT 缓存时立即返回，否则等到对方第一次应答或 timeout_ms 超时。
+ * @param zero_rtt 非 NULL 时写入是否以 0-RTT 返回。
+ * @return 上层的流套接字；对方没有应答返回 -1。
+ */
+int rudp_connect(RudpEngine* engine, const unsigned char pk[PK_BYTES], const struct sockaddr_in* addr, int timeout_ms, int* zero_rtt);
+
+/**
+ * @brief 作废与该好友的 0-RTT 缓存（例如得知对方换了地址）。
+ */
+void rudp_forget(RudpEngine* engine, const unsigned char pk[PK_BYTES]);
+
+void rudp_get_stats(RudpEngine* engine, rudp_stats_t* out);
+
+#endif //ZEROLINK_RUDP_H
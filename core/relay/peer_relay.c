@@ -0,0 +1,54 @@
+#include "peer_relay.h"
+#include <string.h>
+
+#define RELAY_SATURATED_PENALTY 1e9
+
+size_t relay_wrap(unsigned char* out, int kind, const unsigned char pk[PK_BYTES], const unsigned char* inner, size_t len) {
+    out[0] = (unsigned char)kind;
+    memcpy(out + 1, pk, PK_BYTES);
+    memcpy(out + RELAY_HEADER_BYTES, inner, len);
+    return RELAY_HEADER_BYTES + len;
+}
+
+int relay_unwrap(const unsigned char* in, size_t len, relay_packet_t* out) {
+    if (len <= RELAY_HEADER_BYTES || (in[0] != RELAY_KIND_FORWARD && in[0] != RELAY_KIND_DELIVER)) return -1;
+    out->kind = in[0];
+    out->pk = in + 1;
+    out->inner = in + RELAY_HEADER_BYTES;
+    out->inner_len = len - RELAY_HEADER_BYTES;
+    return 0;
+}
+
+void relay_budget_init(relay_budget_t* budget, double rate, double burst, uint64_t now_ms) {
+    budget->rate = rate;
+    budget->burst = burst;
+    budget->tokens = burst;
+    budget->last_ms = now_ms;
+}
+
+static void refill(relay_budget_t* budget, uint64_t now_ms) {
+    if (now_ms <= budget->last_ms) return;
+    budget->tokens += budget->rate * (double)(now_ms - budget->last_ms) / 1000.0;
+    if (budget->tokens > budget->burst) budget->tokens = budget->burst;
+    budget->last_ms = now_ms;
+}
+
+int relay_budget_take(relay_budget_t* budget, size_t bytes, uint64_t now_ms) {
+    refill(budget, now_ms);
+    if (budget->tokens < (double)bytes) return 0;
+    budget->tokens -= (double)bytes;
+    return 1;
+}
+
+double relay_budget_load(relay_budget_t* budget, uint64_t now_ms) {
+    refill(budget, now_ms);
+    if (budget->burst <= 0) return 1.0;
+    return 1.0 - budget->tokens / budget->burst;
+}
+
+double relay_score(uint32_t rtt_ms, double load) {
+    if (load < 0) load = 0;
+    // 往返时间至少按 1 ms 计，负载为 0 的本地中继之间仍按负载区分
+    double score = (double)(rtt_ms ? rtt_ms : 1) * (1.0 + 4.0 * load);
+    return load >= 0.95 ? score + RELAY_SATURATED_PENALTY : score;
+}
@@ -0,0 +1,75 @@
+#ifndef ZEROLINK_PEER_RELAY_H
+#define ZEROLINK_PEER_RELAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../models/pk_intern.h"
+
+/**
+ * @file peer_relay.h
+ * @brief 二级中继 (Peer Relay)：直连失败时，经一个与双方都直连的好友转发。
+ *
+ * 中继包 (RELAY_WRAPPED_PACKET) 本身经发送方与中继之间的链路加密；包内是发送方与接收方之间的完整帧
+ * （长度头 + 端到端加密的帧体），中继只能看到对端公钥，无法解密内容。
+ * 包格式: [类型 1][公钥 32][内层帧]。发往中继时公钥是目标 (RELAY_KIND_FORWARD)，
+ * 中继转交给目标时改写为来源 (RELAY_KIND_DELIVER)。
+ * 中继用令牌桶限制自己转发的带宽，候选中继按探测到的往返时间和当前负载打分。
+ */
+
+#define RELAY_KIND_FORWARD 0
+#define RELAY_KIND_DELIVER 1
+#define RELAY_HEADER_BYTES (1 + PK_BYTES)
+
+/**
+ * @struct relay_packet_t
+ * @brief 解析后的中继包，指针指向输入缓冲区。
+ */
+typedef struct {
+    int kind;
+    const unsigned char *pk;
+    const unsigned char *inner;
+    size_t inner_len;
+} relay_packet_t;
+
+/**
+ * @struct relay_budget_t
+ * @brief 转发带宽的令牌桶（字节），不加锁，由调用者保护。
+ */
+typedef struct {
+    double rate;      ///< 每秒补充的字节数
+    double burst;     ///< 桶容量
+    double tokens;
+    uint64_t last_ms;
+} relay_budget_t;
+
+/**
+ * @brief 组装中继包。out 至少 RELAY_HEADER_BYTES + len 字节。
+ * @return 包长度。
+ */
+size_t relay_wrap(unsigned char* out, int kind, const unsigned char pk[PK_BYTES], const unsigned char* inner, size_t len);
+
+/**
+ * @brief 解析中继包。
+ * @return 成功返回 0，过短或类型未知返回 -1。
+ */
+int relay_unwrap(const unsigned char* in, size_t len, relay_packet_t* out);
+
+void relay_budget_init(relay_budget_t* budget, double rate, double burst, uint64_t now_ms);
+
+/**
+ * @brief 扣除 bytes 个令牌。
+ * @return 令牌足够返回 1（已扣除），否则返回 0。
+ */
+int relay_budget_take(relay_budget_t* budget, size_t bytes, uint64_t now_ms);
+
+/**
+ * @brief 当前负载：0 表示桶满（空闲），1 表示令牌耗尽。
+ */
+double relay_budget_load(relay_budget_t* budget, uint64_t now_ms);
+
+/**
+ * @brief 候选中继的得分（越小越好）：往返时间按负载放大，负载饱和的中继排在所有未饱和的之后。
+ */
+double relay_score(uint32_t rtt_ms, double load);
+
+#endif //ZEROLINK_PEER_RELAY_H
@@ -0,0 +1,210 @@
+#include "archive_block.h"
+#include <zlib.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file archive_block.c
+ * @brief 归档块的构建与读取，格式见 archive_block.h。
+ */
+
+#define ARCHIVE_MAGIC "ZLAB"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER_SIZE 16
+#define ARCHIVE_FIXED_ROW_BYTES (8 + 8 + ARCHIVE_UID_BYTES + ARCHIVE_PK_BYTES + 4 + 4)
+#define ARCHIVE_MAX_RAW_BYTES (64u * 1024 * 1024) // 拒绝声称解压后超过该大小的块
+
+struct ArchiveBuilder {
+    unsigned char fixed[ARCHIVE_BLOCK_ROWS * ARCHIVE_FIXED_ROW_BYTES]; // 定长字段按行暂存，finish 时转为按列
+    size_t count;
+    char *content, *vc;      // 正文与向量时钟（含 NUL）
+    size_t content_len, content_cap, vc_len, vc_cap;
+};
+
+struct ArchiveBlock {
+    unsigned char *raw;
+    size_t count;
+    const char *content[ARCHIVE_BLOCK_ROWS];
+    const char *vc[ARCHIVE_BLOCK_ROWS];
+};
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static int grow(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t cap_new = *cap ? *cap : 4096;
+    while (cap_new < need) cap_new *= 2;
+    char *p = realloc(*buf, cap_new);
+    if (!p) return -1;
+    *buf = p;
+    *cap = cap_new;
+    return 0;
+}
+
+ArchiveBuilder* archive_builder_create(void) {
+    return calloc(1, sizeof(ArchiveBuilder));
+}
+
+void archive_builder_destroy(ArchiveBuilder* builder) {
+    if (!builder) return;
+    free(builder->content);
+    free(builder->vc);
+    free(builder);
+}
+
+size_t archive_builder_count(const ArchiveBuilder* builder) {
+    return builder->count;
+}
+
+int archive_builder_add(ArchiveBuilder* builder, const archive_row_t* row) {
+    const char *content = row->content ? row->content : "";
+    const char *vc = row->vector_clock ? row->vector_clock : "";
+    size_t content_len = strlen(content), vc_len = strlen(vc);
+    if (builder->count >= ARCHIVE_BLOCK_ROWS ||
+        grow(&builder->content, &builder->content_cap, builder->content_len + content_len + 1) != 0 ||
+        grow(&builder->vc, &builder->vc_cap, builder->vc_len + vc_len + 1) != 0) {
+        return -1;
+    }
+    unsigned char *p = builder->fixed + builder->count * ARCHIVE_FIXED_ROW_BYTES;
+    put_u64(p, (uint64_t)row->id);
+    put_u64(p + 8, (uint64_t)row->timestamp);
+    memcpy(p + 16, row->uid, ARCHIVE_UID_BYTES);
+    memcpy(p + 16 + ARCHIVE_UID_BYTES, row->sender_pk, ARCHIVE_PK_BYTES);
+    put_u32(p + 16 + ARCHIVE_UID_BYTES + ARCHIVE_PK_BYTES, (uint32_t)content_len);
+    put_u32(p + 20 + ARCHIVE_UID_BYTES + ARCHIVE_PK_BYTES, (uint32_t)vc_len);
+    memcpy(builder->content + builder->content_len, content, content_len + 1);
+    memcpy(builder->vc + builder->vc_len, vc, vc_len + 1);
+    builder->content_len += content_len + 1;
+    builder->vc_len += vc_len + 1;
+    builder->count++;
+    return 0;
+}
+
+int archive_builder_finish(ArchiveBuilder* builder, unsigned char** out, size_t* out_len) {
+    size_t n = builder->count;
+    size_t raw_len = n * ARCHIVE_FIXED_ROW_BYTES + builder->content_len + builder->vc_len;
+    if (raw_len > ARCHIVE_MAX_RAW_BYTES) return -1;
+    unsigned char *raw = malloc(raw_len ? raw_len : 1);
+    if (!raw) return -1;
+    // 行存转列存
+    static const size_t widths[] = { 8, 8, ARCHIVE_UID_BYTES, ARCHIVE_PK_BYTES, 4, 4 };
+    size_t column = 0, field = 0;
+    for (size_t f = 0; f < sizeof(widths) / sizeof(widths[0]); f++) {
+        for (size_t i = 0; i < n; i++) {
+            memcpy(raw + column + i * widths[f], builder->fixed + i * ARCHIVE_FIXED_ROW_BYTES + field, widths[f]);
+        }
+        column += n * widths[f];
+        field += widths[f];
+    }
+    if (builder->content_len) memcpy(raw + column, builder->content, builder->content_len);
+    if (builder->vc_len) memcpy(raw + column + builder->content_len, builder->vc, builder->vc_len);
+
+    uLongf packed_len = compressBound((uLong)raw_len);
+    unsigned char *data = malloc(ARCHIVE_HEADER_SIZE + packed_len);
+    if (!data || compress2(data + ARCHIVE_HEADER_SIZE, &packed_len, raw, (uLong)raw_len, Z_BEST_COMPRESSION) != Z_OK) {
+        free(data);
+        free(raw);
+        return -1;
+    }
+    free(raw);
+    memcpy(data, ARCHIVE_MAGIC, 4);
+    put_u32(data + 4, ARCHIVE_VERSION);
+    put_u32(data + 8, (uint32_t)n);
+    put_u32(data + 12, (uint32_t)raw_len);
+    *out = data;
+    *out_len = ARCHIVE_HEADER_SIZE + packed_len;
+    builder->count = builder->content_len = builder->vc_len = 0;
+    return 0;
+}
+
+void archive_block_close(ArchiveBlock* block) {
+    if (!block) return;
+    free(block->raw);
+    free(block);
+}
+
+ArchiveBlock* archive_block_open(const void* data, size_t len) {
+    const unsigned char *p = data;
+    if (len < ARCHIVE_HEADER_SIZE || memcmp(p, ARCHIVE_MAGIC, 4) != 0 || get_u32(p + 4) != ARCHIVE_VERSION) return NULL;
+    size_t n = get_u32(p + 8), raw_len = get_u32(p + 12);
+    if (n > ARCHIVE_BLOCK_ROWS || raw_len > ARCHIVE_MAX_RAW_BYTES || raw_len < n * ARCHIVE_FIXED_ROW_BYTES) return NULL;
+
+    ArchiveBlock *block = calloc(1, sizeof(ArchiveBlock));
+    if (!block) return NULL;
+    block->count = n;
+    block->raw = malloc(raw_len ? raw_len : 1);
+    uLongf out_len = (uLongf)raw_len;
+    if (!block->raw || uncompress(block->raw, &out_len, p + ARCHIVE_HEADER_SIZE, (uLong)(len - ARCHIVE_HEADER_SIZE)) != Z_OK || out_len != raw_len) {
+        archive_block_close(block);
+        return NULL;
+    }
+
+    // 按长度列定位每条正文与向量时钟，同时校验它们恰好填满剩余数据
+    const unsigned char *content_lens = block->raw + n * (16 + ARCHIVE_UID_BYTES + ARCHIVE_PK_BYTES);
+    const unsigned char *vc_lens = content_lens + n * 4;
+    size_t off = n * ARCHIVE_FIXED_ROW_BYTES;
+    for (int pass = 0; pass < 2; pass++) {
+        const unsigned char *lens = pass == 0 ? content_lens : vc_lens;
+        const char **strings = pass == 0 ? block->content : block->vc;
+        for (size_t i = 0; i < n; i++) {
+            size_t l = get_u32(lens + i * 4);
+            if (l >= raw_len - off || block->raw[off + l] != '\0') {
+                archive_block_close(block);
+                return NULL;
+            }
+            strings[i] = (const char*)block->raw + off;
+            off += l + 1;
+        }
+    }
+    if (off != raw_len) {
+        archive_block_close(block);
+        return NULL;
+    }
+    return block;
+}
+
+size_t archive_block_count(const ArchiveBlock* block) {
+    return block->count;
+}
+
+static const unsigned char *row_uid(const ArchiveBlock *block, size_t i) {
+    return block->raw + block->count * 16 + i * ARCHIVE_UID_BYTES;
+}
+
+int archive_block_get(const ArchiveBlock* block, size_t index, archive_row_t* row) {
+    if (index >= block->count) return -1;
+    size_t n = block->count;
+    row->id = (int64_t)get_u64(block->raw + index * 8);
+    row->timestamp = (int64_t)get_u64(block->raw + n * 8 + index * 8);
+    row->uid = row_uid(block, index);
+    row->sender_pk = block->raw + n * (16 + ARCHIVE_UID_BYTES) + index * ARCHIVE_PK_BYTES;
+    row->content = block->content[index];
+    row->vector_clock = block->vc[index];
+    return 0;
+}
+
+long archive_block_find(const ArchiveBlock* block, const unsigned char uid[ARCHIVE_UID_BYTES]) {
+    // 块内最多 ARCHIVE_BLOCK_ROWS 条，UID 列连续存放，顺序比较即可
+    for (size_t i = 0; i < block->count; i++) {
+        if (memcmp(row_uid(block, i), uid, ARCHIVE_UID_BYTES) == 0) return (long)i;
+    }
+    return -1;
+}
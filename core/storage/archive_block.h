@@ -0,0 +1,88 @@
+#ifndef ZEROLINK_ARCHIVE_BLOCK_H
+#define ZEROLINK_ARCHIVE_BLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @file archive_block.h
+ * @brief 历史消息归档块的编解码：一小批按 id 升序排列的冷消息，序列化后整体用 zlib 压缩。
+ *
+ * 归档段由若干个这样的块组成，块是随机读取的最小单位：
+ * 读取一条归档消息只需要解压它所在的块（不超过 ARCHIVE_BLOCK_ROWS 条），而不是整个段。
+ * 块内按列存放（id、时间戳、UID、发送者公钥、正文、向量时钟各自连续），
+ * 同类数据相邻可以显著提高压缩率，尤其是每条消息都附带的 JSON 向量时钟。
+ * 格式（小端）:
+ *   [magic "ZLAB"][version u32][count u32][raw_len u32][zlib 压缩的原始数据]
+ * 原始数据:
+ *   [id i64 × n][timestamp i64 × n][uid 16B × n][sender_pk 32B × n][content_len u32 × n][vc_len u32 × n]
+ *   [各条正文，以 NUL 结尾][各条向量时钟，以 NUL 结尾]
+ *
+ * 本模块只负责编解码，不涉及存储位置，也不加锁。
+ */
+
+#define ARCHIVE_BLOCK_ROWS 128
+#define ARCHIVE_UID_BYTES 16
+#define ARCHIVE_PK_BYTES 32
+
+/**
+ * @struct archive_row_t
+ * @brief 一条归档消息。从块中读出时，各指针指向块内部的解压缓冲区，在块关闭前有效。
+ */
+typedef struct {
+    int64_t id;
+    int64_t timestamp;
+    const unsigned char *uid;       ///< ARCHIVE_UID_BYTES 字节
+    const unsigned char *sender_pk; ///< ARCHIVE_PK_BYTES 字节
+    const char *content;
+    const char *vector_clock;
+} archive_row_t;
+
+typedef struct ArchiveBuilder ArchiveBuilder;
+typedef struct ArchiveBlock ArchiveBlock;
+
+/**
+ * @brief 创建一个空的块构建器。内存不足返回 NULL。
+ */
+ArchiveBuilder* archive_builder_create(void);
+
+/**
+ * @brief 追加一条消息（数据会被复制），调用者保证 id 递增且不超过 ARCHIVE_BLOCK_ROWS 条。
+ * @return 成功返回 0，块已满或内存不足返回 -1。
+ */
+int archive_builder_add(ArchiveBuilder* builder, const archive_row_t* row);
+
+size_t archive_builder_count(const ArchiveBuilder* builder);
+
+/**
+ * @brief 序列化并压缩已追加的消息，之后构建器被清空，可以继续构建下一块。
+ * @param out 成功时指向 malloc 分配的块数据，由调用者 free。
+ * @return 成功返回 0，失败返回 -1（构建器保持不变）。
+ */
+int archive_builder_finish(ArchiveBuilder* builder, unsigned char** out, size_t* out_len);
+
+void archive_builder_destroy(ArchiveBuilder* builder);
+
+/**
+ * @brief 解压一个块。data 在返回后即可释放。
+ * @return 成功返回块；数据损坏、格式不符或内存不足时返回 NULL。
+ */
+ArchiveBlock* archive_block_open(const void* data, size_t len);
+
+void archive_block_close(ArchiveBlock* block);
+
+size_t archive_block_count(const ArchiveBlock* block);
+
+/**
+ * @brief 读取第 index 条消息（按 id 升序）。
+ * @return 成功返回 0，下标越界返回 -1。
+ */
+int archive_block_get(const ArchiveBlock* block, size_t index, archive_row_t* row);
+
+/**
+ * @brief 按 UID 查找消息。
+ * @return 消息的下标；不存在时返回 -1。
+ */
+long archive_block_find(const ArchiveBlock* block, const unsigned char uid[ARCHIVE_UID_BYTES]);
+
+#endif //ZEROLINK_ARCHIVE_BLOCK_H
@@ -2,6 +2,7 @@
 #define ZEROLINK_DATABASE_H
 
 #include "../models/chat_block.h"
+#include <stddef.h>
 
 /**
  * @file database.h
@@ -14,15 +15,47 @@
 // 定义一个不透明的数据库句柄类型
 typedef struct DatabaseHandle DatabaseHandle;
 
+/**
+ * @struct DbBlockCursor
+ * @brief 区块范围游标，用于顺序扫描一段连续的区块。
+ *
+ * 游标完全位于调用者的栈上，遍历过程中不做任何堆分配，
+ * 读取顺序与日志段在磁盘上的物理顺序一致（顺序 I/O）。
+ * 字段仅供存储层内部使用。
+ */
+typedef struct {
+    DatabaseHandle *handle;
+    const unsigned char *map; // 当前段的只读映射
+    uint64_t next_index;   // 下一个要返回的区块索引
+    uint64_t end_index;    // 结束索引（包含）
+    uint32_t segment;      // 当前所在的日志段
+    size_t offset;         // 当前段内的字节偏移
+    size_t limit;          // 当前段已提交数据的末尾
+} DbBlockCursor;
+
+/**
+ * @brief 范围遍历回调。
+ * @return 返回 0 继续遍历，返回非 0 提前终止。
+ */
+typedef int (*db_block_visitor)(const ChatBlockView* block, void* ctx);
+
 /**
  * @brief 打开或创建一个指定聊天ID的数据库实例。
- * @param db_path 数据库文件或目录的路径。
+ *
+ * 打开时会对最后写入的日志段执行崩溃恢复扫描：校验每条记录的魔数、长度、CRC 与索引连续性，
+ * 截断末尾写了一半的记录，并重建稀疏索引。之前的段在写满时已封存，按封存记录中的长度直接接受，
+ * 它们的稀疏索引在第一次读取时建立，打开耗时与历史长度无关。
+ *
+ * @param db_path 数据库目录的路径（不存在时自动创建）。
  * @return 成功则返回一个非空的数据库句柄，失败则返回 NULL。
  */
 DatabaseHandle* db_open(const char* db_path);
 
 /**
  * @brief 关闭数据库连接并释放句柄。
+ *
+ * 关闭后，之前通过该句柄获得的所有 ChatBlockView 都会失效。
+ *
  * @param handle 要关闭的数据库句柄。
  */
 void db_close(DatabaseHandle* handle);
@@ -30,7 +63,8 @@ void db_close(DatabaseHandle* handle);
 /**
  * @brief 将一个新的聊天区块追加到数据库中。
  *
- * 实现时必须保证操作的原子性。
+ * 区块索引必须等于当前链长（严格追加）。函数在数据通过 fdatasync 落盘后才返回；
+ * 多个线程同时追加时会合并为一次 fdatasync（组提交）。
  *
  * @param handle 数据库句柄。
  * @param block 要追加的区块。
@@ -39,30 +73,66 @@ void db_close(DatabaseHandle* handle);
 int db_append_block(DatabaseHandle* handle, const ChatBlock* block);
 
 /**
- * @brief 根据索引获取一个聊天区块。
+ * @brief 批量追加多个连续的区块，整批只等待一次落盘。
+ * @param handle 数据库句柄。
+ * @param blocks 区块数组，索引必须从当前链长开始连续递增。
+ * @param count 区块数量。
+ * @return 成功返回 0，失败返回非 0（失败前已写入的区块保持有效）。
+ */
+int db_append_blocks(DatabaseHandle* handle, const ChatBlock* blocks, size_t count);
+
+/**
+ * @brief 返回数据库中的区块数量（即下一个区块的索引）。
+ */
+uint64_t db_get_block_count(DatabaseHandle* handle);
+
+/**
+ * @brief 根据索引获取一个聊天区块的零拷贝视图。
  * @param handle 数据库句柄。
  * @param index 要获取的区块的索引。
- * @return 成功则返回一个指向 ChatBlock 的指针（需要调用者释放），找不到则返回 NULL。
+ * @param out 成功时填充的区块视图。
+ * @return 成功返回 0，找不到返回非 0。
+ */
+int db_get_block_by_index(DatabaseHandle* handle, uint64_t index, ChatBlockView* out);
+
+/**
+ * @brief 获取最新的一个聊天区块的零拷贝视图。
+ * @param handle 数据库句柄。
+ * @param out 成功时填充的区块视图。
+ * @return 成功返回 0，数据库为空返回非 0。
  */
-ChatBlock* db_get_block_by_index(DatabaseHandle* handle, uint64_t index);
+int db_get_latest_block(DatabaseHandle* handle, ChatBlockView* out);
 
 /**
- * @brief 获取最新的一个聊天区块。
+ * @brief 在指定范围上打开一个顺序游标。
  * @param handle 数据库句柄。
- * @return 成功则返回一个指向最新 ChatBlock 的指针（需要调用者释放），数据库为空则返回 NULL。
+ * @param start_index 起始索引（包含）。
+ * @param end_index 结束索引（包含），超出链长时截断到最新区块。
+ * @param cursor 调用者提供的游标。
+ * @return 成功返回 0，范围为空或出错返回非 0。
  */
-ChatBlock* db_get_latest_block(DatabaseHandle* handle);
+int db_cursor_open(DatabaseHandle* handle, uint64_t start_index, uint64_t end_index, DbBlockCursor* cursor);
 
 /**
- * @brief 获取指定范围内的区块。
+ * @brief 从游标取出下一个区块。
+ * @return 取到区块返回 1，遍历结束返回 0，数据损坏返回 -1。
+ */
+int db_cursor_next(DbBlockCursor* cursor, ChatBlockView* out);
+
+/**
+ * @brief 顺序遍历指定范围内的区块。
+ *
+ * 同步时使用：按物理顺序读取，不为单个区块分配内存。
+ *
  * @param handle 数据库句柄。
  * @param start_index 起始索引（包含）。
  * @param end_index 结束索引（包含）。
- * @param blocks_out 函数将分配一个数组来存放区块指针，调用者需要释放该数组以及其中的每个区块。
- * @param count_out 返回获取到的区块数量。
+ * @param visit 每个区块调用一次的回调。
+ * @param ctx 透传给回调的上下文。
+ * @param count_out 可为 NULL，返回实际遍历的区块数量。
  * @return 成功返回 0，失败返回非 0。
  */
-int db_get_blocks_in_range(DatabaseHandle* handle, uint64_t start_index, uint64_t end_index, ChatBlock*** blocks_out, uint64_t* count_out);
+int db_get_blocks_in_range(DatabaseHandle* handle, uint64_t start_index, uint64_t end_index, db_block_visitor visit, void* ctx, uint64_t* count_out);
 
 
 #endif //ZEROLINK_DATABASE_H
@@ -0,0 +1,641 @@
+#include "database.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/**
+ * @file log_store.c
+ * @brief 基于定长日志段的 ChatBlock 追加日志实现。
+ *
+ * 磁盘布局: <db_path>/<首个区块索引(20位十进制)>.seg
+ * 每个段文件预分配为 LOG_SEGMENT_SIZE 字节并整体 mmap 为只读映射，写入通过 pwritev 完成。
+ * 记录格式（小端）:
+ *   [magic u32][body_len u32][crc32(body) u32][reserved u32]
+ *   [index u64][timestamp u64][prev_hash][sender_pubkey][signature][ciphertext_len u32][ciphertext]
+ *   填充到 8 字节对齐。
+ * 写满切换到新段时，旧段末尾 LOG_SEAL_SIZE 字节写入封存记录（小端）:
+ *   [magic u32][crc32(其后 24 字节) u32][已提交末尾 u64][区块数 u64][首个区块索引 u64]
+ * 打开时只逐条扫描最后一个段；封存的段按记录的末尾与区块数直接接受，稀疏索引在第一次读取该段时建立。
+ * 没有有效封存记录的旧段仍按完整扫描恢复。
+ */
+
+#define LOG_SEGMENT_SIZE (64u * 1024 * 1024)
+#define LOG_SPARSE_INTERVAL 64
+#define LOG_RECORD_MAGIC 0x314B4C5Au // "ZLK1"
+#define LOG_HEADER_SIZE 16
+#define LOG_BODY_FIXED_SIZE (8 + 8 + HASH_BYTES + crypto_box_PUBLICKEYBYTES + SIGNATURE_BYTES + 4)
+#define LOG_ALIGN 8
+#define LOG_SEGMENT_SUFFIX ".seg"
+#define LOG_SEAL_MAGIC 0x534B4C5Au   // "ZLKS"
+#define LOG_SEAL_SIZE 32
+#define LOG_SEGMENT_DATA (LOG_SEGMENT_SIZE - LOG_SEAL_SIZE) // 记录可用的区域，其后留给封存记录
+
+typedef struct {
+    uint64_t index;
+    uint32_t offset;
+} SparseEntry;
+
+typedef struct {
+    uint64_t first_index;
+    uint64_t block_count;
+    int fd;
+    unsigned char *map;
+    size_t tail;          // 已提交数据的末尾偏移
+    size_t last_offset;   // 最后一条记录的偏移（indexed 之后有效）
+    int indexed;          // 稀疏索引已建立；封存的段在第一次读取时才建立
+    SparseEntry *sparse;
+    size_t sparse_count, sparse_cap;
+} LogSegment;
+
+struct DatabaseHandle {
+    char dir[PATH_MAX];
+    pthread_mutex_t lock;      // 保护段表、稀疏索引与写入位置
+    pthread_cond_t sync_cond;  // 组提交完成通知
+    LogSegment **segments;
+    uint32_t segment_count, segment_cap;
+    uint64_t next_index;
+    uint32_t latest_segment;
+    size_t latest_offset;
+    uint64_t written_seq, synced_seq;
+    int sync_in_progress;
+};
+
+// --- 编码辅助 ---
+static void put_u32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t len) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static size_t record_size(size_t ciphertext_len) {
+    size_t raw = LOG_HEADER_SIZE + LOG_BODY_FIXED_SIZE + ciphertext_len;
+    return (raw + LOG_ALIGN - 1) & ~(size_t)(LOG_ALIGN - 1);
+}
+
+/**
+ * 解析 map[offset, limit) 处的一条记录。
+ * @return 记录占用的字节数；记录不完整或校验失败时返回 0。
+ */
+static size_t parse_record(const unsigned char *map, size_t offset, size_t limit, ChatBlockView *out) {
+    if (limit - offset < LOG_HEADER_SIZE + LOG_BODY_FIXED_SIZE) return 0;
+    const unsigned char *p = map + offset;
+    if (get_u32(p) != LOG_RECORD_MAGIC) return 0;
+    uint32_t body_len = get_u32(p + 4);
+    if (body_len < LOG_BODY_FIXED_SIZE || body_len > limit - offset - LOG_HEADER_SIZE) return 0;
+    const unsigned char *body = p + LOG_HEADER_SIZE;
+    uint32_t ciphertext_len = get_u32(body + LOG_BODY_FIXED_SIZE - 4);
+    if (ciphertext_len != body_len - LOG_BODY_FIXED_SIZE) return 0;
+    if (crc32_update(0, body, body_len) != get_u32(p + 8)) return 0;
+
+    out->index = get_u64(body);
+    out->timestamp = get_u64(body + 8);
+    out->prev_hash = body + 16;
+    out->sender_pubkey = out->prev_hash + HASH_BYTES;
+    out->signature = out->sender_pubkey + crypto_box_PUBLICKEYBYTES;
+    out->ciphertext = body + LOG_BODY_FIXED_SIZE;
+    out->ciphertext_len = ciphertext_len;
+    size_t total = record_size(ciphertext_len);
+    return total <= limit - offset ? total : limit - offset;
+}
+
+// --- 段与稀疏索引管理 (调用者持有 handle->lock) ---
+static void segment_path(const DatabaseHandle *h, uint64_t first_index, char *out, size_t out_len) {
+    snprintf(out, out_len, "%s/%020" PRIu64 LOG_SEGMENT_SUFFIX, h->dir, first_index);
+}
+
+static int sparse_add(LogSegment *seg, uint64_t index, size_t offset) {
+    if (seg->sparse_count == seg->sparse_cap) {
+        size_t cap = seg->sparse_cap ? seg->sparse_cap * 2 : 256;
+        SparseEntry *grown = realloc(seg->sparse, cap * sizeof(SparseEntry));
+        if (!grown) return -1;
+        seg->sparse = grown;
+        seg->sparse_cap = cap;
+    }
+    seg->sparse[seg->sparse_count++] = (SparseEntry){index, (uint32_t)offset};
+    return 0;
+}
+
+/**
+ * 段内新增一条记录后更新稀疏索引：段的第一条和每 LOG_SPARSE_INTERVAL 条记录一个检查点。
+ */
+static int segment_note_record(LogSegment *seg, uint64_t index, size_t offset) {
+    if ((seg->sparse_count == 0 || index % LOG_SPARSE_INTERVAL == 0) && sparse_add(seg, index, offset) != 0) return -1;
+    seg->last_offset = offset;
+    return 0;
+}
+
+static int segment_map(LogSegment *seg) {
+    seg->map = mmap(NULL, LOG_SEGMENT_SIZE, PROT_READ, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        seg->map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void segment_free(LogSegment *seg) {
+    if (!seg) return;
+    if (seg->map) munmap(seg->map, LOG_SEGMENT_SIZE);
+    if (seg->fd >= 0) close(seg->fd);
+    free(seg->sparse);
+    free(seg);
+}
+
+static int segments_push(DatabaseHandle *h, LogSegment *seg) {
+    if (h->segment_count == h->segment_cap) {
+        uint32_t cap = h->segment_cap ? h->segment_cap * 2 : 8;
+        LogSegment **grown = realloc(h->segments, cap * sizeof(LogSegment*));
+        if (!grown) return -1;
+        h->segments = grown;
+        h->segment_cap = cap;
+    }
+    h->segments[h->segment_count++] = seg;
+    return 0;
+}
+
+static void fsync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static LogSegment* segment_create(DatabaseHandle *h, uint64_t first_index) {
+    char path[PATH_MAX];
+    segment_path(h, first_index, path, sizeof(path));
+    LogSegment *seg = calloc(1, sizeof(LogSegment));
+    if (!seg) return NULL;
+    seg->first_index = first_index;
+    seg->indexed = 1;
+    seg->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (seg->fd < 0 || ftruncate(seg->fd, LOG_SEGMENT_SIZE) != 0 || segment_map(seg) != 0) {
+        segment_free(seg);
+        return NULL;
+    }
+    fsync_dir(h->dir);
+    return seg;
+}
+
+// --- 封存记录 ---
+/**
+ * 在段末写入封存记录。记录区已经越过 LOG_SEGMENT_DATA 的旧段不封存，下次打开时完整扫描。
+ */
+static int segment_seal(LogSegment *seg) {
+    if (seg->tail > LOG_SEGMENT_DATA) return 0;
+    unsigned char seal[LOG_SEAL_SIZE];
+    put_u32(seal, LOG_SEAL_MAGIC);
+    put_u64(seal + 8, seg->tail);
+    put_u64(seal + 16, seg->block_count);
+    put_u64(seal + 24, seg->first_index);
+    put_u32(seal + 4, crc32_update(0, seal + 8, LOG_SEAL_SIZE - 8));
+    return pwrite(seg->fd, seal, sizeof(seal), LOG_SEGMENT_DATA) == (ssize_t)sizeof(seal) ? 0 : -1;
+}
+
+/**
+ * 读取封存记录，成功时设置段的末尾与区块数（稀疏索引留到第一次读取时建立）。
+ * @return 记录有效返回 0，否则返回 -1。
+ */
+static int segment_read_seal(LogSegment *seg) {
+    const unsigned char *seal = seg->map + LOG_SEGMENT_DATA;
+    if (get_u32(seal) != LOG_SEAL_MAGIC || get_u32(seal + 4) != crc32_update(0, seal + 8, LOG_SEAL_SIZE - 8)) return -1;
+    uint64_t tail = get_u64(seal + 8), blocks = get_u64(seal + 16);
+    if (get_u64(seal + 24) != seg->first_index || tail > LOG_SEGMENT_DATA || blocks == 0) return -1;
+    seg->tail = (size_t)tail;
+    seg->block_count = blocks;
+    seg->indexed = 0;
+    return 0;
+}
+
+/**
+ * 为封存的段建立稀疏索引（调用者持有锁）。记录仍由 parse_record 校验；遇到损坏的记录即停止，
+ * 之后的区块在读取时报错，不影响其他段。
+ */
+static int segment_index_locked(LogSegment *seg) {
+    if (seg->indexed) return 0;
+    size_t offset = 0;
+    uint64_t index = seg->first_index;
+    ChatBlockView view;
+    while (offset < seg->tail) {
+        size_t used = parse_record(seg->map, offset, seg->tail, &view);
+        if (used == 0 || view.index != index) break;
+        if (segment_note_record(seg, index, offset) != 0) return -1;
+        offset += used;
+        index++;
+    }
+    seg->indexed = 1;
+    return 0;
+}
+
+/**
+ * @return 包含 index 的段号（first_index 不大于 index 的最后一个段）；调用者保证 index 小于 next_index。
+ */
+static uint32_t segment_find(const DatabaseHandle *h, uint64_t index) {
+    uint32_t lo = 0, hi = h->segment_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (h->segments[mid]->first_index <= index) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? lo - 1 : 0;
+}
+
+// --- 崩溃恢复 ---
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * 逐条扫描一个段（最后一个段或没有封存记录的旧段），重建稀疏索引并确定提交末尾。
+ * @return 段内记录全部有效返回 0；遇到损坏或不连续的记录返回 1（段尾被截断）。
+ */
+static int recover_segment(DatabaseHandle *h, LogSegment *seg) {
+    size_t offset = 0;
+    ChatBlockView view;
+    seg->indexed = 1;
+    while (offset < LOG_SEGMENT_SIZE) {
+        size_t used = parse_record(seg->map, offset, LOG_SEGMENT_SIZE, &view);
+        if (used == 0 || view.index != h->next_index) break;
+        if (segment_note_record(seg, view.index, offset) != 0) return -1;
+        seg->block_count++;
+        h->next_index++;
+        offset += used;
+    }
+    seg->tail = offset;
+
+    // 仅当末尾存在非零残留（写了一半的记录）时才截断并重新置零
+    int torn = 0;
+    for (size_t i = offset; i < LOG_SEGMENT_SIZE && i < offset + LOG_HEADER_SIZE; i++) {
+        if (seg->map[i] != 0) { torn = 1; break; }
+    }
+    if (torn) {
+        munmap(seg->map, LOG_SEGMENT_SIZE);
+        seg->map = NULL;
+        if (ftruncate(seg->fd, (off_t)offset) != 0 || ftruncate(seg->fd, LOG_SEGMENT_SIZE) != 0) return -1;
+        fdatasync(seg->fd);
+        if (segment_map(seg) != 0) return -1;
+        return 1;
+    }
+    return 0;
+}
+
+static int recover(DatabaseHandle *h) {
+    DIR *dir = opendir(h->dir);
+    if (!dir) return -1;
+    uint64_t *firsts = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        uint64_t first;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%20" SCNu64 "%7s", &first, suffix) != 2 || strcmp(suffix, LOG_SEGMENT_SUFFIX) != 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *grown = realloc(firsts, cap * sizeof(uint64_t));
+            if (!grown) { free(firsts); closedir(dir); return -1; }
+            firsts = grown;
+        }
+        firsts[count++] = first;
+    }
+    closedir(dir);
+    if (count > 1) qsort(firsts, count, sizeof(uint64_t), compare_u64);
+
+    int rc = 0;
+    size_t i = 0;
+    for (; i < count; i++) {
+        if (firsts[i] != h->next_index) break; // 段之间出现空洞，其后的段全部不可达
+        char path[PATH_MAX];
+        segment_path(h, firsts[i], path, sizeof(path));
+        LogSegment *seg = calloc(1, sizeof(LogSegment));
+        if (!seg) { rc = -1; break; }
+        seg->first_index = firsts[i];
+        seg->fd = open(path, O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if (seg->fd < 0 || fstat(seg->fd, &st) != 0 ||
+            (st.st_size < LOG_SEGMENT_SIZE && ftruncate(seg->fd, LOG_SEGMENT_SIZE) != 0) ||
+            segment_map(seg) != 0 || segments_push(h, seg) != 0) {
+            segment_free(seg);
+            rc = -1;
+            break;
+        }
+        // 封存的段只在与下一个段衔接时才被信任，否则退回完整扫描
+        if (i + 1 < count && segment_read_seal(seg) == 0 && seg->first_index + seg->block_count == firsts[i + 1]) {
+            h->next_index += seg->block_count;
+            continue;
+        }
+        int status = recover_segment(h, seg);
+        if (status < 0) { rc = -1; break; }
+        if (status > 0) { i++; break; }
+    }
+    if (rc == 0 && h->next_index > 0) {
+        // 最后一条记录可能在封存的段里（切换到新段后还没有写入）
+        uint32_t seg_no = segment_find(h, h->next_index - 1);
+        if (segment_index_locked(h->segments[seg_no]) != 0) rc = -1;
+        h->latest_segment = seg_no;
+        h->latest_offset = h->segments[seg_no]->last_offset;
+    }
+    // 损坏点之后的段保留为 .orphan 以便人工排查，不再参与读写
+    for (; rc == 0 && i < count; i++) {
+        char path[PATH_MAX], orphan[PATH_MAX + 8];
+        segment_path(h, firsts[i], path, sizeof(path));
+        snprintf(orphan, sizeof(orphan), "%s.orphan", path);
+        rename(path, orphan);
+    }
+    free(firsts);
+    return rc;
+}
+
+// --- 公共接口 ---
+DatabaseHandle* db_open(const char* db_path) {
+    pthread_once(&crc_once, crc_init_table);
+    if (mkdir(db_path, 0700) != 0 && errno != EEXIST) return NULL;
+    DatabaseHandle *h = calloc(1, sizeof(DatabaseHandle));
+    if (!h) return NULL;
+    snprintf(h->dir, sizeof(h->dir), "%s", db_path);
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->sync_cond, NULL);
+    if (recover(h) != 0) {
+        db_close(h);
+        return NULL;
+    }
+    if (h->segment_count == 0) {
+        LogSegment *seg = segment_create(h, 0);
+        if (!seg || segments_push(h, seg) != 0) {
+            segment_free(seg);
+            db_close(h);
+            return NULL;
+        }
+    }
+    return h;
+}
+
+void db_close(DatabaseHandle* handle) {
+    if (!handle) return;
+    for (uint32_t i = 0; i < handle->segment_count; i++) segment_free(handle->segments[i]);
+    free(handle->segments);
+    pthread_mutex_destroy(&handle->lock);
+    pthread_cond_destroy(&handle->sync_cond);
+    free(handle);
+}
+
+/**
+ * 写入一条记录（调用者持有锁），写满当前段时先将其落盘再切换到新段。
+ */
+static int append_locked(DatabaseHandle *h, const ChatBlock *block) {
+    if (block->index != h->next_index) return -1;
+    if (block->ciphertext_len > 0 && !block->ciphertext) return -1;
+    size_t total = record_size(block->ciphertext_len);
+    if (total > LOG_SEGMENT_DATA || block->ciphertext_len > UINT32_MAX) return -1;
+
+    LogSegment *seg = h->segments[h->segment_count - 1];
+    if (seg->tail + total > LOG_SEGMENT_DATA) {
+        if (segment_seal(seg) != 0 || fdatasync(seg->fd) != 0) return -1;
+        LogSegment *next = segment_create(h, h->next_index);
+        if (!next) return -1;
+        if (segments_push(h, next) != 0) {
+            segment_free(next);
+            return -1;
+        }
+        seg = next;
+    }
+
+    unsigned char head[LOG_HEADER_SIZE + LOG_BODY_FIXED_SIZE];
+    unsigned char *body = head + LOG_HEADER_SIZE;
+    put_u64(body, block->index);
+    put_u64(body + 8, block->timestamp);
+    memcpy(body + 16, block->prev_hash, HASH_BYTES);
+    memcpy(body + 16 + HASH_BYTES, block->sender_pubkey, crypto_box_PUBLICKEYBYTES);
+    memcpy(body + 16 + HASH_BYTES + crypto_box_PUBLICKEYBYTES, block->signature, SIGNATURE_BYTES);
+    put_u32(body + LOG_BODY_FIXED_SIZE - 4, (uint32_t)block->ciphertext_len);
+
+    uint32_t crc = crc32_update(0, body, LOG_BODY_FIXED_SIZE);
+    if (block->ciphertext_len) crc = crc32_update(crc, block->ciphertext, block->ciphertext_len);
+    put_u32(head, LOG_RECORD_MAGIC);
+    put_u32(head + 4, (uint32_t)(LOG_BODY_FIXED_SIZE + block->ciphertext_len));
+    put_u32(head + 8, crc);
+    put_u32(head + 12, 0);
+
+    static const unsigned char padding[LOG_ALIGN] = {0};
+    size_t pad = total - sizeof(head) - block->ciphertext_len;
+    struct iovec iov[3] = {
+        {head, sizeof(head)},
+        {(void*)block->ciphertext, block->ciphertext_len},
+        {(void*)padding, pad},
+    };
+    ssize_t written = pwritev(seg->fd, iov, 3, (off_t)seg->tail);
+    if (written != (ssize_t)total) return -1;
+
+    uint32_t seg_no = h->segment_count - 1;
+    if (segment_note_record(seg, block->index, seg->tail) != 0) return -1;
+    h->latest_segment = seg_no;
+    h->latest_offset = seg->tail;
+    seg->tail += total;
+    seg->block_count++;
+    h->next_index++;
+    h->written_seq++;
+    return 0;
+}
+
+/**
+ * 组提交：等待 seq 之前的写入全部落盘。
+ * 第一个到达的线程作为 leader 释放锁后执行 fdatasync，期间到达的写入者等待同一次同步或下一轮同步。
+ */
+static int wait_durable_locked(DatabaseHandle *h, uint64_t seq) {
+    int rc = 0;
+    while (h->synced_seq < seq) {
+        if (h->sync_in_progress) {
+            pthread_cond_wait(&h->sync_cond, &h->lock);
+            continue;
+        }
+        h->sync_in_progress = 1;
+        uint64_t target = h->written_seq;
+        int fd = h->segments[h->segment_count - 1]->fd;
+        pthread_mutex_unlock(&h->lock);
+        int sync_rc = fdatasync(fd);
+        pthread_mutex_lock(&h->lock);
+        h->sync_in_progress = 0;
+        if (sync_rc == 0 && target > h->synced_seq) h->synced_seq = target;
+        pthread_cond_broadcast(&h->sync_cond);
+        if (sync_rc != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    return rc;
+}
+
+int db_append_blocks(DatabaseHandle* handle, const ChatBlock* blocks, size_t count) {
+    if (!handle || (!blocks && count)) return -1;
+    pthread_mutex_lock(&handle->lock);
+    int rc = 0;
+    for (size_t i = 0; i < count && rc == 0; i++) {
+        rc = append_locked(handle, &blocks[i]);
+    }
+    int sync_rc = wait_durable_locked(handle, handle->written_seq);
+    pthread_mutex_unlock(&handle->lock);
+    return rc != 0 ? rc : sync_rc;
+}
+
+int db_append_block(DatabaseHandle* handle, const ChatBlock* block) {
+    return db_append_blocks(handle, block, block ? 1 : 0);
+}
+
+uint64_t db_get_block_count(DatabaseHandle* handle) {
+    pthread_mutex_lock(&handle->lock);
+    uint64_t count = handle->next_index;
+    pthread_mutex_unlock(&handle->lock);
+    return count;
+}
+
+/**
+ * 通过段的稀疏索引定位 index 之前最近的检查点（调用者持有锁，段已建立索引）。
+ */
+static const SparseEntry* sparse_floor(const LogSegment *seg, uint64_t index) {
+    size_t lo = 0, hi = seg->sparse_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (seg->sparse[mid].index <= index) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? &seg->sparse[lo - 1] : NULL;
+}
+
+int db_cursor_open(DatabaseHandle* handle, uint64_t start_index, uint64_t end_index, DbBlockCursor* cursor) {
+    if (!handle || !cursor || start_index > end_index) return -1;
+    pthread_mutex_lock(&handle->lock);
+    if (start_index >= handle->next_index) {
+        pthread_mutex_unlock(&handle->lock);
+        return -1;
+    }
+    uint32_t seg_no = segment_find(handle, start_index);
+    LogSegment *seg = handle->segments[seg_no];
+    const SparseEntry *floor = segment_index_locked(seg) == 0 ? sparse_floor(seg, start_index) : NULL;
+    if (!floor) {
+        pthread_mutex_unlock(&handle->lock);
+        return -1;
+    }
+    cursor->handle = handle;
+    cursor->map = seg->map;
+    cursor->next_index = floor->index;
+    cursor->end_index = end_index < handle->next_index ? end_index : handle->next_index - 1;
+    cursor->segment = seg_no;
+    cursor->offset = floor->offset;
+    cursor->limit = seg->tail;
+    pthread_mutex_unlock(&handle->lock);
+
+    size_t page_start = cursor->offset & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+    posix_madvise((void*)(seg->map + page_start), cursor->limit - page_start, POSIX_MADV_SEQUENTIAL);
+
+    // 从检查点顺序前进到起始位置
+    ChatBlockView skipped;
+    while (cursor->next_index < start_index) {
+        if (db_cursor_next(cursor, &skipped) != 1) return -1;
+    }
+    return 0;
+}
+
+int db_cursor_next(DbBlockCursor* cursor, ChatBlockView* out) {
+    if (cursor->next_index > cursor->end_index) return 0;
+    if (cursor->offset >= cursor->limit) {
+        // 只有跨越已知末尾时才需要加锁刷新，段内顺序读取完全无锁
+        DatabaseHandle *h = cursor->handle;
+        pthread_mutex_lock(&h->lock);
+        cursor->limit = h->segments[cursor->segment]->tail;
+        if (cursor->offset >= cursor->limit) {
+            if (cursor->segment + 1 >= h->segment_count) {
+                pthread_mutex_unlock(&h->lock);
+                return 0;
+            }
+            LogSegment *seg = h->segments[++cursor->segment];
+            cursor->map = seg->map;
+            cursor->offset = 0;
+            cursor->limit = seg->tail;
+            posix_madvise((void*)seg->map, seg->tail, POSIX_MADV_SEQUENTIAL);
+        }
+        pthread_mutex_unlock(&h->lock);
+    }
+
+    size_t used = parse_record(cursor->map, cursor->offset, cursor->limit, out);
+    if (used == 0 || out->index != cursor->next_index) return -1;
+    cursor->offset += used;
+    cursor->next_index++;
+    return 1;
+}
+
+int db_get_block_by_index(DatabaseHandle* handle, uint64_t index, ChatBlockView* out) {
+    DbBlockCursor cursor;
+    if (db_cursor_open(handle, index, index, &cursor) != 0) return -1;
+    return db_cursor_next(&cursor, out) == 1 ? 0 : -1;
+}
+
+int db_get_latest_block(DatabaseHandle* handle, ChatBlockView* out) {
+    if (!handle || !out) return -1;
+    pthread_mutex_lock(&handle->lock);
+    if (handle->next_index == 0) {
+        pthread_mutex_unlock(&handle->lock);
+        return -1;
+    }
+    LogSegment *seg = handle->segments[handle->latest_segment];
+    size_t offset = handle->latest_offset;
+    size_t limit = seg->tail;
+    pthread_mutex_unlock(&handle->lock);
+    return parse_record(seg->map, offset, limit, out) ? 0 : -1;
+}
+
+int db_get_blocks_in_range(DatabaseHandle* handle, uint64_t start_index, uint64_t end_index, db_block_visitor visit, void* ctx, uint64_t* count_out) {
+    if (count_out) *count_out = 0;
+    if (!visit) return -1;
+    DbBlockCursor cursor;
+    if (db_cursor_open(handle, start_index, end_index, &cursor) != 0) {
+        return (handle && start_index <= end_index && start_index >= db_get_block_count(handle)) ? 0 : -1;
+    }
+    ChatBlockView view;
+    int status;
+    while ((status = db_cursor_next(&cursor, &view)) == 1) {
+        if (count_out) (*count_out)++;
+        if (visit(&view, ctx) != 0) break;
+    }
+    return status < 0 ? -1 : 0;
+}
@@ -0,0 +1,181 @@
+#include "uid_filter.h"
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/**
+ * @file uid_filter.c
+ * @brief UID 布隆过滤器及其持久化。
+ *
+ * 文件格式（小端）:
+ *   [magic "ZLUF"][version u32][hashes u32][bits_log2 u32][count u64][capacity u64][mark i64][checksum 16B]
+ *   [位数组]
+ * checksum 为 BLAKE2b-128(头部中 checksum 之前的字段 || 位数组)。
+ */
+
+#define UID_FILTER_MAGIC "ZLUF"
+#define UID_FILTER_VERSION 1
+#define UID_FILTER_HEADER_SIZE 60
+#define UID_FILTER_CHECKSUM_OFFSET 44
+#define UID_FILTER_MIN_BITS_LOG2 16
+#define UID_FILTER_MAX_BITS_LOG2 36
+
+struct UidFilter {
+    unsigned char *bits;
+    uint32_t bits_log2;
+    uint64_t count;
+    uint64_t capacity;
+    int64_t mark;
+};
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static size_t filter_bytes(uint32_t bits_log2) {
+    return (size_t)1 << (bits_log2 - 3);
+}
+
+static UidFilter* filter_alloc(uint32_t bits_log2) {
+    UidFilter *filter = calloc(1, sizeof(UidFilter));
+    if (!filter) return NULL;
+    filter->bits = calloc(1, filter_bytes(bits_log2));
+    if (!filter->bits) {
+        free(filter);
+        return NULL;
+    }
+    filter->bits_log2 = bits_log2;
+    return filter;
+}
+
+UidFilter* uid_filter_create(uint64_t capacity) {
+    uint32_t bits_log2 = UID_FILTER_MIN_BITS_LOG2;
+    while (bits_log2 < UID_FILTER_MAX_BITS_LOG2 && (1ULL << bits_log2) < capacity * UID_FILTER_BITS_PER_ITEM) bits_log2++;
+    UidFilter *filter = filter_alloc(bits_log2);
+    if (filter) filter->capacity = (1ULL << bits_log2) / UID_FILTER_BITS_PER_ITEM;
+    return filter;
+}
+
+void uid_filter_destroy(UidFilter* filter) {
+    if (!filter) return;
+    free(filter->bits);
+    free(filter);
+}
+
+// 双重哈希: 第 i 个位置为 (a + i * b) mod m，b 取奇数保证各位置互不相同
+static uint64_t bit_position(const UidFilter* filter, uint64_t hash, uint64_t i) {
+    uint64_t step = ((hash >> 33) | (hash << 31)) | 1;
+    return (hash + i * step) & ((1ULL << filter->bits_log2) - 1);
+}
+
+void uid_filter_add(UidFilter* filter, uint64_t hash) {
+    for (uint64_t i = 0; i < UID_FILTER_HASHES; i++) {
+        uint64_t pos = bit_position(filter, hash, i);
+        filter->bits[pos >> 3] |= (unsigned char)(1u << (pos & 7));
+    }
+    filter->count++;
+}
+
+int uid_filter_maybe_contains(const UidFilter* filter, uint64_t hash) {
+    for (uint64_t i = 0; i < UID_FILTER_HASHES; i++) {
+        uint64_t pos = bit_position(filter, hash, i);
+        if (!(filter->bits[pos >> 3] & (1u << (pos & 7)))) return 0;
+    }
+    return 1;
+}
+
+uint64_t uid_filter_count(const UidFilter* filter) { return filter->count; }
+uint64_t uid_filter_capacity(const UidFilter* filter) { return filter->capacity; }
+int64_t uid_filter_get_mark(const UidFilter* filter) { return filter->mark; }
+void uid_filter_set_mark(UidFilter* filter, int64_t mark) { filter->mark = mark; }
+
+static void filter_checksum(const unsigned char *header, const UidFilter *filter, unsigned char out[16]) {
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, NULL, 0, 16);
+    crypto_generichash_update(&state, header, UID_FILTER_CHECKSUM_OFFSET);
+    crypto_generichash_update(&state, filter->bits, filter_bytes(filter->bits_log2));
+    crypto_generichash_final(&state, out, 16);
+}
+
+int uid_filter_save(const UidFilter* filter, const char* path) {
+    unsigned char header[UID_FILTER_HEADER_SIZE] = {0};
+    memcpy(header, UID_FILTER_MAGIC, 4);
+    put_u32(header + 4, UID_FILTER_VERSION);
+    put_u32(header + 8, UID_FILTER_HASHES);
+    put_u32(header + 12, filter->bits_log2);
+    put_u64(header + 16, filter->count);
+    put_u64(header + 24, filter->capacity);
+    put_u64(header + 32, (uint64_t)filter->mark);
+    filter_checksum(header, filter, header + UID_FILTER_CHECKSUM_OFFSET);
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    size_t len = filter_bytes(filter->bits_log2);
+    int ok = write(fd, header, sizeof(header)) == (ssize_t)sizeof(header);
+    for (size_t off = 0; ok && off < len;) {
+        ssize_t n = write(fd, filter->bits + off, len - off);
+        if (n <= 0) ok = 0;
+        else off += (size_t)n;
+    }
+    ok = ok && fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+UidFilter* uid_filter_load(const char* path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    unsigned char header[UID_FILTER_HEADER_SIZE];
+    UidFilter *filter = NULL;
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, UID_FILTER_MAGIC, 4) != 0 ||
+        get_u32(header + 4) != UID_FILTER_VERSION || get_u32(header + 8) != UID_FILTER_HASHES) {
+        fclose(fp);
+        return NULL;
+    }
+    uint32_t bits_log2 = get_u32(header + 12);
+    if (bits_log2 < UID_FILTER_MIN_BITS_LOG2 || bits_log2 > UID_FILTER_MAX_BITS_LOG2 || !(filter = filter_alloc(bits_log2))) {
+        fclose(fp);
+        return NULL;
+    }
+    filter->count = get_u64(header + 16);
+    filter->capacity = get_u64(header + 24);
+    filter->mark = (int64_t)get_u64(header + 32);
+    unsigned char checksum[16];
+    int ok = fread(filter->bits, 1, filter_bytes(bits_log2), fp) == filter_bytes(bits_log2);
+    fclose(fp);
+    if (ok) {
+        filter_checksum(header, filter, checksum);
+        ok = sodium_memcmp(checksum, header + UID_FILTER_CHECKSUM_OFFSET, sizeof(checksum)) == 0;
+    }
+    if (!ok) {
+        uid_filter_destroy(filter);
+        return NULL;
+    }
+    return filter;
+}
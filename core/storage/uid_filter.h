@@ -0,0 +1,72 @@
+#ifndef ZEROLINK_UID_FILTER_H
+#define ZEROLINK_UID_FILTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @file uid_filter.h
+ * @brief 消息 UID 的布隆过滤器，用于在写数据库之前快速判定“肯定没见过”。
+ *
+ * 过滤器只接受一个 64 位的 UID 哈希（调用者已为同步索引计算过），
+ * 位数组大小为 2 的幂，按 UID_FILTER_BITS_PER_ITEM 位/元素配置，假阳性率约为 1e-5。
+ * 可以连同一个调用者自定义的水位值（例如已收录的最大行号）一起持久化到文件，
+ * 文件带校验和，损坏或版本不符时加载失败，由调用者重建。
+ *
+ * 过滤器本身不加锁，由调用者保证并发安全。
+ */
+
+#define UID_FILTER_BITS_PER_ITEM 24
+#define UID_FILTER_HASHES 16
+
+typedef struct UidFilter UidFilter;
+
+/**
+ * @brief 创建一个空过滤器。
+ * @param capacity 预期元素数，位数组会向上取整到 2 的幂。
+ * @return 成功返回过滤器，内存不足返回 NULL。
+ */
+UidFilter* uid_filter_create(uint64_t capacity);
+
+/**
+ * @brief 从文件加载过滤器。
+ * @return 成功返回过滤器；文件不存在、损坏或格式不符时返回 NULL。
+ */
+UidFilter* uid_filter_load(const char* path);
+
+/**
+ * @brief 原子地把过滤器写入文件（临时文件 + fdatasync + rename）。
+ * @return 成功返回 0，失败返回 -1。
+ */
+int uid_filter_save(const UidFilter* filter, const char* path);
+
+void uid_filter_destroy(UidFilter* filter);
+
+/**
+ * @brief 加入一个 UID 哈希。
+ */
+void uid_filter_add(UidFilter* filter, uint64_t hash);
+
+/**
+ * @brief 查询一个 UID 哈希。
+ * @return 返回 0 表示肯定不存在；返回 1 表示可能存在。
+ */
+int uid_filter_maybe_contains(const UidFilter* filter, uint64_t hash);
+
+/**
+ * @brief 已加入的元素数（重复加入会重复计数）。
+ */
+uint64_t uid_filter_count(const UidFilter* filter);
+
+/**
+ * @brief 过滤器的设计容量；元素数超过容量后假阳性率会快速上升，调用者应重建更大的过滤器。
+ */
+uint64_t uid_filter_capacity(const UidFilter* filter);
+
+/**
+ * @brief 读取/设置随过滤器一起持久化的水位值。
+ */
+int64_t uid_filter_get_mark(const UidFilter* filter);
+void uid_filter_set_mark(UidFilter* filter, int64_t mark);
+
+#endif //ZEROLINK_UID_FILTER_H
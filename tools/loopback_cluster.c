@@ -0,0 +1,674 @@
+/**
+ * @file loopback_cluster.c
+ * @brief 回环集群测试：在本机启动引导服务器和 N 个无界面客户端（各自的 P2P 端口与数据目录），
+ *        通过控制套接字互加好友、按给定速率收发消息，并轮流让一个客户端下线、错过一批消息后重新上线。
+ *
+ * 报告：
+ *   - 发送到落盘的延迟 p50/p99/最大值：从向发送方下达 send 到接收方推送该会话的新消息事件为止
+ *     （事件之后用 history 确认消息内容，重新上线时先补读一遍，这部分按补读的时刻计）
+ *   - 下线期间错过的消息在重新上线后全部同步完成的时间（从重新启动进程算起）
+ *   - 每条送达的消息在链路上的平均字节数（所有客户端发送字节之和，包括握手、同步与重传）
+ *   - 每个客户端进程的 CPU 时间和内存占用（当前 RSS 与峰值）
+ *
+ * 用法: loopback_cluster [--clients 4] [--messages 400] [--rate 100] [--churn 3] [--offline-messages 40]
+ *                        [--bin 程序目录] [--dir 工作目录] [--port 46000] [--seed 1] [--json 结果文件] [--keep]
+ * --bin 为 server 与 client 所在的目录，默认为本程序所在目录；客户端使用 --port 之后的连续端口。
+ */
+#define _GNU_SOURCE
+#include <cjson/cJSON.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define MAX_NODES 16          // 无界面模式最多接受 16 个控制连接，全连通时每个客户端最多 15 个好友
+#define CALL_TIMEOUT_MS 10000
+#define START_TIMEOUT_MS 10000
+#define MESH_TIMEOUT_MS 30000
+#define DELIVER_TIMEOUT_MS 60000
+#define HISTORY_PAGE 1000
+#define MARKER "zl#"
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len, cap;
+} conn_t;
+
+typedef struct {
+    char name[16];
+    char dir[PATH_MAX];
+    char sock[PATH_MAX];
+    int p2p_port;
+    char pk[65];
+    pid_t pid;
+    conn_t ctl;                      // 请求与应答
+    conn_t ev;                       // 订阅的事件
+    long long cursor[MAX_NODES];     // 与每个好友的会话已读到的行号
+    // 跨多次启动累计
+    double tx, rx;
+    double cpu_s;
+    long rss_kb, hwm_kb;
+    int restarts;
+} node_t;
+
+typedef struct {
+    int from, to;
+    int offline;                     // 接收方下线期间发出
+    uint64_t sent_ns, delivered_ns;  // delivered_ns 为 0 表示尚未送达
+} msg_t;
+
+static struct {
+    int clients, messages, rate, churn, offline_messages, port, keep;
+    unsigned seed;
+    const char *json_path;
+    char bin[PATH_MAX];
+    char dir[PATH_MAX];
+} opt = { .clients = 4, .messages = 400, .rate = 100, .churn = 3, .offline_messages = 40, .port = 46000, .seed = 1 };
+
+static node_t nodes[MAX_NODES];
+static pid_t server_pid = -1;
+static msg_t *msgs = NULL;
+static int msg_count = 0, msg_cap = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void kill_children() {
+    for (int i = 0; i < opt.clients; i++) {
+        if (nodes[i].pid > 0) kill(nodes[i].pid, SIGKILL);
+    }
+    if (server_pid > 0) kill(server_pid, SIGKILL);
+}
+
+static void die(const char* what) {
+    fprintf(stderr, "[集群] 错误: %s\n", what);
+    kill_children();
+    exit(1);
+}
+
+// --- 按行读写控制连接 ---
+static int conn_fill(conn_t* c) {
+    if (c->cap - c->len < 4096) {
+        size_t cap = c->cap ? c->cap * 2 : 65536;
+        char *buf = realloc(c->buf, cap);
+        if (!buf) return -1;
+        c->buf = buf;
+        c->cap = cap;
+    }
+    ssize_t n = recv(c->fd, c->buf + c->len, c->cap - c->len, MSG_DONTWAIT);
+    if (n == 0) return -1;
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    c->len += (size_t)n;
+    return 0;
+}
+
+/**
+ * 取出一行完整的 JSON 并解析，没有完整的行时返回 NULL。
+ */
+static cJSON* conn_take(conn_t* c) {
+    char *nl = c->len ? memchr(c->buf, '\n', c->len) : NULL;
+    if (!nl) return NULL;
+    *nl = '\0';
+    cJSON *json = cJSON_Parse(c->buf);
+    size_t used = (size_t)(nl - c->buf) + 1;
+    memmove(c->buf, c->buf + used, c->len - used);
+    c->len -= used;
+    return json ? json : cJSON_CreateObject();
+}
+
+static void conn_close(conn_t* c) {
+    if (c->fd >= 0) close(c->fd);
+    free(c->buf);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static int conn_send(conn_t* c, cJSON* req) {
+    char *text = cJSON_PrintUnformatted(req);
+    if (!text) return -1;
+    size_t len = strlen(text);
+    text[len] = '\n'; // cJSON 的结尾 '\0' 换成换行，只发 len + 1 字节
+    const char *p = text;
+    size_t left = len + 1;
+    while (left > 0) {
+        ssize_t n = send(c->fd, p, left, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            free(text);
+            return -1;
+        }
+        p += n;
+        left -= (size_t)n;
+    }
+    free(text);
+    return 0;
+}
+
+/**
+ * 发出请求并等待应答（控制连接不订阅事件，收到的下一行就是应答）。
+ * @return 应答，超时或连接断开返回 NULL。
+ */
+static cJSON* call(node_t* n, cJSON* req) {
+    int rc = conn_send(&n->ctl, req);
+    cJSON_Delete(req);
+    if (rc != 0) return NULL;
+    uint64_t deadline = now_ns() + CALL_TIMEOUT_MS * 1000000ULL;
+    while (1) {
+        cJSON *reply = conn_take(&n->ctl);
+        if (reply) return reply;
+        uint64_t now = now_ns();
+        if (now >= deadline) return NULL;
+        struct pollfd pfd = { .fd = n->ctl.fd, .events = POLLIN };
+        if (poll(&pfd, 1, (int)((deadline - now) / 1000000) + 1) < 0 && errno != EINTR) return NULL;
+        if ((pfd.revents & (POLLIN | POLLHUP)) && conn_fill(&n->ctl) != 0) return NULL;
+    }
+}
+
+static cJSON* make_cmd(const char* cmd) {
+    cJSON *req = cJSON_CreateObject();
+    cJSON_AddStringToObject(req, "cmd", cmd);
+    return req;
+}
+
+static int reply_ok(cJSON* reply) {
+    return reply && cJSON_IsTrue(cJSON_GetObjectItem(reply, "ok"));
+}
+
+static double reply_number(cJSON* reply, const char* key) {
+    cJSON *item = cJSON_GetObjectItem(reply, key);
+    return cJSON_IsNumber(item) ? item->valuedouble : 0;
+}
+
+// --- 进程管理 ---
+static pid_t spawn(char* const argv[], const char* log_path) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    int log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (log_fd >= 0) {
+        dup2(log_fd, STDOUT_FILENO);
+        dup2(log_fd, STDERR_FILENO);
+    }
+    if (null_fd >= 0) dup2(null_fd, STDIN_FILENO);
+    execv(argv[0], argv);
+    fprintf(stderr, "无法启动 %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+}
+
+static int wait_exit(pid_t pid, int timeout_ms) {
+    for (int waited = 0; waited < timeout_ms; waited += 20) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) return 0;
+        usleep(20000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/**
+ * 读取进程累计的 CPU 时间与当前/峰值常驻内存。
+ */
+static void sample_proc(pid_t pid, double* cpu_s, long* rss_kb, long* hwm_kb) {
+    char path[64], buf[4096];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+        buf[n] = '\0';
+        fclose(fp);
+        // 进程名可能含空格，从最后一个 ')' 之后数字段：第 3 个字段是状态，utime 与 stime 是第 14、15 个
+        char *p = strrchr(buf, ')');
+        unsigned long utime = 0, stime = 0;
+        if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2) {
+            *cpu_s = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+    }
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    fp = fopen(path, "r");
+    if (!fp) return;
+    while (fgets(buf, sizeof(buf), fp)) {
+        sscanf(buf, "VmRSS: %ld", rss_kb);
+        sscanf(buf, "VmHWM: %ld", hwm_kb);
+    }
+    fclose(fp);
+}
+
+static int connect_unix(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void read_chat(int i, int j, uint64_t at);
+
+/**
+ * 启动客户端，等控制套接字可连接后建立请求连接与事件订阅。
+ */
+static void node_start(int i) {
+    node_t *n = &nodes[i];
+    char client_path[PATH_MAX + 8], server_port[16], p2p_port[16], log_path[PATH_MAX + 16];
+    snprintf(client_path, sizeof(client_path), "%s/client", opt.bin);
+    snprintf(server_port, sizeof(server_port), "%d", opt.port);
+    snprintf(p2p_port, sizeof(p2p_port), "%d", n->p2p_port);
+    snprintf(log_path, sizeof(log_path), "%s/client.log", n->dir);
+    char *argv[] = { client_path, "--data", n->dir, "--headless", n->sock, "127.0.0.1", server_port, p2p_port, NULL };
+    n->pid = spawn(argv, log_path);
+    if (n->pid < 0) die("fork 失败");
+
+    uint64_t deadline = now_ns() + START_TIMEOUT_MS * 1000000ULL;
+    while ((n->ctl.fd = connect_unix(n->sock)) < 0) {
+        if (waitpid(n->pid, NULL, WNOHANG) == n->pid) {
+            n->pid = -1;
+            fprintf(stderr, "[集群] %s 启动失败，见 %s\n", n->name, log_path);
+            die("客户端启动失败");
+        }
+        if (now_ns() > deadline) die("等待控制套接字超时");
+        usleep(20000);
+    }
+    n->ev.fd = connect_unix(n->sock);
+    if (n->ev.fd < 0 || conn_send(&n->ev, make_cmd("subscribe")) != 0) die("无法订阅事件");
+    cJSON *reply = call(n, make_cmd("status"));
+    cJSON *pk = reply_ok(reply) ? cJSON_GetObjectItem(reply, "pk") : NULL;
+    if (!cJSON_IsString(pk)) die("status 请求失败");
+    snprintf(n->pk, sizeof(n->pk), "%s", pk->valuestring);
+    cJSON_Delete(reply);
+    // 订阅之前可能已经同步进来了消息，先补读一遍
+    uint64_t now = now_ns();
+    for (int j = 0; j < opt.clients; j++) {
+        if (j != i && n->restarts > 0) read_chat(i, j, now);
+    }
+    n->restarts++;
+}
+
+/**
+ * 记下链路字节数与进程资源后让客户端正常退出。
+ */
+static void node_stop(int i) {
+    node_t *n = &nodes[i];
+    cJSON *reply = call(n, make_cmd("status"));
+    if (reply_ok(reply)) {
+        n->tx += reply_number(reply, "tx_bytes");
+        n->rx += reply_number(reply, "rx_bytes");
+    }
+    cJSON_Delete(reply);
+    double cpu_s = 0;
+    long hwm_kb = 0;
+    sample_proc(n->pid, &cpu_s, &n->rss_kb, &hwm_kb);
+    n->cpu_s += cpu_s;
+    if (hwm_kb > n->hwm_kb) n->hwm_kb = hwm_kb;
+
+    cJSON_Delete(call(n, make_cmd("shutdown")));
+    conn_close(&n->ctl);
+    conn_close(&n->ev);
+    if (wait_exit(n->pid, START_TIMEOUT_MS) != 0) fprintf(stderr, "[集群] %s 未能正常退出，已强制结束。\n", n->name);
+    n->pid = -1;
+}
+
+// --- 消息与送达 ---
+static void read_chat(int i, int j, uint64_t at) {
+    node_t *n = &nodes[i];
+    int got;
+    do {
+        cJSON *req = make_cmd("history");
+        cJSON_AddStringToObject(req, "chat", nodes[j].name);
+        cJSON_AddNumberToObject(req, "after", (double)n->cursor[j]);
+        cJSON_AddNumberToObject(req, "limit", HISTORY_PAGE);
+        cJSON *reply = call(n, req);
+        if (!reply_ok(reply)) {
+            cJSON_Delete(reply);
+            return;
+        }
+        cJSON *list = cJSON_GetObjectItem(reply, "messages"), *item;
+        got = cJSON_GetArraySize(list);
+        cJSON_ArrayForEach(item, list) {
+            n->cursor[j] = (long long)reply_number(item, "id");
+            cJSON *line = cJSON_GetObjectItem(item, "line");
+            const char *mark = cJSON_IsString(line) ? strstr(line->valuestring, MARKER) : NULL;
+            if (!mark) continue;
+            long seq = strtol(mark + strlen(MARKER), NULL, 10);
+            // 自己发出的消息也在这个会话里，只认发给自己的
+            if (seq < 0 || seq >= msg_count || msgs[seq].to != i || msgs[seq].delivered_ns) continue;
+            msgs[seq].delivered_ns = at;
+        }
+        cJSON_Delete(reply);
+    } while (got == HISTORY_PAGE);
+}
+
+static void handle_event(int i, cJSON* event, uint64_t at) {
+    cJSON *type = cJSON_GetObjectItem(event, "event");
+    if (!cJSON_IsString(type)) return; // subscribe 的应答
+    if (strcmp(type->valuestring, "chat") == 0) {
+        cJSON *chat = cJSON_GetObjectItem(event, "chat");
+        if (!cJSON_IsString(chat)) return;
+        for (int j = 0; j < opt.clients; j++) {
+            if (j != i && strcmp(nodes[j].name, chat->valuestring) == 0) read_chat(i, j, at);
+        }
+    } else if (strcmp(type->valuestring, "dropped") == 0) {
+        for (int j = 0; j < opt.clients; j++) {
+            if (j != i) read_chat(i, j, at);
+        }
+    }
+}
+
+/**
+ * 处理各客户端推送的事件，直到 deadline。
+ */
+static void pump(uint64_t deadline) {
+    struct pollfd fds[MAX_NODES];
+    int index[MAX_NODES];
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= deadline) return;
+        int nfds = 0;
+        for (int i = 0; i < opt.clients; i++) {
+            if (nodes[i].pid <= 0) continue;
+            index[nfds] = i;
+            fds[nfds++] = (struct pollfd){ .fd = nodes[i].ev.fd, .events = POLLIN };
+        }
+        int timeout = (int)((deadline - now + 999999) / 1000000);
+        if (poll(fds, nfds, timeout) <= 0) continue;
+        uint64_t at = now_ns();
+        for (int k = 0; k < nfds; k++) {
+            if (!(fds[k].revents & (POLLIN | POLLHUP))) continue;
+            node_t *n = &nodes[index[k]];
+            if (conn_fill(&n->ev) != 0) die("事件连接断开");
+            cJSON *event;
+            while ((event = conn_take(&n->ev)) != NULL) {
+                handle_event(index[k], event, at);
+                cJSON_Delete(event);
+            }
+        }
+    }
+}
+
+static void send_message(int from, int to, int offline) {
+    if (msg_count == msg_cap) {
+        msg_cap = msg_cap ? msg_cap * 2 : 1024;
+        msgs = realloc(msgs, sizeof(msg_t) * (size_t)msg_cap);
+        if (!msgs) die("内存不足");
+    }
+    int seq = msg_count++;
+    msgs[seq] = (msg_t){ .from = from, .to = to, .offline = offline, .sent_ns = now_ns() };
+    char text[128];
+    snprintf(text, sizeof(text), MARKER "%d# 回环测试消息 from %s", seq, nodes[from].name);
+    cJSON *req = make_cmd("send");
+    cJSON_AddStringToObject(req, "to", nodes[to].name);
+    cJSON_AddStringToObject(req, "text", text);
+    cJSON *reply = call(&nodes[from], req);
+    if (!reply_ok(reply)) die("send 请求失败");
+    cJSON_Delete(reply);
+}
+
+static int pending(int offline_only) {
+    int count = 0;
+    for (int k = 0; k < msg_count; k++) {
+        if (!msgs[k].delivered_ns && (!offline_only || msgs[k].offline)) count++;
+    }
+    return count;
+}
+
+/**
+ * 等到所有消息送达或超时，返回最后一条送达的时刻。
+ */
+static uint64_t wait_delivered(int offline_only, int timeout_ms) {
+    uint64_t deadline = now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+    while (pending(offline_only) > 0 && now_ns() < deadline) pump(now_ns() + 50000000ULL);
+    uint64_t last = 0;
+    for (int k = 0; k < msg_count; k++) {
+        if (msgs[k].delivered_ns > last) last = msgs[k].delivered_ns;
+    }
+    return last;
+}
+
+static int online_count(int i) {
+    cJSON *reply = call(&nodes[i], make_cmd("status"));
+    int online = reply_ok(reply) ? (int)reply_number(reply, "online") : -1;
+    cJSON_Delete(reply);
+    return online;
+}
+
+static int wait_mesh(int timeout_ms) {
+    uint64_t deadline = now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+    while (now_ns() < deadline) {
+        int ready = 1;
+        for (int i = 0; i < opt.clients && ready; i++) ready = online_count(i) >= opt.clients - 1;
+        if (ready) return 0;
+        pump(now_ns() + 100000000ULL);
+    }
+    return -1;
+}
+
+// --- 统计与输出 ---
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double* sorted, int n, double p) {
+    if (n == 0) return 0;
+    int k = (int)(p * (n - 1) + 0.5);
+    return sorted[k];
+}
+
+static int remove_entry(const char* path, const struct stat* sb, int flag, struct FTW* ftw) {
+    (void)sb;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) opt.clients = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) opt.messages = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) opt.rate = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--churn") == 0 && i + 1 < argc) opt.churn = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--offline-messages") == 0 && i + 1 < argc) opt.offline_messages = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) opt.port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) opt.seed = (unsigned)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--bin") == 0 && i + 1 < argc) snprintf(opt.bin, sizeof(opt.bin), "%s", argv[++i]);
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) snprintf(opt.dir, sizeof(opt.dir), "%s", argv[++i]);
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) opt.json_path = argv[++i];
+        else if (strcmp(argv[i], "--keep") == 0) opt.keep = 1;
+        else {
+            fprintf(stderr, "用法: %s [--clients 4] [--messages 400] [--rate 100] [--churn 3] [--offline-messages 40] "
+                            "[--bin 程序目录] [--dir 工作目录] [--port 46000] [--seed 1] [--json 结果文件] [--keep]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (opt.clients < 2 || opt.clients > MAX_NODES) {
+        fprintf(stderr, "客户端数应在 2 到 %d 之间。\n", MAX_NODES);
+        return 1;
+    }
+    if (opt.rate < 1) opt.rate = 1;
+    if (!opt.bin[0]) {
+        char exe[PATH_MAX];
+        ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        if (len < 0) die("无法确定程序目录，请用 --bin 指定");
+        exe[len] = '\0';
+        snprintf(opt.bin, sizeof(opt.bin), "%s", dirname(exe));
+    }
+    if (!opt.dir[0]) {
+        snprintf(opt.dir, sizeof(opt.dir), "/tmp/zerolink_cluster.XXXXXX");
+        if (!mkdtemp(opt.dir)) die("无法创建工作目录");
+    } else if (mkdir(opt.dir, 0700) != 0 && errno != EEXIST) {
+        die("无法创建工作目录");
+    }
+    signal(SIGPIPE, SIG_IGN);
+    srand(opt.seed);
+
+    // 1. 引导服务器
+    char server_path[PATH_MAX + 8], server_port[16], log_path[PATH_MAX + 16];
+    snprintf(server_path, sizeof(server_path), "%s/server", opt.bin);
+    snprintf(server_port, sizeof(server_port), "%d", opt.port);
+    snprintf(log_path, sizeof(log_path), "%s/server.log", opt.dir);
+    char *server_argv[] = { server_path, server_port, NULL };
+    server_pid = spawn(server_argv, log_path);
+    usleep(200000);
+    if (server_pid < 0 || waitpid(server_pid, NULL, WNOHANG) == server_pid) die("引导服务器启动失败");
+
+    // 2. 第一次启动生成身份并互加好友；引导服务器只在上线时通告地址，所以全部重启一次后才会互相连接
+    for (int i = 0; i < opt.clients; i++) {
+        node_t *n = &nodes[i];
+        snprintf(n->name, sizeof(n->name), "c%d", i);
+        snprintf(n->dir, sizeof(n->dir), "%s/%s", opt.dir, n->name);
+        snprintf(n->sock, sizeof(n->sock), "%s/control.sock", n->dir);
+        n->p2p_port = opt.port + 1 + i;
+        n->ctl.fd = n->ev.fd = -1;
+        if (mkdir(n->dir, 0700) != 0 && errno != EEXIST) die("无法创建数据目录");
+        node_start(i);
+    }
+    for (int i = 0; i < opt.clients; i++) {
+        for (int j = 0; j < opt.clients; j++) {
+            if (i == j) continue;
+            cJSON *req = make_cmd("add_friend");
+            cJSON_AddStringToObject(req, "pk", nodes[j].pk);
+            cJSON_AddStringToObject(req, "name", nodes[j].name);
+            cJSON *reply = call(&nodes[i], req);
+            if (!reply_ok(reply)) die("add_friend 请求失败");
+            cJSON_Delete(reply);
+        }
+    }
+    for (int i = 0; i < opt.clients; i++) node_stop(i);
+    for (int i = 0; i < opt.clients; i++) {
+        nodes[i].tx = nodes[i].rx = nodes[i].cpu_s = 0;
+        nodes[i].hwm_kb = 0;
+    }
+    uint64_t mesh_start = now_ns();
+    for (int i = 0; i < opt.clients; i++) node_start(i);
+    if (wait_mesh(MESH_TIMEOUT_MS) != 0) die("客户端未能全部互连");
+    double mesh_ms = (now_ns() - mesh_start) / 1e6;
+    fprintf(stderr, "[集群] %d 个客户端已全部互连，用时 %.0f ms\n", opt.clients, mesh_ms);
+
+    // 3. 在线收发：按速率随机挑选收发双方
+    uint64_t interval = 1000000000ULL / (uint64_t)opt.rate, next = now_ns();
+    for (int k = 0; k < opt.messages; k++) {
+        int from = rand() % opt.clients, to = rand() % (opt.clients - 1);
+        if (to >= from) to++;
+        pump(next);
+        send_message(from, to, 0);
+        next += interval;
+    }
+    wait_delivered(0, DELIVER_TIMEOUT_MS);
+    int online_sent = msg_count;
+
+    // 4. 下线与重连：下线期间其余客户端给它发消息，重新上线后靠同步补齐
+    double converge_ms[64];
+    int rounds = opt.churn > 64 ? 64 : opt.churn, converged = 0;
+    for (int r = 0; r < rounds; r++) {
+        int victim = rand() % opt.clients;
+        node_stop(victim);
+        for (int k = 0; k < opt.offline_messages; k++) {
+            int from = rand() % (opt.clients - 1);
+            if (from >= victim) from++;
+            send_message(from, victim, 1);
+        }
+        uint64_t restart = now_ns();
+        node_start(victim);
+        uint64_t last = wait_delivered(1, DELIVER_TIMEOUT_MS);
+        if (pending(1) == 0) {
+            converge_ms[converged++] = last > restart ? (last - restart) / 1e6 : 0;
+            fprintf(stderr, "[集群] 第 %d 轮: %s 重新上线后 %.0f ms 补齐 %d 条消息\n", r + 1, nodes[victim].name,
+                    converge_ms[converged - 1], opt.offline_messages);
+        } else {
+            fprintf(stderr, "[集群] 第 %d 轮: %s 重新上线后 %d 秒内仍缺 %d 条消息\n", r + 1, nodes[victim].name,
+                    DELIVER_TIMEOUT_MS / 1000, pending(1));
+        }
+        if (wait_mesh(MESH_TIMEOUT_MS) != 0) fprintf(stderr, "[集群] 第 %d 轮之后未能恢复全部互连\n", r + 1);
+    }
+
+    // 5. 汇总
+    for (int i = 0; i < opt.clients; i++) node_stop(i);
+    kill(server_pid, SIGTERM);
+    wait_exit(server_pid, 2000);
+    server_pid = -1;
+
+    double *latency = malloc(sizeof(double) * (size_t)(online_sent + 1));
+    int delivered = 0, online_delivered = 0;
+    for (int k = 0; k < msg_count; k++) {
+        if (!msgs[k].delivered_ns) continue;
+        delivered++;
+        if (msgs[k].offline) continue;
+        latency[online_delivered++] = (msgs[k].delivered_ns - msgs[k].sent_ns) / 1e6;
+    }
+    qsort(latency, (size_t)online_delivered, sizeof(double), compare_double);
+    qsort(converge_ms, (size_t)converged, sizeof(double), compare_double);
+    double tx = 0;
+    for (int i = 0; i < opt.clients; i++) tx += nodes[i].tx;
+    double bytes_per_msg = delivered ? tx / delivered : 0;
+
+    printf("客户端 %d  消息 %d（在线 %d，下线期间 %d）  送达 %d  丢失 %d\n", opt.clients, msg_count, online_sent,
+           msg_count - online_sent, delivered, msg_count - delivered);
+    printf("发送到落盘延迟 (ms): p50 %.1f  p99 %.1f  最大 %.1f\n", percentile(latency, online_delivered, 0.5),
+           percentile(latency, online_delivered, 0.99), online_delivered ? latency[online_delivered - 1] : 0);
+    printf("重新上线后补齐 (ms): %d/%d 轮完成  p50 %.0f  最大 %.0f\n", converged, rounds,
+           percentile(converge_ms, converged, 0.5), converged ? converge_ms[converged - 1] : 0);
+    printf("链路字节/送达消息: %.0f\n", bytes_per_msg);
+    printf("%-6s %10s %10s %10s %12s %12s\n", "节点", "CPU(s)", "RSS(KB)", "峰值(KB)", "发送(B)", "接收(B)");
+    for (int i = 0; i < opt.clients; i++) {
+        node_t *n = &nodes[i];
+        printf("%-6s %10.2f %10ld %10ld %12.0f %12.0f\n", n->name, n->cpu_s, n->rss_kb, n->hwm_kb, n->tx, n->rx);
+    }
+
+    if (opt.json_path) {
+        cJSON *out = cJSON_CreateObject();
+        cJSON_AddNumberToObject(out, "clients", opt.clients);
+        cJSON_AddNumberToObject(out, "messages", msg_count);
+        cJSON_AddNumberToObject(out, "delivered", delivered);
+        cJSON_AddNumberToObject(out, "mesh_ms", mesh_ms);
+        cJSON_AddNumberToObject(out, "latency_p50_ms", percentile(latency, online_delivered, 0.5));
+        cJSON_AddNumberToObject(out, "latency_p99_ms", percentile(latency, online_delivered, 0.99));
+        cJSON_AddNumberToObject(out, "latency_max_ms", online_delivered ? latency[online_delivered - 1] : 0);
+        cJSON_AddNumberToObject(out, "churn_rounds", rounds);
+        cJSON_AddNumberToObject(out, "churn_converged", converged);
+        cJSON_AddNumberToObject(out, "converge_p50_ms", percentile(converge_ms, converged, 0.5));
+        cJSON_AddNumberToObject(out, "converge_max_ms", converged ? converge_ms[converged - 1] : 0);
+        cJSON_AddNumberToObject(out, "bytes_per_message", bytes_per_msg);
+        cJSON *list = cJSON_AddArrayToObject(out, "nodes");
+        for (int i = 0; i < opt.clients; i++) {
+            cJSON *item = cJSON_CreateObject();
+            cJSON_AddStringToObject(item, "name", nodes[i].name);
+            cJSON_AddNumberToObject(item, "cpu_s", nodes[i].cpu_s);
+            cJSON_AddNumberToObject(item, "rss_kb", (double)nodes[i].rss_kb);
+            cJSON_AddNumberToObject(item, "hwm_kb", (double)nodes[i].hwm_kb);
+            cJSON_AddNumberToObject(item, "tx_bytes", nodes[i].tx);
+            cJSON_AddNumberToObject(item, "rx_bytes", nodes[i].rx);
+            cJSON_AddItemToArray(list, item);
+        }
+        char *text = cJSON_PrintUnformatted(out);
+        FILE *fp = fopen(opt.json_path, "w");
+        if (fp && text) fprintf(fp, "%s\n", text);
+        if (fp) fclose(fp);
+        free(text);
+        cJSON_Delete(out);
+    }
+    free(latency);
+    free(msgs);
+
+    if (!opt.keep) nftw(opt.dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    else fprintf(stderr, "[集群] 数据与日志保留在 %s\n", opt.dir);
+    return pending(0) == 0 ? 0 : 2;
+}
@@ -0,0 +1,545 @@
+/**
+ * @file rudp_sim.c
+ * @brief UDP 传输（core/net/rudp.h）的回环模拟：同一进程中的两个引擎经一个模拟链路互连，
+ *        链路在两个方向上按给定的丢包率、延迟和抖动转发报文。
+ *
+ * 报告：
+ *   - 建连到第一条消息送达的时间：首次连接（等对方应答）与 0-RTT 恢复
+ *   - 各丢包率下按固定速率发送的聊天消息的送达延迟 p50/p99/最大值、重传与判定丢失的报文数，
+ *     以及随后一段大块数据的吞吐量
+ *   - 连接迁移：发送途中发起方换一个出口地址（模拟 NAT 重新绑定），消息是否全部按序送达及迁移前后的最大延迟
+ * 抖动只改变每个报文的延迟，同一方向上的报文不会被它打乱顺序（与排队造成的抖动一致）。
+ *
+ * 用法: rudp_sim [--loss 0,1,5,10] [--delay 20] [--jitter 5] [--messages 200] [--rate 50] [--bulk-mb 1]
+ *                [--port 47000] [--seed 1] [--json 结果文件]
+ * --delay 与 --jitter 为单向的毫秒数；使用 --port 起的连续四个 UDP 端口。
+ */
+#include <cjson/cJSON.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sodium.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "../core/net/rudp.h"
+
+#define MAX_LOSS_LEVELS 8
+#define PROXY_QUEUE 8192              // 链路上同时在途的报文
+#define RECORD_BYTES 128              // 一条模拟聊天消息
+#define CONNECT_TIMEOUT_MS 3000
+#define STALL_MS 15000                // 接收方这么久读不到数据即放弃本轮
+#define BULK_CHUNK (64 * 1024)
+
+static struct {
+    double loss[MAX_LOSS_LEVELS];
+    int loss_count;
+    int delay_ms, jitter_ms;
+    int messages, rate;
+    int bulk_mb;
+    int port;
+    unsigned seed;
+    const char *json_path;
+} opt = { {0, 1, 5, 10}, 4, 20, 5, 200, 50, 1, 47000, 1, NULL };
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void die(const char* what) {
+    fprintf(stderr, "[模拟] %s\n", what);
+    exit(1);
+}
+
+static struct sockaddr_in loopback(int port) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return addr;
+}
+
+// --- 模拟链路 ---
+// 发起方 A 把报文发到 sock[0]，链路从 sock[via] 转给 B；B 的应答无论到达哪个套接字都从 sock[0] 转回 A。
+// via 从 0 换成 1 时，B 看到的对端地址随之改变。
+typedef struct {
+    uint64_t due_ns;
+    int sock;
+    struct sockaddr_in to;
+    size_t len;
+    unsigned char data[RUDP_MAX_DATAGRAM];
+} queued_t;
+
+static struct {
+    int sock[2];
+    struct sockaddr_in a_addr, b_addr;
+    int have_a;
+    _Atomic int via;
+    _Atomic int stop;
+    pthread_mutex_t mutex;            // 保护下面的链路参数
+    double loss;
+    uint64_t delay_ns, jitter_ns;
+    uint64_t rng;
+    uint64_t last_due_ns[2];          // 每个方向上最后一个报文的发出时刻
+    queued_t *queue;                  // [head, head + queued) 按发出时刻排序
+    int head, queued;
+    pthread_t tid;
+} link_sim;
+
+static uint64_t rng_next() {
+    uint64_t x = link_sim.rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return link_sim.rng = x;
+}
+
+static void link_set(double loss_percent) {
+    pthread_mutex_lock(&link_sim.mutex);
+    link_sim.loss = loss_percent / 100.0;
+    pthread_mutex_unlock(&link_sim.mutex);
+}
+
+static void link_enqueue(const unsigned char* data, size_t len, int dir, int sock, const struct sockaddr_in* to) {
+    pthread_mutex_lock(&link_sim.mutex);
+    int drop = (double)(rng_next() % 1000000) / 1e6 < link_sim.loss || link_sim.queued == PROXY_QUEUE;
+    uint64_t delay = link_sim.delay_ns;
+    if (link_sim.jitter_ns) {
+        uint64_t j = rng_next() % (2 * link_sim.jitter_ns + 1);
+        delay = delay + j > link_sim.jitter_ns ? delay + j - link_sim.jitter_ns : 0;
+    }
+    pthread_mutex_unlock(&link_sim.mutex);
+    if (drop) return;
+    uint64_t due = now_ns() + delay;
+    if (due < link_sim.last_due_ns[dir]) due = link_sim.last_due_ns[dir];
+    link_sim.last_due_ns[dir] = due;
+    if (link_sim.head + link_sim.queued == PROXY_QUEUE) {
+        memmove(link_sim.queue, link_sim.queue + link_sim.head, sizeof(queued_t) * (size_t)link_sim.queued);
+        link_sim.head = 0;
+    }
+    // 按发出时刻插入，同一时刻的保持到达顺序；通常就在末尾
+    int pos = link_sim.head + link_sim.queued;
+    while (pos > link_sim.head && link_sim.queue[pos - 1].due_ns > due) pos--;
+    memmove(&link_sim.queue[pos + 1], &link_sim.queue[pos], sizeof(queued_t) * (size_t)(link_sim.head + link_sim.queued - pos));
+    link_sim.queued++;
+    queued_t *q = &link_sim.queue[pos];
+    q->due_ns = due;
+    q->sock = sock;
+    q->to = *to;
+    q->len = len;
+    memcpy(q->data, data, len);
+}
+
+static void* link_thread(void* arg) {
+    (void)arg;
+    unsigned char buf[RUDP_MAX_DATAGRAM + 1];
+    while (!atomic_load(&link_sim.stop)) {
+        uint64_t now = now_ns(), next = now + 50000000ULL;
+        while (link_sim.queued > 0) {
+            queued_t *q = &link_sim.queue[link_sim.head];
+            if (q->due_ns > now) {
+                next = q->due_ns;
+                break;
+            }
+            sendto(link_sim.sock[q->sock], q->data, q->len, 0, (struct sockaddr*)&q->to, sizeof(q->to));
+            link_sim.head++;
+            link_sim.queued--;
+        }
+        if (link_sim.queued == 0) link_sim.head = 0;
+        struct pollfd fds[2] = { { link_sim.sock[0], POLLIN, 0 }, { link_sim.sock[1], POLLIN, 0 } };
+        poll(fds, 2, (int)((next - now + 999999) / 1000000));
+        for (int s = 0; s < 2; s++) {
+            if (!(fds[s].revents & POLLIN)) continue;
+            for (;;) {
+                struct sockaddr_in from;
+                socklen_t from_len = sizeof(from);
+                ssize_t n = recvfrom(link_sim.sock[s], buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&from, &from_len);
+                if (n < 0) break;
+                if (n > RUDP_MAX_DATAGRAM) continue;
+                int from_b = from.sin_port == link_sim.b_addr.sin_port;
+                if (from_b) {
+                    if (link_sim.have_a) link_enqueue(buf, (size_t)n, 1, 0, &link_sim.a_addr);
+                } else if (s == 0) {
+                    link_sim.a_addr = from;
+                    link_sim.have_a = 1;
+                    link_enqueue(buf, (size_t)n, 0, atomic_load(&link_sim.via), &link_sim.b_addr);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static void link_start(int port, int b_port) {
+    for (int s = 0; s < 2; s++) {
+        struct sockaddr_in addr = loopback(port + s);
+        link_sim.sock[s] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (link_sim.sock[s] < 0 || bind(link_sim.sock[s], (struct sockaddr*)&addr, sizeof(addr)) != 0) die("模拟链路的端口绑定失败");
+        int buf = 4 << 20;
+        setsockopt(link_sim.sock[s], SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+    }
+    link_sim.b_addr = loopback(b_port);
+    link_sim.delay_ns = (uint64_t)opt.delay_ms * 1000000ULL;
+    link_sim.jitter_ns = (uint64_t)opt.jitter_ms * 1000000ULL;
+    link_sim.rng = 0x9e3779b97f4a7c15ULL ^ opt.seed;
+    link_sim.queue = malloc(sizeof(queued_t) * PROXY_QUEUE);
+    if (!link_sim.queue) die("内存不足");
+    pthread_mutex_init(&link_sim.mutex, NULL);
+    if (pthread_create(&link_sim.tid, NULL, link_thread, NULL) != 0) die("无法启动模拟链路线程");
+}
+
+// --- 接收方 B 的入站连接 ---
+static unsigned char pk_a[PK_BYTES], pk_b[PK_BYTES];
+static pthread_mutex_t accept_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t accept_cond = PTHREAD_COND_INITIALIZER;
+static int accepted_fd = -1;
+
+static int accept_a(void* ctx, const unsigned char pk[PK_BYTES]) {
+    (void)ctx;
+    return memcmp(pk, pk_a, PK_BYTES) == 0;
+}
+
+static void on_accepted(void* ctx, int fd, const unsigned char pk[PK_BYTES], const struct sockaddr_in* addr) {
+    (void)ctx; (void)pk; (void)addr;
+    pthread_mutex_lock(&accept_mutex);
+    if (accepted_fd >= 0) close(accepted_fd);
+    accepted_fd = fd;
+    pthread_cond_signal(&accept_cond);
+    pthread_mutex_unlock(&accept_mutex);
+}
+
+static int wait_accepted(int timeout_ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) { until.tv_sec++; until.tv_nsec -= 1000000000; }
+    pthread_mutex_lock(&accept_mutex);
+    while (accepted_fd < 0) {
+        if (pthread_cond_timedwait(&accept_cond, &accept_mutex, &until) == ETIMEDOUT) break;
+    }
+    int fd = accepted_fd;
+    accepted_fd = -1;
+    pthread_mutex_unlock(&accept_mutex);
+    return fd;
+}
+
+/**
+ * 读满 len 字节；STALL_MS 内没有新数据或连接关闭时返回已读的字节数。
+ */
+static size_t read_full(int fd, void* buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, STALL_MS) != 1) break;
+        ssize_t n = read(fd, (unsigned char*)buf + got, len - got);
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    return got;
+}
+
+static int write_full(int fd, const void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const unsigned char*)buf + done, len - done);
+        if (n <= 0) return -1;
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * 关闭一条连接的两端：发起方先关，等接收方读到 EOF（发起方的数据已全部送达）。
+ */
+static void close_pair(int a_fd, int b_fd) {
+    close(a_fd);
+    unsigned char buf[4096];
+    struct pollfd pfd = { b_fd, POLLIN, 0 };
+    while (poll(&pfd, 1, STALL_MS) == 1 && read(b_fd, buf, sizeof(buf)) > 0) {}
+    close(b_fd);
+}
+
+// --- 一轮收发 ---
+typedef struct {
+    uint32_t seq;
+    uint32_t pad;
+    uint64_t sent_ns;
+} record_head_t;
+
+typedef struct {
+    int fd;
+    int expect;
+    size_t bulk_bytes;
+    double *latency_ms;               // 按到达顺序
+    int received;
+    int out_of_order;
+    size_t bulk_received;
+    uint64_t bulk_done_ns;
+    pthread_t tid;
+} receiver_t;
+
+static void* receiver_thread(void* arg) {
+    receiver_t *r = arg;
+    unsigned char record[RECORD_BYTES];
+    for (int i = 0; i < r->expect; i++) {
+        if (read_full(r->fd, record, sizeof(record)) != sizeof(record)) return NULL;
+        record_head_t head;
+        memcpy(&head, record, sizeof(head));
+        r->latency_ms[r->received++] = (double)(now_ns() - head.sent_ns) / 1e6;
+        if (head.seq != (uint32_t)i) r->out_of_order++;
+    }
+    unsigned char *chunk = malloc(BULK_CHUNK);
+    while (chunk && r->bulk_received < r->bulk_bytes) {
+        size_t want = r->bulk_bytes - r->bulk_received < BULK_CHUNK ? r->bulk_bytes - r->bulk_received : BULK_CHUNK;
+        size_t got = read_full(r->fd, chunk, want);
+        r->bulk_received += got;
+        if (got < want) break;
+    }
+    r->bulk_done_ns = now_ns();
+    free(chunk);
+    return NULL;
+}
+
+typedef struct {
+    double loss;
+    int delivered, out_of_order;
+    double p50_ms, p99_ms, max_ms;
+    double bulk_kbps;
+    uint64_t retransmitted, lost, migrations;
+} run_result_t;
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double* sorted, int n, double p) {
+    if (n == 0) return 0;
+    return sorted[(int)(p * (n - 1) + 0.5)];
+}
+
+/**
+ * 建立一条连接，按 opt.rate 发送 opt.messages 条消息，再发送 bulk_bytes 字节；migrate_at >= 0 时在发出该条消息前切换出口地址。
+ */
+static int run_round(RudpEngine* a, RudpEngine* b, const struct sockaddr_in* link_addr, size_t bulk_bytes, int migrate_at, run_result_t* out) {
+    rudp_stats_t a0, b0, a1, b1;
+    rudp_get_stats(a, &a0);
+    rudp_get_stats(b, &b0);
+    int a_fd = rudp_connect(a, pk_b, link_addr, CONNECT_TIMEOUT_MS, NULL);
+    if (a_fd < 0) return -1;
+    // 连接要等第一个报文到达 B 才出现，先发出第一条消息
+    receiver_t r = { .fd = -1, .expect = opt.messages, .bulk_bytes = bulk_bytes };
+    r.latency_ms = calloc((size_t)opt.messages + 1, sizeof(double));
+    unsigned char record[RECORD_BYTES] = {0};
+    unsigned char *chunk = calloc(1, BULK_CHUNK);
+    if (!r.latency_ms || !chunk) die("内存不足");
+    uint64_t start = now_ns(), bulk_start = 0;
+    int b_fd = -1, ok = 0;
+    for (int i = 0; i < opt.messages; i++) {
+        uint64_t due = start + (uint64_t)i * 1000000000ULL / (uint64_t)opt.rate;
+        struct timespec ts = { (time_t)(due / 1000000000ULL), (long)(due % 1000000000ULL) };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        if (i == migrate_at) atomic_store(&link_sim.via, 1);
+        record_head_t head = { (uint32_t)i, 0, now_ns() };
+        memcpy(record, &head, sizeof(head));
+        if (write_full(a_fd, record, sizeof(record)) != 0) break;
+        if (i == 0) {
+            b_fd = wait_accepted(CONNECT_TIMEOUT_MS);
+            if (b_fd < 0) break;
+            r.fd = b_fd;
+            if (pthread_create(&r.tid, NULL, receiver_thread, &r) != 0) die("无法启动接收线程");
+        }
+    }
+    if (r.fd >= 0) {
+        bulk_start = now_ns();
+        for (size_t sent = 0; sent < bulk_bytes; sent += BULK_CHUNK) {
+            size_t n = bulk_bytes - sent < BULK_CHUNK ? bulk_bytes - sent : BULK_CHUNK;
+            if (write_full(a_fd, chunk, n) != 0) break;
+        }
+        pthread_join(r.tid, NULL);
+        ok = 1;
+    }
+    free(chunk);
+    if (b_fd >= 0) close_pair(a_fd, b_fd);
+    else close(a_fd);
+    atomic_store(&link_sim.via, 0);
+
+    rudp_get_stats(a, &a1);
+    rudp_get_stats(b, &b1);
+    out->delivered = r.received;
+    out->out_of_order = r.out_of_order;
+    qsort(r.latency_ms, (size_t)r.received, sizeof(double), compare_double);
+    out->p50_ms = percentile(r.latency_ms, r.received, 0.5);
+    out->p99_ms = percentile(r.latency_ms, r.received, 0.99);
+    out->max_ms = r.received ? r.latency_ms[r.received - 1] : 0;
+    out->bulk_kbps = ok && r.bulk_received && r.bulk_done_ns > bulk_start
+                     ? (double)r.bulk_received / 1024.0 / ((double)(r.bulk_done_ns - bulk_start) / 1e9) : 0;
+    out->retransmitted = a1.retransmitted - a0.retransmitted + b1.retransmitted - b0.retransmitted;
+    out->lost = a1.lost - a0.lost + b1.lost - b0.lost;
+    out->migrations = b1.migrations - b0.migrations;
+    free(r.latency_ms);
+    return ok ? 0 : -1;
+}
+
+/**
+ * 建连到第一条消息在 B 读出的时间（毫秒），失败返回负数。
+ */
+static double measure_setup(RudpEngine* a, const struct sockaddr_in* link_addr, int* zero_rtt) {
+    unsigned char record[RECORD_BYTES] = {0};
+    uint64_t start = now_ns();
+    int a_fd = rudp_connect(a, pk_b, link_addr, CONNECT_TIMEOUT_MS, zero_rtt);
+    if (a_fd < 0) return -1;
+    if (write_full(a_fd, record, sizeof(record)) != 0) {
+        close(a_fd);
+        return -1;
+    }
+    int b_fd = wait_accepted(CONNECT_TIMEOUT_MS);
+    if (b_fd < 0) {
+        close(a_fd);
+        return -1;
+    }
+    double ms = read_full(b_fd, record, sizeof(record)) == sizeof(record) ? (double)(now_ns() - start) / 1e6 : -1;
+    close_pair(a_fd, b_fd);
+    return ms;
+}
+
+static void parse_loss(const char* list) {
+    opt.loss_count = 0;
+    const char *p = list;
+    while (*p && opt.loss_count < MAX_LOSS_LEVELS) {
+        char *end;
+        opt.loss[opt.loss_count++] = strtod(p, &end);
+        if (end == p) break;
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) parse_loss(argv[++i]);
+        else if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) opt.delay_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--jitter") == 0 && i + 1 < argc) opt.jitter_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) opt.messages = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) opt.rate = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bulk-mb") == 0 && i + 1 < argc) opt.bulk_mb = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) opt.port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) opt.seed = (unsigned)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) opt.json_path = argv[++i];
+        else {
+            fprintf(stderr, "用法: %s [--loss 0,1,5,10] [--delay 20] [--jitter 5] [--messages 200] [--rate 50] [--bulk-mb 1] "
+                            "[--port 47000] [--seed 1] [--json 结果文件]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (opt.messages < 1) opt.messages = 1;
+    if (opt.rate < 1) opt.rate = 1;
+    if (opt.bulk_mb < 0) opt.bulk_mb = 0;
+    if (opt.jitter_ms > opt.delay_ms) opt.jitter_ms = opt.delay_ms;
+    if (sodium_init() < 0) die("libsodium 初始化失败");
+    signal(SIGPIPE, SIG_IGN);
+
+    unsigned char sk_a[crypto_box_SECRETKEYBYTES], sk_b[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(pk_a, sk_a);
+    crypto_box_keypair(pk_b, sk_b);
+    PeerKeyCache *keys_a = peer_key_cache_create(sk_a, 8), *keys_b = peer_key_cache_create(sk_b, 8);
+    sodium_memzero(sk_a, sizeof(sk_a));
+    sodium_memzero(sk_b, sizeof(sk_b));
+    if (!keys_a || !keys_b) die("无法创建密钥缓存");
+    rudp_callbacks_t none = { NULL, NULL, NULL }, accept_cb = { accept_a, on_accepted, NULL };
+    RudpEngine *a = rudp_create(pk_a, keys_a, opt.port, &none);
+    RudpEngine *b = rudp_create(pk_b, keys_b, opt.port + 1, &accept_cb);
+    if (!a || !b) die("UDP 端口绑定失败，请用 --port 换一组端口");
+    link_start(opt.port + 2, opt.port + 1);
+    struct sockaddr_in link_addr = loopback(opt.port + 2);
+
+    // 1. 建连：首次连接要等对方应答，随后的连接以 0-RTT 恢复
+    int zero_rtt = 0;
+    double cold_ms = measure_setup(a, &link_addr, &zero_rtt);
+    double resumed_ms = measure_setup(a, &link_addr, &zero_rtt);
+    int resumed_zero_rtt = zero_rtt;
+    printf("链路: 单向延迟 %dms ±%dms\n", opt.delay_ms, opt.jitter_ms);
+    printf("建连到首条消息送达: 首次 %.1fms，再次连接 %.1fms（%s）\n", cold_ms, resumed_ms, resumed_zero_rtt ? "0-RTT" : "未能 0-RTT");
+
+    // 2. 各丢包率下的消息延迟与大块吞吐
+    run_result_t runs[MAX_LOSS_LEVELS];
+    size_t bulk_bytes = (size_t)opt.bulk_mb << 20;
+    printf("%8s %10s %10s %10s %10s %8s %8s %14s\n", "丢包(%)", "送达", "p50(ms)", "p99(ms)", "最大(ms)", "重传", "丢失", "吞吐(KB/s)");
+    for (int k = 0; k < opt.loss_count; k++) {
+        link_set(opt.loss[k]);
+        run_result_t *res = &runs[k];
+        memset(res, 0, sizeof(*res));
+        res->loss = opt.loss[k];
+        if (run_round(a, b, &link_addr, bulk_bytes, -1, res) != 0) fprintf(stderr, "[模拟] 丢包 %.1f%% 的一轮没有完成\n", opt.loss[k]);
+        printf("%8.1f %6d/%-3d %10.2f %10.2f %10.2f %8llu %8llu %14.0f\n", res->loss, res->delivered, opt.messages,
+               res->p50_ms, res->p99_ms, res->max_ms, (unsigned long long)res->retransmitted, (unsigned long long)res->lost, res->bulk_kbps);
+    }
+
+    // 3. 迁移：发送到一半时发起方换出口地址
+    link_set(0);
+    run_result_t migration = {0};
+    run_round(a, b, &link_addr, 0, opt.messages / 2, &migration);
+    printf("迁移: 送达 %d/%d，乱序 %d，最大延迟 %.2fms，迁移 %llu 次\n", migration.delivered, opt.messages,
+           migration.out_of_order, migration.max_ms, (unsigned long long)migration.migrations);
+
+    rudp_stats_t sa, sb;
+    rudp_get_stats(a, &sa);
+    rudp_get_stats(b, &sb);
+    printf("累计: 报文 %llu/%llu（A 发/收），%llu/%llu（B 发/收），拒绝 %llu\n",
+           (unsigned long long)sa.datagrams_sent, (unsigned long long)sa.datagrams_received,
+           (unsigned long long)sb.datagrams_sent, (unsigned long long)sb.datagrams_received,
+           (unsigned long long)(sa.rejected + sb.rejected));
+
+    if (opt.json_path) {
+        cJSON *out = cJSON_CreateObject();
+        cJSON_AddNumberToObject(out, "delay_ms", opt.delay_ms);
+        cJSON_AddNumberToObject(out, "jitter_ms", opt.jitter_ms);
+        cJSON_AddNumberToObject(out, "messages", opt.messages);
+        cJSON_AddNumberToObject(out, "rate", opt.rate);
+        cJSON_AddNumberToObject(out, "setup_cold_ms", cold_ms);
+        cJSON_AddNumberToObject(out, "setup_resumed_ms", resumed_ms);
+        cJSON_AddBoolToObject(out, "zero_rtt", resumed_zero_rtt);
+        cJSON *list = cJSON_AddArrayToObject(out, "runs");
+        for (int k = 0; k < opt.loss_count; k++) {
+            cJSON *item = cJSON_CreateObject();
+            cJSON_AddNumberToObject(item, "loss_percent", runs[k].loss);
+            cJSON_AddNumberToObject(item, "delivered", runs[k].delivered);
+            cJSON_AddNumberToObject(item, "latency_p50_ms", runs[k].p50_ms);
+            cJSON_AddNumberToObject(item, "latency_p99_ms", runs[k].p99_ms);
+            cJSON_AddNumberToObject(item, "latency_max_ms", runs[k].max_ms);
+            cJSON_AddNumberToObject(item, "retransmitted", (double)runs[k].retransmitted);
+            cJSON_AddNumberToObject(item, "lost", (double)runs[k].lost);
+            cJSON_AddNumberToObject(item, "bulk_kbps", runs[k].bulk_kbps);
+            cJSON_AddItemToArray(list, item);
+        }
+        cJSON *mig = cJSON_AddObjectToObject(out, "migration");
+        cJSON_AddNumberToObject(mig, "delivered", migration.delivered);
+        cJSON_AddNumberToObject(mig, "out_of_order", migration.out_of_order);
+        cJSON_AddNumberToObject(mig, "latency_max_ms", migration.max_ms);
+        cJSON_AddNumberToObject(mig, "migrations", (double)migration.migrations);
+        char *text = cJSON_PrintUnformatted(out);
+        FILE *fp = fopen(opt.json_path, "w");
+        if (fp && text) fprintf(fp, "%s\n", text);
+        if (fp) fclose(fp);
+        free(text);
+        cJSON_Delete(out);
+    }
+
+    atomic_store(&link_sim.stop, 1);
+    pthread_join(link_sim.tid, NULL);
+    rudp_destroy(a);
+    rudp_destroy(b);
+    peer_key_cache_destroy(keys_a);
+    peer_key_cache_destroy(keys_b);
+    int complete = migration.delivered == opt.messages && migration.out_of_order == 0;
+    for (int k = 0; k < opt.loss_count; k++) complete &= runs[k].delivered == opt.messages;
+    return complete ? 0 : 2;
+}
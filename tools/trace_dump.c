@@ -0,0 +1,266 @@
+/**
+ * @file trace_dump.c
+ * @brief 读取客户端 --trace 写下的环形追踪文件（可同时给出收发两端的多个文件），按消息还原时间线。
+ *
+ * 报告：
+ *   - 各段耗时的次数、p50/p99/最大值：发送方写库、加密、发出，链路（发出到对端读出），
+ *     接收方解密、解析、写库、显示，以及端到端（发送到对端显示）
+ *   - 最近若干条消息的时间线，每个时间点注明所在的一端和距上一个时间点的间隔
+ * 各文件的时间都取自 CLOCK_REALTIME，跨机器的“链路”一段包含两台机器的时钟差。
+ *
+ * 用法: trace_dump [--last 10] [--id 追踪ID开头] 追踪文件...
+ */
+#include "../client/logic/trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define MAX_FILES 16
+
+typedef struct {
+    uint64_t trace_id;
+    uint64_t ts_ns;
+    uint32_t stage;
+    int node;
+} event_t;
+
+typedef struct {
+    const char *name;
+    int from_role, from_stage; // role 0 为发送方，1 为接收方
+    int to_role, to_stage;
+} segment_t;
+
+static const segment_t segments[] = {
+    { "发送方写库",   0, TRACE_STAGE_SEND,      0, TRACE_STAGE_PERSISTED },
+    { "加密",         0, TRACE_STAGE_PERSISTED, 0, TRACE_STAGE_ENCRYPTED },
+    { "发出",         0, TRACE_STAGE_ENCRYPTED, 0, TRACE_STAGE_SENT },
+    { "链路",         0, TRACE_STAGE_SENT,      1, TRACE_STAGE_RECEIVED },
+    { "解密",         1, TRACE_STAGE_RECEIVED,  1, TRACE_STAGE_DECRYPTED },
+    { "解析",         1, TRACE_STAGE_DECRYPTED, 1, TRACE_STAGE_PARSED },
+    { "接收方写库",   1, TRACE_STAGE_PARSED,    1, TRACE_STAGE_PERSISTED },
+    { "等待显示",     1, TRACE_STAGE_PERSISTED, 1, TRACE_STAGE_DISPLAYED },
+    { "端到端",       0, TRACE_STAGE_SEND,      1, TRACE_STAGE_DISPLAYED },
+};
+#define SEGMENT_COUNT (int)(sizeof(segments) / sizeof(segments[0]))
+
+typedef struct {
+    uint64_t *v;
+    size_t n, cap;
+} samples_t;
+
+static char nodes[MAX_FILES][TRACE_NODE_SIZE];
+static event_t *events = NULL;
+static size_t event_count = 0, event_cap = 0;
+
+static void push_event(const event_t* e) {
+    if (event_count == event_cap) {
+        event_cap = event_cap ? event_cap * 2 : 4096;
+        events = realloc(events, event_cap * sizeof(event_t));
+        if (!events) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    events[event_count++] = *e;
+}
+
+static void push_sample(samples_t* s, uint64_t v) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 256;
+        s->v = realloc(s->v, s->cap * sizeof(uint64_t));
+        if (!s->v) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->v[s->n++] = v;
+}
+
+/**
+ * 读入一个追踪文件中完整写入、未被覆盖的记录。
+ */
+static int load_file(const char* path, int node) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    trace_file_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t) || header.capacity == 0) {
+        fprintf(stderr, "%s: 不是追踪文件或版本不符\n", path);
+        fclose(fp);
+        return -1;
+    }
+    snprintf(nodes[node], sizeof(nodes[node]), "%s", header.node[0] ? header.node : path);
+    size_t loaded = 0;
+    for (uint64_t slot = 0; slot < header.capacity; slot++) {
+        trace_record_t r;
+        if (fread(&r, sizeof(r), 1, fp) != 1) break;
+        uint64_t seq = atomic_load(&r.seq);
+        if (seq == 0 || (seq - 1) % header.capacity != slot || r.stage >= TRACE_STAGE_COUNT) continue;
+        event_t e = { r.trace_id, r.ts_ns, r.stage, node };
+        push_event(&e);
+        loaded++;
+    }
+    fclose(fp);
+    uint64_t written = atomic_load(&header.next);
+    fprintf(stderr, "%s: %s, %zu 个时间点%s\n", path, nodes[node], loaded,
+            written > header.capacity ? "（环已写满，最早的已被覆盖）" : "");
+    return 0;
+}
+
+static int compare_events(const void* a, const void* b) {
+    const event_t *x = a, *y = b;
+    if (x->trace_id != y->trace_id) return x->trace_id < y->trace_id ? -1 : 1;
+    if (x->ts_ns != y->ts_ns) return x->ts_ns < y->ts_ns ? -1 : 1;
+    return (int)x->stage - (int)y->stage;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * 一条消息的事件 [begin, end) 中，按角色取各阶段第一次出现的时刻，0 表示没有。
+ * 发送方是记录了 send 的一端，其余各端都当作接收方。
+ */
+static void message_stages(size_t begin, size_t end, uint64_t ts[2][TRACE_STAGE_COUNT], int* sender) {
+    memset(ts, 0, sizeof(uint64_t) * 2 * TRACE_STAGE_COUNT);
+    *sender = -1;
+    for (size_t i = begin; i < end; i++) {
+        if (events[i].stage == TRACE_STAGE_SEND) {
+            *sender = events[i].node;
+            break;
+        }
+    }
+    for (size_t i = begin; i < end; i++) {
+        int role = events[i].node == *sender ? 0 : 1;
+        if (ts[role][events[i].stage] == 0) ts[role][events[i].stage] = events[i].ts_ns;
+    }
+}
+
+static void print_timeline(size_t begin, size_t end) {
+    printf("消息 %016" PRIx64 "\n", events[begin].trace_id);
+    uint64_t t0 = events[begin].ts_ns, prev = t0;
+    for (size_t i = begin; i < end; i++) {
+        printf("  %+10.3fms  %-16s %-10s  (+%.3fms)\n", (double)(int64_t)(events[i].ts_ns - t0) / 1e6,
+               nodes[events[i].node], trace_stage_name((trace_stage_t)events[i].stage),
+               (double)(int64_t)(events[i].ts_ns - prev) / 1e6);
+        prev = events[i].ts_ns;
+    }
+}
+
+static double percentile_ms(const samples_t* s, double p) {
+    size_t k = (size_t)(p * (double)(s->n - 1) + 0.5);
+    return (double)s->v[k] / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+    int last = 10, files = 0;
+    const char *id_prefix = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--last") == 0 && i + 1 < argc) {
+            last = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--id") == 0 && i + 1 < argc) {
+            id_prefix = argv[++i];
+        } else if (argv[i][0] == '-' || files == MAX_FILES) {
+            fprintf(stderr, "用法: %s [--last 10] [--id 追踪ID开头] 追踪文件...（最多 %d 个）\n", argv[0], MAX_FILES);
+            return 1;
+        } else {
+            if (load_file(argv[i], files) != 0) return 1;
+            files++;
+        }
+    }
+    if (files == 0) {
+        fprintf(stderr, "用法: %s [--last 10] [--id 追踪ID开头] 追踪文件...\n", argv[0]);
+        return 1;
+    }
+    if (event_count == 0) {
+        printf("没有时间点。\n");
+        return 0;
+    }
+    qsort(events, event_count, sizeof(event_t), compare_events);
+
+    // 按消息分组，统计各段耗时；时间线按消息开始的时刻挑出最近的若干条
+    samples_t samples[SEGMENT_COUNT] = {0};
+    size_t messages = 0;
+    size_t *starts = malloc(sizeof(size_t) * (event_count + 1));
+    if (!starts) return 1;
+    for (size_t begin = 0; begin < event_count;) {
+        size_t end = begin;
+        while (end < event_count && events[end].trace_id == events[begin].trace_id) end++;
+        starts[messages++] = begin;
+        uint64_t ts[2][TRACE_STAGE_COUNT];
+        int sender;
+        message_stages(begin, end, ts, &sender);
+        for (int k = 0; k < SEGMENT_COUNT; k++) {
+            const segment_t *seg = &segments[k];
+            uint64_t a = ts[seg->from_role][seg->from_stage], b = ts[seg->to_role][seg->to_stage];
+            if (a && b) push_sample(&samples[k], b > a ? b - a : 0);
+        }
+        begin = end;
+    }
+    starts[messages] = event_count;
+
+    if (id_prefix) {
+        int shown = 0;
+        for (size_t m = 0; m < messages; m++) {
+            char hex[17];
+            snprintf(hex, sizeof(hex), "%016" PRIx64, events[starts[m]].trace_id);
+            if (strncmp(hex, id_prefix, strlen(id_prefix)) != 0) continue;
+            print_timeline(starts[m], starts[m + 1]);
+            shown++;
+        }
+        if (!shown) printf("没有追踪 ID 以 %s 开头的消息。\n", id_prefix);
+        free(starts);
+        return 0;
+    }
+
+    printf("%zu 条消息\n%-12s %8s %10s %10s %10s\n", messages, "阶段", "次数", "p50(ms)", "p99(ms)", "最大(ms)");
+    for (int k = 0; k < SEGMENT_COUNT; k++) {
+        samples_t *s = &samples[k];
+        if (s->n == 0) {
+            printf("%-12s %8d %10s %10s %10s\n", segments[k].name, 0, "-", "-", "-");
+            continue;
+        }
+        qsort(s->v, s->n, sizeof(uint64_t), compare_u64);
+        printf("%-12s %8zu %10.3f %10.3f %10.3f\n", segments[k].name, s->n,
+               percentile_ms(s, 0.50), percentile_ms(s, 0.99), (double)s->v[s->n - 1] / 1e6);
+        free(s->v);
+    }
+
+    // 最近的消息：按第一个时间点排序后取最后 last 条
+    if (last > 0) {
+        size_t *order = malloc(sizeof(size_t) * messages);
+        if (!order) return 1;
+        size_t n = 0;
+        for (size_t m = 0; m < messages; m++) {
+            // 插入排序足够：只保留最近的 last 条
+            uint64_t t = events[starts[m]].ts_ns;
+            size_t pos = n;
+            while (pos > 0 && events[order[pos - 1]].ts_ns > t) pos--;
+            if (n == (size_t)last && pos == 0) continue;
+            if (n == (size_t)last) {
+                memmove(order, order + 1, (pos - 1) * sizeof(size_t));
+                pos--;
+            } else {
+                memmove(order + pos + 1, order + pos, (n - pos) * sizeof(size_t));
+                n++;
+            }
+            order[pos] = starts[m];
+        }
+        printf("\n最近 %zu 条消息的时间线:\n", n);
+        for (size_t i = 0; i < n; i++) {
+            size_t begin = order[i], end = begin;
+            while (end < event_count && events[end].trace_id == events[begin].trace_id) end++;
+            print_timeline(begin, end);
+        }
+        free(order);
+    }
+    free(starts);
+    free(events);
+    return 0;
+}
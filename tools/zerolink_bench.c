@@ -0,0 +1,602 @@
+/**
+ * @file zerolink_bench.c
+ * @brief 客户端消息路径各阶段的微基准：JSON 构造与解析、链路帧加密与解密、消息写入（逐条与成批）、
+ *        向量时钟读写与合并，1 万、10 万、100 万条消息规模下的同步生成（区间指纹应答与完整补发流），
+ *        以及大块同步数据占满一条慢速链路时聊天帧的送达延迟（分片复用关闭与开启对比）。
+ *
+ * 为了测到真正的实现而不是复制品，本文件直接包含 client_logic.c，调用其中的静态函数；
+ * 数据写在临时目录中，与正常运行的客户端完全隔离。链路的另一端是一个只读不处理的 socketpair。
+ * 每项报告 ns/op、每次操作的堆分配次数（本线程的 malloc/calloc/realloc，替换 glibc 的入口计数）
+ * 和单次操作耗时的 p50/p90/p99/最大值。成批的项目以整批计时再除以批大小。
+ *
+ * 用法: zerolink_bench [--iters 20000] [--sync-sizes 10000,100000,1000000] [--filter 名字子串]
+ *                      [--json 结果文件] [--dir 数据目录] [--keep]
+ * --json 每项一行 JSON（第一行为运行环境），便于两次运行之间对比。
+ */
+#define _GNU_SOURCE
+#include "../client/logic/client_logic.c"
+#include <ftw.h>
+#include <malloc.h>
+
+#define BENCH_PAYLOAD "今晚七点在老地方见，记得带上周借的那本书。See you at seven!"
+#define BENCH_INSERT_BATCH 100
+#define BENCH_SYNC_ITERS 50
+#define BENCH_MAX_SYNC_SIZES 8
+#define BENCH_LINK_RATE (4 * 1024 * 1024)  // 延迟项目中链路另一端的读取速率 (字节/秒)
+#define BENCH_LINK_SYNC_FRAMES 32          // 同时发送的同步帧数，每帧接近 MAX_FRAME_SIZE
+#define BENCH_LINK_CHAT_INTERVAL_US 10000
+
+// --- 分配计数：替换 malloc 系列入口，只统计当前线程 ---
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+static __thread uint64_t thread_allocs = 0;
+
+void *malloc(size_t size) {
+    thread_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    thread_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    thread_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+// --- 计时与结果 ---
+static struct {
+    int iters;
+    uint64_t sync_sizes[BENCH_MAX_SYNC_SIZES];
+    int sync_count;
+    const char *filter;
+    const char *json_path;
+    char dir[PATH_MAX];
+    int keep;
+} opt = { .iters = 20000, .sync_sizes = { 10000, 100000, 1000000 }, .sync_count = 3 };
+
+static FILE *json_out = NULL;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+typedef struct {
+    const char *name;
+    const char *params;   // 规模等参数，写入结果便于对比
+    int ops_per_iter;     // 每次计时包含的操作数（成批的项目大于 1）
+    uint64_t *samples;    // 每次计时的耗时 (ns)
+    int count;
+    uint64_t allocs;
+    uint64_t bytes;       // 写到链路上的字节数，0 表示不涉及链路
+} bench_t;
+
+static int bench_enabled(const char* name) {
+    return !opt.filter || strstr(name, opt.filter) != NULL;
+}
+
+static void bench_begin(bench_t* b, const char* name, const char* params, int iters, int ops_per_iter) {
+    memset(b, 0, sizeof(*b));
+    b->name = name;
+    b->params = params;
+    b->ops_per_iter = ops_per_iter;
+    b->samples = __libc_malloc(sizeof(uint64_t) * (size_t)iters);
+}
+
+static void bench_report(bench_t* b) {
+    if (b->count == 0) {
+        __libc_free(b->samples);
+        return;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < b->count; i++) total += b->samples[i];
+    qsort(b->samples, (size_t)b->count, sizeof(uint64_t), compare_u64);
+    double ops = (double)b->count * b->ops_per_iter;
+    double per_op = (double)total / ops;
+    // 百分位按单次操作折算
+    double p50 = (double)b->samples[b->count / 2] / b->ops_per_iter;
+    double p90 = (double)b->samples[(size_t)(b->count * 0.90)] / b->ops_per_iter;
+    double p99 = (double)b->samples[(size_t)(b->count * 0.99)] / b->ops_per_iter;
+    double max = (double)b->samples[b->count - 1] / b->ops_per_iter;
+    double allocs = (double)b->allocs / ops;
+    printf("%-28s %-12s %10.0f %8.1f %10.0f %10.0f %10.0f %12.0f", b->name, b->params, per_op, allocs, p50, p90, p99, max);
+    if (b->bytes) printf("  %.0f B/op", (double)b->bytes / ops);
+    printf("\n");
+    fflush(stdout);
+    if (json_out) {
+        fprintf(json_out, "{\"bench\":\"%s\",\"params\":\"%s\",\"ops\":%.0f,\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,"
+                          "\"p50_ns\":%.1f,\"p90_ns\":%.1f,\"p99_ns\":%.1f,\"max_ns\":%.1f,\"bytes_per_op\":%.1f}\n",
+                b->name, b->params, ops, per_op, allocs, p50, p90, p99, max, (double)b->bytes / ops);
+        fflush(json_out);
+    }
+    __libc_free(b->samples);
+}
+
+// 计时一段代码：samples 记录耗时，allocs 累加本线程的分配次数
+#define BENCH_TIMED(b, body) do {                   \
+        uint64_t allocs_before_ = thread_allocs;    \
+        uint64_t start_ = now_ns();                 \
+        body;                                       \
+        (b)->samples[(b)->count++] = now_ns() - start_; \
+        (b)->allocs += thread_allocs - allocs_before_; \
+    } while (0)
+
+// --- 链路的另一端：读出并丢弃，统计字节数 ---
+static int sink_fd = -1;
+static _Atomic uint64_t sink_bytes = 0;
+
+static void *sink_thread(void *arg) {
+    (void)arg;
+    unsigned char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(sink_fd, buf, sizeof(buf))) > 0) sink_bytes += (uint64_t)n;
+    return NULL;
+}
+
+static void bench_log(const char* line) {
+    (void)line; // 基准运行期间不输出业务日志
+}
+
+/**
+ * 建立一个指向回环 socketpair 的对端，供 send_encrypted 与同步函数使用。
+ */
+static int make_bench_peer(peer_t* peer, pthread_t* tid) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return -1;
+    memset(peer, 0, sizeof(*peer));
+    peer->sockfd = sv[0];
+    sink_fd = sv[1];
+    randombytes_buf(peer->pk, sizeof(peer->pk));
+    peer->pk[0] |= 1; // 避免全零公钥
+    peer->id = pk_intern(peer->pk);
+    peer->key = peer_key_acquire(key_cache, peer->pk);
+    peer->key_exchanged = 1;
+    link_mux_init(&peer->mux);
+    if (!peer->key || peer->id == PK_ID_NONE || peer_start_writer(peer) != 0) return -1;
+    return pthread_create(tid, NULL, sink_thread, NULL);
+}
+
+static char* make_chat_json(const char* clock_str) {
+    unsigned char uid[MSG_UID_BYTES];
+    char uid_hex[MSG_UID_HEX_LEN + 1];
+    generate_message_uid(uid);
+    uid_to_hex(uid, uid_hex);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "chat");
+    cJSON_AddStringToObject(json, "uid", uid_hex);
+    cJSON_AddStringToObject(json, "content", BENCH_PAYLOAD);
+    cJSON_AddStringToObject(json, "vector_clock", clock_str);
+    char *text = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    return text;
+}
+
+static const char* bench_clock() {
+    static char clock_str[256];
+    if (!clock_str[0]) snprintf(clock_str, sizeof(clock_str), "{\"%s\":1042,\"%064d\":977}", get_my_public_key_hex(), 7);
+    return clock_str;
+}
+
+// --- 各阶段 ---
+static void bench_json(int iters) {
+    bench_t b;
+    if (bench_enabled("json_build_chat")) {
+        bench_begin(&b, "json_build_chat", "-", iters, 1);
+        for (int i = 0; i < iters; i++) {
+            char *text;
+            BENCH_TIMED(&b, text = make_chat_json(bench_clock()));
+            free(text);
+        }
+        bench_report(&b);
+    }
+    if (bench_enabled("json_parse_chat")) {
+        char *text = make_chat_json(bench_clock());
+        bench_begin(&b, "json_parse_chat", "-", iters, 1);
+        for (int i = 0; i < iters; i++) {
+            // 与 handle_peer_message 相同：解析后取出各字段并还原 uid
+            BENCH_TIMED(&b, {
+                cJSON *json = cJSON_Parse(text);
+                cJSON *type = cJSON_GetObjectItem(json, "type");
+                cJSON *uid = cJSON_GetObjectItem(json, "uid");
+                cJSON *content = cJSON_GetObjectItem(json, "content");
+                cJSON *vc = cJSON_GetObjectItem(json, "vector_clock");
+                unsigned char uid_bin[MSG_UID_BYTES];
+                if (!cJSON_IsString(type) || !cJSON_IsString(uid) || uid_from_hex(uid->valuestring, uid_bin) != 0 ||
+                    !cJSON_IsString(content) || !cJSON_IsString(vc)) abort();
+                cJSON_Delete(json);
+            });
+        }
+        bench_report(&b);
+        free(text);
+    }
+}
+
+static void bench_crypto(peer_t* peer, int iters) {
+    char *text = make_chat_json(bench_clock());
+    size_t len = strlen(text);
+    bench_t b;
+    if (bench_enabled("send_encrypted")) {
+        uint64_t before = sink_bytes;
+        bench_begin(&b, "send_encrypted", "chat", iters, 1);
+        for (int i = 0; i < iters; i++) BENCH_TIMED(&b, send_encrypted(peer, LINK_PRIO_INTERACTIVE, text));
+        // 等对端读完，字节数才完整
+        while (sink_bytes - before < (uint64_t)iters * (4 + PEER_BOX_OVERHEAD + len)) usleep(1000);
+        b.bytes = sink_bytes - before;
+        bench_report(&b);
+    }
+    if (bench_enabled("decrypt")) {
+        unsigned char *sealed = malloc(len + PEER_BOX_OVERHEAD), *plain = malloc(len + 1);
+        peer_box_frame_t frame = { .in = (const unsigned char*)text, .in_len = len, .out = sealed };
+        peer_box_seal_batch(peer->key, &frame, 1);
+        bench_begin(&b, "decrypt", "chat", iters, 1);
+        for (int i = 0; i < iters; i++) {
+            // 与 receive_from_peer 相同：原地解密一帧
+            peer_box_frame_t in = { .in = sealed, .in_len = frame.out_len, .out = plain };
+            BENCH_TIMED(&b, if (peer_box_open_batch(peer->key, &in, 1) != 1) abort());
+        }
+        bench_report(&b);
+        free(sealed);
+        free(plain);
+    }
+    free(text);
+}
+
+static void insert_one(chat_db_t* cdb, pk_id_t sender, const char* clock_str) {
+    unsigned char uid[MSG_UID_BYTES];
+    generate_message_uid(uid);
+    db_save_message(cdb, uid, sender, BENCH_PAYLOAD, clock_str);
+}
+
+static void bench_db(pk_id_t chat_id, int iters) {
+    bench_t b;
+    chat_db_t *cdb = chat_db_acquire(chat_id);
+    if (!cdb) return;
+    if (bench_enabled("db_save_message")) {
+        // 单条：每条消息一个隐式事务，与 send_chat_message 相同
+        int n = iters / 10 > 0 ? iters / 10 : 1;
+        bench_begin(&b, "db_save_message", "single", n, 1);
+        for (int i = 0; i < n; i++) BENCH_TIMED(&b, insert_one(cdb, my_id, bench_clock()));
+        bench_report(&b);
+    }
+    if (bench_enabled("db_save_message_batch")) {
+        // 成批：与同步块相同，一个事务写入一整批
+        int batches = iters / BENCH_INSERT_BATCH > 0 ? iters / BENCH_INSERT_BATCH : 1;
+        bench_begin(&b, "db_save_message_batch", "x100", batches, BENCH_INSERT_BATCH);
+        for (int i = 0; i < batches; i++) {
+            BENCH_TIMED(&b, {
+                chat_db_exec(cdb, "BEGIN;");
+                for (int k = 0; k < BENCH_INSERT_BATCH; k++) insert_one(cdb, my_id, bench_clock());
+                chat_db_exec(cdb, "COMMIT;");
+            });
+        }
+        bench_report(&b);
+    }
+    if (bench_enabled("vc_get")) {
+        cJSON *seed = cJSON_Parse(bench_clock());
+        db_save_vector_clock(cdb, seed);
+        cJSON_Delete(seed);
+        bench_begin(&b, "vc_get", "-", iters, 1);
+        for (int i = 0; i < iters; i++) {
+            cJSON *clock;
+            BENCH_TIMED(&b, clock = db_get_vector_clock(cdb));
+            cJSON_Delete(clock);
+        }
+        bench_report(&b);
+    }
+    if (bench_enabled("vc_merge")) {
+        char remote[256];
+        bench_begin(&b, "vc_merge", "-", iters, 1);
+        for (int i = 0; i < iters; i++) {
+            snprintf(remote, sizeof(remote), "{\"%s\":%d}", pk_hex(chat_id), i + 1);
+            BENCH_TIMED(&b, db_merge_vector_clock(cdb, remote));
+        }
+        bench_report(&b);
+    }
+    if (bench_enabled("vc_save")) {
+        cJSON *clock = db_get_vector_clock(cdb);
+        bench_begin(&b, "vc_save", "-", iters, 1);
+        for (int i = 0; i < iters; i++) {
+            vc_increment(clock, pk_hex(my_id));
+            BENCH_TIMED(&b, db_save_vector_clock(cdb, clock));
+        }
+        bench_report(&b);
+        cJSON_Delete(clock);
+    }
+    chat_db_release(cdb);
+}
+
+/**
+ * 把会话中的消息补到 target 条，成批写入（不计时）。
+ */
+static void populate(pk_id_t chat_id, pk_id_t sender, uint64_t target) {
+    chat_db_t *cdb = chat_db_acquire(chat_id);
+    if (!cdb) return;
+    uint64_t have = (uint64_t)db_query_int64(cdb->db, "SELECT count(*) FROM messages;");
+    uint64_t start = now_ns();
+    while (have < target) {
+        chat_db_exec(cdb, "BEGIN;");
+        for (int k = 0; k < 1000 && have < target; k++, have++) insert_one(cdb, (have & 1) ? sender : my_id, bench_clock());
+        chat_db_exec(cdb, "COMMIT;");
+    }
+    chat_db_release(cdb);
+    fprintf(stderr, "[基准] 会话已有 %llu 条消息（准备用时 %.1f 秒）\n", (unsigned long long)target, (now_ns() - start) / 1e9);
+}
+
+static void bench_sync(peer_t* peer, uint64_t size) {
+    char params[32];
+    snprintf(params, sizeof(params), "n=%llu", (unsigned long long)size);
+    populate(peer->id, peer->id, size);
+    bench_t b;
+    if (bench_enabled("sync_ranges_root")) {
+        // 对方一条消息都没有：根区间指纹不同，按叶子桶汇总出 16 个子区间的指纹并发出
+        cJSON *req = cJSON_Parse("{\"type\":\"sync_ranges\",\"ranges\":[{\"lo\":0,\"hi\":4294967296,\"n\":0,\"fp\":\"0000000000000000\"}]}");
+        uint64_t before = sink_bytes;
+        bench_begin(&b, "sync_ranges_root", params, BENCH_SYNC_ITERS, 1);
+        for (int i = 0; i < BENCH_SYNC_ITERS; i++) BENCH_TIMED(&b, handle_sync_ranges(peer, req));
+        b.bytes = sink_bytes - before;
+        bench_report(&b);
+        cJSON_Delete(req);
+    }
+    if (bench_enabled("sync_ranges_scan")) {
+        // 与叶子桶不对齐的区间只能扫描 hkey 索引（递归后期的典型请求）
+        cJSON *req = cJSON_Parse("{\"type\":\"sync_ranges\",\"ranges\":[{\"lo\":123456789,\"hi\":391892245,\"n\":0,\"fp\":\"0000000000000000\"}]}");
+        bench_begin(&b, "sync_ranges_scan", params, BENCH_SYNC_ITERS, 1);
+        for (int i = 0; i < BENCH_SYNC_ITERS; i++) BENCH_TIMED(&b, handle_sync_ranges(peer, req));
+        bench_report(&b);
+        cJSON_Delete(req);
+    }
+    if (bench_enabled("sync_stream_full")) {
+        // 完整补发：按游标分块读出全部消息、组装 sync_chunk、加密并写到链路上。
+        // 每块计时一次，样本取块内每条消息的平均耗时；分配与字节数最后按消息总数折算
+        sync_stream_t *st = sync_stream_open(peer, 0, SYNC_HASH_SPACE);
+        if (!st) return;
+        int max_chunks = (int)(size / 8) + 16;
+        uint64_t before = sink_bytes;
+        bench_begin(&b, "sync_stream_full", params, max_chunks, 1);
+        int done = 0;
+        while (!done && b.count < max_chunks) {
+            int sent_before = st->sent;
+            uint64_t allocs_before = thread_allocs, start = now_ns();
+            done = sync_stream_send_chunk(peer, st);
+            uint64_t elapsed = now_ns() - start;
+            int rows = st->sent - sent_before;
+            b.samples[b.count++] = rows > 0 ? elapsed / (uint64_t)rows : elapsed;
+            b.allocs += thread_allocs - allocs_before;
+        }
+        int sent = st->sent;
+        sync_stream_close(peer, st);
+        if (sent > 0) {
+            double scale = (double)sent / b.count;
+            b.allocs = (uint64_t)(b.allocs / scale);
+            b.bytes = (uint64_t)((sink_bytes - before) / scale);
+        }
+        bench_report(&b);
+    }
+}
+
+// --- 链路复用：同步数据占满链路时的聊天延迟 ---
+typedef struct {
+    int fd;
+    uint64_t *arrivals;    // 第 i 个聊天帧读完的时刻
+    int max_chats;
+    _Atomic int chats;
+} paced_reader_t;
+
+/**
+ * 以 BENCH_LINK_RATE 的速率读出帧流，按外层帧头识别聊天帧（小于 1 KB 的整帧）并记录到达时刻。
+ */
+static void *paced_reader_thread(void *arg) {
+    paced_reader_t *r = arg;
+    unsigned char buf[4096], hdr[4];
+    size_t hdr_have = 0, body_left = 0;
+    int is_chat = 0;
+    uint64_t start = now_ns(), total = 0;
+    ssize_t n;
+    while ((n = read(r->fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n;) {
+            if (hdr_have < 4) {
+                hdr[hdr_have++] = buf[i++];
+                if (hdr_have < 4) continue;
+                uint32_t header = read_frame_header(hdr);
+                body_left = header & ~FRAME_FLAGS;
+                is_chat = !(header & FRAME_MUX_FLAG) && body_left < 1024;
+            } else {
+                size_t take = (size_t)(n - i) < body_left ? (size_t)(n - i) : body_left;
+                body_left -= take;
+                i += (ssize_t)take;
+            }
+            if (hdr_have == 4 && body_left == 0) {
+                int c = r->chats;
+                if (is_chat && c < r->max_chats) {
+                    r->arrivals[c] = now_ns();
+                    r->chats = c + 1;
+                }
+                hdr_have = 0;
+            }
+        }
+        // 按速率限流：读到的字节数超前于时间时睡到应有的时刻
+        total += (uint64_t)n;
+        uint64_t due = start + total * 1000000000ULL / BENCH_LINK_RATE, now = now_ns();
+        if (due > now) usleep((useconds_t)((due - now) / 1000));
+    }
+    return NULL;
+}
+
+typedef struct {
+    peer_t *peer;
+    _Atomic int done;
+} link_sync_sender_t;
+
+static void *link_sync_sender(void *arg) {
+    link_sync_sender_t *s = arg;
+    size_t len = MAX_FRAME_SIZE - PEER_BOX_OVERHEAD;
+    unsigned char *plain = malloc(len);
+    memset(plain, 'x', len);
+    for (int i = 0; i < BENCH_LINK_SYNC_FRAMES; i++) send_sealed(s->peer, LINK_PRIO_SYNC, 0, plain, len);
+    free(plain);
+    s->done = 1;
+    return NULL;
+}
+
+/**
+ * 一个线程连续发送同步帧，链路另一端按固定速率读取；同时每隔一段时间发一条聊天消息，
+ * 计时从调用 send_encrypted 到另一端读完该帧。mux=off 时大帧整帧发送（与不支持分片的对端相同）。
+ */
+static void bench_link_latency(int mux) {
+    const char *name = "link_chat_latency";
+    if (!bench_enabled(name)) return;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return;
+    // 小发送缓冲模拟 TCP_NOTSENT_LOWAT：内核里只排少量数据
+    int sndbuf = LINK_NOTSENT_LOWAT;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    peer_t peer;
+    memset(&peer, 0, sizeof(peer));
+    peer.sockfd = sv[0];
+    randombytes_buf(peer.pk, sizeof(peer.pk));
+    peer.pk[0] |= 1;
+    peer.id = pk_intern(peer.pk);
+    peer.key = peer_key_acquire(key_cache, peer.pk);
+    peer.mux_enabled = mux;
+    link_mux_init(&peer.mux);
+    if (peer.key && peer_start_writer(&peer) != 0) {
+        peer_key_release(key_cache, peer.key);
+        peer.key = NULL;
+    }
+    int max_chats = (int)((uint64_t)BENCH_LINK_SYNC_FRAMES * MAX_FRAME_SIZE * 1000000 / BENCH_LINK_RATE / BENCH_LINK_CHAT_INTERVAL_US) + 64;
+    uint64_t *sent_at = __libc_malloc(sizeof(uint64_t) * (size_t)max_chats);
+    paced_reader_t reader = { .fd = sv[1], .arrivals = __libc_malloc(sizeof(uint64_t) * (size_t)max_chats), .max_chats = max_chats };
+    link_sync_sender_t sender = { .peer = &peer };
+    pthread_t reader_tid, sender_tid;
+    char *text = make_chat_json(bench_clock());
+    int chats = 0;
+    if (peer.key && pthread_create(&reader_tid, NULL, paced_reader_thread, &reader) == 0) {
+        if (pthread_create(&sender_tid, NULL, link_sync_sender, &sender) == 0) {
+            usleep(BENCH_LINK_CHAT_INTERVAL_US); // 先让同步数据占满链路
+            // 同步发送线程在队列超过软上限时等待写线程，聊天消息一直发到同步帧全部入队且队列排空为止
+            while ((!sender.done || link_mux_queued(&peer.mux) > 0) && chats < max_chats) {
+                sent_at[chats++] = now_ns();
+                send_encrypted(&peer, LINK_PRIO_INTERACTIVE, text);
+                usleep(BENCH_LINK_CHAT_INTERVAL_US);
+            }
+            pthread_join(sender_tid, NULL);
+        }
+        // 等另一端读完全部聊天帧
+        while (reader.chats < chats) usleep(1000);
+        peer_stop_writer(&peer);
+        pthread_join(reader_tid, NULL);
+    }
+    bench_t b;
+    bench_begin(&b, name, mux ? "mux=on" : "mux=off", chats, 1);
+    for (int i = 0; i < chats; i++) b.samples[b.count++] = reader.arrivals[i] - sent_at[i];
+    bench_report(&b);
+    free(text);
+    __libc_free(sent_at);
+    __libc_free(reader.arrivals);
+    close(sv[0]);
+    close(sv[1]);
+    link_mux_destroy(&peer.mux);
+    peer_key_release(key_cache, peer.key);
+}
+
+// --- 入口 ---
+static int parse_sizes(const char* arg) {
+    opt.sync_count = 0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", arg);
+    for (char *tok = strtok(buf, ","); tok && opt.sync_count < BENCH_MAX_SYNC_SIZES; tok = strtok(NULL, ",")) {
+        uint64_t n = strtoull(tok, NULL, 10);
+        if (n == 0) return -1;
+        opt.sync_sizes[opt.sync_count++] = n;
+    }
+    return opt.sync_count > 0 ? 0 : -1;
+}
+
+static int remove_entry(const char* path, const struct stat* sb, int flag, struct FTW* ftw) {
+    (void)sb;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iters") == 0 && i + 1 < argc) opt.iters = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sync-sizes") == 0 && i + 1 < argc) {
+            if (parse_sizes(argv[++i]) != 0) {
+                fprintf(stderr, "无效的规模列表: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) opt.filter = argv[++i];
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) opt.json_path = argv[++i];
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) snprintf(opt.dir, sizeof(opt.dir), "%s", argv[++i]);
+        else if (strcmp(argv[i], "--keep") == 0) opt.keep = 1;
+        else {
+            fprintf(stderr, "用法: %s [--iters N] [--sync-sizes 10000,100000,1000000] [--filter 名字子串] [--json 结果文件] [--dir 数据目录] [--keep]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (opt.iters < 100) opt.iters = 100;
+    if (!opt.dir[0]) {
+        snprintf(opt.dir, sizeof(opt.dir), "/tmp/zerolink_bench.XXXXXX");
+        if (!mkdtemp(opt.dir)) {
+            perror("mkdtemp");
+            return 1;
+        }
+    }
+    if (opt.json_path && !(json_out = fopen(opt.json_path, "w"))) {
+        perror(opt.json_path);
+        return 1;
+    }
+
+    static const client_events_t quiet = { bench_log, NULL };
+    set_client_events(&quiet);
+    if (init_client_services(opt.dir) != 0) return 1;
+    peer_t peer;
+    pthread_t sink_tid;
+    if (make_bench_peer(&peer, &sink_tid) != 0) {
+        fprintf(stderr, "无法建立回环链路。\n");
+        return 1;
+    }
+    if (json_out) {
+        fprintf(json_out, "{\"env\":{\"sqlite\":\"%s\",\"sodium\":\"%s\",\"iters\":%d,\"payload_bytes\":%zu,\"time\":%lld}}\n",
+                sqlite3_libversion(), sodium_version_string(), opt.iters, strlen(BENCH_PAYLOAD), (long long)time(NULL));
+    }
+    printf("%-28s %-12s %10s %8s %10s %10s %10s %12s\n", "bench", "params", "ns/op", "allocs", "p50", "p90", "p99", "max");
+
+    bench_json(opt.iters);
+    bench_crypto(&peer, opt.iters);
+    // 写入和时钟在单独的会话中测，不影响同步规模
+    unsigned char other[PK_BYTES];
+    randombytes_buf(other, sizeof(other));
+    bench_db(pk_intern(other), opt.iters);
+    for (int i = 0; i < opt.sync_count; i++) bench_sync(&peer, opt.sync_sizes[i]);
+    bench_link_latency(0);
+    bench_link_latency(1);
+
+    peer_stop_writer(&peer);
+    pthread_join(sink_tid, NULL);
+    close(peer.sockfd);
+    close(sink_fd);
+    peer_key_release(key_cache, peer.key);
+    shutdown_client_services();
+    if (json_out) fclose(json_out);
+    if (!opt.keep) nftw(opt.dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    else fprintf(stderr, "[基准] 数据保留在 %s\n", opt.dir);
+    return 0;
+}